@@ -0,0 +1,171 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "fs/tfs_ioengine.h"
+
+// Random read benchmark for fs/tfs_ioengine: QUEUE_DEPTH threads issue
+// BLOCK_KB reads at random aligned offsets of FILE through pread, through
+// the io_uring engine, and through the engine with O_DIRECT, and report
+// IOPS and latency percentiles for each. Drop the page cache between runs
+// (or use a file larger than memory) to measure the device.
+
+using namespace TestFS;
+
+static void usage() {
+	fprintf(stderr,
+			"USAGE:  ioenginebench <FILE> [SIZE_MB] [QUEUE_DEPTH] [BLOCK_KB] [SECONDS] [pread|uring|direct]\n");
+	exit(1);
+}
+
+static uint64_t NowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Worker {
+	IoEngine* engine;
+	int fd;
+	bool direct;
+	size_t block;
+	size_t blocks;
+	uint64_t end_ns;
+	unsigned seed;
+	int errors;
+	std::vector<uint64_t> latencies;
+	pthread_t thread;
+};
+
+static void* WorkerMain(void* arg) {
+	Worker* w = reinterpret_cast<Worker*>(arg);
+	void* buf;
+	if (posix_memalign(&buf, IoEngine::DIRECT_ALIGN, w->block) != 0) {
+		return NULL;
+	}
+	while (NowNs() < w->end_ns) {
+		off_t offset = (off_t) (rand_r(&w->seed) % w->blocks) * w->block;
+		uint64_t start = NowNs();
+		ssize_t ret = w->direct
+				? w->engine->ReadDirect(w->fd, buf, w->block, offset)
+				: w->engine->Read(w->fd, buf, w->block, offset);
+		w->latencies.push_back(NowNs() - start);
+		if (ret != (ssize_t) w->block) {
+			++w->errors;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static int Prepare(const char* fpath, size_t size) {
+	struct stat st;
+	if (stat(fpath, &st) == 0 && (size_t) st.st_size >= size) {
+		return 0;
+	}
+	int fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	std::vector<char> buf(1 << 20, 'x');
+	for (size_t done = 0; done < size; done += buf.size()) {
+		if (write(fd, &buf[0], buf.size()) != (ssize_t) buf.size()) {
+			close(fd);
+			return -1;
+		}
+	}
+	fsync(fd);
+	close(fd);
+	return 0;
+}
+
+static void Run(const std::string &mode, const char* fpath, size_t size,
+		int depth, size_t block, int seconds) {
+	bool direct = (mode == "direct");
+	Logging logs("/tmp/ioenginebench.log");
+	logs.Open();
+	IoEngine engine(mode != "pread", depth * 2, 16, &logs);
+	int fd = open(fpath, direct ? (O_RDONLY | O_DIRECT) : O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (!direct) {
+		// take the kernel's readahead out of a random read test
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+
+	std::vector<Worker> workers(depth);
+	uint64_t start = NowNs();
+	for (int i = 0; i < depth; ++i) {
+		Worker &w = workers[i];
+		w.engine = &engine;
+		w.fd = fd;
+		w.direct = direct;
+		w.block = block;
+		w.blocks = size / block;
+		w.end_ns = start + seconds * 1000000000ULL;
+		w.seed = i + 1;
+		w.errors = 0;
+		pthread_create(&w.thread, NULL, WorkerMain, &w);
+	}
+	std::vector<uint64_t> latencies;
+	int errors = 0;
+	for (int i = 0; i < depth; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		latencies.insert(latencies.end(), workers[i].latencies.begin(),
+				workers[i].latencies.end());
+		errors += workers[i].errors;
+	}
+	double elapsed = (NowNs() - start) / 1e9;
+	close(fd);
+
+	std::string report;
+	engine.Report(report);
+	std::sort(latencies.begin(), latencies.end());
+	size_t completed = latencies.size();
+	printf("%-6s qd %d block %lu: %.0f IOPS, %.1f MB/s, %d errors\n",
+			mode.c_str(), depth, block, completed / elapsed,
+			completed * block / elapsed / (1 << 20), errors);
+	if (completed > 0) {
+		printf("       latency us: p50 %.1f p99 %.1f p999 %.1f\n",
+				latencies[completed / 2] / 1e3,
+				latencies[completed * 99 / 100] / 1e3,
+				latencies[completed * 999 / 1000] / 1e3);
+	}
+	printf("       engine: %s", report.c_str());
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argv[1][0] == '-') {
+		usage();
+	}
+	const char* fpath = argv[1];
+	size_t size = (size_t) ((argc > 2) ? atol(argv[2]) : 1024) << 20;
+	int depth = (argc > 3) ? atoi(argv[3]) : 32;
+	size_t block = (size_t) ((argc > 4) ? atol(argv[4]) : 4) << 10;
+	int seconds = (argc > 5) ? atoi(argv[5]) : 10;
+	if (depth <= 0 || block == 0 || block % IoEngine::DIRECT_ALIGN != 0
+			|| size < block) {
+		usage();
+	}
+	if (Prepare(fpath, size) < 0) {
+		perror(fpath);
+		return 1;
+	}
+	if (argc > 6) {
+		Run(argv[6], fpath, size, depth, block, seconds);
+	} else {
+		Run("pread", fpath, size, depth, block, seconds);
+		Run("uring", fpath, size, depth, block, seconds);
+		Run("direct", fpath, size, depth, block, seconds);
+	}
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <fuse.h>
 #include <libgen.h>
 #include <cstdlib>
@@ -13,6 +14,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <vector>
 #include <algorithm>
@@ -44,55 +47,534 @@ int TestFS::Setup(Properties& prop) {
                 exit(1);
         }
 
+        // records go to per-thread rings and a writer thread; "text" has
+        // the writer format them, otherwise util/logdecode reads the file
         logs = new Logging(prop.getProperty("logfile", ""));
         logs->SetDefault(logs);
+        logs->SetLevel(Logging::ParseLevel(prop.getProperty("log_level", "info")));
+        logs->SetText(prop.getProperty("log_format", "binary") == "text");
+        logs->SetRingSize(prop.getPropertyInt("log_ring_kb", 256) << 10);
         logs->Open();
 
-        try {
-                cluster = new RAMCloud::RamCloud(ramcloud_endpoint, "__unnamed__");
-        } catch (RAMCloud::ClientException& e) {
-                fprintf(stderr, "RAMCloud exception: %s\n", e.str().c_str());
+        // per-operation latencies and RPC counts, also served as STATS_FILE
+        monitor = prop.getPropertyBool("op_stats", true) ? new Monitor() : NULL;
+        if (monitor != NULL) {
+                monitor->SetDefault(monitor);
+        }
+
+        // new and rewritten inodes get the compact header; legacy keeps
+        // the old layout for mounts that cannot read compact inodes yet
+        SetCompactInodes(prop.getProperty("inode_format", "compact") != "legacy");
+
+        // inline data is stored compressed when it shrinks enough; stored
+        // values are expanded whatever compress_inline says
+        compressor = new InlineCompressor(
+                        prop.getPropertyBool("compress_inline", false),
+                        prop.getPropertyInt("compress_min_bytes", 128),
+                        prop.getPropertyInt("compress_min_saving", 12));
+        if (prop.getPropertyBool("compress_inline", false) && !CompactInodes()) {
+                logs->LogMsg("compress_inline needs compact inodes, not compressing\n");
+        }
+        SetInlineCompressor(compressor);
+
+        // kernel-side caching is only safe with an invalidation path
+        flag_kernel_cache = prop.getPropertyDouble("entry_timeout", 0) > 0
+                        || prop.getPropertyDouble("attr_timeout", 0) > 0
+                        || prop.getPropertyBool("kernel_cache", false);
+        notifier = flag_kernel_cache ? new KernelNotifier(mountdir) : NULL;
+
+        // client metadata cache; the lease bounds staleness when a
+        // coherency message from another mount is lost
+        int lease_ms = prop.getPropertyInt("cache_lease_ms", 0);
+        metacache = (lease_ms > 0) ? new MetaCache(
+                        prop.getPropertyInt("cache_entries", 65536), lease_ms) : NULL;
+        coherency = NULL;
+        if (prop.getProperty("coherency_group", "").size() > 0) {
+                coherency = new CoherencyChannel(prop.getProperty("coherency_group"),
+                                prop.getPropertyInt("coherency_port", 7654),
+                                metacache, notifier);
+                coherency->Start();
+        }
+
+        // blob paths under datadir; new datadirs get the hashed layout
+        // unless datadir_layout says otherwise, and group directories are
+        // created ahead of the inode counter
+        layout = new DatadirLayout(datadir,
+                        prop.getPropertyInt("datadir_precreate_groups", 16), logs);
+        if (layout->Open(prop.getPropertyInt("datadir_layout",
+                        DatadirLayout::LAYOUT_HASHED)) < 0) {
+                fprintf(stderr, "cannot open %s/LAYOUT\n", datadir.c_str());
                 return 1;
-        } catch (RAMCloud::Exception& e) {
-                fprintf(stderr, "RAMCloud exception: %s\n", e.str().c_str());
+        }
+        layout->Start();
+
+        // blobs are written to the local datadir and served to other
+        // nodes from here; blob_nodes maps the other nodes' ids to their
+        // blob servers. The server listens on blob_address only, does its
+        // disk I/O on blob_server_threads workers, and every node needs
+        // the same blob_secret
+        node_id = prop.getPropertyInt("node_id", 0);
+        blobserver = NULL;
+        blobcache = NULL;
+        blobclient = NULL;
+        if (prop.getProperty("blob_nodes", "").size() > 0) {
+                std::string secret = prop.getProperty("blob_secret", "");
+                if (secret.size() == 0
+                                || prop.getProperty("blob_address", "").size() == 0) {
+                        fprintf(stderr, "blob_nodes needs blob_address and blob_secret\n");
+                        return 1;
+                }
+                int cache_mb = prop.getPropertyInt("blob_cache_mb", 64);
+                if (cache_mb > 0) {
+                        blobcache = new BlobCache((size_t) cache_mb << 20,
+                                        prop.getPropertyInt("blob_cache_block", 65536),
+                                        prop.getPropertyInt("blob_cache_lease_ms", 1000));
+                }
+                blobclient = new BlobClient(blobcache, secret);
+                blobclient->AddNodes(prop.getProperty("blob_nodes"));
+                blobserver = new BlobServer(layout, secret, logs);
+                if (blobserver->Start(prop.getProperty("blob_address"),
+                                prop.getPropertyInt("blob_port",
+                                BLOB_DEFAULT_PORT),
+                                prop.getPropertyInt("blob_server_threads", 4)) < 0) {
+                        fprintf(stderr, "cannot start blob server\n");
+                        return 1;
+                }
+                logs->LogMsg("Node %u serving blobs from %s\n", node_id,
+                                datadir.c_str());
+        }
+
+        // inline_budget_mb turns on the adaptive threshold; threshold
+        // stays the default for groups without enough samples
+        threshold = prop.getPropertyInt("threshold", 4096);
+        thresholds = NULL;
+        if (prop.getPropertyInt("inline_budget_mb", 0) > 0) {
+                thresholds = new ThresholdPolicy(threshold,
+                                prop.getPropertyInt("min_threshold", 1024),
+                                prop.getPropertyInt("max_threshold", 1 << 20),
+                                (uint64_t) prop.getPropertyInt("inline_budget_mb", 0) << 20,
+                                prop.getPropertyInt("threshold_max_groups", 65536),
+                                prop.getPropertyInt("threshold_max_files", 1 << 20));
+        }
+        // directory overrides are looked up on every write that may cross
+        // the threshold, so they are cached with the metadata lease
+        overrides = new ThresholdOverrides(
+                        prop.getPropertyInt("threshold_override_entries", 4096),
+                        prop.getPropertyInt("cache_lease_ms", 0) > 0
+                                        ? prop.getPropertyInt("cache_lease_ms", 0) : 1000);
+
+        // datadir reads, writes and syncs go through io_uring with
+        // io_engine=uring, through pread/pwrite otherwise (the default, and
+        // the fallback on kernels whose io_uring lacks READ/WRITE)
+        io = new IoEngine(prop.getProperty("io_engine", "sync") == "uring",
+                        prop.getPropertyInt("uring_entries", 256),
+                        prop.getPropertyInt("uring_registered_files", 64), logs);
+
+        // datadir blob descriptors are shared by all handles and kept open;
+        // blobs of direct_io_cutoff_kb and up are read through a second,
+        // O_DIRECT set of descriptors
+        size_t fd_capacity = FdCache::Capacity(prop.getPropertyInt("fd_cache_size", 0));
+        direct_cutoff = (uint64_t) prop.getPropertyInt("direct_io_cutoff_kb", 0) << 10;
+        directfds = NULL;
+        if (direct_cutoff > 0) {
+                directfds = new FdCache(fd_capacity / 4, O_DIRECT);
+                directfds->SetCloseHook(IoEngine::Unregister, io);
+                fd_capacity -= fd_capacity / 4;
+        }
+        fdcache = new FdCache(fd_capacity);
+        fdcache->SetCloseHook(IoEngine::Unregister, io);
+
+        // append streams in datadir are preallocated, and their size is
+        // written once per append_flush_ms instead of on every write
+        appender = NULL;
+        if (prop.getPropertyInt("append_prealloc_max_kb", 16384) > 0) {
+                appender = new Appender(
+                                (size_t) prop.getPropertyInt("append_prealloc_max_kb", 16384) << 10,
+                                prop.getPropertyInt("append_flush_ms", 1000),
+                                FlushAppendSize, this);
+                appender->Start();
+        }
+
+        // per-handle readahead for sequential blob reads; files above the
+        // cache budget also drop the pages behind the stream
+        readahead = NULL;
+        if (prop.getPropertyInt("readahead_max_kb", 8192) > 0) {
+                readahead = new Readahead(
+                                (size_t) prop.getPropertyInt("readahead_max_kb", 8192) << 10,
+                                (uint64_t) prop.getPropertyInt("readahead_cache_budget_mb", 256) << 20);
+        }
+
+        // the write that pushes an inline file past the threshold only
+        // stages it; the blob file is created by a background worker
+        migrator = NULL;
+        if (prop.getPropertyBool("async_migration", false)) {
+                migrator = new Migrator(
+                                (size_t) prop.getPropertyInt("migrate_staging_kb", 4096) << 10,
+                                WriteMigratedBlob, CommitMigration, this, logs);
+                migrator->Start();
+        }
+
+        // files up to pack_threshold share segment files in datadir/packs;
+        // extents are local, so this needs blobs not to be served remotely
+        pack_threshold = prop.getPropertyInt("pack_threshold", 0);
+        packs = NULL;
+        if ((pack_threshold > 0 || prop.getPropertyBool("archive_data", false))
+                        && blobclient != NULL) {
+                fprintf(stderr, "pack_threshold and archive_data cannot be used "
+                                "with blob_nodes\n");
                 return 1;
         }
+        if (pack_threshold > 0) {
+                packs = new PackStore(datadir + "/packs", node_id,
+                                (uint64_t) prop.getPropertyInt("pack_segment_mb", 256) << 20,
+                                prop.getPropertyDouble("pack_compact_ratio", 0.5), logs);
+                if (packs->Open(RelocatePacked, this) < 0) {
+                        fprintf(stderr, "cannot open %s/packs\n", datadir.c_str());
+                        return 1;
+                }
+        }
+
+        // the cold tier: idle blobs compressed into segment files in
+        // datadir/archive, expanded back into a blob on first use; local
+        // like packs
+        archives = NULL;
+        placement = NULL;
+        if (prop.getPropertyBool("archive_data", false)) {
+                archives = new ArchiveStore(datadir + "/archive", node_id,
+                                (uint64_t) prop.getPropertyInt("archive_segment_mb", 1024) << 20,
+                                logs);
+                if (archives->Open() < 0) {
+                        fprintf(stderr, "cannot open %s/archive\n", datadir.c_str());
+                        return 1;
+                }
+        }
+
+        // Unlink removes the inode and leaves the datadir file to a
+        // background reclaimer; datadir/reclaim.queue lists what is left
+        reclaimer = NULL;
+        if (prop.getPropertyBool("deferred_unlink", true)) {
+                reclaimer = new Reclaimer(datadir + "/reclaim.queue",
+                                prop.getPropertyInt("reclaim_files_per_sec", 1000),
+                                (uint64_t) prop.getPropertyInt("reclaim_mb_per_sec", 256) << 20,
+                                logs);
+                if (reclaimer->Open() < 0) {
+                        fprintf(stderr, "cannot open %s/reclaim.queue\n", datadir.c_str());
+                        return 1;
+                }
+                reclaimer->Start();
+        }
+
+        chunks = NULL;
+        flag_chunked_data = false;
+        flag_split_inline = false;
+        contents = NULL;
+        flag_dedup_inline = false;
+        coldstore = NULL;
+        tiering = NULL;
+        mds = NULL;
+        std::string mdsproxy = prop.getProperty("mdsproxy", "");
+        if (mdsproxy.size() > 0) {
+                // metadata goes through testfs-mdsproxy, which owns the
+                // RAMCloud connection; what keeps its own objects in
+                // RAMCloud cannot run behind it
+                if (prop.getProperty("data_mode", "disk") == "chunked"
+                                || prop.getPropertyBool("split_inline", false)
+                                || prop.getPropertyBool("dedup_inline", false)
+                                || prop.getPropertyBool("tier_metadata", false)
+                                || archives != NULL) {
+                        fprintf(stderr, "data_mode=chunked, split_inline, dedup_inline, "
+                                        "tier_metadata and archive_data cannot be used "
+                                        "with mdsproxy\n");
+                        return 1;
+                }
+                if (prop.getProperty("blob_secret", "").size() == 0) {
+                        fprintf(stderr, "mdsproxy needs blob_secret\n");
+                        return 1;
+                }
+                size_t colon = mdsproxy.find(':');
+                unsigned short port = (colon == std::string::npos) ? MDS_DEFAULT_PORT
+                                : atoi(mdsproxy.c_str() + colon + 1);
+                try {
+                        mds = new MdsClient(mdsproxy.substr(0, colon), port,
+                                        prop.getProperty("blob_secret"));
+                } catch (SocketException& e) {
+                        fprintf(stderr, "mdsproxy %s: %s\n", mdsproxy.c_str(), e.what());
+                        return 1;
+                }
+                SetMdsProxy(mds);
+                cluster = NULL;
+                logs->LogMsg("Using metadata proxy %s\n", mdsproxy.c_str());
+        } else {
+                try {
+                        cluster = new RAMCloud::RamCloud(ramcloud_endpoint, "__unnamed__");
+                } catch (RAMCloud::ClientException& e) {
+                        fprintf(stderr, "RAMCloud exception: %s\n", e.str().c_str());
+                        return 1;
+                } catch (RAMCloud::Exception& e) {
+                        fprintf(stderr, "RAMCloud exception: %s\n", e.str().c_str());
+                        return 1;
+                }
+        }
+
+	// the tables and the chunk store are the proxy's with mdsproxy; the
+	// options that need them directly are refused above
+	if (cluster != NULL) {
+		logs->LogMsg("Connecting two databases.\n");
+		try{
+			idt=ConnectDB(&cluster,idtable);
+		}catch(TableDoesntExistException){
+			logs->LogMsg("Cannot find table %s at %s\n",idtable,ramcloud_endpoint);
+			logs->LogMsg("Initiating a new one...\n");
+			idt=cluster.createTable(idtable);
+		}
+
+		try{
+			mdt=ConnectDB(&cluster,metatable);
+		}catch(TableDoesntExistException){
+			logs->LogMsg("Cannot find table %s at %s\n",metatable,ramcloud_endpoint);
+			logs->LogMsg("Initiating a new one...\n");
+			idt=cluster.createTable(metatable);
+		}
+
+		// chunk objects are always readable; data_mode only picks where
+		// newly migrated files go
+		try{
+			dtt=ConnectDB(&cluster,datatable);
+		}catch(TableDoesntExistException){
+			dtt=cluster.createTable(datatable);
+		}
+		chunks = new ChunkStore(cluster, dtt,
+				prop.getPropertyInt("chunk_size", 1 << 20));
+	}
+	flag_chunked_data = (prop.getProperty("data_mode", "disk") == "chunked");
+	// small file data in its own object, so attribute changes and GetAttr
+	// move only the header and name
+	flag_split_inline = prop.getPropertyBool("split_inline", false);
+
+	// identical small files share one payload in the content table
+	if (prop.getPropertyBool("dedup_inline", false)) {
+		uint64_t ctt;
+		try{
+			ctt=ConnectDB(&cluster,contenttable);
+		}catch(TableDoesntExistException){
+			ctt=cluster.createTable(contenttable);
+		}
+		contents = new ContentStore(cluster, ctt);
+		flag_dedup_inline = true;
+		dedup_min_bytes = prop.getPropertyInt("dedup_min_bytes", 512);
+	}
 
-        logs->LogMsg("Connecting two databases.\n");
-	try{
-		idt=ConnectDB(&cluster,idtable);
-	}catch(TableDoesntExistException){
-		logs->LogMsg("Cannot find table %s at %s\n",idtable,ramcloud_endpoint);
-		logs->LogMsg("Initiating a new one...\n");
-		idt=cluster.createTable(idtable);
+	// inodes idle for tier_cold_secs, or the least recently used ones
+	// while the namespace is over tier_dram_budget_mb, move to a log on
+	// local SSD and are read back on first use. Stubs can turn up without
+	// tier_metadata too (frozen by another node, or by this one on an
+	// earlier mount), so every direct mount thaws; with mdsproxy the
+	// proxy does
+	if (cluster != NULL) {
+		bool tier = prop.getPropertyBool("tier_metadata", false);
+		if (tier && !CompactInodes()) {
+			logs->LogMsg("tier_metadata needs compact inodes, not tiering\n");
+			tier = false;
+		}
+		std::string tier_dir = prop.getProperty("tier_dir", datadir + "/cold");
+		if (tier || access(tier_dir.c_str(), F_OK) == 0) {
+			coldstore = new ColdStore(tier_dir, logs);
+			if (coldstore->Open() < 0) {
+				fprintf(stderr, "cannot open the cold inode store\n");
+				return 1;
+			}
+			if (blobserver != NULL) {
+				blobserver->SetColdStore(coldstore);
+			}
+		}
+		tiering = new MetaTiering(cluster, mdt, coldstore, blobclient,
+				node_id, logs);
+		SetMetaTiering(tiering);
+		if (tier) {
+			tiering->SetPolicy(
+					(uint64_t) prop.getPropertyInt("tier_dram_budget_mb", 0) << 20,
+					prop.getPropertyInt("tier_cold_secs", 7 * 86400),
+					prop.getPropertyInt("tier_min_idle_secs", 3600),
+					prop.getPropertyInt("tier_min_bytes", 256));
+			tiering->Start(prop.getPropertyInt("tier_scan_interval_secs", 600));
+		}
 	}
 
-	try{
-		mdt=ConnectDB(&cluster,metatable);
-	}catch(TableDoesntExistException){
-		logs->LogMsg("Cannot find table %s at %s\n",metatable,ramcloud_endpoint);
-		logs->LogMsg("Initiating a new one...\n");
-		idt=cluster.createTable(metatable);
+	// the policy engine moves idle blobs to the archive, and small ones
+	// back inline with placement_inline_max
+	if (archives != NULL) {
+		placement = new PlacementPolicy(cluster, mdt, MoveData,
+				BlobAccessTime, this, logs);
+		placement->SetRules(prop.getPropertyInt("placement_inline_max", 0),
+				prop.getPropertyInt("placement_inline_after_secs", 86400),
+				prop.getPropertyInt("archive_min_bytes", 1 << 20),
+				prop.getPropertyInt("archive_after_secs", 30 * 86400));
+		placement->Start(prop.getPropertyInt("placement_interval_secs", 3600));
 	}
 
         return 0;
 }
 void Destroy() {
+        if (migrator != NULL) {
+                // drains staged files while RAMCloud and the fd cache
+                // are still there
+                std::string report;
+                migrator->Stop();
+                migrator->Report(report);
+                logs->LogMsg("Background migration: %s", report.c_str());
+                delete migrator;
+        }
+        if (appender != NULL) {
+                // writes the pending append sizes
+                std::string report;
+                appender->Stop();
+                appender->Report(report);
+                logs->LogMsg("Append streams: %s", report.c_str());
+                delete appender;
+        }
+        if (reclaimer != NULL) {
+                // what is still queued is picked up by the next mount
+                std::string report;
+                reclaimer->Stop();
+                reclaimer->Report(report);
+                logs->LogMsg("Blob reclamation: %s", report.c_str());
+                delete reclaimer;
+        }
+        if (placement != NULL) {
+                // its moves need RAMCloud, the fd cache and the archive
+                std::string report;
+                placement->Stop();
+                placement->Report(report);
+                logs->LogMsg("Data placement: %s", report.c_str());
+                delete placement;
+        }
+        if (tiering != NULL) {
+                std::string report;
+                tiering->Stop();
+                tiering->Report(report);
+                logs->LogMsg("Metadata tiering: %s", report.c_str());
+                SetMetaTiering(NULL);
+                delete tiering;
+        }
+        if (coherency != NULL) {
+                delete coherency;
+        }
+        if (metacache != NULL) {
+                delete metacache;
+        }
+        if (notifier != NULL) {
+                delete notifier;
+        }
         if (cluster != NULL) {
                 delete cluster;
         }
+        if (mds != NULL) {
+                SetMdsProxy(NULL);
+                delete mds;
+        }
+        if (compressor != NULL) {
+                std::string report;
+                compressor->Report(report);
+                logs->LogMsg("Inline compression: %s", report.c_str());
+                SetInlineCompressor(NULL);
+                delete compressor;
+        }
+        if (blobserver != NULL) {
+                delete blobserver;
+        }
+        if (blobclient != NULL) {
+                delete blobclient;
+        }
+        if (blobcache != NULL) {
+                delete blobcache;
+        }
+        if (coldstore != NULL) {
+                // after the blob server, which reads it for other nodes
+                delete coldstore;
+        }
+        if (chunks != NULL) {
+                delete chunks;
+        }
+        if (contents != NULL) {
+                std::string report;
+                contents->Report(report);
+                logs->LogMsg("Inline dedup: %s", report.c_str());
+                delete contents;
+        }
+        if (fdcache != NULL) {
+                std::string report;
+                fdcache->Report(report);
+                logs->LogMsg("Blob fd cache: %s", report.c_str());
+                delete fdcache;
+        }
+        if (readahead != NULL) {
+                std::string report;
+                readahead->Report(report);
+                logs->LogMsg("Readahead: %s", report.c_str());
+                delete readahead;
+        }
+        if (directfds != NULL) {
+                std::string report;
+                directfds->Report(report);
+                logs->LogMsg("O_DIRECT fd cache: %s", report.c_str());
+                delete directfds;
+        }
+        if (io != NULL) {
+                // after the fd caches, whose closes unregister files
+                std::string report;
+                io->Report(report);
+                logs->LogMsg("Blob I/O: %s", report.c_str());
+                delete io;
+        }
+        if (packs != NULL) {
+                std::string report;
+                packs->Report(report);
+                logs->LogMsg("Packed blobs: %s", report.c_str());
+                delete packs;
+        }
+        if (archives != NULL) {
+                std::string report;
+                archives->Report(report);
+                logs->LogMsg("Archived blobs: %s", report.c_str());
+                delete archives;
+        }
+        if (thresholds != NULL) {
+                std::string report;
+                thresholds->Report(report);
+                logs->LogMsg("Inline thresholds: %s", report.c_str());
+                delete thresholds;
+        }
+        if (overrides != NULL) {
+                delete overrides;
+        }
+        if (layout != NULL) {
+                // after the blob server, which formats paths with it
+                std::string report;
+                layout->Stop();
+                layout->Report(report);
+                logs->LogMsg("Datadir layout: %s", report.c_str());
+                delete layout;
+        }
+        if (monitor != NULL) {
+                // last, as every thread above may still count RPCs
+                std::string report;
+                monitor->Report(report);
+                logs->LogMsg("Operation stats:\n%s", report.c_str());
+                delete monitor;
+        }
         if (logs != NULL)
                 delete logs;
 }
 
-tfs_inode_t NewInode() {
-        max_inode_num=GetNextID(&cluster,idt);
-        if (max_inode_num % (NUM_FILES_IN_DATADIR) == 0) {
-                char fpath[512];
-                sprintf(fpath, "%s/%d", datadir_.data(), (int) max_inode_num >> 14);
-                mkdir(fpath, 0777);
+int TestFS::NewInode(tfs_inode_t *inode) {
+        int64_t id = GetNextID(cluster, idt);
+        if (id < 0) {
+                return (int) id;
         }
-        return max_inode_num;
+        max_inode_num = id;
+        layout->Reserve(max_inode_num);
+        *inode = max_inode_num;
+        return 0;
 }
 
 
@@ -101,28 +583,59 @@ struct tfs_file_handle_t {
 	int fd_;
 	InodeAccessMode mode_;
 	KeyInfo *keylist_;   
-	tfs_file_handle_t() :flags_(-1),fd_(-1),mode_(0),keylist_(NULL) {
+	RAMCloud::Buffer *rcbuf_;  // keeps inline segments alive until FUSE replies
+	int pipe_[2];              // vmsplice pipe for inline ReadBuf
+	std::string *snapshot_;    // STATS_FILE as of Open; nothing else is set
+	tfs_file_handle_t() :flags_(-1),fd_(-1),mode_(0),keylist_(NULL),rcbuf_(NULL),snapshot_(NULL) {
+		pipe_[0] = pipe_[1] = -1;
 	}
 };
 
 
-const tfs_inode_header *GetInodeHeader(const RAMCloud::Buffer &value) {
-	return reinterpret_cast<const tfs_inode_header*>(value.getRange(0,value.size()));
+InodeHeader GetInodeHeader(const RAMCloud::Buffer &value) {
+	return InodeHeader(reinterpret_cast<const char*>(value.getRange(0,value.size())),
+			value.size());
 }
-const tfs_inode_header *GetInodeHeader(const std::string &value) {
-	return reinterpret_cast<const tfs_inode_header*>(value.data());
+InodeHeader GetInodeHeader(const std::string &value) {
+	return InodeHeader(value.data(), value.size());
 }
-const tfs_stat_t *GetAttribute(RAMCloud::Buffer &value) {
-	return reinterpret_cast<const tfs_stat_t*>(value.getRange(0, value.size()));
+PackLocation PackLocationOf(const tfs_inode_header *iheader) {
+	PackLocation loc;
+	loc.node = iheader->blob_owner;
+	loc.segment = iheader->pack_segment;
+	loc.offset = iheader->pack_offset;
+	loc.capacity = iheader->pack_capacity;
+	return loc;
 }
-const tfs_stat_t *GetAttribute(std::String &value) {
-	return reinterpret_cast<const tfs_stat_t*>(value.data());
+void SetPackLocation(tfs_inode_header &iheader, const PackLocation &loc) {
+	iheader.blob_owner = loc.node;
+	iheader.pack_segment = loc.segment;
+	iheader.pack_offset = loc.offset;
+	iheader.pack_capacity = loc.capacity;
+}
+ArchiveLocation ArchiveLocationOf(const tfs_inode_header *iheader) {
+	ArchiveLocation loc;
+	loc.node = iheader->blob_owner;
+	loc.segment = iheader->pack_segment;
+	loc.offset = iheader->pack_offset;
+	return loc;
+}
+void SetArchiveLocation(tfs_inode_header &iheader, const ArchiveLocation &loc) {
+	iheader.blob_owner = loc.node;
+	iheader.pack_segment = loc.segment;
+	iheader.pack_offset = loc.offset;
+	iheader.pack_capacity = 0;
+}
+tfs_stat_t GetAttribute(RAMCloud::Buffer &value) {
+	return GetInodeHeader(value)->fstat;
+}
+tfs_stat_t GetAttribute(const std::string &value) {
+	return GetInodeHeader(value)->fstat;
 }
 
 size_t GetInlineData(RAMCloud::Buffer &value, char* buf, size_t offset,
 		size_t size) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t realoffset = TFS_INODE_HEADER_SIZE + header->namelen + 1 + offset;
+	size_t realoffset = GetInodeHeader(value).DataOffset() + offset;
 	if (realoffset < value.size()) {
 		if (realoffset + size > value.size()) {
 			size = value.size() - realoffset;
@@ -142,32 +655,31 @@ void UpdateIhandleValue(std::string &value, const char* buf, size_t offset,
 	value.replace(offset, size, buf, size);
 }
 
+// Re-encodes the header in the current format, so this is also where a
+// legacy inode gets upgraded; the name and data move with the new length.
 void UpdateInodeHeader(std::string &value, tfs_inode_header &new_header) {
-	UpdateIhandleValue(value, (const char *) &new_header, 0,
-			TFS_INODE_HEADER_SIZE);
+	char encoded[TFS_INODE_MAX_ENCODED];
+	size_t old_size = GetInodeHeader(value).NameOffset();
+	value.replace(0, old_size, encoded, EncodeInodeHeader(new_header, encoded));
 }
 
 void UpdateAttribute(std::string &value, const tfs_stat_t &new_fstat) {
-	UpdateIhandleValue(value, (const char *) &new_fstat, 0,
-			TFS_INODE_ATTR_SIZE);
+	tfs_inode_header header = *GetInodeHeader(value);
+	header.fstat = new_fstat;
+	UpdateInodeHeader(value, header);
 }
 
 void UpdateInlineData(std::string &value, const char* buf, size_t offset,size_t size) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t realoffset = TFS_INODE_HEADER_SIZE + header->namelen + 1 + offset;
+	size_t realoffset = GetInodeHeader(value).DataOffset() + offset;
 	UpdateIhandleValue(value, buf, realoffset, size);
 }
 
 void TruncateInlineData(std::string &value, size_t new_size) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t target_size = TFS_INODE_HEADER_SIZE + header->namelen + new_size + 1;
-	value.resize(target_size);
+	value.resize(GetInodeHeader(value).DataOffset() + new_size);
 }
 
 void DropInlineData(std::string &value) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t target_size = TFS_INODE_HEADER_SIZE + header->namelen + 1;
-	value.resize(target_size);
+	value.resize(GetInodeHeader(value).DataOffset());
 }
 
 
@@ -209,25 +721,31 @@ void TestFS::InitStat(tfs_stat_t &statbuf, tfs_inode_t inode, mode_t mode,dev_t
 
 tfs_inode_val_t TestFS::InitInodeValue(tfs_inode_t inum, mode_t mode, dev_t dev,
 		std::string filename) {
+	tfs_inode_header header;
+	memset(&header, 0, sizeof(header));
+	InitStat(header.fstat, inum, mode, dev);
+	header.namelen = filename.size();
+	char encoded[TFS_INODE_MAX_ENCODED];
+	size_t header_size = EncodeInodeHeader(header, encoded);
 	tfs_inode_val_t ival;
-	ival.size = TFS_INODE_HEADER_SIZE + filename.size() + 1;
+	ival.size = header_size + filename.size() + 1;
 	ival.value = new char[ival.size];
-	tfs_inode_header* header = reinterpret_cast<tfs_inode_header*>(ival.value);
-	InitStat(header->fstat, inum, mode, dev);
-	header->has_blob = 0;
-	header->namelen = filename.size();
-	char* name_buffer = ival.value + TFS_INODE_HEADER_SIZE;
+	memcpy(ival.value, encoded, header_size);
+	char* name_buffer = ival.value + header_size;
 	memcpy(name_buffer, filename.data(), filename.size());
-	name_buffer[header->namelen] = '\0';
+	name_buffer[header.namelen] = '\0';
 	return ival;
 }
 
 std::string TestFS::InitInodeValue(const std::string& old_value,std::string filename) {
-	std::string new_value = old_value;
-	tfs_inode_header header = *GetInodeHeader(old_value);
-	new_value.replace(TFS_INODE_HEADER_SIZE, header.namelen + 1,filename.data(), filename.size() + 1);
-	header.namelen = filename.size(); 
-	UpdateInodeHeader(new_value, header); //maybe do not need
+	InodeHeader old_header = GetInodeHeader(old_value);
+	tfs_inode_header header = *old_header;
+	header.namelen = filename.size();
+	// built whole: the old value's header no longer matches the new name
+	char encoded[TFS_INODE_MAX_ENCODED];
+	std::string new_value(encoded, EncodeInodeHeader(header, encoded));
+	new_value.append(filename.data(), filename.size() + 1);
+	new_value.append(old_value, old_header.DataOffset(), std::string::npos);
 	return new_value;
 }
 
@@ -250,11 +768,11 @@ bool TestFS::ParentPathLookup(const char *path, RAMCloud::KeyInfo &mykeylist,
 			MakeMetaKey(lpos + 1, rpos - lpos - 1, inode_in_search, &mykeylist);
 			Buffer result;
 			int ret=GetRamCloudBuffer(&cluster,mykeylist[0],metaid,&result);
-			if (ret == 0) {
-				inode_in_search = GetAttribute(result)->st_ino;
+			if (ret == 0 && GetInodeHeader(result).Valid()) {
+				inode_in_search = GetAttribute(result).st_ino;
 				result.reset(); 
 			} else {
-				errno = ENOENT;
+				errno = (ret < 0) ? -ret : EIO;
 				flag_found = false;
 			}
 			if (!flag_found) {
@@ -319,7 +837,7 @@ void* TestFS::Init(struct fuse_conn_info *conn) {
 		tfs_inode_val_t value = InitInodeValue(ROOT_INODE_ID, statbuf.st_mode,
 				statbuf.st_dev, std::string("\0"));
 		try {
-			WriteString(&cluster,mykeylist,mdt,value);
+			WriteMeta(mykeylist, value);
 		} catch (RamCloudClientException e) {
 			logs->LogMsg("TestFS create root directory failed.\n");
 		}
@@ -341,8 +859,7 @@ int TestFS::GetAttr(const char *path, struct stat *statbuf) {
 
 size_t GetInlineData(RAMCloud::Buffer &value, char* buf, size_t offset,
 		size_t size) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t realoffset = TFS_INODE_HEADER_SIZE + header->namelen + 1 + offset;
+	size_t realoffset = GetInodeHeader(value).DataOffset() + offset;
 	if (realoffset < value.size()) {
 		if (realoffset + size > value.size()) {
 			size = value.size() - realoffset;
@@ -362,32 +879,31 @@ void UpdateIhandleValue(std::string &value, const char* buf, size_t offset,
 	value.replace(offset, size, buf, size);
 }
 
+// Re-encodes the header in the current format, so this is also where a
+// legacy inode gets upgraded; the name and data move with the new length.
 void UpdateInodeHeader(std::string &value, tfs_inode_header &new_header) {
-	UpdateIhandleValue(value, (const char *) &new_header, 0,
-			TFS_INODE_HEADER_SIZE);
+	char encoded[TFS_INODE_MAX_ENCODED];
+	size_t old_size = GetInodeHeader(value).NameOffset();
+	value.replace(0, old_size, encoded, EncodeInodeHeader(new_header, encoded));
 }
 
 void UpdateAttribute(std::string &value, const tfs_stat_t &new_fstat) {
-	UpdateIhandleValue(value, (const char *) &new_fstat, 0,
-			TFS_INODE_ATTR_SIZE);
+	tfs_inode_header header = *GetInodeHeader(value);
+	header.fstat = new_fstat;
+	UpdateInodeHeader(value, header);
 }
 
 void UpdateInlineData(std::string &value, const char* buf, size_t offset,size_t size) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t realoffset = TFS_INODE_HEADER_SIZE + header->namelen + 1 + offset;
+	size_t realoffset = GetInodeHeader(value).DataOffset() + offset;
 	UpdateIhandleValue(value, buf, realoffset, size);
 }
 
 void TruncateInlineData(std::string &value, size_t new_size) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t target_size = TFS_INODE_HEADER_SIZE + header->namelen + new_size + 1;
-	value.resize(target_size);
+	value.resize(GetInodeHeader(value).DataOffset() + new_size);
 }
 
 void DropInlineData(std::string &value) {
-	const tfs_inode_header* header = GetInodeHeader(value);
-	size_t target_size = TFS_INODE_HEADER_SIZE + header->namelen + 1;
-	value.resize(target_size);
+	value.resize(GetInodeHeader(value).DataOffset());
 }
 
 
@@ -429,25 +945,31 @@ void TestFS::InitStat(tfs_stat_t &statbuf, tfs_inode_t inode, mode_t mode,dev_t
 
 tfs_inode_val_t TestFS::InitInodeValue(tfs_inode_t inum, mode_t mode, dev_t dev,
 		std::string filename) {
+	tfs_inode_header header;
+	memset(&header, 0, sizeof(header));
+	InitStat(header.fstat, inum, mode, dev);
+	header.namelen = filename.size();
+	char encoded[TFS_INODE_MAX_ENCODED];
+	size_t header_size = EncodeInodeHeader(header, encoded);
 	tfs_inode_val_t ival;
-	ival.size = TFS_INODE_HEADER_SIZE + filename.size() + 1;
+	ival.size = header_size + filename.size() + 1;
 	ival.value = new char[ival.size];
-	tfs_inode_header* header = reinterpret_cast<tfs_inode_header*>(ival.value);
-	InitStat(header->fstat, inum, mode, dev);
-	header->has_blob = 0;
-	header->namelen = filename.size();
-	char* name_buffer = ival.value + TFS_INODE_HEADER_SIZE;
+	memcpy(ival.value, encoded, header_size);
+	char* name_buffer = ival.value + header_size;
 	memcpy(name_buffer, filename.data(), filename.size());
-	name_buffer[header->namelen] = '\0';
+	name_buffer[header.namelen] = '\0';
 	return ival;
 }
 
 std::string TestFS::InitInodeValue(const std::string& old_value,std::string filename) {
-	std::string new_value = old_value;
-	tfs_inode_header header = *GetInodeHeader(old_value);
-	new_value.replace(TFS_INODE_HEADER_SIZE, header.namelen + 1,filename.data(), filename.size() + 1);
-	header.namelen = filename.size(); 
-	UpdateInodeHeader(new_value, header); //maybe do not need
+	InodeHeader old_header = GetInodeHeader(old_value);
+	tfs_inode_header header = *old_header;
+	header.namelen = filename.size();
+	// built whole: the old value's header no longer matches the new name
+	char encoded[TFS_INODE_MAX_ENCODED];
+	std::string new_value(encoded, EncodeInodeHeader(header, encoded));
+	new_value.append(filename.data(), filename.size() + 1);
+	new_value.append(old_value, old_header.DataOffset(), std::string::npos);
 	return new_value;
 }
 
@@ -468,13 +990,9 @@ bool TestFS::ParentPathLookup(const char *path, RAMCloud::KeyInfo &mykeylist,
 	while ((rpos = strchr(lpos + 1, PATH_DELIMITER)) != NULL) {
 		if (rpos - lpos > 0) {
 			MakeMetaKey(lpos + 1, rpos - lpos - 1, inode_in_search, &mykeylist);
-			Buffer result;
-			int ret=GetRamCloudBuffer(&cluster,mykeylist[0],metaid,&result);
-			if (ret == 0) {
-				inode_in_search = GetAttribute(result)->st_ino;
-				result.reset(); 
+			if (LookupMeta(mykeylist[0], std::string(path, rpos - path), item)) {
+				inode_in_search = GetInodeHeader(item)->fstat.st_ino;
 			} else {
-				errno = ENOENT;
 				flag_found = false;
 			}
 			if (!flag_found) {
@@ -500,7 +1018,6 @@ bool TestFS::PathLookup(const char *path, RAMCloud::KeyInfo &key) {
 		}
 		return true;
 	} else {
-		errno = ENOENT;
 		return false;
 	}
 }
@@ -518,15 +1035,98 @@ bool TestFS::PathLookup(const char *path, RAMCloud::KeyInfo *mykeylist,std::stri
 		}
 		return true;
 	} else {
+		return false;
+	}
+}
+
+bool TestFS::LookupMeta(const RAMCloud::KeyInfo &key, const std::string &path,
+		std::string &value) {
+	std::string cache_key;
+	if (metacache != NULL) {
+		cache_key = MetaKeyString(key);
+		if (metacache->Get(cache_key, value)) {
+			return true;
+		}
+	}
+	RAMCloud::Buffer rcbuf;
+	uint64_t version = 0;
+	int ret;
+	try {
+		ret = GetRamCloudBuffer(cluster, key, mdt, &rcbuf, &version);
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
 		errno = ENOENT;
 		return false;
 	}
+	if (ret < 0) {
+		errno = -ret;
+		return false;
+	}
+	value.assign(static_cast<const char*>(rcbuf.getRange(0, rcbuf.size())),
+			rcbuf.size());
+	if (value.empty() || !GetInodeHeader(value).Valid()) {
+		errno = EIO;
+		return false;
+	}
+	if (metacache != NULL) {
+		metacache->Put(cache_key, value, version, path);
+	}
+	return true;
+}
+
+void TestFS::WriteMeta(RAMCloud::KeyInfo *mykeylist, const std::string &value) {
+	uint64_t version = 0;
+	WriteString(cluster, mykeylist, mdt, value, &version);
+	MetaChanged(mykeylist[0], version);
+}
+
+void TestFS::WriteMeta(RAMCloud::KeyInfo *mykeylist, const tfs_inode_val_t &value) {
+	uint64_t version = 0;
+	WriteString(cluster, mykeylist, mdt, value, &version);
+	MetaChanged(mykeylist[0], version);
+}
+
+int TestFS::WriteMetaIf(RAMCloud::KeyInfo *mykeylist, const std::string &value,
+		uint64_t version) {
+	uint64_t new_version = 0;
+	int ret;
+	try {
+		ret = WriteStringIf(cluster, mykeylist, mdt, value, version,
+				&new_version);
+	} catch (RAMCloud::ClientException& e) {
+		return -EIO;
+	}
+	if (ret == 0) {
+		MetaChanged(mykeylist[0], new_version);
+	}
+	return ret;
+}
+
+void TestFS::RemoveMeta(RAMCloud::KeyInfo *mykeylist) {
+	uint64_t version = 0;
+	RemoveKey(cluster, mykeylist, mdt, &version);
+	// anything cached at the removed version is stale now
+	MetaChanged(mykeylist[0], version + 1);
+}
+
+void TestFS::MetaChanged(const RAMCloud::KeyInfo &key, uint64_t version) {
+	if (metacache != NULL) {
+		metacache->Erase(MetaKeyString(key));
+	}
+	if (coherency != NULL) {
+		coherency->Publish(key, version);
+	}
 }
 
 void* TestFS::Init(struct fuse_conn_info *conn) {
 	logs->LogMsg("TestFS initialized.\n");
 	if (conn != NULL) {
 		flag_fuse_enabled = true;
+		// let FUSE move blob pages between /dev/fuse and datadir with splice
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ
+				| FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+		if (notifier != NULL) {
+			notifier->Start(fuse_get_context()->fuse);
+		}
 	} else {
 		flag_fuse_enabled = false;
 	}
@@ -539,27 +1139,92 @@ void* TestFS::Init(struct fuse_conn_info *conn) {
 		tfs_inode_val_t value = InitInodeValue(ROOT_INODE_ID, statbuf.st_mode,
 				statbuf.st_dev, std::string("\0"));
 		try {
-			WriteString(&cluster,mykeylist,mdt,value);
+			WriteMeta(mykeylist, value);
 		} catch (RamCloudClientException e) {
 			logs->LogMsg("TestFS create root directory failed.\n");
 		}
 		FreeInodeValue(value);
 	}
+	return NULL;
 }
 
 void TestFS::Destroy(void * data) {
+	if (notifier != NULL) {
+		notifier->Stop();
+	}
 	logs->LogMsg("file system unmounted.\n");
 }
 
+int TestFS::StatsGetAttr(const char *path, struct stat *statbuf) {
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+	if (strcmp(path, STATS_DIR) == 0) {
+		statbuf->st_mode = S_IFDIR | 0555;
+		statbuf->st_nlink = 2;
+		return 0;
+	}
+	if (!IsStatsFile(path)) {
+		return -ENOENT;
+	}
+	std::string report;
+	monitor->Report(report);
+	statbuf->st_mode = S_IFREG | 0644;
+	statbuf->st_nlink = 1;
+	statbuf->st_size = report.size();
+	return 0;
+}
+
+int TestFS::StatsOpen(const char *path, struct fuse_file_info *fi) {
+	if (!IsStatsFile(path)) {
+		return -ENOENT;
+	}
+	tfs_file_handle_t* fh = new tfs_file_handle_t();
+	fh->flags_ = fi->flags;
+	fh->snapshot_ = new std::string();
+	monitor->Report(*fh->snapshot_);
+	// the report has grown since GetAttr sized it
+	fi->direct_io = 1;
+	fi->fh = (uint64_t) fh;
+	return 0;
+}
+
+int TestFS::StatsWrite(const char *buf, size_t size) {
+	std::string command(buf, size);
+	while (!command.empty() && isspace(command[command.size() - 1])) {
+		command.resize(command.size() - 1);
+	}
+	if (command != "reset") {
+		return -EINVAL;
+	}
+	monitor->Reset();
+	return size;
+}
+
 int TestFS::GetAttr(const char *path, struct stat *statbuf) {
+	MonitorScope scope(monitor, OP_GETATTR);
+	if (IsStatsPath(path)) {
+		return StatsGetAttr(path, statbuf);
+	}
 	RAMCloud::KeyInfo mykeylist[2];
 	if (!PathLookup(path, mykeylist)) {
 		return FSError("GetAttr Path Lookup: No such file or directory: %s\n");
 	}
 	int ret = 0;
-	ramcloud::Buffer rcbuf;
-	GetRamCloudBuffer(&cluster,mykeylist[0],mdt,&rcbuf);
-	*statbuf = *(GetAttribute(rcbuf));
+	off_t staged_size;
+	bool staged = (migrator != NULL
+			&& migrator->StagedSize(MetaKeyString(mykeylist[0]), staged_size))
+			|| (appender != NULL
+			&& appender->Size(MetaKeyString(mykeylist[0]), staged_size));
+	std::string value;
+	if (!LookupMeta(mykeylist[0], std::string(path), value)) {
+		return FSError("GetAttr: No such file or directory\n");
+	}
+	*statbuf = GetInodeHeader(value)->fstat;
+	if (staged) {
+		statbuf->st_size = staged_size;
+	}
 #ifdef TABLEFS_DEBUG
 	logs->LogMsg("GetAttr DBKey: %s\n", mykeylist[0].key);
 	logs->LogStat(path, statbuf);
@@ -568,15 +1233,20 @@ int TestFS::GetAttr(const char *path, struct stat *statbuf) {
 }
 
 void TestFS::GetDiskFilePath(char *path, tfs_inode_t inode_id) {
-	sprintf(path, "%s/%d/%d", datadir.data(),
-			(int) inode_id >> NUM_FILES_IN_DATADIR_BITS,
-			(int) inode_id % (NUM_FILES_IN_DATADIR));
+	layout->Format(path, inode_id);
 }
 
 int TestFS::OpenDiskFile(const tfs_inode_header* iheader, int flags) {
 	char fpath[128];
 	GetDiskFilePath(fpath, iheader->fstat.st_ino);
-	int fd = open(fpath, flags | O_CREAT, iheader->fstat.st_mode);
+	int fd = fdcache->Get(iheader->fstat.st_ino, fpath, iheader->fstat.st_mode,
+			flags);
+	if (fd < 0) {
+		errno = -fd;
+		fd = -1;
+	} else if ((flags & O_TRUNC) && ftruncate(fd, 0) != 0) {
+		CloseDiskFile(fd);
+	}
 #ifdef  TABLEFS_DEBUG
 	logs->LogMsg("OpenDiskFile: %s InodeID: %d FD: %d\n",
 			fpath, iheader->fstat.st_ino, fd);
@@ -584,6 +1254,38 @@ int TestFS::OpenDiskFile(const tfs_inode_header* iheader, int flags) {
 	return fd;
 }
 
+int TestFS::OpenBlobFile(RAMCloud::KeyInfo *mykeylist,
+		const tfs_inode_header* iheader, int flags) {
+	if (archives == NULL) {
+		return OpenDiskFile(iheader, flags);
+	}
+	// ArchiveBlob and InlineBlob check InUse under this lock: holding it
+	// from the re-read to the open, either they see our descriptor or
+	// they already moved the blob and we see the new header
+	archives->Lock();
+	std::string current;
+	int ret = 0;
+	try {
+		current = CopytoString(cluster, mykeylist[0], mdt);
+	} catch (RAMCloud::ClientException& e) {
+		ret = -ENOENT;
+	}
+	InodeHeader now = GetInodeHeader(current);
+	if (ret == 0 && !now.Valid()) {
+		ret = -EIO;
+	}
+	if (ret == 0 && (now->has_blob != iheader->has_blob
+			|| now->fstat.st_ino != iheader->fstat.st_ino)) {
+		ret = -EAGAIN;
+	}
+	int fd = (ret == 0) ? OpenDiskFile(now, flags) : -1;
+	archives->Unlock();
+	if (ret < 0) {
+		errno = -ret;
+	}
+	return fd;
+}
+
 int TestFS::TruncateDiskFile(tfs_inode_t inode_id, off_t new_size) {
 	char fpath[128];
 	GetDiskFilePath(fpath, inode_id);
@@ -591,38 +1293,45 @@ int TestFS::TruncateDiskFile(tfs_inode_t inode_id, off_t new_size) {
 	logs->LogMsg("TruncateDiskFile: %s, InodeID: %d, NewSize: %d\n",
 			fpath, inode_id, new_size);
 #endif
-	return truncate(fpath, new_size);
+	int fd = fdcache->Get(inode_id, fpath, 0644, O_WRONLY | O_CREAT);
+	if (fd < 0) {
+		errno = -fd;
+		return -1;
+	}
+	int ret = ftruncate(fd, new_size);
+	CloseDiskFile(fd);
+	return ret;
 }
 
 size_t TestFS::MigrateDiskFileToBuffer(tfs_inode_t inode_id, char* buffer,
 		size_t size) {
 	char fpath[128];
 	GetDiskFilePath(fpath, inode_id);
-	int fd = open(fpath, O_RDONLY);
-	ssize_t ret = pread(fd, buffer, size, 0);
-	close(fd);
+	int fd = fdcache->Get(inode_id, fpath, 0644, O_RDONLY);
+	ssize_t ret = (fd < 0) ? fd : io->Read(fd, buffer, size, 0);
+	CloseDiskFile(fd);
+	ForgetDiskFile(inode_id);
 	unlink(fpath);
 	return ret;
 }
 
 // need to change parameter in write usd std::string as input
 int TestFS::MigrateToDiskFile(std::string &stringbuf, int &fd, int flags) {
-	const tfs_inode_header* iheader = GetInodeHeader(stringbuf);
+	InodeHeader iheader = GetInodeHeader(stringbuf);
 	if (fd >= 0) {
-		close(fd);
+		CloseDiskFile(fd);
 	}
-	fd = OpenDiskFile(iheader, flags);
+	fd = OpenDiskFile(iheader, flags | O_CREAT);
 	if (fd < 0) {
 		fd = -1;
 		return -errno;
 	}
 	int ret = 0;
 	if (iheader->fstat.st_size > 0) {
-		const char* buffer = (const char *) iheader
-				+ (TFS_INODE_HEADER_SIZE + iheader->namelen + 1);
-		if (pwrite(fd, buffer, iheader->fstat.st_size, 0)
-				!= iheader->fstat.st_size) {
-			ret = -errno;
+		const char* buffer = stringbuf.data() + iheader.DataOffset();
+		ssize_t written = io->Write(fd, buffer, iheader->fstat.st_size, 0);
+		if (written != iheader->fstat.st_size) {
+			ret = (written < 0) ? written : -EIO;
 		}
 		DropInlineData(stringbuf);
 	}
@@ -630,113 +1339,1060 @@ int TestFS::MigrateToDiskFile(std::string &stringbuf, int &fd, int flags) {
 }
 
 void TestFS::CloseDiskFile(int& fd_) {
-	close(fd_);
+	fdcache->Put(fd_);
 	fd_ = -1;
 }
 
-int TestFS::Open(const char *path, struct fuse_file_info *fi) {
-#ifdef  TABLEFS_DEBUG
-	logs->LogMsg("Open: %s, Flags: %d\n", path, fi->flags);
-#endif
+void TestFS::ForgetDiskFile(tfs_inode_t inode_id) {
+	fdcache->Forget(inode_id);
+	if (directfds != NULL) {
+		directfds->Forget(inode_id);
+	}
+}
 
-	RAMCloud::KeyInfo mykeylist[2];
-	if (!PathLookup(path, mykeylist) {
-		return FSError("Open: No such file or directory\n");
+int TestFS::ReadDirect(const tfs_inode_header* iheader, char* buf,
+		size_t size, off_t offset) {
+	char fpath[128];
+	GetDiskFilePath(fpath, iheader->fstat.st_ino);
+	int fd = directfds->Get(iheader->fstat.st_ino, fpath,
+			iheader->fstat.st_mode, O_RDONLY);
+	if (fd < 0) {
+		return fd;
 	}
-	int ret = 0;
-	tfs_file_handle_t* fh = new tfs_file_handle_t();
-	fh->keylist_ = mykeylist;
-	fh->flags_ = fi->flags;
-	RAMCloud::Buffer rcbuf;
-	GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
-	const tfs_inode_header *iheader = GetInodeHeader(rcbuf);
-	if (iheader->has_blob > 0) {
-		fh->flag = fi->flags;
-		fh->fd_ = OpenDiskFile(iheader, fh->flags_);
-		if (fh->fd_ < 0) {
-			ret = -errno;
-		}
+	ssize_t ret = io->ReadDirect(fd, buf, size, offset);
+	directfds->Put(fd);
+	return ret;
+}
+
+int TestFS::WriteMigratedBlob(void* arg, tfs_inode_t inode, mode_t mode,
+		const std::string &data) {
+	TestFS* fs = reinterpret_cast<TestFS*>(arg);
+	char fpath[128];
+	fs->GetDiskFilePath(fpath, inode);
+	int fd = fs->fdcache->Get(inode, fpath, mode, O_WRONLY | O_CREAT);
+	if (fd < 0) {
+		return fd;
 	}
-#ifdef  TABLEFS_DEBUG
-	logs->LogMsg("Open: %s,FD: %d\n",
-			path,fh->fd_);
-#endif
-	if (ret == 0) {
-		fi->fh = (uint64_t) fh;
+	int ret = 0;
+	if (ftruncate(fd, data.size()) != 0) {
+		ret = -errno;
 	} else {
-		delete fh;
+		ssize_t written = fs->io->WriteSync(fd, data.data(), data.size(), 0,
+				true);
+		if (written != (ssize_t) data.size()) {
+			ret = (written < 0) ? written : -EIO;
+		}
 	}
+	fs->CloseDiskFile(fd);
 	return ret;
 }
 
-// need to readin data again, maybe save inode header pointer in fuse_file_info at open 
-int TestFS::Read(const char* path, char *buf, size_t size, off_t offset,struct fuse_file_info *fi) {
+int TestFS::CommitMigration(void* arg, const std::string &key,
+		const std::string &data, bool on_disk) {
+	TestFS* fs = reinterpret_cast<TestFS*>(arg);
+	RAMCloud::KeyInfo keylist[2];
+	keylist[0].key = key.data();
+	keylist[0].keyLength = key.size();
+	keylist[1].key = key.data();
+	keylist[1].keyLength = 24;
+	std::string value;
+	try {
+		value = CopytoString(fs->cluster, keylist[0], fs->mdt);
+	} catch (RAMCloud::ClientException& e) {
+		return -ENOENT;
+	}
+	if (!GetInodeHeader(value).Valid()) {
+		return -EIO;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(value);
+	// staged from a split file, whose data object is now stale
+	bool was_split = (new_iheader.has_blob == BLOB_SPLIT);
+	off_t split_size = new_iheader.fstat.st_size;
+	DropInlineData(value);
+	if (on_disk) {
+		new_iheader.has_blob = BLOB_ON_DISK;
+		new_iheader.blob_owner = fs->node_id;
+	} else {
+		// no blob file: keep the staged bytes, even past the threshold
+		new_iheader.has_blob = 0;
+		value.append(data);
+	}
+	new_iheader.fstat.st_size = data.size();
+	// Release leaves the timestamps of a staged file to the commit
+	new_iheader.fstat.st_atim.tv_sec = time(NULL);
+	new_iheader.fstat.st_atim.tv_nsec = 0;
+	new_iheader.fstat.st_mtim = new_iheader.fstat.st_atim;
+	UpdateInodeHeader(value, new_iheader);
+	fs->WriteMeta(keylist, value);
+	if (was_split && fs->chunks != NULL) {
+		fs->chunks->Remove(new_iheader.fstat.st_ino, split_size);
+	}
+	return 0;
+}
 
-#ifdef  TABLEFS_DEBUG
-logs->LogMsg("Read: %s\n", path);
-#endif
+void TestFS::FlushMigration(RAMCloud::KeyInfo *mykeylist) {
+	if (migrator != NULL) {
+		migrator->Flush(MetaKeyString(mykeylist[0]));
+	}
+}
 
-tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
-RAMCloud::KeyInfo *mykeylist=fh->keylist_; 
-ramcloud::Buffer rcbuf;
-GetRamCloudBuffer(&cluster,*mykeylist,mdt,rcbuf);
-const tfs_inode_header* iheader = GetInodeHeader(rcbuf);
-int ret;
-if (iheader->has_blob > 0) {
-	if (fh->fd_ < 0) {
-		fh->fd_ = OpenDiskFile(iheader, fh->flags_);
-		if (fh->fd_ < 0)
-			ret = -EBADF;
+int TestFS::FlushAppendSize(void* arg, const std::string &key, off_t size) {
+	TestFS* fs = reinterpret_cast<TestFS*>(arg);
+	RAMCloud::KeyInfo keylist[2];
+	keylist[0].key = key.data();
+	keylist[0].keyLength = key.size();
+	keylist[1].key = key.data();
+	keylist[1].keyLength = 24;
+	for (;;) {
+		RAMCloud::Buffer rcbuf;
+		uint64_t version = 0;
+		int ret;
+		try {
+			ret = GetRamCloudBuffer(fs->cluster, keylist[0], fs->mdt, &rcbuf,
+					&version);
+		} catch (RAMCloud::ClientException& e) {
+			return -ENOENT;
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		std::string value(static_cast<const char*>(
+				rcbuf.getRange(0, rcbuf.size())), rcbuf.size());
+		if (!GetInodeHeader(value).Valid()) {
+			return -EIO;
+		}
+		tfs_stat_t new_value = GetAttribute(value);
+		if (new_value.st_size >= size) {
+			// a later write or flush already has it at least this big
+			return 0;
+		}
+		new_value.st_size = size;
+		new_value.st_mtim.tv_sec = time(NULL);
+		new_value.st_mtim.tv_nsec = 0;
+		UpdateAttribute(value, new_value);
+		// a size written between the read and here must not be lost
+		ret = fs->WriteMetaIf(keylist, value, version);
+		if (ret != -EAGAIN) {
+			return ret;
+		}
 	}
-	if (fh->fd_ >= 0) {
-		ret = pread(fh->fd_, buf, size, offset);
+}
+
+void TestFS::FlushAppends(RAMCloud::KeyInfo *mykeylist, bool forget) {
+	if (appender != NULL) {
+		std::string key = MetaKeyString(mykeylist[0]);
+		appender->Flush(key);
+		if (forget) {
+			appender->Forget(key);
+		}
 	}
-} else {
+}
 
-	ret = GetInlineData(rcbuf, buf, offset, size);
+int TestFS::MigrateToChunks(std::string &stringbuf) {
+	if (chunks == NULL) {
+		return -EIO;
+	}
+	InodeHeader iheader = GetInodeHeader(stringbuf);
+	int ret = 0;
+	if (iheader->fstat.st_size > 0) {
+		const char* buffer = stringbuf.data() + iheader.DataOffset();
+		ret = chunks->Write(iheader->fstat.st_ino, buffer,
+				iheader->fstat.st_size, 0);
+		if (ret < 0) {
+			return ret;
+		}
+		DropInlineData(stringbuf);
+	}
+	return 0;
 }
-return ret;
+
+int TestFS::SplitInlineData(std::string &stringbuf, const char* buf,
+		size_t size, off_t offset) {
+	if (chunks == NULL) {
+		return -EIO;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(stringbuf);
+	size_t prefix = GetInodeHeader(stringbuf).DataOffset();
+	size_t cursize = std::min((size_t) new_iheader.fstat.st_size,
+			stringbuf.size() - prefix);
+	std::string data(std::max((size_t) new_iheader.fstat.st_size,
+			(size_t) offset + size), '\0');
+	memcpy(&data[0], stringbuf.data() + prefix, cursize);
+	memcpy(&data[offset], buf, size);
+	int ret = chunks->Write(new_iheader.fstat.st_ino, data.data(),
+			data.size(), 0);
+	if (ret < 0) {
+		return ret;
+	}
+	DropInlineData(stringbuf);
+	new_iheader.fstat.st_size = data.size();
+	new_iheader.has_blob = BLOB_SPLIT;
+	UpdateInodeHeader(stringbuf, new_iheader);
+	return size;
 }
 
-int TestFS::Write(const char* path, const char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi) {
-#ifdef  TABLEFS_DEBUG
-logs->LogMsg("Write: %s %lld %d\n", path, offset, size);
-#endif
+int TestFS::JoinSplitData(std::string &stringbuf) {
+	if (chunks == NULL) {
+		return -EIO;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(stringbuf);
+	std::string data(new_iheader.fstat.st_size, '\0');
+	int ret = chunks->Read(new_iheader.fstat.st_ino, new_iheader.fstat.st_size,
+			&data[0], data.size(), 0);
+	if (ret < 0) {
+		return ret;
+	}
+	DropInlineData(stringbuf);
+	stringbuf.append(data);
+	new_iheader.has_blob = 0;
+	UpdateInodeHeader(stringbuf, new_iheader);
+	return 0;
+}
 
-tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
-RAMCloud::KeyInfo *mykeylist=fh->keylist_;
-std::String strbuf=CopytoString(&cluster,*mykeylist,mdt);
-const tfs_inode_header* iheader = GetInodeHeader(strbuf);
-int ret = 0, has_imgrated = 0;
-int has_larger_size = (iheader->fstat.st_size < offset + size) ? 1 : 0;
+int TestFS::ShareInlineData(std::string &stringbuf, const char* buf,
+		size_t size) {
+	std::string digest;
+	int ret = contents->Ref(buf, size, digest);
+	if (ret < 0) {
+		return ret;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(stringbuf);
+	DropInlineData(stringbuf);
+	stringbuf.append(digest);
+	new_iheader.fstat.st_size = size;
+	new_iheader.has_blob = BLOB_SHARED;
+	UpdateInodeHeader(stringbuf, new_iheader);
+	return size;
+}
+
+int TestFS::UnshareData(std::string &stringbuf, std::string &digest) {
+	InodeHeader iheader = GetInodeHeader(stringbuf);
+	digest = stringbuf.substr(iheader.DataOffset());
+	std::string data;
+	int ret = (contents == NULL) ? -EIO : contents->Get(digest, data);
+	if (ret < 0) {
+		digest.clear();
+		return ret;
+	}
+	tfs_inode_header new_iheader = *iheader;
+	DropInlineData(stringbuf);
+	stringbuf.append(data);
+	new_iheader.has_blob = 0;
+	UpdateInodeHeader(stringbuf, new_iheader);
+	return 0;
+}
 
-#ifdef  TABLEFS_DEBUG
-logs->LogMsg("Write: %s has_larger_size %d old: %d new: %lld\n",
-		path, has_larger_size, iheader->fstat.st_size, offset + size);
-#endif
+int TestFS::ReadSharedData(RAMCloud::Buffer &value, char* buf, size_t size,
+		off_t offset) {
+	if (contents == NULL) {
+		return -EIO;
+	}
+	std::string digest(ContentStore::DIGEST_SIZE, '\0');
+	if (GetInlineData(value, &digest[0], 0, digest.size()) != digest.size()) {
+		return -EIO;
+	}
+	return contents->Read(digest, buf, size, offset);
+}
 
-if (iheader->has_blob > 0) {
-	if (fh->fd_ < 0) {
-		fh->fd_ = OpenDiskFile(iheader, fh->flags_);
-		if (fh->fd_ < 0)
-			ret = -EBADF;
+uint32_t TestFS::DirThreshold(const std::string &dir) {
+	uint32_t override_threshold = 0;
+	if (overrides->Get(dir, override_threshold)) {
+		return override_threshold;
 	}
-	if (fh->fd_ >= 0) {
-		ret = pwrite(fh->fd_, buf, size, offset);
+	RAMCloud::KeyInfo dirkey[2];
+	std::string value;
+	if (PathLookup(dir.c_str(), dirkey) && LookupMeta(dirkey[0], dir, value)
+			&& GetInodeHeader(value).Valid()) {
+		override_threshold = GetInodeHeader(value)->inline_threshold;
+	}
+	if (override_threshold == 0 && dir != "/") {
+		std::string parent, ext;
+		ThresholdPolicy::SplitPath(dir.c_str(), parent, ext);
+		override_threshold = DirThreshold(parent);
+	}
+	overrides->Put(dir, override_threshold);
+	return override_threshold;
+}
+
+uint64_t TestFS::InlineThreshold(const char *path) {
+	std::string dir, ext;
+	ThresholdPolicy::SplitPath(path, dir, ext);
+	uint32_t override_threshold = DirThreshold(dir);
+	if (override_threshold > 0) {
+		return override_threshold;
+	}
+	return (thresholds != NULL) ? thresholds->Threshold(dir, ext) : threshold;
+}
+
+int TestFS::MigrateToPack(std::string &stringbuf, RAMCloud::KeyInfo *mykeylist,
+		const char* buf, size_t size, off_t offset) {
+	tfs_inode_header new_iheader = *GetInodeHeader(stringbuf);
+	size_t prefix = GetInodeHeader(stringbuf).DataOffset();
+	size_t cursize = new_iheader.fstat.st_size;
+	if (cursize > stringbuf.size() - prefix) {
+		cursize = stringbuf.size() - prefix;
+	}
+	std::string data(std::max((size_t) new_iheader.fstat.st_size,
+			(size_t) offset + size), '\0');
+	memcpy(&data[0], stringbuf.data() + prefix, cursize);
+	if (size > 0) {
+		memcpy(&data[offset], buf, size);
+	}
+	PackLocation loc;
+	int ret = packs->Append(MetaKeyString(mykeylist[0]),
+			new_iheader.fstat.st_ino, data.data(), data.size(), loc);
+	if (ret < 0) {
+		return ret;
+	}
+	DropInlineData(stringbuf);
+	new_iheader.fstat.st_size = data.size();
+	new_iheader.has_blob = BLOB_PACKED;
+	SetPackLocation(new_iheader, loc);
+	UpdateInodeHeader(stringbuf, new_iheader);
+	return size;
+}
+
+// Places the whole content of a packed file, data zero-extended to
+// file_size, in a new extent or, past pack_threshold, in its own datadir
+// file, and frees the old extent. Called with packs->Lock() held.
+int TestFS::RepackData(tfs_inode_header &iheader, RAMCloud::KeyInfo *mykeylist,
+		std::string &data, size_t file_size) {
+	PackLocation old = PackLocationOf(&iheader);
+	if (file_size <= pack_threshold) {
+		data.resize(file_size);
+		PackLocation loc;
+		int ret = packs->Append(MetaKeyString(mykeylist[0]),
+				iheader.fstat.st_ino, data.data(), data.size(), loc);
+		if (ret < 0) {
+			return ret;
+		}
+		SetPackLocation(iheader, loc);
+	} else {
+		int fd = OpenDiskFile(&iheader, O_WRONLY | O_CREAT | O_TRUNC);
+		if (fd < 0) {
+			return -errno;
+		}
+		int ret = 0;
+		ssize_t written = io->Write(fd, data.data(), data.size(), 0);
+		if (written != (ssize_t) data.size()) {
+			ret = (written < 0) ? written : -EIO;
+		} else if (ftruncate(fd, file_size) != 0) {
+			ret = -errno;
+		}
+		CloseDiskFile(fd);
+		if (ret < 0) {
+			return ret;
+		}
+		iheader.has_blob = BLOB_ON_DISK;
+		iheader.blob_owner = node_id;
+	}
+	packs->Free(old);
+	iheader.fstat.st_size = file_size;
+	return 0;
+}
+
+int TestFS::WritePacked(const char* path, RAMCloud::KeyInfo *mykeylist,
+		const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	packs->Lock();
+	std::string strbuf = CopytoString(cluster, *mykeylist, mdt);
+	if (!GetInodeHeader(strbuf).Valid()) {
+		packs->Unlock();
+		return -EIO;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(strbuf);
+	if (new_iheader.has_blob != BLOB_PACKED) {
+		// moved out of the pack store since the caller looked
+		packs->Unlock();
+		return Write(path, buf, size, offset, fi);
+	}
+	PackLocation loc = PackLocationOf(&new_iheader);
+	size_t cursize = new_iheader.fstat.st_size;
+	size_t end = offset + size;
+	int ret;
+	if (end <= loc.capacity) {
+		ret = packs->Write(loc, buf, size, offset);
+		if (ret >= 0 && end > cursize) {
+			new_iheader.fstat.st_size = end;
+		}
+	} else {
+		// outgrew its extent: rewrite the whole file elsewhere
+		std::string data(std::max(cursize, end), '\0');
+		ret = packs->Read(loc, cursize, &data[0], cursize, 0);
+		if (ret >= 0) {
+			memcpy(&data[offset], buf, size);
+			ret = RepackData(new_iheader, mykeylist, data, data.size());
+		}
+		if (ret >= 0) {
+			ret = size;
+		}
+	}
+	if (ret >= 0) {
+		UpdateInodeHeader(strbuf, new_iheader);
+		WriteMeta(mykeylist, strbuf);
+	}
+	packs->Unlock();
+	return ret;
+}
+
+int TestFS::TruncatePacked(const char *path, RAMCloud::KeyInfo *mykeylist,
+		off_t new_size, off_t limit) {
+	packs->Lock();
+	std::string strbuf = CopytoString(cluster, *mykeylist, mdt);
+	if (!GetInodeHeader(strbuf).Valid()) {
+		packs->Unlock();
+		return -EIO;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(strbuf);
+	if (new_iheader.has_blob != BLOB_PACKED) {
+		packs->Unlock();
+		return Truncate(path, new_size);
+	}
+	PackLocation loc = PackLocationOf(&new_iheader);
+	size_t cursize = new_iheader.fstat.st_size;
+	int ret = 0;
+	if (new_size <= limit) {
+		// small enough to go back inline
+		std::string data(new_size, '\0');
+		ret = packs->Read(loc, cursize, &data[0], new_size, 0);
+		if (ret >= 0) {
+			UpdateInlineData(strbuf, data.data(), 0, new_size);
+			packs->Free(loc);
+			new_iheader.has_blob = 0;
+			new_iheader.fstat.st_size = new_size;
+		}
+	} else if (new_size <= loc.capacity) {
+		// keep the bytes past the end of file zero
+		if ((size_t) new_size < cursize) {
+			ret = packs->Zero(loc, new_size, cursize - new_size);
+		}
+		new_iheader.fstat.st_size = new_size;
+	} else {
+		std::string data(cursize, '\0');
+		ret = packs->Read(loc, cursize, &data[0], cursize, 0);
+		if (ret >= 0) {
+			ret = RepackData(new_iheader, mykeylist, data, new_size);
+		}
+	}
+	if (ret >= 0) {
+		ret = 0;
+		UpdateInodeHeader(strbuf, new_iheader);
+		WriteMeta(mykeylist, strbuf);
+	}
+	packs->Unlock();
+	return ret;
+}
+
+// Compaction moved an extent: point its inode at the new place, unless the
+// inode changed meanwhile (e.g. renamed by another mount).
+int TestFS::RelocatePacked(void* arg, const std::string &key,
+		const PackLocation &from, const PackLocation &to) {
+	TestFS* fs = reinterpret_cast<TestFS*>(arg);
+	RAMCloud::KeyInfo keylist[2];
+	keylist[0].key = key.data();
+	keylist[0].keyLength = key.size();
+	// the secondary key is the parent id that prefixes the primary key,
+	// see MakeMetaKey
+	keylist[1].key = key.data();
+	keylist[1].keyLength = 24;
+	std::string value;
+	try {
+		value = CopytoString(fs->cluster, keylist[0], fs->mdt);
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
+		return -ENOENT;
+	} catch (RAMCloud::ClientException& e) {
+		return -EIO;
+	}
+	if (!GetInodeHeader(value).Valid()) {
+		return -EIO;
+	}
+	tfs_inode_header new_iheader = *GetInodeHeader(value);
+	if (new_iheader.has_blob != BLOB_PACKED
+			|| new_iheader.blob_owner != from.node
+			|| new_iheader.pack_segment != from.segment
+			|| new_iheader.pack_offset != from.offset) {
+		// unlinked, rewritten or moved out of the pack meanwhile
+		return -ENOENT;
+	}
+	SetPackLocation(new_iheader, to);
+	UpdateInodeHeader(value, new_iheader);
+	fs->WriteMeta(keylist, value);
+	return 0;
+}
+
+int TestFS::RestoreArchived(RAMCloud::KeyInfo *mykeylist, int &fd_) {
+	if (fd_ >= 0) {
+		// opened on the blob file the archive replaced
+		CloseDiskFile(fd_);
+	}
+	if (archives == NULL) {
+		return -EIO;
+	}
+	archives->Lock();
+	std::string value = CopytoString(cluster, mykeylist[0], mdt);
+	InodeHeader iheader = GetInodeHeader(value);
+	if (!iheader.Valid()) {
+		archives->Unlock();
+		return -EIO;
+	}
+	if (iheader->has_blob != BLOB_ARCHIVED) {
+		archives->Unlock();
+		return 0;
+	}
+	ArchiveLocation loc = ArchiveLocationOf(iheader);
+	int fd = OpenDiskFile(iheader, O_WRONLY | O_CREAT | O_TRUNC);
+	int ret = (fd < 0) ? -errno : archives->Restore(loc, fd);
+	if (ret == 0 && fdatasync(fd) != 0) {
+		ret = -errno;
+	}
+	if (fd >= 0) {
+		CloseDiskFile(fd);
+	}
+	if (ret == 0) {
+		tfs_inode_header new_iheader = *iheader;
+		new_iheader.has_blob = BLOB_ON_DISK;
+		new_iheader.blob_owner = node_id;
+		new_iheader.pack_segment = 0;
+		new_iheader.pack_offset = 0;
+		// in use again: the policy leaves it in the blob tier while it is
+		new_iheader.fstat.st_atim.tv_sec = time(NULL);
+		new_iheader.fstat.st_atim.tv_nsec = 0;
+		UpdateInodeHeader(value, new_iheader);
+		WriteMeta(mykeylist, value);
+		archives->Free(loc);
+	} else {
+		logs->LogMsg("RestoreArchived: inode %lu: %s\n",
+				(unsigned long) iheader->fstat.st_ino, strerror(-ret));
+	}
+	archives->Unlock();
+	return ret;
+}
+
+int TestFS::ArchiveBlob(RAMCloud::KeyInfo *mykeylist) {
+	std::string value;
+	try {
+		value = CopytoString(cluster, mykeylist[0], mdt);
+	} catch (RAMCloud::ClientException& e) {
+		return -ENOENT;
+	}
+	InodeHeader iheader = GetInodeHeader(value);
+	if (!iheader.Valid()) {
+		return -EIO;
+	}
+	if (iheader->has_blob != BLOB_ON_DISK || IsRemoteBlob(iheader)) {
+		return -EAGAIN;
+	}
+	tfs_inode_t inode = iheader->fstat.st_ino;
+	if (fdcache->InUse(inode)) {
+		return -EBUSY;
+	}
+	char fpath[128];
+	GetDiskFilePath(fpath, inode);
+	int fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	// compress outside the lock; a write meanwhile changes the mtime
+	struct stat before, after;
+	ArchiveLocation loc;
+	int ret = (fstat(fd, &before) != 0) ? -errno
+			: archives->Append(MetaKeyString(mykeylist[0]), inode, fd,
+					iheader->fstat.st_size, loc);
+	bool appended = (ret == 0);
+	if (ret == 0) {
+		ret = archives->Sync();
+	}
+	if (ret == 0 && (fstat(fd, &after) != 0 || after.st_size != before.st_size
+			|| after.st_mtim.tv_sec != before.st_mtim.tv_sec
+			|| after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)) {
+		ret = -EAGAIN;
+	}
+	close(fd);
+
+	archives->Lock();
+	std::string current;
+	uint64_t version = 0;
+	if (ret == 0) {
+		RAMCloud::Buffer rcbuf;
+		try {
+			ret = GetRamCloudBuffer(cluster, mykeylist[0], mdt, &rcbuf,
+					&version);
+		} catch (RAMCloud::ClientException& e) {
+			ret = -ENOENT;
+		}
+		if (ret == 0) {
+			current.assign(static_cast<const char*>(
+					rcbuf.getRange(0, rcbuf.size())), rcbuf.size());
+		}
+	}
+	InodeHeader now = GetInodeHeader(current);
+	if (ret == 0 && !now.Valid()) {
+		ret = -EIO;
+	}
+	if (ret == 0 && (now->has_blob != BLOB_ON_DISK
+			|| now->fstat.st_ino != inode
+			|| now->fstat.st_size != iheader->fstat.st_size
+			|| fdcache->InUse(inode))) {
+		ret = -EAGAIN;
+	}
+	if (ret < 0) {
+		if (appended) {
+			archives->Free(loc);
+		}
+		archives->Unlock();
+		return ret;
+	}
+	tfs_inode_header new_iheader = *now;
+	new_iheader.has_blob = BLOB_ARCHIVED;
+	SetArchiveLocation(new_iheader, loc);
+	UpdateInodeHeader(current, new_iheader);
+	// a write since the re-read wins; the blob stays on disk
+	ret = WriteMetaIf(mykeylist, current, version);
+	if (ret == -EAGAIN) {
+		archives->Free(loc);
+	}
+	archives->Unlock();
+	if (ret < 0) {
+		return ret;
+	}
+	// not through the reclaimer: a restore recreates this same path
+	ForgetDiskFile(inode);
+	unlink(fpath);
+	return 0;
+}
+
+int TestFS::InlineBlob(RAMCloud::KeyInfo *mykeylist) {
+	std::string value;
+	try {
+		value = CopytoString(cluster, mykeylist[0], mdt);
+	} catch (RAMCloud::ClientException& e) {
+		return -ENOENT;
+	}
+	InodeHeader iheader = GetInodeHeader(value);
+	if (!iheader.Valid()) {
+		return -EIO;
+	}
+	if (iheader->has_blob != BLOB_ON_DISK || IsRemoteBlob(iheader)) {
+		return -EAGAIN;
+	}
+	tfs_inode_t inode = iheader->fstat.st_ino;
+	if (fdcache->InUse(inode)) {
+		return -EBUSY;
+	}
+	char fpath[128];
+	GetDiskFilePath(fpath, inode);
+	std::string data(iheader->fstat.st_size, '\0');
+	int fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	ssize_t n = data.empty() ? 0 : pread(fd, &data[0], data.size(), 0);
+	close(fd);
+	if (n < 0) {
+		return -EIO;
+	}
+
+	archives->Lock();
+	std::string current;
+	uint64_t version = 0;
+	RAMCloud::Buffer rcbuf;
+	int ret;
+	try {
+		ret = GetRamCloudBuffer(cluster, mykeylist[0], mdt, &rcbuf, &version);
+	} catch (RAMCloud::ClientException& e) {
+		ret = -ENOENT;
+	}
+	if (ret == 0) {
+		current.assign(static_cast<const char*>(
+				rcbuf.getRange(0, rcbuf.size())), rcbuf.size());
+	}
+	InodeHeader now = GetInodeHeader(current);
+	if (ret == 0 && !now.Valid()) {
+		ret = -EIO;
+	}
+	if (ret == 0 && (now->has_blob != BLOB_ON_DISK
+			|| now->fstat.st_ino != inode
+			|| now->fstat.st_size != iheader->fstat.st_size
+			|| now->fstat.st_mtim.tv_sec != iheader->fstat.st_mtim.tv_sec
+			|| fdcache->InUse(inode))) {
+		ret = -EAGAIN;
+	}
+	if (ret < 0) {
+		archives->Unlock();
+		return ret;
+	}
+	tfs_inode_header new_iheader = *now;
+	new_iheader.has_blob = 0;
+	UpdateInodeHeader(current, new_iheader);
+	UpdateInlineData(current, data.data(), 0, data.size());
+	// a write since the re-read wins; the blob stays on disk
+	ret = WriteMetaIf(mykeylist, current, version);
+	archives->Unlock();
+	if (ret < 0) {
+		return ret;
+	}
+	ForgetDiskFile(inode);
+	unlink(fpath);
+	return 0;
+}
+
+int TestFS::MoveData(void* arg, const std::string &key,
+		PlacementPolicy::Tier to) {
+	TestFS* fs = reinterpret_cast<TestFS*>(arg);
+	RAMCloud::KeyInfo keylist[2];
+	keylist[0].key = key.data();
+	keylist[0].keyLength = key.size();
+	keylist[1].key = key.data();
+	keylist[1].keyLength = 24;
+	switch (to) {
+	case PlacementPolicy::TIER_ARCHIVE:
+		return fs->ArchiveBlob(keylist);
+	case PlacementPolicy::TIER_INLINE:
+		return fs->InlineBlob(keylist);
+	default:
+		return -EINVAL;
+	}
+}
+
+time_t TestFS::BlobAccessTime(void* arg, tfs_inode_t inode) {
+	TestFS* fs = reinterpret_cast<TestFS*>(arg);
+	char fpath[128];
+	fs->GetDiskFilePath(fpath, inode);
+	struct stat st;
+	if (stat(fpath, &st) != 0) {
+		return 0;
+	}
+	return std::max(st.st_atime, st.st_mtime);
+}
+
+int TestFS::ReadExternalBlob(const tfs_inode_header* iheader, char* buf,
+		size_t size, off_t offset) {
+	if (iheader->has_blob == BLOB_SHARED || iheader->has_blob == BLOB_ARCHIVED) {
+		// the digest is in the inline data: see ReadSharedData; archived
+		// data is restored first, see RestoreArchived
+		return -EIO;
+	}
+	if (iheader->has_blob == BLOB_PACKED) {
+		if (packs == NULL) {
+			return -EIO;
+		}
+		return packs->Read(PackLocationOf(iheader), iheader->fstat.st_size,
+				buf, size, offset);
+	}
+	if (iheader->has_blob == BLOB_CHUNKED || iheader->has_blob == BLOB_SPLIT) {
+		if (chunks == NULL) {
+			return -EIO;
+		}
+		return chunks->Read(iheader->fstat.st_ino, iheader->fstat.st_size,
+				buf, size, offset);
+	}
+	return blobclient->Read(iheader->blob_owner, iheader->fstat.st_ino,
+			buf, size, offset);
+}
+
+int TestFS::WriteExternalBlob(const tfs_inode_header* iheader,
+		const char* buf, size_t size, off_t offset) {
+	if (iheader->has_blob == BLOB_PACKED || iheader->has_blob == BLOB_SHARED
+			|| iheader->has_blob == BLOB_ARCHIVED) {
+		// packed files are written through WritePacked, shared ones
+		// after UnshareData, archived ones after RestoreArchived
+		return -EIO;
+	}
+	if (iheader->has_blob == BLOB_CHUNKED || iheader->has_blob == BLOB_SPLIT) {
+		if (chunks == NULL) {
+			return -EIO;
+		}
+		return chunks->Write(iheader->fstat.st_ino, buf, size, offset);
+	}
+	return blobclient->Write(iheader->blob_owner, iheader->fstat.st_ino,
+			buf, size, offset);
+}
+
+int TestFS::Open(const char *path, struct fuse_file_info *fi) {
+	MonitorScope scope(monitor, OP_OPEN);
+	if (IsStatsPath(path)) {
+		return StatsOpen(path, fi);
+	}
+#ifdef  TABLEFS_DEBUG
+	logs->LogMsg("Open: %s, Flags: %d\n", path, fi->flags);
+#endif
+
+	RAMCloud::KeyInfo mykeylist[2];
+	if (!PathLookup(path, mykeylist) {
+		return FSError("Open: No such file or directory\n");
+	}
+	int ret = 0;
+	tfs_file_handle_t* fh = new tfs_file_handle_t();
+	fh->keylist_ = mykeylist;
+	fh->flags_ = fi->flags;
+	RAMCloud::Buffer rcbuf;
+	ret = GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
+	InodeHeader iheader = GetInodeHeader(rcbuf);
+	if (ret == 0 && !iheader.Valid()) {
+		ret = -EIO;
+	}
+	if (ret == 0 && iheader->has_blob == BLOB_ARCHIVED) {
+		// first access to cold data: back to the blob tier
+		ret = RestoreArchived(mykeylist, fh->fd_);
+		rcbuf.reset();
+		if (ret == 0) {
+			ret = GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
+		}
+		iheader = GetInodeHeader(rcbuf);
+		if (ret == 0 && !iheader.Valid()) {
+			ret = -EIO;
+		}
+	}
+	if (ret == 0 && iheader->has_blob > 0 && !IsExternalBlob(iheader)) {
+		fh->flag = fi->flags;
+		fh->fd_ = OpenBlobFile(mykeylist, iheader, fh->flags_);
+		if (fh->fd_ < 0) {
+			ret = -errno;
+		}
+		if (ret == -EAGAIN) {
+			// archived or inlined under us: start over from the new header
+			delete fh;
+			return Open(path, fi);
+		}
+	}
+#ifdef  TABLEFS_DEBUG
+	logs->LogMsg("Open: %s,FD: %d\n",
+			path,fh->fd_);
+#endif
+	if (ret == 0) {
+		fi->fh = (uint64_t) fh;
+	} else {
+		delete fh;
+	}
+	return ret;
+}
+
+// need to readin data again, maybe save inode header pointer in fuse_file_info at open 
+int TestFS::Read(const char* path, char *buf, size_t size, off_t offset,struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_READ);
+
+#ifdef  TABLEFS_DEBUG
+logs->LogMsg("Read: %s\n", path);
+#endif
+
+tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
+if (fh->snapshot_ != NULL) {
+	const std::string &data = *fh->snapshot_;
+	if (offset >= (off_t) data.size()) {
+		return 0;
+	}
+	size = std::min(size, data.size() - offset);
+	memcpy(buf, data.data() + offset, size);
+	return size;
+}
+RAMCloud::KeyInfo *mykeylist=fh->keylist_; 
+if (migrator != NULL) {
+	int ret = migrator->Read(MetaKeyString(mykeylist[0]), buf, size, offset);
+	if (ret != -ENOENT) {
+		return ret;
+	}
+}
+ramcloud::Buffer rcbuf;
+int ret = GetRamCloudBuffer(&cluster,*mykeylist,mdt,rcbuf);
+InodeHeader iheader = GetInodeHeader(rcbuf);
+if (ret < 0 || !iheader.Valid()) {
+	return (ret < 0) ? ret : -EIO;
+}
+if (iheader->has_blob == BLOB_ARCHIVED) {
+	// archived while open
+	ret = RestoreArchived(mykeylist, fh->fd_);
+	if (ret < 0) {
+		return ret;
+	}
+	rcbuf.reset();
+	ret = GetRamCloudBuffer(&cluster,*mykeylist,mdt,rcbuf);
+	iheader = GetInodeHeader(rcbuf);
+	if (ret < 0 || !iheader.Valid()) {
+		return (ret < 0) ? ret : -EIO;
+	}
+}
+if (iheader->has_blob == BLOB_SHARED) {
+	ret = ReadSharedData(rcbuf, buf, size, offset);
+} else if (IsExternalBlob(iheader)) {
+	ret = ReadExternalBlob(iheader, buf, size, offset);
+} else if (iheader->has_blob > 0) {
+	if (fh->fd_ < 0) {
+		fh->fd_ = OpenBlobFile(mykeylist, iheader, fh->flags_);
+		if (fh->fd_ < 0 && errno == EAGAIN)
+			return Read(path, buf, size, offset, fi);
+		if (fh->fd_ < 0)
+			ret = -EBADF;
+	}
+	if (directfds != NULL && (uint64_t) iheader->fstat.st_size >= direct_cutoff) {
+		ret = ReadDirect(iheader, buf, size, offset);
+	} else if (fh->fd_ >= 0) {
+		ret = io->Read(fh->fd_, buf, size, offset);
+		if (readahead != NULL && ret > 0) {
+			readahead->OnRead(fi->fh, fh->fd_, offset, ret,
+					iheader->fstat.st_size,
+					fdcache->Holders(iheader->fstat.st_ino) > 1);
+		}
+	}
+} else {
+
+	ret = GetInlineData(rcbuf, buf, offset, size);
+}
+return ret;
+}
+
+int TestFS::Write(const char* path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_WRITE);
+if (IsStatsPath(path)) {
+	return StatsWrite(buf, size);
+}
+#ifdef  TABLEFS_DEBUG
+logs->LogMsg("Write: %s %lld %d\n", path, offset, size);
+#endif
+
+tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
+RAMCloud::KeyInfo *mykeylist=fh->keylist_;
+if (migrator != NULL) {
+	// a file being migrated is written in its staging buffer
+	int ret = migrator->Write(MetaKeyString(mykeylist[0]), buf, size, offset);
+	if (ret == -EFBIG) {
+		// outgrew staging: wait for the blob and write that
+		FlushMigration(mykeylist);
+	} else if (ret != -ENOENT) {
+		return ret;
+	}
+}
+std::String strbuf=CopytoString(&cluster,*mykeylist,mdt);
+InodeHeader iheader = GetInodeHeader(strbuf);
+if (!iheader.Valid()) {
+	return -EIO;
+}
+int ret = 0, has_imgrated = 0;
+int has_larger_size = (iheader->fstat.st_size < offset + size) ? 1 : 0;
+off_t joined_size = -1;
+if (iheader->has_blob == BLOB_ARCHIVED) {
+	ret = RestoreArchived(mykeylist, fh->fd_);
+	if (ret < 0) {
+		return ret;
+	}
+	strbuf = CopytoString(cluster, *mykeylist, mdt);
+	iheader = GetInodeHeader(strbuf);
+	if (!iheader.Valid()) {
+		return -EIO;
+	}
+}
+if (iheader->has_blob == BLOB_SPLIT && offset + size > InlineThreshold(path)) {
+	// outgrew the inline size: take the data back and move it on like
+	// any inline file
+	joined_size = iheader->fstat.st_size;
+	ret = JoinSplitData(strbuf);
+	if (ret < 0) {
+		return ret;
+	}
+	iheader = GetInodeHeader(strbuf);
+}
+std::string unshared;
+if (iheader->has_blob == BLOB_SHARED) {
+	// copy on write; the payload loses this reference once the inode
+	// stops pointing to it
+	ret = UnshareData(strbuf, unshared);
+	if (ret < 0) {
+		return ret;
+	}
+	iheader = GetInodeHeader(strbuf);
+}
+
+#ifdef  TABLEFS_DEBUG
+logs->LogMsg("Write: %s has_larger_size %d old: %d new: %lld\n",
+		path, has_larger_size, iheader->fstat.st_size, offset + size);
+#endif
+
+if (iheader->has_blob == BLOB_PACKED && packs != NULL) {
+	return WritePacked(path, mykeylist, buf, size, offset, fi);
+}
+
+if (IsExternalBlob(iheader)) {
+	ret = WriteExternalBlob(iheader, buf, size, offset);
+	if (iheader->has_blob == BLOB_SPLIT && !has_larger_size) {
+		// only the data object changed
+		return ret;
+	}
+} else if (iheader->has_blob > 0) {
+	if (fh->fd_ < 0) {
+		fh->fd_ = OpenBlobFile(mykeylist, iheader, fh->flags_);
+		if (fh->fd_ < 0 && errno == EAGAIN)
+			return Write(path, buf, size, offset, fi);
+		if (fh->fd_ < 0)
+			ret = -EBADF;
+	}
+	if (fh->fd_ >= 0) {
+		ret = io->Write(fh->fd_, buf, size, offset);
+	}
+	if (ret > 0 && appender != NULL
+			&& appender->Extend(MetaKeyString(mykeylist[0]), fh->fd_,
+					iheader->fstat.st_size, offset, ret)) {
+		// an append stream: the flusher writes its size
+		return ret;
 	}
 } else {                     //Today's mark
-	if (offset + size > threshold) {
+	uint64_t limit = InlineThreshold(path);
+	if (offset + size > limit && flag_chunked_data) {
+		ret = MigrateToChunks(strbuf);
+		if (ret == 0) {
+			tfs_inode_header new_iheader = *GetInodeHeader(strbuf);
+			new_iheader.fstat.st_size = offset + size;
+			new_iheader.has_blob = BLOB_CHUNKED;
+			UpdateInodeHeader(strbuf, new_iheader);
+			has_imgrated = 1;
+			ret = chunks->Write(new_iheader.fstat.st_ino, buf, size, offset);
+		}
+	} else if (offset + size > limit && packs != NULL
+			&& offset + size <= pack_threshold) {
+		ret = MigrateToPack(strbuf, mykeylist, buf, size, offset);
+		has_imgrated = 1;
+	} else if (offset + size > limit) {
+		ret = -EFBIG;
+		if (migrator != NULL) {
+			size_t prefix = iheader.DataOffset();
+			size_t cursize = std::min((size_t) iheader->fstat.st_size,
+					strbuf.size() - prefix);
+			ret = migrator->Stage(MetaKeyString(mykeylist[0]),
+					iheader->fstat.st_ino, iheader->fstat.st_mode,
+					strbuf.data() + prefix, cursize, buf, size, offset);
+		}
+		if (ret != -EFBIG) {
+			// staged: the inode stays inline until the worker commits it
+			if (!unshared.empty()) {
+				WriteMeta(mykeylist, strbuf);
+				contents->Unref(unshared);
+			}
+			return ret;
+		}
 		size_t cursize = iheader->fstat.st_size;
 		ret = MigrateToDiskFile(rcbuf, fh->fd_, fi->flags);
 		if (ret == 0) {
 			tfs_inode_header new_iheader = *GetInodeHeader(rcbuf);
 			new_iheader.fstat.st_size = offset + size;
 			new_iheader.has_blob = 1;
+			new_iheader.blob_owner = node_id;
 			UpdateInodeHeader(strbuf, new_iheader);
 			has_imgrated = 1;
-			ret = pwrite(fh->fd_, buf, size, offset);
+			ret = io->Write(fh->fd_, buf, size, offset);
+		}
+	} else if (flag_dedup_inline && S_ISREG(iheader->fstat.st_mode)
+			&& offset == 0 && size >= dedup_min_bytes
+			&& (off_t) size >= iheader->fstat.st_size) {
+		// the whole file in one write, as cp and tar write small files
+		ret = ShareInlineData(strbuf, buf, size);
+		if (ret >= 0) {
+			has_imgrated = 1;
+		} else {
+			// sharing is only an optimization: keep the copy inline
+			UpdateInlineData(strbuf, buf, offset, size);
+			ret = size;
 		}
+	} else if (flag_split_inline && S_ISREG(iheader->fstat.st_mode)) {
+		ret = SplitInlineData(strbuf, buf, size, offset);
+		has_imgrated = 1;
 	} else {
 		UpdateInlineData(strbuf, buf, offset, size);
 		ret = size;
@@ -753,25 +2409,262 @@ if (ret >= 0) {
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Write: %s",path);
 #endif
-WriteString(&cluster,mykeylist,mdt,strbuf);
+WriteMeta(mykeylist, strbuf);
+if (joined_size >= 0) {
+	// the inode no longer refers to the data object
+	chunks->Remove(iheader->fstat.st_ino, joined_size);
+}
+if (!unshared.empty()) {
+	contents->Unref(unshared);
+}
 return ret;
 }
 
 
+// Hand inline data to FUSE straight out of the RAMCloud::Buffer segments:
+// the segments are vmspliced into a per-handle pipe and FUSE splices the
+// pipe into /dev/fuse, so the bytes are never copied in user space. The
+// buffer must outlive the reply, so it is parked in fh->rcbuf_.
+int TestFS::SpliceInlineData(tfs_file_handle_t* fh, struct fuse_bufvec **bufp,
+		size_t size, off_t offset) {
+	RAMCloud::Buffer &value = *fh->rcbuf_;
+	InodeHeader header = GetInodeHeader(value);
+	size_t realoffset = header.DataOffset() + offset;
+	if (realoffset >= value.size()) {
+		size = 0;
+	} else if (realoffset + size > value.size()) {
+		size = value.size() - realoffset;
+	}
+	struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+	*bufv = FUSE_BUFVEC_INIT(size);
+	*bufp = bufv;
+	if (size == 0) {
+		return 0;
+	}
+
+	int nbytes = 0;
+	if (fh->pipe_[0] >= 0 && ioctl(fh->pipe_[0], FIONREAD, &nbytes) == 0 && nbytes > 0) {
+		// a previous reply failed half way, start over with a clean pipe
+		close(fh->pipe_[0]);
+		close(fh->pipe_[1]);
+		fh->pipe_[0] = fh->pipe_[1] = -1;
+	}
+	if (fh->pipe_[0] < 0 && pipe2(fh->pipe_, O_CLOEXEC | O_NONBLOCK) == 0) {
+		fcntl(fh->pipe_[1], F_SETPIPE_SZ, (thresholds != NULL)
+				? thresholds->MaxThreshold() : threshold);
+	}
+	if (fh->pipe_[0] >= 0 && fcntl(fh->pipe_[1], F_GETPIPE_SZ) >= (int) size) {
+		std::vector<struct iovec> iov;
+		RAMCloud::Buffer::Iterator it(&value, realoffset, size);
+		while (!it.isDone()) {
+			struct iovec seg;
+			seg.iov_base = const_cast<void *>(it.getData());
+			seg.iov_len = it.getLength();
+			iov.push_back(seg);
+			it.next();
+		}
+		if (vmsplice(fh->pipe_[1], &iov[0], iov.size(), 0) == (ssize_t) size) {
+			bufv->buf[0].flags = FUSE_BUF_IS_FD;
+			bufv->buf[0].fd = fh->pipe_[0];
+			return 0;
+		}
+		close(fh->pipe_[0]);
+		close(fh->pipe_[1]);
+		fh->pipe_[0] = fh->pipe_[1] = -1;
+	}
+
+	// no usable pipe: a single copy into memory FUSE will free()
+	bufv->buf[0].mem = malloc(size);
+	value.copy(realoffset, size, bufv->buf[0].mem);
+	return 0;
+}
+
+int TestFS::ReadBuf(const char* path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fi) {
+	MonitorScope scope(monitor, OP_READBUF);
+#ifdef  TABLEFS_DEBUG
+	logs->LogMsg("ReadBuf: %s %lld %d\n", path, offset, size);
+#endif
+	tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
+	if (fh->snapshot_ != NULL) {
+		struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+		*bufv = FUSE_BUFVEC_INIT(size);
+		bufv->buf[0].mem = malloc(size);
+		bufv->buf[0].size = Read(path, (char *) bufv->buf[0].mem, size,
+				offset, fi);
+		*bufp = bufv;
+		return 0;
+	}
+	if (fh->rcbuf_ == NULL) {
+		fh->rcbuf_ = new RAMCloud::Buffer();
+	} else {
+		fh->rcbuf_->reset();
+	}
+	off_t staged_size = 0;
+	if (migrator != NULL && migrator->StagedSize(MetaKeyString(fh->keylist_[0]),
+			staged_size)) {
+		// staged for migration: the current bytes are in the staging
+		// buffer. If the job commits before Read, the inode is current
+		size_t len = (offset < staged_size)
+				? std::min(size, (size_t) (staged_size - offset)) : 0;
+		char* data = (char *) malloc(len > 0 ? len : 1);
+		int ret = migrator->Read(MetaKeyString(fh->keylist_[0]), data, len,
+				offset);
+		if (ret >= 0) {
+			struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+			*bufv = FUSE_BUFVEC_INIT(ret);
+			bufv->buf[0].mem = data;
+			*bufp = bufv;
+			return 0;
+		}
+		free(data);
+	}
+	int ret = GetRamCloudBuffer(cluster, *fh->keylist_, mdt, fh->rcbuf_);
+	InodeHeader iheader = GetInodeHeader(*fh->rcbuf_);
+	if (ret < 0 || !iheader.Valid()) {
+		return (ret < 0) ? ret : -EIO;
+	}
+	if (iheader->has_blob == BLOB_ARCHIVED) {
+		ret = RestoreArchived(fh->keylist_, fh->fd_);
+		if (ret < 0) {
+			return ret;
+		}
+		fh->rcbuf_->reset();
+		ret = GetRamCloudBuffer(cluster, *fh->keylist_, mdt, fh->rcbuf_);
+		iheader = GetInodeHeader(*fh->rcbuf_);
+		if (ret < 0 || !iheader.Valid()) {
+			return (ret < 0) ? ret : -EIO;
+		}
+	}
+	if (iheader->has_blob == 0) {
+		return SpliceInlineData(fh, bufp, size, offset);
+	}
+	if (IsExternalBlob(iheader)) {
+		struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+		*bufv = FUSE_BUFVEC_INIT(size);
+		bufv->buf[0].mem = malloc(size);
+		*bufp = bufv;
+		char* data = (char *) bufv->buf[0].mem;
+		int ret = (iheader->has_blob == BLOB_SHARED)
+				? ReadSharedData(*fh->rcbuf_, data, size, offset)
+				: ReadExternalBlob(iheader, data, size, offset);
+		bufv->buf[0].size = (ret > 0) ? ret : 0;
+		return (ret < 0) ? ret : 0;
+	}
+
+	if (fh->fd_ < 0) {
+		fh->fd_ = OpenBlobFile(fh->keylist_, iheader, fh->flags_);
+		if (fh->fd_ < 0 && errno == EAGAIN)
+			return ReadBuf(path, bufp, size, offset, fi);
+		if (fh->fd_ < 0)
+			return -EBADF;
+	}
+	if (readahead != NULL) {
+		readahead->OnRead(fi->fh, fh->fd_, offset, size, iheader->fstat.st_size,
+				fdcache->Holders(iheader->fstat.st_ino) > 1);
+	}
+	// FUSE splices the blob range from the datadir file into /dev/fuse
+	struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	bufv->buf[0].fd = fh->fd_;
+	bufv->buf[0].pos = offset;
+	*bufp = bufv;
+	return 0;
+}
+
+int TestFS::WriteBuf(const char* path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi) {
+	MonitorScope scope(monitor, OP_WRITEBUF);
+	size_t size = fuse_buf_size(buf);
+#ifdef  TABLEFS_DEBUG
+	logs->LogMsg("WriteBuf: %s %lld %d\n", path, offset, size);
+#endif
+	if (IsStatsPath(path)) {
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = malloc(size);
+		ssize_t copied = fuse_buf_copy(&mem, buf, (enum fuse_buf_copy_flags) 0);
+		int ret = (copied < 0) ? copied :
+				StatsWrite((const char *) mem.buf[0].mem, copied);
+		free(mem.buf[0].mem);
+		return ret;
+	}
+	tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
+	RAMCloud::KeyInfo *mykeylist = fh->keylist_;
+	std::string strbuf = CopytoString(cluster, *mykeylist, mdt);
+	InodeHeader iheader = GetInodeHeader(strbuf);
+	if (!iheader.Valid()) {
+		return -EIO;
+	}
+
+	if (iheader->has_blob == 0 || IsExternalBlob(iheader)) {
+		// inline data, migration, chunks and remote blobs take the
+		// copying path
+		if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+			return Write(path, (const char *) buf->buf[0].mem + buf->off, size,
+					offset, fi);
+		}
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = malloc(size);
+		ssize_t copied = fuse_buf_copy(&mem, buf, (enum fuse_buf_copy_flags) 0);
+		int ret = (copied < 0) ? copied :
+				Write(path, (const char *) mem.buf[0].mem, copied, offset, fi);
+		free(mem.buf[0].mem);
+		return ret;
+	}
+
+	if (fh->fd_ < 0) {
+		fh->fd_ = OpenBlobFile(mykeylist, iheader, fh->flags_);
+		if (fh->fd_ < 0 && errno == EAGAIN)
+			return WriteBuf(path, buf, offset, fi);
+		if (fh->fd_ < 0)
+			return -EBADF;
+	}
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].fd = fh->fd_;
+	dst.buf[0].pos = offset;
+	ssize_t ret = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_MOVE);
+	if (ret > 0 && appender != NULL
+			&& appender->Extend(MetaKeyString(mykeylist[0]), fh->fd_,
+					iheader->fstat.st_size, offset, ret)) {
+		return ret;
+	}
+	if (ret > 0 && iheader->fstat.st_size < (off_t) (offset + ret)) {
+		tfs_inode_header new_iheader = *iheader;
+		new_iheader.fstat.st_size = offset + ret;
+		UpdateInodeHeader(strbuf, new_iheader);
+		WriteMeta(mykeylist, strbuf);
+	}
+	return ret;
+}
+
+
 // GetInodeHeader directly change metakey to iheader?
 int TestFS::Fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_FSYNC);
+if (IsStatsPath(path)) {
+	return 0;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Fsync: %s\n", path);
 #endif
 tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
 RAMCloud *mykeylist = fh->keylist_;
+// a staged file is durable once its migration has committed
+FlushMigration(fh->keylist_);
+FlushAppends(fh->keylist_, false);
 ramcloud::Buffer rcbuf;
-GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
-const tfs_inode_header* iheader = GetInodeHeader(rcbuf);
-int ret = 0;
+int ret = GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
+InodeHeader iheader = GetInodeHeader(rcbuf);
+if (ret < 0 || !iheader.Valid()) {
+	return (ret < 0) ? ret : -EIO;
+}
 if (handle->mode_ == INODE_WRITE) {
-	if (iheader->has_blob > 0) {
-		ret = fsync(fh->fd_);
+	if (iheader->has_blob == BLOB_PACKED && packs != NULL) {
+		ret = -packs->Sync(PackLocationOf(iheader));
+	} else if (iheader->has_blob > 0 && fh->fd_ >= 0) {
+		ret = -io->Fsync(fh->fd_, datasync != 0);
 	}
 	if (datasync == 0) {
 		//ret = metadb->Sync();
@@ -783,13 +2676,25 @@ return -ret;
 }
 
 int TestFS::Release(const char *path, struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_RELEASE);
 tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
+if (fh->snapshot_ != NULL) {
+	delete fh->snapshot_;
+	delete fh;
+	return 0;
+}
 RAMCloud mykeylist = fh->keylist_;
+// the commit of a staged file stamps its times, so do not wait for it
+off_t staged_size;
+bool staged = migrator != NULL
+		&& migrator->StagedSize(MetaKeyString(fh->keylist_[0]), staged_size);
+// likewise the size flush of an append stream, which we force here
+bool appending = appender != NULL
+		&& appender->Flush(MetaKeyString(fh->keylist_[0]));
 ramcloud::Buffer rcbuf;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-if (fh->mode_ == INODE_WRITE) {
-	const tfs_stat_t *value = GetAttribute(myresult);
-	tfs_stat_t new_value = *value;
+if (fh->mode_ == INODE_WRITE && !staged && !appending) {
+	tfs_stat_t new_value = GetAttribute(myresult);
 	new_value.st_atim.tv_sec = time(NULL);
 	new_value.st_atim.tv_nsec = 0;
 	new_value.st_mtim.tv_sec = time(NULL);
@@ -797,17 +2702,40 @@ if (fh->mode_ == INODE_WRITE) {
 	UpdateAttribute(myresult, new_value);
 }
 
+if (thresholds != NULL && (fh->flags_ & O_ACCMODE) != O_RDONLY
+		&& S_ISREG(GetAttribute(myresult).st_mode)) {
+	std::string dir, ext;
+	ThresholdPolicy::SplitPath(path, dir, ext);
+	thresholds->Record(GetAttribute(myresult).st_ino, dir, ext,
+			staged ? staged_size : GetAttribute(myresult).st_size);
+}
+
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Release: %s, FD: %d\n",
 		path, fh->fd_);
 #endif
 
 int ret = 0;
-if (fh->fd_ != -1) {
-	ret = close(fh->fd_);
+if (fh->fd_ != -1 && appender != NULL) {
+	// the last handle out frees the preallocation past EOF
+	Appender::TrimRequest trim = { appender, MetaKeyString(fh->keylist_[0]) };
+	fdcache->Put(fh->fd_, Appender::TrimOnLastPut, &trim);
+	fh->fd_ = -1;
+} else if (fh->fd_ != -1) {
+	CloseDiskFile(fh->fd_);
 }
+if (readahead != NULL) {
+	readahead->Forget(fi->fh);
+}
+if (fh->pipe_[0] >= 0) {
+	close(fh->pipe_[0]);
+	close(fh->pipe_[1]);
+}
+delete fh->rcbuf_;
 
-WriteString(&cluster,mykeylist,mdt,myresult);
+if (!staged && !appending) {
+	WriteMeta(mykeylist, myresult);
+}
 
 if (ret != 0) {
 	return -errno;
@@ -817,6 +2745,11 @@ if (ret != 0) {
 }
 
 int TestFS::Truncate(const char *path, off_t new_size) {
+MonitorScope scope(monitor, OP_TRUNCATE);
+if (IsStatsPath(path)) {
+	// how a shell opens the file to write "reset" to it
+	return IsStatsFile(path) ? 0 : -EISDIR;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Truncate: %s\n", path);
 #endif
@@ -826,11 +2759,88 @@ if (!PathLookup(path, mykeylist)) {
 	return FSError("Open: No such file or directory\n");
 }
 
+FlushMigration(mykeylist);
+FlushAppends(mykeylist, true);
 int ret = 0;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-const tfs_inode_header *iheader = GetInodeHeader(myresult);
-if (iheader->has_blob > 0) {
-	if (new_size > threshold) {
+InodeHeader iheader = GetInodeHeader(myresult);
+off_t old_size = iheader->fstat.st_size;
+off_t limit = InlineThreshold(path);
+if (iheader->has_blob == BLOB_PACKED && packs != NULL) {
+	return TruncatePacked(path, mykeylist, new_size, limit);
+}
+if (iheader->has_blob == BLOB_ARCHIVED) {
+	if (new_size == old_size) {
+		return 0;
+	}
+	int fd = -1;
+	ret = RestoreArchived(mykeylist, fd);
+	if (ret < 0) {
+		return ret;
+	}
+	myresult = CopytoString(cluster, mykeylist[0], mdt);
+	iheader = GetInodeHeader(myresult);
+	if (!iheader.Valid()) {
+		return -EIO;
+	}
+}
+bool joined = false;
+if (iheader->has_blob == BLOB_SPLIT && new_size > limit) {
+	// leaves the inline size: go through the inline migration below
+	ret = JoinSplitData(myresult);
+	if (ret < 0) {
+		return ret;
+	}
+	joined = true;
+	iheader = GetInodeHeader(myresult);
+}
+std::string unshared;
+if (iheader->has_blob == BLOB_SHARED) {
+	if (new_size == old_size) {
+		return 0;
+	}
+	ret = UnshareData(myresult, unshared);
+	if (ret < 0) {
+		return ret;
+	}
+	iheader = GetInodeHeader(myresult);
+}
+uint32_t blob_kind = iheader->has_blob;
+if (blob_kind == 0) {
+	if (flag_chunked_data) {
+		blob_kind = BLOB_CHUNKED;
+	} else if (packs != NULL && new_size <= (off_t) pack_threshold) {
+		blob_kind = BLOB_PACKED;
+	} else {
+		blob_kind = BLOB_ON_DISK;
+	}
+}
+if (iheader->has_blob == BLOB_SPLIT) {
+	ret = (chunks == NULL) ? -EIO
+			: chunks->Truncate(iheader->fstat.st_ino, old_size, new_size);
+} else if (iheader->has_blob == BLOB_CHUNKED) {
+	if (chunks == NULL) {
+		ret = -EIO;
+	} else if (new_size > limit) {
+		ret = chunks->Truncate(iheader->fstat.st_ino, old_size, new_size);
+	} else {
+		// small enough to go back inline
+		tfs_inode_t inode = iheader->fstat.st_ino;
+		char* buffer = new char[new_size];
+		ret = chunks->Read(inode, old_size, buffer, new_size, 0);
+		if (ret >= 0) {
+			memset(buffer + ret, 0, new_size - ret);
+			UpdateInlineData(myresult, buffer, 0, new_size);
+			ret = chunks->Remove(inode, old_size);
+		}
+		delete[] buffer;
+	}
+} else if (IsRemoteBlob(iheader)) {
+	// stays with its owner; shrinking below threshold does not pull it back
+	ret = blobclient->Truncate(iheader->blob_owner, iheader->fstat.st_ino,
+			new_size);
+} else if (iheader->has_blob > 0) {
+	if (new_size > limit) {
 		TruncateDiskFile(iheader->fstat.st_ino, new_size);
 	} else {
 		char* buffer = new char[new_size];
@@ -839,42 +2849,68 @@ if (iheader->has_blob > 0) {
 		delete[] buffer;
 	}
 } else {
-	if (new_size > threshold()) {
-		int fd;
+	if (new_size > limit && flag_chunked_data) {
+		// the grown part is a hole, only the old bytes need moving
+		ret = MigrateToChunks(myresult);
+	} else if (new_size > limit && blob_kind == BLOB_PACKED) {
+		ret = MigrateToPack(myresult, mykeylist, NULL, 0, new_size);
+	} else if (new_size > limit) {
+		int fd = -1;
 		if (MigrateToDiskFile(rcbuf, fd, O_TRUNC | O_WRONLY) == 0) {
 			if ((ret = ftruncate(fd, new_size)) == 0) {
-				fsync(fd);
+				io->Fsync(fd, false);
 			}
-			close(fd);
+			CloseDiskFile(fd);
 		}
 	} else {
 		TruncateInlineData(myresult, new_size);
 	}
 }
-if (new_size != iheader->fstat.st_size) {
+if (ret >= 0 && new_size != old_size) {
+	ret = 0;
 	tfs_inode_header new_iheader = *GetInodeHeader(myresult);
 	new_iheader.fstat.st_size = new_size;
-	if (new_size > threshold()) {
-		new_iheader.has_blob = 1;
-	} else {
+	if (IsRemoteBlob(&new_iheader)) {
+		// still held by the owner node
+	} else if (new_size > limit) {
+		new_iheader.has_blob = blob_kind;
+		if (blob_kind == BLOB_ON_DISK) {
+			new_iheader.blob_owner = node_id;
+		}
+	} else if (new_iheader.has_blob != BLOB_SPLIT) {
 		new_iheader.has_blob = 0;
 	}
 	UpdateInodeHeader(myresult, new_iheader);
 }
-WriteString(&cluster,mykeylist,mdt,myresult);
+WriteMeta(mykeylist, myresult);
+if (joined) {
+	chunks->Remove(iheader->fstat.st_ino, old_size);
+}
+if (!unshared.empty()) {
+	contents->Unref(unshared);
+}
 return ret;
 }
 
 int TestFS::Readlink(const char *path, char *buf, size_t size) {
+MonitorScope scope(monitor, OP_READLINK);
+if (IsStatsPath(path)) {
+	return -EINVAL;
+}
 
 RAMCloud::KeyInfo mykeylist[2];
 if (!PathLookup(path, mykeylist)) {
         return FSError("Open: No such file or directory\n");
 }
 
-int ret = 0;
 ramcloud::Buffer rcbuf;
-GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
+int ret = GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
+if (ret == 0 && !GetInodeHeader(rcbuf).Valid()) {
+	ret = -EIO;
+}
+if (ret < 0) {
+	return ret;
+}
 size_t data_size = GetInlineData(rcbuf, buf, 0, size - 1);
 buf[data_size] = '\0';
 if (ret < 0) {
@@ -885,6 +2921,10 @@ if (ret < 0) {
 }
 
 int TestFS::Symlink(const char *target, const char *path) {
+MonitorScope scope(monitor, OP_SYMLINK);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 RAMCloud::KeyInfo mykeylist[2];
 std::string filename;
 if (!PathLookup(path, mykeylist,filename)) {
@@ -894,25 +2934,28 @@ if (!PathLookup(path, mykeylist,filename)) {
 #endif
 	return FSError("Symlink: No such parent file or directory\n");
 }
-ramcloud::Buffer rcbuf;
-GetRamCloudBuffer(&cluster,mykeylist,mdt,&rcbuf);
-size_t val_size = TFS_INODE_HEADER_SIZE + filename.size() + 1 + strlen(target);
-char* value = new char[val_size];
-tfs_inode_header* header = reinterpret_cast<tfs_inode_header*>(rcbuf.getRange(0,rcbuf.size()));
-InitStat(header->fstat, NewInode(), S_IFLNK, 0);
-header->has_blob = 0;
-header->namelen = filename.size();
-char* name_buffer = value + TFS_INODE_HEADER_SIZE;
-memcpy(name_buffer, filename.data(), filename.size());
-name_buffer[header->namelen] = '\0';
-strncpy(name_buffer + filename.size() + 1, target, strlen(target));
-std::string towrite(value);
-delete[] value;
-WriteString(&cluster,mykeylist,mdt,towrite);
+tfs_inode_t inode;
+int ret = NewInode(&inode);
+if (ret < 0) {
+	return ret;
+}
+tfs_inode_header header;
+memset(&header, 0, sizeof(header));
+InitStat(header.fstat, inode, S_IFLNK, 0);
+header.namelen = filename.size();
+char encoded[TFS_INODE_MAX_ENCODED];
+std::string towrite(encoded, EncodeInodeHeader(header, encoded));
+towrite.append(filename.data(), filename.size() + 1);
+towrite.append(target);
+WriteMeta(mykeylist, towrite);
 return 0;
 }
 
 int TestFS::Unlink(const char *path) {
+MonitorScope scope(monitor, OP_UNLINK);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Unlink: %s\n", path);
 #endif
@@ -921,21 +2964,91 @@ if (!PathLookup(path, mykeylist)) {
         return FSError("Open: No such file or directory\n");
 }
 
-int ret = 0;
+// the worker must not recreate the blob after it is unlinked
+FlushMigration(mykeylist);
+if (appender != NULL) {
+	appender->Forget(MetaKeyString(mykeylist[0]));
+}
 RAMCloud::Buffer rcbuf;
-GetRamCloudBuffer(&cluster,mykeylist,mdt,*rcbuf);
-const tfs_inode_header *value = GetInodeHeader(rcbuf);
-if (value->fstat.st_size > threshold) {
+int ret = GetRamCloudBuffer(&cluster,mykeylist,mdt,*rcbuf);
+InodeHeader value = GetInodeHeader(rcbuf);
+if (ret < 0 || !value.Valid()) {
+	return (ret < 0) ? ret : -EIO;
+}
+if (thresholds != NULL) {
+	thresholds->Forget(value->fstat.st_ino);
+}
+if (value->has_blob == BLOB_PACKED && packs != NULL) {
+	// re-read under the lock: compaction may have moved the extent
+	packs->Lock();
+	std::string myresult = CopytoString(cluster, mykeylist[0], mdt);
+	if (!GetInodeHeader(myresult).Valid()) {
+		packs->Unlock();
+		return -EIO;
+	}
+	if (GetInodeHeader(myresult)->has_blob == BLOB_PACKED) {
+		packs->Free(PackLocationOf(GetInodeHeader(myresult)));
+	}
+	RemoveMeta(mykeylist);
+	packs->Unlock();
+	return ret;
+} else if (value->has_blob == BLOB_ARCHIVED && archives != NULL) {
+	// likewise, a restore may have raced us
+	archives->Lock();
+	std::string myresult = CopytoString(cluster, mykeylist[0], mdt);
+	InodeHeader current = GetInodeHeader(myresult);
+	if (!current.Valid()) {
+		archives->Unlock();
+		return -EIO;
+	}
+	if (current->has_blob == BLOB_ARCHIVED) {
+		archives->Free(ArchiveLocationOf(current));
+	} else if (current->has_blob == BLOB_ON_DISK) {
+		char fpath[128];
+		GetDiskFilePath(fpath, current->fstat.st_ino);
+		ForgetDiskFile(current->fstat.st_ino);
+		unlink(fpath);
+	}
+	RemoveMeta(mykeylist);
+	archives->Unlock();
+	return ret;
+} else if (value->has_blob == BLOB_CHUNKED || value->has_blob == BLOB_SPLIT) {
+	if (chunks != NULL) {
+		chunks->Remove(value->fstat.st_ino, value->fstat.st_size);
+	}
+} else if (value->has_blob == BLOB_SHARED) {
+	std::string digest(ContentStore::DIGEST_SIZE, '\0');
+	bool have = GetInlineData(rcbuf, &digest[0], 0, digest.size())
+			== digest.size();
+	RemoveMeta(mykeylist);
+	if (have && contents != NULL) {
+		contents->Unref(digest);
+	}
+	return ret;
+} else if (IsRemoteBlob(value)) {
+	blobclient->Unlink(value->blob_owner, value->fstat.st_ino);
+} else if (value->has_blob == BLOB_ON_DISK) {
 	char fpath[128];
 	GetDiskFilePath(fpath, value->fstat.st_ino);
+	ForgetDiskFile(value->fstat.st_ino);
+	if (reclaimer != NULL) {
+		// inode first: a crash in between leaks the file instead of
+		// leaving an inode without its data
+		RemoveMeta(mykeylist);
+		reclaimer->Enqueue(fpath);
+		return ret;
+	}
 	unlink(fpath);
 }
-//To do: move this to tfs_rcdb.cpp
-cluster->remove(mdt, mykeylist[0].keyLength, mykeylist[0].keyLength);
+RemoveMeta(mykeylist);
 return ret;
 }
 
 int TestFS::MakeNode(const char *path, mode_t mode, dev_t dev) {
+MonitorScope scope(monitor, OP_MKNOD);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("MakeNode: %s\n", path);
 #endif
@@ -945,11 +3058,15 @@ if (!PathLookup(path, mykeylist, filename)) {
 	return FSError("MakeNode: No such parent file or directory\n");
 }
 
-tfs_inode_val_t value = InitInodeValue(NewInode(), mode | S_IFREG, dev,
+tfs_inode_t inode;
+int ret = NewInode(&inode);
+if (ret < 0) {
+	return ret;
+}
+tfs_inode_val_t value = InitInodeValue(inode, mode | S_IFREG, dev,
 		filename);
 
-int ret = 0;
-WriteString(&cluster,mykeylist,mdt,value);
+WriteMeta(mykeylist, value);
 FreeInodeValue(value);
 
 if (ret == 0) {
@@ -961,6 +3078,10 @@ if (ret == 0) {
 }
 
 int TestFS::MakeDir(const char *path, mode_t mode) {
+MonitorScope scope(monitor, OP_MKDIR);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("MakeDir: %s\n", path);
 #endif
@@ -970,11 +3091,15 @@ if (!PathLookup(path, mykeylist, filename)) {
         return FSError("MakeDir: No such parent file or directory\n");
 }
 
-tfs_inode_val_t value = InitInodeValue(NewInode(), mode | S_IFDIR, 0,
+tfs_inode_t inode;
+int ret = NewInode(&inode);
+if (ret < 0) {
+	return ret;
+}
+tfs_inode_val_t value = InitInodeValue(inode, mode | S_IFDIR, 0,
 		filename);
 
-int ret = 0;
-WriteString(&cluster,mykeylist,mdt,value);
+WriteMeta(mykeylist, value);
 FreeInodeValue(value);
 
 if (ret == 0) {
@@ -986,6 +3111,10 @@ if (ret == 0) {
 }
 
 int TestFS::OpenDir(const char *path, struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_OPENDIR);
+if (IsStatsPath(path)) {
+	return (strcmp(path, STATS_DIR) == 0) ? 0 : -ENOTDIR;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("OpenDir: %s\n", path);
 #endif
@@ -999,28 +3128,38 @@ return 0;
 }
 
 int TestFS::ReadDir(const char *path, void *buf, fuse_fill_dir_t filler,off_t offset, struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_READDIR);
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("ReadDir: %s\n", path);
 #endif
+if (IsStatsPath(path)) {
+	if (filler(buf, ".", NULL, 0) < 0 || filler(buf, "..", NULL, 0) < 0
+			|| filler(buf, "stats", NULL, 0) < 0) {
+		return -ENOMEM;
+	}
+	return 0;
+}
 RAMCloud::mykeylist = fi->keylist_;
 RAMCloud::Buffer rcbuf;
-GetRamCloudBuffer(&cluster,mykeylist,mdt,*rcbuf);
-uint64_t parentid=GetAttribute(rcbuf)->st_ino;
+int ret = GetRamCloudBuffer(&cluster,mykeylist,mdt,*rcbuf);
+if (ret < 0 || !GetInodeHeader(rcbuf).Valid()) {
+	return (ret < 0) ? ret : -EIO;
+}
+uint64_t parentid=GetAttribute(rcbuf).st_ino;
 if (filler(buf, ".", NULL, 0) < 0) {
 return FSError("Cannot read a directory");
 }
 if (filler(buf, "..", NULL, 0) < 0) {
 return FSError("Cannot read a directory");
 }
-char* result;
 char secondary_key[keylength];
 sprintf(secondary_key,"%024lu",parentid);
-RAMCloud::IndexKey::IndexKeyRange keyRange(indexId, secondary_key, strlen(secondary_key),secondary_key, strlen(secondary_key));
-RAMCloud::IndexLookup rangeLookup(cluster, table, keyRange);
+std::vector<std::string> children;
+ListDirectory(cluster, mdt, std::string(secondary_key), children);
 int ret=0;
-while (rangeLookup.getNext()) {
-	result=static_cast<const char*>(rangeLookup.currentObject()->getValue());
-	const char* name_buffer=result+TFS_INODE_HEADER_SIZE;
+for (size_t i = 0; i < children.size(); ++i) {
+	const char* name_buffer=children[i].data()
+			+GetInodeHeader(children[i]).NameOffset();
 	if (name_buffer[0] == '\0') {
         	continue;
 	}
@@ -1037,6 +3176,10 @@ while (rangeLookup.getNext()) {
 }
 
 int TestFS::ReleaseDir(const char *path, struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_RELEASEDIR);
+if (IsStatsPath(path)) {
+	return 0;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("ReleaseDir: %s\n", path);
 #endif
@@ -1045,8 +3188,7 @@ RAMCloud mykeylist = fh->keylist_;
 ramcloud::Buffer rcbuf;
 int ret=0;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-const tfs_stat_t *value = GetAttribute(myresult);
-tfs_stat_t new_value = *value;
+tfs_stat_t new_value = GetAttribute(myresult);
 new_value.st_atim.tv_sec = time(NULL);
 new_value.st_atim.tv_nsec = 0;
 UpdateAttribute(myresult, new_value);
@@ -1055,6 +3197,10 @@ return ret;
 }
 
 int TestFS::RemoveDir(const char *path) {
+MonitorScope scope(monitor, OP_RMDIR);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("RemoveDir: %s\n", path);
 #endif
@@ -1064,10 +3210,15 @@ if (!PathLookup(path, mykeylist)) {
 }
 
 int ret = 0;
-cluster->remove(mdt,mykeylist[0].key,mykeylist[0].keyLength);
+RemoveMeta(mykeylist);
+return ret;
 }
 
 int TestFS::Rename(const char *old_path, const char *new_path) {
+MonitorScope scope(monitor, OP_RENAME);
+if (IsStatsPath(old_path) || IsStatsPath(new_path)) {
+	return -EPERM;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Rename: %s %s\n", old_path, new_path);
 #endif
@@ -1086,15 +3237,34 @@ logs->LogMsg("Rename old_key: %s\n", oldkeylist[0].key);
 logs->LogMsg("Rename new_key: %s\n", newkeylist[0].key);
 #endif
 
+// staged jobs commit under the old key
+FlushMigration(oldkeylist);
+FlushAppends(oldkeylist, true);
 int ret = 0;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-const tfs_inode_header* old_iheader = GetInodeHeader(myresult);
+InodeHeader old_iheader = GetInodeHeader(myresult);
 std::string new_value = InitInodeValue(myresult, filename);
-WriteString(&cluster,mykeylist,mdt,new_value);
+if (old_iheader->has_blob == BLOB_PACKED && packs != NULL) {
+	// compaction finds the inode through the key stored with its extent
+	packs->Lock();
+	packs->Relabel(PackLocationOf(old_iheader), MetaKeyString(newkeylist[0]));
+	packs->Unlock();
+}
+if (old_iheader->has_blob == BLOB_ARCHIVED && archives != NULL) {
+	archives->Lock();
+	archives->Relabel(ArchiveLocationOf(old_iheader), MetaKeyString(newkeylist[0]));
+	archives->Unlock();
+}
+WriteMeta(mykeylist, new_value);
+if (S_ISDIR(old_iheader->fstat.st_mode)) {
+	// the subtree now inherits from its new ancestors
+	overrides->Clear();
+}
 return ret;
 }
 
 int TestFS::Access(const char *path, int mask) {
+MonitorScope scope(monitor, OP_ACCESS);
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("Access: %s %08x\n", path, mask);
 #endif
@@ -1103,6 +3273,10 @@ return 0;
 }
 
 int TestFS::UpdateTimens(const char *path, const struct timespec tv[2]) {
+MonitorScope scope(monitor, OP_UTIMENS);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 #ifdef  TABLEFS_DEBUG
 logs->LogMsg("UpdateTimens: %s\n", path);
 #endif
@@ -1111,48 +3285,222 @@ RAMCloud::KeyInfo mykeylist[2];
 if (!PathLookup(path, mykeylist)) {
         return FSError("OpenDir: No such parent file or directory\n");
 }
+FlushMigration(mykeylist);
+FlushAppends(mykeylist, false);
 int ret = 0;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-const tfs_stat_t *value = GetAttribute(myresult);
-tfs_stat_t new_value = *value;
+tfs_stat_t new_value = GetAttribute(myresult);
 new_value.st_atim.tv_sec = tv[0].tv_sec;
 new_value.st_atim.tv_nsec = tv[0].tv_nsec;
 new_value.st_mtim.tv_sec = tv[1].tv_sec;
 new_value.st_mtim.tv_nsec = tv[1].tv_nsec;
 UpdateAttribute(myresult, new_value);
-WriteString(&cluster,mykeylist,mdt,myresult);
+WriteMeta(mykeylist, myresult);
 return ret;
 }
 
 int TestFS::Chmod(const char *path, mode_t mode) {
+MonitorScope scope(monitor, OP_CHMOD);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 RAMCloud::KeyInfo mykeylist[2];
 if (!PathLookup(path, mykeylist)) {
         return FSError("Chmod: No such parent file or directory\n");
 }
+FlushMigration(mykeylist);
+FlushAppends(mykeylist, false);
 int ret = 0;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-const tfs_stat_t *value = GetAttribute(myresult);
-tfs_stat_t new_value = *value;
+tfs_stat_t new_value = GetAttribute(myresult);
 new_value.st_mode = mode;
 UpdateAttribute(myresult, new_value);
-WriteString(&cluster,mykeylist,mdt,myresult);
+WriteMeta(mykeylist, myresult);
 return ret;
 }
 
 int TestFS::Chown(const char *path, uid_t uid, gid_t gid) {
+MonitorScope scope(monitor, OP_CHOWN);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
 RAMCloud::KeyInfo mykeylist[2];
 if (!PathLookup(path, mykeylist)) {
         return FSError("Chown: No such parent file or directory\n");
 }
+FlushMigration(mykeylist);
+FlushAppends(mykeylist, false);
 int ret = 0;
-tfs_stat_t new_value = *value;
 std::string myresult=CopyToString(&cluster,mykeylist,mdt);
-const tfs_stat_t *value = GetAttribute(myresult);
+tfs_stat_t new_value = GetAttribute(myresult);
 new_value.st_uid = uid;
 new_value.st_gid = gid;
 UpdateAttribute(myresult, new_value);
-WriteString(&cluster,mykeylist,mdt,myresult);
+WriteMeta(mykeylist, myresult);
 return ret;
 }
 
+int TestFS::SetXattr(const char *path, const char *name, const char *value,
+		size_t size, int flags) {
+MonitorScope scope(monitor, OP_SETXATTR);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
+if (strcmp(name, INLINE_THRESHOLD_XATTR) != 0) {
+	return -ENOTSUP;
+}
+RAMCloud::KeyInfo mykeylist[2];
+std::string myresult;
+if (!PathLookup(path, mykeylist) || !LookupMeta(mykeylist[0], path, myresult)) {
+	return FSError("SetXattr: No such file or directory\n");
+}
+tfs_inode_header new_iheader = *GetInodeHeader(myresult);
+if (!S_ISDIR(new_iheader.fstat.st_mode)) {
+	return -EINVAL;
+}
+if ((flags & XATTR_CREATE) && new_iheader.inline_threshold > 0) {
+	return -EEXIST;
+}
+if ((flags & XATTR_REPLACE) && new_iheader.inline_threshold == 0) {
+	return -ENODATA;
+}
+std::string number(value, size);
+char* end;
+unsigned long new_threshold = strtoul(number.c_str(), &end, 10);
+if (end == number.c_str() || new_threshold == 0 || new_threshold > 0xffffffffUL) {
+	return -EINVAL;
+}
+new_iheader.inline_threshold = new_threshold;
+UpdateInodeHeader(myresult, new_iheader);
+WriteMeta(mykeylist, myresult);
+overrides->Clear();
+return 0;
+}
+
+int TestFS::GetXattr(const char *path, const char *name, char *value,
+		size_t size) {
+MonitorScope scope(monitor, OP_GETXATTR);
+if (IsStatsPath(path)) {
+	return -ENODATA;
+}
+RAMCloud::KeyInfo mykeylist[2];
+std::string myresult;
+if (!PathLookup(path, mykeylist) || !LookupMeta(mykeylist[0], path, myresult)) {
+	return FSError("GetXattr: No such file or directory\n");
+}
+uint32_t override_threshold = GetInodeHeader(myresult)->inline_threshold;
+if (strcmp(name, INLINE_THRESHOLD_XATTR) != 0 || override_threshold == 0) {
+	return -ENODATA;
+}
+char number[16];
+int len = sprintf(number, "%u", override_threshold);
+if (size == 0) {
+	return len;
+}
+if (size < (size_t) len) {
+	return -ERANGE;
+}
+memcpy(value, number, len);
+return len;
+}
+
+int TestFS::ListXattr(const char *path, char *list, size_t size) {
+MonitorScope scope(monitor, OP_LISTXATTR);
+if (IsStatsPath(path)) {
+	return 0;
+}
+RAMCloud::KeyInfo mykeylist[2];
+std::string myresult;
+if (!PathLookup(path, mykeylist) || !LookupMeta(mykeylist[0], path, myresult)) {
+	return FSError("ListXattr: No such file or directory\n");
+}
+if (GetInodeHeader(myresult)->inline_threshold == 0) {
+	return 0;
+}
+size_t len = sizeof(INLINE_THRESHOLD_XATTR);
+if (size == 0) {
+	return len;
+}
+if (size < len) {
+	return -ERANGE;
+}
+memcpy(list, INLINE_THRESHOLD_XATTR, len);
+return len;
+}
+
+int TestFS::RemoveXattr(const char *path, const char *name) {
+MonitorScope scope(monitor, OP_REMOVEXATTR);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
+if (strcmp(name, INLINE_THRESHOLD_XATTR) != 0) {
+	return -ENODATA;
+}
+RAMCloud::KeyInfo mykeylist[2];
+std::string myresult;
+if (!PathLookup(path, mykeylist) || !LookupMeta(mykeylist[0], path, myresult)) {
+	return FSError("RemoveXattr: No such file or directory\n");
+}
+tfs_inode_header new_iheader = *GetInodeHeader(myresult);
+if (new_iheader.inline_threshold == 0) {
+	return -ENODATA;
+}
+new_iheader.inline_threshold = 0;
+UpdateInodeHeader(myresult, new_iheader);
+WriteMeta(mykeylist, myresult);
+overrides->Clear();
+return 0;
+}
+
+int TestFS::Fallocate(const char *path, int mode, off_t offset, off_t length,
+		struct fuse_file_info *fi) {
+MonitorScope scope(monitor, OP_FALLOCATE);
+if (IsStatsPath(path)) {
+	return -EPERM;
+}
+#ifdef  TABLEFS_DEBUG
+logs->LogMsg("Fallocate: %s %d %lld %lld\n", path, mode, offset, length);
+#endif
+tfs_file_handle_t* fh = reinterpret_cast<tfs_file_handle_t*>(fi->fh);
+RAMCloud::KeyInfo *mykeylist = fh->keylist_;
+FlushMigration(mykeylist);
+FlushAppends(mykeylist, false);
+std::string strbuf = CopytoString(cluster, *mykeylist, mdt);
+InodeHeader iheader = GetInodeHeader(strbuf);
+if (!iheader.Valid()) {
+	return -EIO;
+}
+if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > iheader->fstat.st_size) {
+	// grow first; Truncate moves the data out of line if it has to
+	FlushAppends(mykeylist, true);
+	int ret = Truncate(path, offset + length);
+	if (ret < 0) {
+		return ret;
+	}
+	strbuf = CopytoString(cluster, *mykeylist, mdt);
+	iheader = GetInodeHeader(strbuf);
+	if (!iheader.Valid()) {
+		return -EIO;
+	}
+}
+if (iheader->has_blob != BLOB_ON_DISK || IsRemoteBlob(iheader)) {
+	// inline, chunked, packed and remote data have no local blocks to
+	// reserve; growing them was all there was to do
+	return (mode & ~FALLOC_FL_KEEP_SIZE) ? -EOPNOTSUPP : 0;
+}
+if (fh->fd_ < 0) {
+	fh->fd_ = OpenBlobFile(mykeylist, iheader, fh->flags_);
+	if (fh->fd_ < 0 && errno == EAGAIN) {
+		return Fallocate(path, mode, offset, length, fi);
+	}
+	if (fh->fd_ < 0) {
+		return -errno;
+	}
+}
+if (fallocate(fh->fd_, mode, offset, length) != 0) {
+	return -errno;
+}
+return 0;
+}
+
 }
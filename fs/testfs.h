@@ -5,21 +5,54 @@
 #include <fuse.h>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <unordered_map>
 #include <errno.h>
 #include "fs/tfs_inode.h"
+#include "fs/tfs_notify.h"
+#include "fs/tfs_cache.h"
+#include "fs/tfs_coherency.h"
+#include "fs/tfs_mdsclient.h"
+#include "fs/tfs_blobserver.h"
+#include "fs/tfs_blobclient.h"
+#include "fs/tfs_chunkstore.h"
+#include "fs/tfs_threshold.h"
+#include "fs/tfs_packstore.h"
+#include "fs/tfs_fdcache.h"
+#include "fs/tfs_migrator.h"
+#include "fs/tfs_ioengine.h"
+#include "fs/tfs_readahead.h"
+#include "fs/tfs_appender.h"
+#include "fs/tfs_reclaimer.h"
+#include "fs/tfs_layout.h"
+#include "fs/tfs_compress.h"
+#include "fs/tfs_contentstore.h"
+#include "fs/tfs_coldstore.h"
+#include "fs/tfs_tiering.h"
+#include "fs/tfs_archive.h"
+#include "fs/tfs_placement.h"
 #include "util/properties.h"
 #include "util/logging.h"
+#include "util/monitor.h"
 #include "ramcloud/RamCloud.h"
 
 namespace TestFS {
 const char idtable[] = "idtable";
 const char metatable[] = "metatable";
+const char datatable[] = "datatable";
+const char contenttable[] = "contenttable";
+const char INLINE_THRESHOLD_XATTR[] = "user.testfs.inline_threshold";
+// Virtual, read-only but for "reset": the operation latencies and RPC
+// counts of this mount.
+const char STATS_DIR[] = "/.testfs";
+const char STATS_FILE[] = "/.testfs/stats";
 enum InodeAccessMode {
 	INODE_READ = 0, INODE_DELETE = 1, INODE_WRITE = 2,
 };
 
+struct tfs_file_handle_t;
+
 enum InodeState {
 	CLEAN = 0, DELETED = 1, DIRTY = 2,
 };
@@ -30,6 +63,9 @@ public:
 	}
 
 
+	int Setup(Properties& prop);
+
+	// conn is NULL when TestFS is driven without FUSE, as by testfs-replay.
 	void* Init(struct fuse_conn_info *conn);
 
 	void Destroy(void * data);
@@ -44,6 +80,12 @@ public:
 	int Write(const char* path, const char *buf, size_t size, off_t offset,
 			struct fuse_file_info *fi);
 
+	int ReadBuf(const char* path, struct fuse_bufvec **bufp, size_t size,
+			off_t offset, struct fuse_file_info *fi);
+
+	int WriteBuf(const char* path, struct fuse_bufvec *buf, off_t offset,
+			struct fuse_file_info *fi);
+
 	int Truncate(const char *path, off_t offset);
 
 	int Fsync(const char *path, int datasync, struct fuse_file_info *fi);
@@ -79,6 +121,21 @@ public:
 
 	int Chown(const char *path, uid_t uid, gid_t gid);
 
+	// Only INLINE_THRESHOLD_XATTR on directories is supported: it overrides
+	// the inline threshold for files anywhere below that directory, up to
+	// a subdirectory with its own.
+	int SetXattr(const char *path, const char *name, const char *value,
+			size_t size, int flags);
+
+	int GetXattr(const char *path, const char *name, char *value, size_t size);
+
+	int ListXattr(const char *path, char *list, size_t size);
+
+	int RemoveXattr(const char *path, const char *name);
+
+	int Fallocate(const char *path, int mode, off_t offset, off_t length,
+			struct fuse_file_info *fi);
+
 
 private:
 	std::string datadir;
@@ -90,12 +147,47 @@ private:
 	uint64_t idt;
 	uint64_t mdt;
 	uint64_t threshold;
+	bool flag_kernel_cache;
+	KernelNotifier* notifier;
+	MetaCache* metacache;
+	CoherencyChannel* coherency;
+	MdsClient* mds;
+	uint32_t node_id;
+	BlobServer* blobserver;
+	BlobCache* blobcache;
+	BlobClient* blobclient;
+	uint64_t dtt;
+	ChunkStore* chunks;
+	bool flag_chunked_data;
+	bool flag_split_inline;
+	ThresholdPolicy* thresholds;
+	ThresholdOverrides* overrides;
+	PackStore* packs;
+	FdCache* fdcache;
+	uint64_t pack_threshold;
+	Migrator* migrator;
+	IoEngine* io;
+	FdCache* directfds;
+	uint64_t direct_cutoff;
+	Readahead* readahead;
+	Appender* appender;
+	Reclaimer* reclaimer;
+	DatadirLayout* layout;
+	InlineCompressor* compressor;
+	ContentStore* contents;
+	bool flag_dedup_inline;
+	uint64_t dedup_min_bytes;
+	ColdStore* coldstore;
+	MetaTiering* tiering;
+	ArchiveStore* archives;
+	PlacementPolicy* placement;
+	Monitor* monitor;
 	
-	int Setup(Properties& prop);
 	bool IsEmpty() {
                 return (max_inode_num == 0);
         }
-        tfs_inode_t NewInode();
+        // Sets *inode to a fresh inode number; returns 0 or -errno.
+        int NewInode(tfs_inode_t *inode);
 
 	inline int FSError(const char *error_message);
 	
@@ -105,6 +197,12 @@ private:
 
 	inline int OpenDiskFile(const tfs_inode_header* iheader, int flags);
 
+	// OpenDiskFile for a file handle: re-reads the header under the
+	// archive lock and opens the blob before releasing it. Fails with
+	// errno EAGAIN if has_blob changed since iheader was read.
+	int OpenBlobFile(RAMCloud::KeyInfo *mykeylist,
+			const tfs_inode_header* iheader, int flags);
+
 	inline int TruncateDiskFile(tfs_inode_t inode_id, off_t new_size);
 
 	inline ssize_t MigrateDiskFileToBuffer(tfs_inode_t inode_it, char* buffer,
@@ -112,8 +210,138 @@ private:
 
 	int MigrateToDiskFile(RAMCloud::Buffer* rcbuf, int &fd, int flags);
 
+	int SpliceInlineData(tfs_file_handle_t* fh, struct fuse_bufvec **bufp,
+			size_t size, off_t offset);
+
 	inline void CloseDiskFile(int& fd_);
 
+	// The blob file is gone or replaced: drop its cached descriptors.
+	void ForgetDiskFile(tfs_inode_t inode_id);
+
+	// Reads a datadir blob through its O_DIRECT descriptor.
+	int ReadDirect(const tfs_inode_header* iheader, char* buf, size_t size,
+			off_t offset);
+
+	// True if the blob lives in another node's datadir.
+	bool IsRemoteBlob(const tfs_inode_header* iheader) {
+		return blobclient != NULL && iheader->has_blob == BLOB_ON_DISK
+				&& iheader->blob_owner != node_id;
+	}
+
+	// True if the blob has no local datadir file to open.
+	bool IsExternalBlob(const tfs_inode_header* iheader) {
+		return iheader->has_blob == BLOB_CHUNKED
+				|| iheader->has_blob == BLOB_PACKED
+				|| iheader->has_blob == BLOB_SPLIT
+				|| iheader->has_blob == BLOB_SHARED
+				|| iheader->has_blob == BLOB_ARCHIVED || IsRemoteBlob(iheader);
+	}
+
+	// STATS_DIR or anything in it; they exist only with a monitor.
+	bool IsStatsPath(const char *path) {
+		size_t len = sizeof(STATS_DIR) - 1;
+		return monitor != NULL && strncmp(path, STATS_DIR, len) == 0
+				&& (path[len] == '\0' || path[len] == '/');
+	}
+
+	bool IsStatsFile(const char *path) {
+		return monitor != NULL && strcmp(path, STATS_FILE) == 0;
+	}
+
+	int StatsGetAttr(const char *path, struct stat *statbuf);
+
+	// Takes the snapshot that reads of this open file return.
+	int StatsOpen(const char *path, struct fuse_file_info *fi);
+
+	// Writing "reset" starts the counts over; nothing else is accepted.
+	int StatsWrite(const char *buf, size_t size);
+
+	int ReadExternalBlob(const tfs_inode_header* iheader, char* buf,
+			size_t size, off_t offset);
+
+	int WriteExternalBlob(const tfs_inode_header* iheader, const char* buf,
+			size_t size, off_t offset);
+
+	int MigrateToChunks(std::string &stringbuf);
+
+	// Moves the inline data, with the write applied, to the file's data
+	// object and marks the inode BLOB_SPLIT.
+	int SplitInlineData(std::string &stringbuf, const char* buf, size_t size,
+			off_t offset);
+
+	// Reads a split file's data object back into stringbuf as inline data
+	// (has_blob 0). The object stays until the caller has written the
+	// inode and removes it.
+	int JoinSplitData(std::string &stringbuf);
+
+	// Stores size bytes of buf, the whole new content of the file, in the
+	// content store and leaves only its digest inline (BLOB_SHARED).
+	int ShareInlineData(std::string &stringbuf, const char* buf, size_t size);
+
+	// Copy on write: gives a shared file its own inline copy of the
+	// payload. digest is the reference to drop once the inode is written.
+	int UnshareData(std::string &stringbuf, std::string &digest);
+
+	int ReadSharedData(RAMCloud::Buffer &value, char* buf, size_t size,
+			off_t offset);
+
+	int MigrateToPack(std::string &stringbuf, RAMCloud::KeyInfo *mykeylist,
+			const char* buf, size_t size, off_t offset);
+
+	int RepackData(tfs_inode_header &iheader, RAMCloud::KeyInfo *mykeylist,
+			std::string &data, size_t file_size);
+
+	int WritePacked(const char* path, RAMCloud::KeyInfo *mykeylist,
+			const char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi);
+
+	int TruncatePacked(const char *path, RAMCloud::KeyInfo *mykeylist,
+			off_t new_size, off_t limit);
+
+	static int RelocatePacked(void* arg, const std::string &key,
+			const PackLocation &from, const PackLocation &to);
+
+	// Expands an archived file back into its datadir blob and points the
+	// inode at it; fd_, a descriptor of the old blob file, is dropped.
+	// Returns 0 also if the inode is no longer archived.
+	int RestoreArchived(RAMCloud::KeyInfo *mykeylist, int &fd_);
+
+	// Moves an idle datadir blob into the archive or back inline, for
+	// PlacementPolicy; refuses files that are open or changed meanwhile.
+	int ArchiveBlob(RAMCloud::KeyInfo *mykeylist);
+
+	int InlineBlob(RAMCloud::KeyInfo *mykeylist);
+
+	static int MoveData(void* arg, const std::string &key,
+			PlacementPolicy::Tier to);
+
+	static time_t BlobAccessTime(void* arg, tfs_inode_t inode);
+
+	static int WriteMigratedBlob(void* arg, tfs_inode_t inode, mode_t mode,
+			const std::string &data);
+
+	static int CommitMigration(void* arg, const std::string &key,
+			const std::string &data, bool on_disk);
+
+	// Waits out a background migration of the inode; call it before
+	// reading an inode that is about to be rewritten.
+	void FlushMigration(RAMCloud::KeyInfo *mykeylist);
+
+	static int FlushAppendSize(void* arg, const std::string &key, off_t size);
+
+	// Writes the deferred size of an append stream before the inode is
+	// rewritten; forget when the rewrite changes the size or the key.
+	void FlushAppends(RAMCloud::KeyInfo *mykeylist, bool forget);
+
+	// Inline threshold for path: the xattr override of its directory or
+	// the nearest ancestor with one, else the adaptive policy, else the
+	// configured threshold.
+	uint64_t InlineThreshold(const char *path);
+
+	// The INLINE_THRESHOLD_XATTR in effect for dir, or 0; cached in
+	// overrides.
+	uint32_t DirThreshold(const std::string &dir);
+
 	inline void InitStat(struct stat &statbuf, tfs_inode_t inode, mode_t mode,
 			dev_t dev);
 
@@ -125,6 +353,22 @@ private:
 
 	void FreeInodeValue(tfs_inode_val_t &ival);
 
+	bool LookupMeta(const RAMCloud::KeyInfo &key, const std::string &path,
+			std::string &value);
+
+	void WriteMeta(RAMCloud::KeyInfo *mykeylist, const std::string &value);
+
+	void WriteMeta(RAMCloud::KeyInfo *mykeylist, const tfs_inode_val_t &value);
+
+	// WriteMeta unless the inode changed since it was read at version;
+	// returns 0, -EAGAIN or -errno.
+	int WriteMetaIf(RAMCloud::KeyInfo *mykeylist, const std::string &value,
+			uint64_t version);
+
+	void RemoveMeta(RAMCloud::KeyInfo *mykeylist);
+
+	void MetaChanged(const RAMCloud::KeyInfo &key, uint64_t version);
+
 	bool ParentPathLookup(const char* path,  RAMCloud::KeyInfo *mykeylist,tfs_inode_t &inode_in_search, const char* &lastdelimiter);
 
 	inline bool PathLookup(const char *path, RAMCloud::KeyInfo *mykeylist,std::string &filename);
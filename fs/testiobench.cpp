@@ -0,0 +1,101 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Sequential I/O benchmark for a mounted TestFS.
+// Reports MB/s and CPU seconds per GB, both for this process and, when a
+// pid is given, for the testfs daemon (read from /proc/<pid>/stat).
+
+static void usage() {
+	fprintf(stderr,
+			"USAGE:  testiobench <FILE> <seqwrite|seqread> <TOTAL_MB> [BLOCK_KB] [DAEMON_PID]\n");
+	exit(1);
+}
+
+static double Now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double SelfCPU() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+			+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static double DaemonCPU(int pid) {
+	if (pid <= 0) {
+		return 0;
+	}
+	char fpath[64];
+	sprintf(fpath, "/proc/%d/stat", pid);
+	FILE* f = fopen(fpath, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	unsigned long utime = 0, stime = 0;
+	// fields 14 and 15 are utime and stime in clock ticks
+	fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime);
+	fclose(f);
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		usage();
+	}
+	const char* fpath = argv[1];
+	std::string mode(argv[2]);
+	size_t total = (size_t) atol(argv[3]) << 20;
+	size_t block = (argc > 4) ? (size_t) atol(argv[4]) << 10 : 1 << 20;
+	int pid = (argc > 5) ? atoi(argv[5]) : 0;
+	bool is_write = (mode == "seqwrite");
+	if (!is_write && mode != "seqread") {
+		usage();
+	}
+
+	int fd = is_write ? open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+			: open(fpath, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	char* buf = new char[block];
+	memset(buf, 'x', block);
+
+	double start = Now(), self_cpu = SelfCPU(), daemon_cpu = DaemonCPU(pid);
+	size_t done = 0;
+	while (done < total) {
+		ssize_t ret = is_write ? write(fd, buf, block) : read(fd, buf, block);
+		if (ret <= 0) {
+			break;
+		}
+		done += ret;
+	}
+	if (is_write) {
+		fsync(fd);
+	}
+	double elapsed = Now() - start;
+	self_cpu = SelfCPU() - self_cpu;
+	daemon_cpu = DaemonCPU(pid) - daemon_cpu;
+	close(fd);
+	delete[] buf;
+
+	double gb = done / (double) (1 << 30);
+	printf("%s: %lu bytes, block %lu, %.2f s, %.2f MB/s\n", mode.c_str(),
+			done, block, elapsed, done / elapsed / (1 << 20));
+	printf("cpu/GB: client %.3f s", gb > 0 ? self_cpu / gb : 0);
+	if (pid > 0) {
+		printf(", daemon %.3f s", gb > 0 ? daemon_cpu / gb : 0);
+	}
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,218 @@
+#include "fs/tfs_appender.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <cstdio>
+#include <vector>
+
+namespace TestFS {
+
+Appender::Appender(size_t max_step, uint64_t flush_ms, FlushFn flush,
+		void* arg) :
+		max_step(max_step < MIN_STEP ? MIN_STEP : max_step),
+		flush_ms(flush_ms), flush(flush), arg(arg), running(false),
+		num_appends(0), num_deferred(0), num_flushes(0),
+		preallocated_bytes(0), trimmed_bytes(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_mutex_init(&flush_mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Appender::~Appender() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&flush_mutex);
+	pthread_mutex_destroy(&mutex);
+}
+
+void Appender::Start() {
+	running = true;
+	pthread_create(&flusher, NULL, FlusherMain, this);
+}
+
+void Appender::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(flusher, NULL);
+	}
+}
+
+bool Appender::Extend(const std::string &key, int fd, off_t meta_size,
+		off_t offset, size_t size) {
+	off_t end = offset + size;
+	off_t alloc_from = 0, alloc_len = 0;
+
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Stream>::iterator it = streams.find(key);
+	if (it == streams.end()) {
+		if (offset != meta_size) {
+			// not at EOF: nothing to track
+			pthread_mutex_unlock(&mutex);
+			return false;
+		}
+		Stream fresh = { meta_size, 0, MIN_STEP, meta_size, false };
+		it = streams.insert(std::make_pair(key, fresh)).first;
+	}
+	Stream &s = it->second;
+	if (offset == s.size) {
+		++s.run;
+		++num_appends;
+	} else if (end > s.size) {
+		s.run = 0;
+	}
+	if (end > s.size) {
+		s.size = end;
+		s.dirty = true;
+	}
+	bool tracked = s.run >= APPEND_RUN;
+	if (!tracked) {
+		// the caller writes this size itself
+		s.dirty = false;
+	}
+	if (tracked && s.allocated_to - s.size < (off_t) s.step / 2) {
+		alloc_from = (s.allocated_to > s.size) ? s.allocated_to : s.size;
+		alloc_len = s.step;
+		s.allocated_to = alloc_from + alloc_len;
+		preallocated_bytes += alloc_len;
+		if (s.step < max_step) {
+			s.step *= 2;
+		}
+	}
+	if (tracked) {
+		++num_deferred;
+	} else if (s.run == 0 && s.allocated_to <= s.size) {
+		// not an append stream (any more)
+		streams.erase(it);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (alloc_len > 0) {
+		// only an optimization: a file system without it just grows
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, alloc_from, alloc_len);
+	}
+	return tracked;
+}
+
+bool Appender::Size(const std::string &key, off_t &size) {
+	bool found = false;
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Stream>::iterator it = streams.find(key);
+	if (it != streams.end() && it->second.run >= APPEND_RUN) {
+		size = it->second.size;
+		found = true;
+	}
+	pthread_mutex_unlock(&mutex);
+	return found;
+}
+
+bool Appender::Flush(const std::string &key) {
+	pthread_mutex_lock(&flush_mutex);
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Stream>::iterator it = streams.find(key);
+	bool tracked = it != streams.end() && it->second.run >= APPEND_RUN;
+	bool dirty = it != streams.end() && it->second.dirty;
+	off_t size = dirty ? it->second.size : 0;
+	if (dirty) {
+		it->second.dirty = false;
+		++num_flushes;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (dirty && flush(arg, key, size) < 0) {
+		pthread_mutex_lock(&mutex);
+		it = streams.find(key);
+		if (it != streams.end()) {
+			it->second.dirty = true;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	pthread_mutex_unlock(&flush_mutex);
+	return tracked;
+}
+
+void Appender::Trim(const std::string &key, int fd) {
+	off_t size = 0, allocated_to = 0;
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Stream>::iterator it = streams.find(key);
+	if (it != streams.end() && !it->second.dirty) {
+		size = it->second.size;
+		allocated_to = it->second.allocated_to;
+		if (allocated_to > size) {
+			trimmed_bytes += allocated_to - size;
+		}
+		streams.erase(it);
+	}
+	pthread_mutex_unlock(&mutex);
+	if (allocated_to > size) {
+		// ext4 ignores hole punches past EOF; truncating to the current
+		// size is what drops KEEP_SIZE blocks
+		struct stat st;
+		if (fstat(fd, &st) == 0) {
+			ftruncate(fd, st.st_size);
+		}
+	}
+}
+
+void Appender::TrimOnLastPut(void* arg, int fd) {
+	TrimRequest* req = reinterpret_cast<TrimRequest*>(arg);
+	req->appender->Trim(req->key, fd);
+}
+
+void Appender::Forget(const std::string &key) {
+	pthread_mutex_lock(&mutex);
+	streams.erase(key);
+	pthread_mutex_unlock(&mutex);
+}
+
+void* Appender::FlusherMain(void* arg) {
+	Appender* self = reinterpret_cast<Appender*>(arg);
+	bool stop = false;
+	while (!stop) {
+		pthread_mutex_lock(&self->mutex);
+		if (self->running) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += self->flush_ms / 1000;
+			deadline.tv_nsec += (self->flush_ms % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec += 1;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&self->cond, &self->mutex, &deadline);
+		}
+		stop = !self->running;
+		std::vector<std::string> dirty;
+		for (std::unordered_map<std::string, Stream>::iterator it =
+				self->streams.begin(); it != self->streams.end(); ++it) {
+			if (it->second.dirty) {
+				dirty.push_back(it->first);
+			}
+		}
+		pthread_mutex_unlock(&self->mutex);
+		for (size_t i = 0; i < dirty.size(); ++i) {
+			self->Flush(dirty[i]);
+		}
+	}
+	return NULL;
+}
+
+void Appender::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%zu streams, %lu appends, %lu size updates deferred, %lu flushed, "
+			"%lu MB preallocated, %lu MB trimmed\n",
+			streams.size(), (unsigned long) num_appends,
+			(unsigned long) num_deferred, (unsigned long) num_flushes,
+			(unsigned long) (preallocated_bytes >> 20),
+			(unsigned long) (trimmed_bytes >> 20));
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
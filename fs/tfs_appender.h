@@ -0,0 +1,104 @@
+#ifndef TFS_APPENDER_H_
+#define TFS_APPENDER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+
+namespace TestFS {
+
+// Tracks files in datadir that grow by appends (log files, mostly).
+//
+// Once writes keep landing at EOF, the file is preallocated past EOF
+// with fallocate(FALLOC_FL_KEEP_SIZE) in steps that double from MIN_STEP
+// up to max_step, and its size is kept here: the writes stop rewriting
+// the inode, and a flusher thread writes the size (and mtime) once per
+// flush_ms through FlushFn. When the last handle goes away, Trim()
+// releases the preallocation beyond EOF.
+//
+// While a file is tracked this size is the authoritative one; the
+// callers that rewrite the inode Flush() it first, and Forget() it once
+// the size changes another way (truncate, unlink, rename). TestFS's
+// FlushFn never lowers the inode's size and only writes over the version
+// it read, so a size flushed late cannot undo a newer one.
+class Appender {
+public:
+	static const size_t MIN_STEP = 64 << 10;
+	static const int APPEND_RUN = 2;
+
+	typedef int (*FlushFn)(void* arg, const std::string &key, off_t size);
+
+	Appender(size_t max_step, uint64_t flush_ms, FlushFn flush, void* arg);
+
+	~Appender();
+
+	void Start();
+
+	// Writes all pending sizes and stops the flusher.
+	void Stop();
+
+	// After size bytes were written at offset through fd; meta_size is
+	// the size in the inode the write read. Returns true if the file is
+	// tracked, so the inode need not be rewritten.
+	bool Extend(const std::string &key, int fd, off_t meta_size,
+			off_t offset, size_t size);
+
+	bool Size(const std::string &key, off_t &size);
+
+	// Writes key's size now if it is pending. Returns true if key is
+	// tracked.
+	bool Flush(const std::string &key);
+
+	// Drops key and frees its preallocation. Nobody else may be writing
+	// through fd, see TrimOnLastPut.
+	void Trim(const std::string &key, int fd);
+
+	struct TrimRequest {
+		Appender* appender;
+		std::string key;
+	};
+
+	// FdCache::Put callback (arg is a TrimRequest): runs Trim when the
+	// last holder of fd lets go, with the cache locked so no handle can
+	// pick fd up meanwhile.
+	static void TrimOnLastPut(void* arg, int fd);
+
+	void Forget(const std::string &key);
+
+	void Report(std::string &out);
+
+private:
+	struct Stream {
+		off_t size;
+		int run;               // consecutive writes at EOF
+		size_t step;
+		off_t allocated_to;    // preallocated up to here
+		bool dirty;
+	};
+
+	static void* FlusherMain(void* arg);
+
+	size_t max_step;
+	uint64_t flush_ms;
+	FlushFn flush;
+	void* arg;
+	std::unordered_map<std::string, Stream> streams;
+	pthread_mutex_t mutex;
+	// serializes size writes, so an older size never lands last
+	pthread_mutex_t flush_mutex;
+	pthread_cond_t cond;
+	pthread_t flusher;
+	bool running;
+
+	uint64_t num_appends;
+	uint64_t num_deferred;
+	uint64_t num_flushes;
+	uint64_t preallocated_bytes;
+	uint64_t trimmed_bytes;
+};
+
+}
+
+#endif
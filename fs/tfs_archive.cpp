@@ -0,0 +1,333 @@
+#include "fs/tfs_archive.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "util/compress.h"
+
+namespace TestFS {
+
+// stored and raw length of the block that follows
+struct archive_block {
+	uint32_t stored;
+	uint32_t raw;
+} __attribute__((packed));
+
+ArchiveStore::ArchiveStore(const std::string &dir, uint32_t node,
+		uint64_t segment_size, Logging* logs) :
+		dir(dir), node(node), segment_size(segment_size), logs(logs), active(0),
+		num_archived(0), raw_bytes(0), stored_bytes(0), num_restored(0),
+		num_freed(0), num_removed(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_mutex_init(&append_lock, NULL);
+	pthread_mutex_init(&extent_lock, NULL);
+}
+
+ArchiveStore::~ArchiveStore() {
+	for (std::map<uint32_t, Segment>::iterator it = segments.begin();
+			it != segments.end(); ++it) {
+		close(it->second.fd);
+	}
+	pthread_mutex_destroy(&extent_lock);
+	pthread_mutex_destroy(&append_lock);
+	pthread_mutex_destroy(&mutex);
+}
+
+std::string ArchiveStore::SegmentPath(uint32_t segment) {
+	char name[32];
+	sprintf(name, "/arc-%08u", segment);
+	return dir + name;
+}
+
+int ArchiveStore::ScanSegment(uint32_t segment) {
+	int fd = open(SegmentPath(segment).c_str(), O_RDWR);
+	if (fd < 0) {
+		return -errno;
+	}
+	Segment seg;
+	seg.fd = fd;
+	seg.size = 0;
+	seg.live = 0;
+	archive_record rec;
+	while (pread(fd, &rec, sizeof(rec), seg.size) == sizeof(rec)
+			&& rec.magic == RECORD_MAGIC) {
+		if (rec.flags & RECORD_LIVE) {
+			++seg.live;
+		}
+		seg.size += sizeof(rec) + rec.stored_size;
+	}
+	if (seg.live == 0) {
+		// everything in it was restored or deleted before the crash
+		close(fd);
+		unlink(SegmentPath(segment).c_str());
+		return 0;
+	}
+	segments[segment] = seg;
+	return 0;
+}
+
+int ArchiveStore::OpenActiveLocked(uint32_t segment) {
+	int fd = open(SegmentPath(segment).c_str(), O_RDWR | O_CREAT | O_TRUNC,
+			0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	Segment seg;
+	seg.fd = fd;
+	seg.size = 0;
+	seg.live = 0;
+	segments[segment] = seg;
+	active = segment;
+	return 0;
+}
+
+int ArchiveStore::Open() {
+	mkdir(dir.c_str(), 0755);
+	DIR* dp = opendir(dir.c_str());
+	if (dp == NULL) {
+		return -errno;
+	}
+	uint32_t next = 0;
+	struct dirent* de;
+	while ((de = readdir(dp)) != NULL) {
+		unsigned int segment;
+		if (sscanf(de->d_name, "arc-%08u", &segment) == 1) {
+			ScanSegment(segment);
+			if (segment + 1 > next) {
+				next = segment + 1;
+			}
+		}
+	}
+	closedir(dp);
+	// a new segment per mount: a torn append is never appended after
+	pthread_mutex_lock(&mutex);
+	int ret = OpenActiveLocked(next);
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void ArchiveStore::Lock() {
+	pthread_mutex_lock(&extent_lock);
+}
+
+void ArchiveStore::Unlock() {
+	pthread_mutex_unlock(&extent_lock);
+}
+
+int ArchiveStore::Append(const std::string &key, tfs_inode_t inode, int fd,
+		uint64_t size, ArchiveLocation &loc) {
+	archive_record rec;
+	memset(&rec, 0, sizeof(rec));
+	if (key.size() > sizeof(rec.key)) {
+		return -ENAMETOOLONG;
+	}
+	rec.magic = RECORD_MAGIC;
+	rec.flags = RECORD_LIVE;
+	rec.inode = inode;
+	rec.raw_size = size;
+	rec.keylen = key.size();
+	memcpy(rec.key, key.data(), key.size());
+
+	pthread_mutex_lock(&append_lock);
+	pthread_mutex_lock(&mutex);
+	int out = segments[active].fd;
+	uint64_t pos = segments[active].size;
+	loc.node = node;
+	loc.segment = active;
+	pthread_mutex_unlock(&mutex);
+	loc.offset = pos + sizeof(rec);
+
+	// the record goes in last, so a torn extent ends the segment's scan
+	std::string raw(BLOCK_SIZE, '\0');
+	std::string packed(sizeof(archive_block) + BLOCK_SIZE, '\0');
+	uint64_t done = 0, end = loc.offset;
+	int ret = 0;
+	while (done < size && ret == 0) {
+		size_t len = (size - done < BLOCK_SIZE) ? size - done : BLOCK_SIZE;
+		ssize_t n = pread(fd, &raw[0], len, done);
+		if (n < 0) {
+			ret = -errno;
+			break;
+		}
+		memset(&raw[n], 0, len - n);
+		archive_block block;
+		block.raw = len;
+		block.stored = LzCompress(raw.data(), len,
+				&packed[sizeof(block)], len - 1);
+		if (block.stored == 0) {
+			block.stored = len;
+			memcpy(&packed[sizeof(block)], raw.data(), len);
+		}
+		memcpy(&packed[0], &block, sizeof(block));
+		size_t total = sizeof(block) + block.stored;
+		if (pwrite(out, packed.data(), total, end) != (ssize_t) total) {
+			ret = -EIO;
+		}
+		end += total;
+		done += len;
+	}
+	rec.stored_size = end - loc.offset;
+	if (ret == 0 && pwrite(out, &rec, sizeof(rec), pos) != sizeof(rec)) {
+		ret = -EIO;
+	}
+
+	pthread_mutex_lock(&mutex);
+	if (ret == 0) {
+		segments[loc.segment].size = end;
+		++segments[loc.segment].live;
+		++num_archived;
+		raw_bytes += size;
+		stored_bytes += rec.stored_size;
+		if (end >= segment_size) {
+			// seal it; its extents are synced before any inode points
+			// to them
+			if (fdatasync(out) != 0) {
+				ret = -errno;
+			} else {
+				ret = OpenActiveLocked(active + 1);
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	pthread_mutex_unlock(&append_lock);
+	return ret;
+}
+
+int ArchiveStore::Sync() {
+	pthread_mutex_lock(&append_lock);
+	pthread_mutex_lock(&mutex);
+	int fd = segments[active].fd;
+	pthread_mutex_unlock(&mutex);
+	int ret = (fdatasync(fd) == 0) ? 0 : -errno;
+	pthread_mutex_unlock(&append_lock);
+	return ret;
+}
+
+bool ArchiveStore::ReadRecord(const ArchiveLocation &loc,
+		archive_record &rec) {
+	pthread_mutex_lock(&mutex);
+	std::map<uint32_t, Segment>::iterator it = segments.find(loc.segment);
+	int fd = (it == segments.end()) ? -1 : it->second.fd;
+	pthread_mutex_unlock(&mutex);
+	return fd >= 0 && loc.offset >= sizeof(rec)
+			&& pread(fd, &rec, sizeof(rec), loc.offset - sizeof(rec))
+					== sizeof(rec)
+			&& rec.magic == RECORD_MAGIC && (rec.flags & RECORD_LIVE);
+}
+
+int ArchiveStore::Restore(const ArchiveLocation &loc, int fd) {
+	archive_record rec;
+	if (loc.node != node) {
+		return -EREMOTE;
+	}
+	if (!ReadRecord(loc, rec)) {
+		return -EIO;
+	}
+	pthread_mutex_lock(&mutex);
+	int in = segments[loc.segment].fd;
+	pthread_mutex_unlock(&mutex);
+
+	std::string raw(BLOCK_SIZE, '\0');
+	std::string packed(BLOCK_SIZE, '\0');
+	uint64_t pos = loc.offset, end = loc.offset + rec.stored_size;
+	uint64_t done = 0;
+	while (done < rec.raw_size) {
+		archive_block block;
+		if (pos + sizeof(block) > end
+				|| pread(in, &block, sizeof(block), pos) != sizeof(block)
+				|| block.raw > BLOCK_SIZE || block.stored > block.raw
+				|| pos + sizeof(block) + block.stored > end) {
+			return -EIO;
+		}
+		pos += sizeof(block);
+		if (pread(in, &packed[0], block.stored, pos) != (ssize_t) block.stored) {
+			return -EIO;
+		}
+		pos += block.stored;
+		const char* data = packed.data();
+		if (block.stored < block.raw) {
+			if (!LzDecompress(packed.data(), block.stored, &raw[0], block.raw)) {
+				return -EIO;
+			}
+			data = raw.data();
+		}
+		if (pwrite(fd, data, block.raw, done) != (ssize_t) block.raw) {
+			return -errno;
+		}
+		done += block.raw;
+	}
+	if (ftruncate(fd, rec.raw_size) != 0) {
+		return -errno;
+	}
+	pthread_mutex_lock(&mutex);
+	++num_restored;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+void ArchiveStore::Free(const ArchiveLocation &loc) {
+	archive_record rec;
+	if (loc.node != node || !ReadRecord(loc, rec)) {
+		return;
+	}
+	uint32_t flags = 0;
+	pthread_mutex_lock(&mutex);
+	Segment &seg = segments[loc.segment];
+	pwrite(seg.fd, &flags, sizeof(flags),
+			loc.offset - sizeof(rec) + offsetof(archive_record, flags));
+	++num_freed;
+	if (--seg.live == 0 && loc.segment != active) {
+		close(seg.fd);
+		unlink(SegmentPath(loc.segment).c_str());
+		segments.erase(loc.segment);
+		++num_removed;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+int ArchiveStore::Relabel(const ArchiveLocation &loc, const std::string &key) {
+	archive_record rec;
+	if (key.size() > sizeof(rec.key)) {
+		return -ENAMETOOLONG;
+	}
+	if (loc.node != node) {
+		return -EREMOTE;
+	}
+	if (!ReadRecord(loc, rec)) {
+		return -EIO;
+	}
+	rec.keylen = key.size();
+	memset(rec.key, 0, sizeof(rec.key));
+	memcpy(rec.key, key.data(), key.size());
+	pthread_mutex_lock(&mutex);
+	ssize_t n = pwrite(segments[loc.segment].fd, &rec, sizeof(rec),
+			loc.offset - sizeof(rec));
+	pthread_mutex_unlock(&mutex);
+	return (n == sizeof(rec)) ? 0 : -EIO;
+}
+
+void ArchiveStore::Report(std::string &out) {
+	uint64_t live = 0;
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	for (std::map<uint32_t, Segment>::iterator it = segments.begin();
+			it != segments.end(); ++it) {
+		live += it->second.live;
+	}
+	snprintf(line, sizeof(line),
+			"%zu segments, %lu live extents; %lu archived (%lu bytes in "
+			"%lu stored), %lu restored, %lu freed, %lu segments removed\n",
+			segments.size(), (unsigned long) live,
+			(unsigned long) num_archived, (unsigned long) raw_bytes,
+			(unsigned long) stored_bytes, (unsigned long) num_restored,
+			(unsigned long) num_freed, (unsigned long) num_removed);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
@@ -0,0 +1,122 @@
+#ifndef TFS_ARCHIVE_H_
+#define TFS_ARCHIVE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include "fs/tfs_inode.h"
+#include "util/logging.h"
+
+namespace TestFS {
+
+struct ArchiveLocation {
+	uint32_t node;       // whose datadir/archive holds the extent
+	uint32_t segment;
+	uint64_t offset;     // of the data, just past its archive_record
+};
+
+// Every extent starts with this record; the key is the owning inode's
+// primary meta key, as in pack_record.
+struct archive_record {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t inode;
+	uint64_t raw_size;
+	uint64_t stored_size;   // bytes of blocks after the record
+	uint16_t keylen;
+	uint16_t reserved[3];
+	char key[56];
+} __attribute__((packed));
+
+// Cold tier for file data: whole blobs compressed into large append-only
+// segment files under datadir/archive (BLOB_ARCHIVED).
+//
+// An extent is a run of blocks of up to BLOCK_SIZE raw bytes, each an
+// 8-byte header (stored and raw length) and the LzCompress output, or the
+// raw bytes where they do not compress. Extents are never read in place:
+// Restore() expands one back into a datadir blob file. Freed extents are
+// marked dead in their record, and a sealed segment is deleted once
+// nothing in it is live; there is no compaction, as archived data is
+// rarely rewritten.
+//
+// Callers that change an extent together with its inode header hold
+// Lock() across both. As in PackStore, another node's extent is refused
+// with -EREMOTE.
+class ArchiveStore {
+public:
+	static const size_t BLOCK_SIZE = 1 << 20;
+
+	ArchiveStore(const std::string &dir, uint32_t node, uint64_t segment_size,
+			Logging* logs);
+
+	~ArchiveStore();
+
+	// Scans existing segments for live extents. Returns 0 or a negative
+	// errno.
+	int Open();
+
+	void Lock();
+
+	void Unlock();
+
+	// Compresses size bytes of fd into a new extent. Reads past the end of
+	// fd are zeros, as in a sparse file.
+	int Append(const std::string &key, tfs_inode_t inode, int fd,
+			uint64_t size, ArchiveLocation &loc);
+
+	// Makes every extent appended so far durable.
+	int Sync();
+
+	// Expands the extent into fd from offset 0. Returns 0 or a negative
+	// errno (-EIO for a damaged extent).
+	int Restore(const ArchiveLocation &loc, int fd);
+
+	void Free(const ArchiveLocation &loc);
+
+	int Relabel(const ArchiveLocation &loc, const std::string &key);
+
+	void Report(std::string &out);
+
+private:
+	struct Segment {
+		int fd;
+		uint64_t size;
+		uint64_t live;       // extents, not bytes
+	};
+
+	static const uint32_t RECORD_MAGIC = 0x54464152;
+	static const uint32_t RECORD_LIVE = 1;
+
+	std::string SegmentPath(uint32_t segment);
+
+	int ScanSegment(uint32_t segment);
+
+	// Starts segment as the active one. Called with mutex held.
+	int OpenActiveLocked(uint32_t segment);
+
+	// Reads the record in front of loc.
+	bool ReadRecord(const ArchiveLocation &loc, archive_record &rec);
+
+	std::string dir;
+	uint32_t node;
+	uint64_t segment_size;
+	Logging* logs;
+
+	std::map<uint32_t, Segment> segments;
+	uint32_t active;
+	pthread_mutex_t mutex;          // segments and the byte counts
+	pthread_mutex_t append_lock;    // one Append at a time
+	pthread_mutex_t extent_lock;    // see Lock()
+
+	uint64_t num_archived;
+	uint64_t raw_bytes;
+	uint64_t stored_bytes;
+	uint64_t num_restored;
+	uint64_t num_freed;
+	uint64_t num_removed;
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include "fs/tfs_blobcache.h"
+#include <time.h>
+
+namespace TestFS {
+
+BlobCache::BlobCache(size_t capacity_bytes, size_t block_size,
+		uint64_t lease_ms) :
+		capacity_bytes(capacity_bytes), block_size(block_size),
+		lease_ms(lease_ms), used_bytes(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+BlobCache::~BlobCache() {
+	pthread_mutex_destroy(&mutex);
+}
+
+uint64_t BlobCache::NowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void BlobCache::EraseLocked(std::map<BlockKey, Entry>::iterator it) {
+	used_bytes -= it->second.data.size();
+	lru_list.erase(it->second.lru);
+	blocks.erase(it);
+}
+
+bool BlobCache::Get(tfs_inode_t inode, uint64_t block, std::string &data) {
+	bool found = false;
+	pthread_mutex_lock(&mutex);
+	std::map<BlockKey, Entry>::iterator it = blocks.find(BlockKey(inode, block));
+	if (it != blocks.end()) {
+		if (it->second.expire_ms > NowMs()) {
+			data = it->second.data;
+			lru_list.splice(lru_list.begin(), lru_list, it->second.lru);
+			found = true;
+		} else {
+			EraseLocked(it);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return found;
+}
+
+void BlobCache::Put(tfs_inode_t inode, uint64_t block,
+		const std::string &data) {
+	BlockKey key(inode, block);
+	pthread_mutex_lock(&mutex);
+	std::map<BlockKey, Entry>::iterator it = blocks.find(key);
+	if (it != blocks.end()) {
+		EraseLocked(it);
+	}
+	while (used_bytes + data.size() > capacity_bytes && !lru_list.empty()) {
+		EraseLocked(blocks.find(lru_list.back()));
+	}
+	lru_list.push_front(key);
+	Entry &entry = blocks[key];
+	entry.data = data;
+	entry.expire_ms = NowMs() + lease_ms;
+	entry.lru = lru_list.begin();
+	used_bytes += data.size();
+	pthread_mutex_unlock(&mutex);
+}
+
+void BlobCache::Invalidate(tfs_inode_t inode) {
+	pthread_mutex_lock(&mutex);
+	std::map<BlockKey, Entry>::iterator it =
+			blocks.lower_bound(BlockKey(inode, 0));
+	while (it != blocks.end() && it->first.first == inode) {
+		std::map<BlockKey, Entry>::iterator next = it;
+		++next;
+		EraseLocked(it);
+		it = next;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+}
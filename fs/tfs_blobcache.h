@@ -0,0 +1,59 @@
+#ifndef TFS_BLOBCACHE_H_
+#define TFS_BLOBCACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include "fs/tfs_inode.h"
+
+namespace TestFS {
+
+// Local read cache for blobs served by other nodes, in fixed-size blocks.
+// Like MetaCache every block carries a lease; writes through this mount
+// drop the inode's blocks right away, writes from other mounts become
+// visible once the lease runs out.
+class BlobCache {
+public:
+	BlobCache(size_t capacity_bytes, size_t block_size, uint64_t lease_ms);
+
+	~BlobCache();
+
+	size_t BlockSize() const {
+		return block_size;
+	}
+
+	// A block shorter than BlockSize() marks the end of the blob.
+	bool Get(tfs_inode_t inode, uint64_t block, std::string &data);
+
+	void Put(tfs_inode_t inode, uint64_t block, const std::string &data);
+
+	void Invalidate(tfs_inode_t inode);
+
+private:
+	typedef std::pair<tfs_inode_t, uint64_t> BlockKey;
+
+	struct Entry {
+		std::string data;
+		uint64_t expire_ms;
+		std::list<BlockKey>::iterator lru;
+	};
+
+	static uint64_t NowMs();
+
+	void EraseLocked(std::map<BlockKey, Entry>::iterator it);
+
+	size_t capacity_bytes;
+	size_t block_size;
+	uint64_t lease_ms;
+	size_t used_bytes;
+	std::map<BlockKey, Entry> blocks;
+	std::list<BlockKey> lru_list;
+	pthread_mutex_t mutex;
+};
+
+}
+
+#endif
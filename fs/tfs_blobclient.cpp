@@ -0,0 +1,257 @@
+#include "fs/tfs_blobclient.h"
+#include <errno.h>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+namespace TestFS {
+
+BlobClient::BlobClient(BlobCache* cache, const std::string &secret) :
+		cache(cache), secret(secret) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+BlobClient::~BlobClient() {
+	for (std::map<uint32_t, Node>::iterator it = nodes.begin();
+			it != nodes.end(); ++it) {
+		for (size_t i = 0; i < it->second.idle.size(); ++i) {
+			delete it->second.idle[i];
+		}
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+int BlobClient::AddNodes(const std::string &spec) {
+	std::stringstream ss(spec);
+	std::string item;
+	int count = 0;
+	while (std::getline(ss, item, ',')) {
+		size_t eq = item.find('=');
+		if (eq == std::string::npos) {
+			continue;
+		}
+		Node &node = nodes[atoi(item.c_str())];
+		std::string addr = item.substr(eq + 1);
+		size_t colon = addr.find(':');
+		node.host = addr.substr(0, colon);
+		node.port = (colon == std::string::npos) ? BLOB_DEFAULT_PORT
+				: atoi(addr.c_str() + colon + 1);
+		++count;
+	}
+	return count;
+}
+
+TCPSocket* BlobClient::Acquire(uint32_t node) {
+	pthread_mutex_lock(&mutex);
+	std::map<uint32_t, Node>::iterator it = nodes.find(node);
+	if (it == nodes.end()) {
+		pthread_mutex_unlock(&mutex);
+		return NULL;
+	}
+	if (!it->second.idle.empty()) {
+		TCPSocket* sock = it->second.idle.back();
+		it->second.idle.pop_back();
+		pthread_mutex_unlock(&mutex);
+		return sock;
+	}
+	std::string host = it->second.host;
+	unsigned short port = it->second.port;
+	pthread_mutex_unlock(&mutex);
+
+	TCPSocket* sock = NULL;
+	try {
+		sock = new TCPSocket(host, port);
+		sock->setNoDelay(true);
+		Authenticate(sock);
+		return sock;
+	} catch (SocketException& e) {
+		delete sock;
+		return NULL;
+	}
+}
+
+void BlobClient::Authenticate(TCPSocket* sock) {
+	uint32_t frame;
+	blob_response_header resp;
+	uint8_t nonce[BLOB_NONCE_SIZE];
+	if (sock->recvFully(&frame, sizeof(frame)) != sizeof(frame)
+			|| frame != sizeof(resp) + BLOB_NONCE_SIZE
+			|| sock->recvFully(&resp, sizeof(resp)) != sizeof(resp)
+			|| sock->recvFully(nonce, sizeof(nonce)) != sizeof(nonce)) {
+		throw SocketException("blob server sent no challenge");
+	}
+	blob_request_header req;
+	memset(&req, 0, sizeof(req));
+	req.opcode = BLOB_AUTH;
+	req.length = BLOB_AUTH_SIZE;
+	uint8_t answer[BLOB_AUTH_SIZE];
+	BlobAuth(secret, nonce, answer);
+	frame = sizeof(req) + sizeof(answer);
+	struct iovec iov[3];
+	iov[0].iov_base = &frame;
+	iov[0].iov_len = sizeof(frame);
+	iov[1].iov_base = &req;
+	iov[1].iov_len = sizeof(req);
+	iov[2].iov_base = answer;
+	iov[2].iov_len = sizeof(answer);
+	sock->sendv(iov, 3);
+}
+
+void BlobClient::Release(uint32_t node, TCPSocket* sock) {
+	pthread_mutex_lock(&mutex);
+	std::vector<TCPSocket*> &idle = nodes[node].idle;
+	if (idle.size() < MAX_IDLE) {
+		idle.push_back(sock);
+		sock = NULL;
+	}
+	pthread_mutex_unlock(&mutex);
+	delete sock;
+}
+
+int BlobClient::Call(uint32_t node, const blob_request_header &request,
+		const char* out, char* in, blob_response_header &resp) {
+	TCPSocket* sock = Acquire(node);
+	if (sock == NULL) {
+		return -EHOSTUNREACH;
+	}
+	blob_request_header req = request;
+	try {
+		uint32_t frame = sizeof(req) + ((out != NULL) ? req.length : 0);
+		struct iovec iov[3];
+		iov[0].iov_base = &frame;
+		iov[0].iov_len = sizeof(frame);
+		iov[1].iov_base = (void *) &req;
+		iov[1].iov_len = sizeof(req);
+		iov[2].iov_base = (void *) out;
+		iov[2].iov_len = (out != NULL) ? req.length : 0;
+		sock->sendv(iov, (out != NULL) ? 3 : 2);
+		if (sock->recvFully(&frame, sizeof(frame)) != sizeof(frame)
+				|| sock->recvFully(&resp, sizeof(resp)) != sizeof(resp)) {
+			throw SocketException("blob server closed the connection");
+		}
+		// only reads carry data, status bytes of it
+		size_t data = (resp.status > 0 && in != NULL) ? resp.status : 0;
+		if (frame != sizeof(resp) + data) {
+			throw SocketException("blob server sent a malformed response");
+		}
+		if (data > 0 && sock->recvFully(in, data) != (int) data) {
+			throw SocketException("blob server closed the connection");
+		}
+	} catch (SocketException& e) {
+		// the stream may be out of sync; never reuse it
+		delete sock;
+		return -EIO;
+	}
+	Release(node, sock);
+	return resp.status;
+}
+
+int BlobClient::ReadRemote(uint32_t node, tfs_inode_t inode, char* buf,
+		size_t size, off_t offset) {
+	blob_request_header req;
+	memset(&req, 0, sizeof(req));
+	req.inode = inode;
+	req.offset = offset;
+	req.length = size;
+	req.opcode = BLOB_READ;
+	blob_response_header resp;
+	return Call(node, req, NULL, buf, resp);
+}
+
+int BlobClient::Read(uint32_t node, tfs_inode_t inode, char* buf,
+		size_t size, off_t offset) {
+	if (size > BLOB_MAX_IO) {
+		size = BLOB_MAX_IO;
+	}
+	if (cache == NULL) {
+		return ReadRemote(node, inode, buf, size, offset);
+	}
+
+	// fetch whole blocks so neighbouring reads hit the cache
+	size_t bsize = cache->BlockSize();
+	size_t done = 0;
+	std::string data;
+	while (done < size) {
+		uint64_t pos = offset + done;
+		uint64_t block = pos / bsize;
+		if (!cache->Get(inode, block, data)) {
+			data.resize(bsize);
+			int ret = ReadRemote(node, inode, &data[0], bsize, block * bsize);
+			if (ret < 0) {
+				return (done > 0) ? (int) done : ret;
+			}
+			data.resize(ret);
+			cache->Put(inode, block, data);
+		}
+		size_t skip = pos - block * bsize;
+		if (skip >= data.size()) {
+			break;
+		}
+		size_t n = data.size() - skip;
+		if (n > size - done) {
+			n = size - done;
+		}
+		memcpy(buf + done, data.data() + skip, n);
+		done += n;
+		if (data.size() < bsize) {
+			break;
+		}
+	}
+	return done;
+}
+
+int BlobClient::Write(uint32_t node, tfs_inode_t inode, const char* buf,
+		size_t size, off_t offset) {
+	if (size > BLOB_MAX_IO) {
+		size = BLOB_MAX_IO;
+	}
+	if (cache != NULL) {
+		cache->Invalidate(inode);
+	}
+	blob_request_header req;
+	memset(&req, 0, sizeof(req));
+	req.inode = inode;
+	req.offset = offset;
+	req.length = size;
+	req.opcode = BLOB_WRITE;
+	blob_response_header resp;
+	return Call(node, req, buf, NULL, resp);
+}
+
+int BlobClient::Truncate(uint32_t node, tfs_inode_t inode, off_t new_size) {
+	if (cache != NULL) {
+		cache->Invalidate(inode);
+	}
+	blob_request_header req;
+	memset(&req, 0, sizeof(req));
+	req.inode = inode;
+	req.offset = new_size;
+	req.opcode = BLOB_TRUNCATE;
+	blob_response_header resp;
+	return Call(node, req, NULL, NULL, resp);
+}
+
+int BlobClient::Unlink(uint32_t node, tfs_inode_t inode) {
+	if (cache != NULL) {
+		cache->Invalidate(inode);
+	}
+	blob_request_header req;
+	memset(&req, 0, sizeof(req));
+	req.inode = inode;
+	req.opcode = BLOB_UNLINK;
+	blob_response_header resp;
+	return Call(node, req, NULL, NULL, resp);
+}
+
+int BlobClient::ReadCold(uint32_t node, const ColdLocation &loc, char* buf) {
+	blob_request_header req;
+	memset(&req, 0, sizeof(req));
+	req.inode = loc.segment;
+	req.offset = loc.offset;
+	req.length = loc.length;
+	req.opcode = BLOB_COLD_READ;
+	blob_response_header resp;
+	return Call(node, req, NULL, buf, resp);
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef TFS_BLOBCLIENT_H_
+#define TFS_BLOBCLIENT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "fs/tfs_blobproto.h"
+#include "fs/tfs_blobcache.h"
+#include "fs/tfs_coldstore.h"
+#include "fs/tfs_inode.h"
+#include "util/socket.h"
+
+namespace TestFS {
+
+// Client side of the blob protocol. Keeps a few idle connections per node
+// so concurrent FUSE threads do not serialize on one socket, and fronts
+// reads with an optional BlobCache.
+//
+// All calls return what the local syscall would: a byte count or 0 on
+// success, a negative errno on failure (-EHOSTUNREACH for unknown or
+// unreachable nodes).
+class BlobClient {
+public:
+	// secret is the blob_secret of the nodes' blob servers.
+	BlobClient(BlobCache* cache, const std::string &secret);
+
+	~BlobClient();
+
+	// spec is "id=host[:port],id=host[:port],..."; returns the node count.
+	int AddNodes(const std::string &spec);
+
+	int Read(uint32_t node, tfs_inode_t inode, char* buf, size_t size,
+			off_t offset);
+
+	int Write(uint32_t node, tfs_inode_t inode, const char* buf, size_t size,
+			off_t offset);
+
+	int Truncate(uint32_t node, tfs_inode_t inode, off_t new_size);
+
+	int Unlink(uint32_t node, tfs_inode_t inode);
+
+	// Reads the raw ColdStore record at loc from node into buf, which has
+	// room for loc.length bytes.
+	int ReadCold(uint32_t node, const ColdLocation &loc, char* buf);
+
+private:
+	struct Node {
+		std::string host;
+		unsigned short port;
+		std::vector<TCPSocket*> idle;
+	};
+
+	static const size_t MAX_IDLE = 4;
+
+	TCPSocket* Acquire(uint32_t node);
+
+	// Answers the challenge a new connection opens with; throws
+	// SocketException.
+	void Authenticate(TCPSocket* sock);
+
+	void Release(uint32_t node, TCPSocket* sock);
+
+	int Call(uint32_t node, const blob_request_header &req, const char* out,
+			char* in, blob_response_header &resp);
+
+	int ReadRemote(uint32_t node, tfs_inode_t inode, char* buf, size_t size,
+			off_t offset);
+
+	BlobCache* cache;
+	std::string secret;
+	std::map<uint32_t, Node> nodes;
+	pthread_mutex_t mutex;
+};
+
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef TFS_BLOBPROTO_H_
+#define TFS_BLOBPROTO_H_
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include "util/sha256.h"
+
+namespace TestFS {
+
+// Wire protocol between a TestFS mount and the blob server of the node that
+// owns a file's blob (tfs_inode_header::blob_owner).
+//
+// A request is a blob_request_header followed, for BLOB_WRITE, by length
+// bytes of data. A response is a blob_response_header followed, for
+// BLOB_READ, by status bytes of data (which may be short at end of file).
+// BLOB_COLD_READ reads a ColdStore record instead of a blob: inode is the
+// segment, and the response carries the whole record or an error. Requests
+// and responses are util/eventloop frames, as for tfs_mdsproto.h.
+// One request is outstanding per connection. Integers are in host byte
+// order.
+//
+// A server opens every connection with a challenge: a response header
+// with status 0 and BLOB_NONCE_SIZE fresh random bytes. The client's first
+// request is BLOB_AUTH, carrying BlobAuth() of the blob_secret the nodes
+// share and that nonce; it gets no response, and the server closes a
+// connection that starts with anything else or a wrong answer. The secret
+// never crosses the wire and an answer is good for one connection only.
+
+static const uint32_t BLOB_DEFAULT_PORT = 7656;
+static const uint32_t BLOB_MAX_IO = 1 << 24;
+static const size_t BLOB_NONCE_SIZE = 16;
+static const size_t BLOB_AUTH_SIZE = SHA256_DIGEST_SIZE;
+
+enum BlobOpcode {
+	BLOB_READ = 1, BLOB_WRITE = 2, BLOB_TRUNCATE = 3, BLOB_UNLINK = 4,
+	BLOB_STAT = 5, BLOB_COLD_READ = 6, BLOB_AUTH = 7,
+};
+
+struct blob_request_header {
+	uint64_t inode;
+	uint64_t offset;        // new size for BLOB_TRUNCATE
+	uint32_t length;
+	uint8_t opcode;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+// status is the byte count for BLOB_READ/BLOB_WRITE, 0 on success for the
+// others, or a negative errno.
+struct blob_response_header {
+	int32_t status;
+	uint32_t reserved;
+} __attribute__((packed));
+
+// The answer to a challenge: HMAC-SHA-256 of the nonce under the secret.
+inline void BlobAuth(const std::string &secret,
+		const uint8_t nonce[BLOB_NONCE_SIZE], uint8_t out[BLOB_AUTH_SIZE]) {
+	hmac_sha256(secret.data(), secret.size(), nonce, BLOB_NONCE_SIZE, out);
+}
+
+// Fills nonce from /dev/urandom; false if it cannot.
+inline bool BlobNonce(uint8_t nonce[BLOB_NONCE_SIZE]) {
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	ssize_t n = read(fd, nonce, BLOB_NONCE_SIZE);
+	close(fd);
+	return n == (ssize_t) BLOB_NONCE_SIZE;
+}
+
+// Compares an answer in full, so the time taken says nothing about it.
+inline bool BlobAuthMatches(const std::string &secret,
+		const uint8_t nonce[BLOB_NONCE_SIZE], const char* answer) {
+	uint8_t expect[BLOB_AUTH_SIZE];
+	BlobAuth(secret, nonce, expect);
+	uint8_t diff = 0;
+	for (size_t i = 0; i < BLOB_AUTH_SIZE; ++i) {
+		diff |= (uint8_t) answer[i] ^ expect[i];
+	}
+	return diff == 0;
+}
+
+}
+
+#endif
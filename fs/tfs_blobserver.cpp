@@ -0,0 +1,255 @@
+#include "fs/tfs_blobserver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cstring>
+#include "fs/tfs_inode.h"
+
+namespace TestFS {
+
+BlobServer::BlobServer(DatadirLayout* layout, const std::string &secret,
+		Logging* logs) :
+		layout(layout), secret(secret), cold(NULL), logs(logs), loop(NULL),
+		running(false), stopping(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+BlobServer::~BlobServer() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+int BlobServer::Start(const std::string &address, unsigned short port,
+		int nworkers) {
+	loop = new EventLoop();
+	int bound = loop->Listen(address, port, this);
+	if (bound < 0) {
+		logs->LogMsg("BlobServer: cannot listen on %s:%u: %s\n",
+				address.c_str(), port, strerror(errno));
+		delete loop;
+		loop = NULL;
+		return -1;
+	}
+	running = true;
+	stopping = false;
+	workers.resize((nworkers > 0) ? nworkers : 1);
+	for (size_t i = 0; i < workers.size(); ++i) {
+		pthread_create(&workers[i], NULL, WorkerMain, this);
+	}
+	pthread_create(&thread, NULL, LoopMain, this);
+	return bound;
+}
+
+void BlobServer::SetColdStore(ColdStore* store) {
+	cold = store;
+}
+
+void BlobServer::Stop() {
+	if (!running) {
+		return;
+	}
+	running = false;
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	for (size_t i = 0; i < workers.size(); ++i) {
+		pthread_join(workers[i], NULL);
+	}
+	workers.clear();
+	// requests nobody picked up are dropped with their connections
+	for (size_t i = 0; i < queue.size(); ++i) {
+		delete queue[i];
+	}
+	queue.clear();
+	loop->Stop();
+	pthread_join(thread, NULL);
+	delete loop;
+	loop = NULL;
+}
+
+void* BlobServer::LoopMain(void* arg) {
+	reinterpret_cast<BlobServer*>(arg)->loop->Run();
+	return NULL;
+}
+
+void* BlobServer::WorkerMain(void* arg) {
+	BlobServer* self = reinterpret_cast<BlobServer*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (!self->stopping) {
+		if (self->queue.empty()) {
+			pthread_cond_wait(&self->cond, &self->mutex);
+			continue;
+		}
+		Job* job = self->queue.front();
+		self->queue.pop_front();
+		pthread_mutex_unlock(&self->mutex);
+		self->Handle(job);
+		self->loop->RunInLoop(Reply, job);
+		pthread_mutex_lock(&self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+void BlobServer::Reply(void* arg) {
+	Job* job = reinterpret_cast<Job*>(arg);
+	Peer* peer = job->peer;
+	if (!peer->closed) {
+		struct iovec iov[2];
+		iov[0].iov_base = &job->resp;
+		iov[0].iov_len = sizeof(job->resp);
+		iov[1].iov_base = const_cast<char*>(job->out.data());
+		iov[1].iov_len = job->out.size();
+		peer->conn->SendMessage(iov, 2);
+	}
+	if (--peer->pending == 0 && peer->closed) {
+		delete peer;
+	}
+	delete job;
+}
+
+void BlobServer::OnAccept(Connection* conn) {
+	Peer* peer = new Peer;
+	peer->authenticated = false;
+	peer->conn = conn;
+	peer->pending = 0;
+	peer->closed = false;
+	conn->context = peer;
+	if (!BlobNonce(peer->nonce)) {
+		logs->LogMsg("BlobServer: no random bytes for a challenge\n");
+		conn->Close();
+		return;
+	}
+	blob_response_header resp;
+	memset(&resp, 0, sizeof(resp));
+	struct iovec iov[2];
+	iov[0].iov_base = &resp;
+	iov[0].iov_len = sizeof(resp);
+	iov[1].iov_base = peer->nonce;
+	iov[1].iov_len = BLOB_NONCE_SIZE;
+	conn->SendMessage(iov, 2);
+}
+
+void BlobServer::OnClose(Connection* conn) {
+	Peer* peer = reinterpret_cast<Peer*>(conn->context);
+	conn->context = NULL;
+	peer->closed = true;
+	if (peer->pending == 0) {
+		delete peer;
+	}
+}
+
+void BlobServer::OnMessage(Connection* conn, const char* data, uint32_t len) {
+	blob_request_header req;
+	if (len < sizeof(req)) {
+		conn->Close();
+		return;
+	}
+	memcpy(&req, data, sizeof(req));
+	Peer* peer = reinterpret_cast<Peer*>(conn->context);
+	if (!peer->authenticated) {
+		if (req.opcode != BLOB_AUTH || len != sizeof(req) + BLOB_AUTH_SIZE
+				|| !BlobAuthMatches(secret, peer->nonce, data + sizeof(req))) {
+			logs->LogMsg("BlobServer: connection without the blob secret, "
+					"closing it\n");
+			conn->Close();
+			return;
+		}
+		peer->authenticated = true;
+		return;
+	}
+	size_t expect = sizeof(req) + ((req.opcode == BLOB_WRITE) ? req.length : 0);
+	if (req.length > BLOB_MAX_IO || len != expect) {
+		logs->LogMsg("BlobServer: malformed request, closing the connection\n");
+		conn->Close();
+		return;
+	}
+	Job* job = new Job;
+	job->peer = peer;
+	job->req = req;
+	job->data.assign(data + sizeof(req), len - sizeof(req));
+	++peer->pending;
+	pthread_mutex_lock(&mutex);
+	queue.push_back(job);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+void BlobServer::Handle(Job* job) {
+	const blob_request_header &req = job->req;
+	blob_response_header &resp = job->resp;
+	std::string &out = job->out;
+	char fpath[4096];
+	layout->Format(fpath, req.inode);
+	memset(&resp, 0, sizeof(resp));
+
+	switch (req.opcode) {
+	case BLOB_READ: {
+		int fd = open(fpath, O_RDONLY);
+		if (fd < 0) {
+			resp.status = -errno;
+			break;
+		}
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			resp.status = -errno;
+			close(fd);
+			break;
+		}
+		uint64_t size = st.st_size;
+		uint64_t avail = (req.offset < size) ? size - req.offset : 0;
+		out.resize((avail < req.length) ? avail : req.length);
+		ssize_t n = out.empty() ? 0 : pread(fd, &out[0], out.size(), req.offset);
+		resp.status = (n < 0) ? -errno : n;
+		out.resize((n < 0) ? 0 : n);
+		close(fd);
+		break;
+	}
+	case BLOB_WRITE: {
+		int fd = open(fpath, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0 && errno == ENOENT && layout->MakeDirs(req.inode) == 0) {
+			// the id was allocated by another node, which pre-created
+			// its directory in its own datadir only
+			fd = open(fpath, O_WRONLY | O_CREAT, 0644);
+		}
+		if (fd < 0) {
+			resp.status = -errno;
+		} else {
+			ssize_t n = pwrite(fd, job->data.data(), req.length, req.offset);
+			resp.status = (n < 0) ? -errno : n;
+			close(fd);
+		}
+		break;
+	}
+	case BLOB_TRUNCATE:
+		resp.status = (truncate(fpath, req.offset) == 0) ? 0 : -errno;
+		break;
+	case BLOB_UNLINK:
+		resp.status = (unlink(fpath) == 0) ? 0 : -errno;
+		break;
+	case BLOB_COLD_READ: {
+		out.resize(req.length);
+		ColdLocation loc;
+		loc.segment = req.inode;
+		loc.offset = req.offset;
+		loc.length = req.length;
+		resp.status = (cold == NULL) ? -ENOENT : cold->ReadRaw(loc, &out[0]);
+		out.resize((resp.status > 0) ? resp.status : 0);
+		break;
+	}
+	case BLOB_STAT: {
+		struct stat st;
+		resp.status = (stat(fpath, &st) == 0) ? 0 : -errno;
+		break;
+	}
+	default:
+		resp.status = -EINVAL;
+	}
+}
+
+}
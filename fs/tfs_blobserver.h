@@ -0,0 +1,96 @@
+#ifndef TFS_BLOBSERVER_H_
+#define TFS_BLOBSERVER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "fs/tfs_blobproto.h"
+#include "fs/tfs_coldstore.h"
+#include "fs/tfs_layout.h"
+#include "util/eventloop.h"
+#include "util/logging.h"
+
+namespace TestFS {
+
+// Serves the blobs in this node's datadir to other TestFS mounts.
+//
+// One EventLoop thread owns every connection and only parses frames and
+// sends responses. The disk I/O of a request is done by a pool of worker
+// threads with plain syscalls against the datadir; the worker hands the
+// response, with any read data, back to the loop, which writes it out in
+// one writev. A slow read thus holds up one worker, not every client.
+// Responses carry no request id, so a client keeps one request outstanding
+// per connection, as BlobClient does.
+class BlobServer : public ConnectionHandler {
+public:
+	// Only connections that answer the challenge with secret, the
+	// blob_secret every node shares, are served.
+	BlobServer(DatadirLayout* layout, const std::string &secret,
+			Logging* logs);
+
+	~BlobServer();
+
+	// Listens on address (an IPv4 address of this node) and port;
+	// returns the bound port or -1. workers threads do the disk I/O.
+	int Start(const std::string &address, unsigned short port, int workers);
+
+	void Stop();
+
+	// Lets other nodes thaw the inodes this node's MetaTiering froze.
+	void SetColdStore(ColdStore* store);
+
+	void OnAccept(Connection* conn);
+
+	void OnMessage(Connection* conn, const char* data, uint32_t len);
+
+	void OnClose(Connection* conn);
+
+private:
+	// A connection's challenge, until it is answered, and its requests
+	// still with the workers. Freed by whichever of OnClose and the last
+	// Reply comes later.
+	struct Peer {
+		uint8_t nonce[BLOB_NONCE_SIZE];
+		bool authenticated;
+		Connection* conn;
+		size_t pending;
+		bool closed;
+	};
+
+	// A request on its way through a worker and back to the loop.
+	struct Job {
+		Peer* peer;
+		blob_request_header req;
+		std::string data;     // payload of a write
+		blob_response_header resp;
+		std::string out;      // read data
+	};
+
+	static void* LoopMain(void* arg);
+
+	static void* WorkerMain(void* arg);
+
+	// Runs on the loop: sends a finished job's response.
+	static void Reply(void* arg);
+
+	void Handle(Job* job);
+
+	DatadirLayout* layout;
+	std::string secret;
+	ColdStore* cold;
+	Logging* logs;
+	EventLoop* loop;
+	pthread_t thread;
+	bool running;
+	std::vector<pthread_t> workers;
+	std::deque<Job*> queue;
+	bool stopping;
+	pthread_mutex_t mutex;   // queue and stopping
+	pthread_cond_t cond;
+};
+
+}
+
+#endif
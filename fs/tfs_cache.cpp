@@ -0,0 +1,91 @@
+#include "fs/tfs_cache.h"
+#include <time.h>
+
+namespace TestFS {
+
+MetaCache::MetaCache(size_t capacity, uint64_t lease_ms) :
+		capacity(capacity), lease_ms(lease_ms) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+MetaCache::~MetaCache() {
+	pthread_mutex_destroy(&mutex);
+}
+
+uint64_t MetaCache::NowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void MetaCache::EraseLocked(
+		std::unordered_map<std::string, Entry>::iterator it) {
+	lru_list.erase(it->second.lru);
+	entries.erase(it);
+}
+
+bool MetaCache::Get(const std::string &key, std::string &value,
+		uint64_t *version) {
+	bool found = false;
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Entry>::iterator it = entries.find(key);
+	if (it != entries.end()) {
+		if (it->second.expire_ms > NowMs()) {
+			value = it->second.value;
+			if (version != NULL) {
+				*version = it->second.version;
+			}
+			lru_list.splice(lru_list.begin(), lru_list, it->second.lru);
+			found = true;
+		} else {
+			EraseLocked(it);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return found;
+}
+
+void MetaCache::Put(const std::string &key, const std::string &value,
+		uint64_t version, const std::string &path) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Entry>::iterator it = entries.find(key);
+	if (it != entries.end()) {
+		EraseLocked(it);
+	}
+	while (entries.size() >= capacity && !lru_list.empty()) {
+		EraseLocked(entries.find(lru_list.back()));
+	}
+	lru_list.push_front(key);
+	Entry &entry = entries[key];
+	entry.value = value;
+	entry.path = path;
+	entry.version = version;
+	entry.expire_ms = NowMs() + lease_ms;
+	entry.lru = lru_list.begin();
+	pthread_mutex_unlock(&mutex);
+}
+
+void MetaCache::Erase(const std::string &key) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Entry>::iterator it = entries.find(key);
+	if (it != entries.end()) {
+		EraseLocked(it);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool MetaCache::Invalidate(const std::string &key, uint64_t version,
+		std::string &path) {
+	bool dropped = false;
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Entry>::iterator it = entries.find(key);
+	if (it != entries.end() && it->second.version < version) {
+		path = it->second.path;
+		EraseLocked(it);
+		dropped = true;
+	}
+	pthread_mutex_unlock(&mutex);
+	return dropped;
+}
+
+}
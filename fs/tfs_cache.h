@@ -0,0 +1,61 @@
+#ifndef TFS_CACHE_H_
+#define TFS_CACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace TestFS {
+
+// Client-side cache of metatable objects keyed by primary meta key.
+// Every entry carries a lease: once it expires the entry is refetched, so a
+// lost invalidation can leave an entry stale for at most lease_ms.
+class MetaCache {
+public:
+	MetaCache(size_t capacity, uint64_t lease_ms);
+
+	~MetaCache();
+
+	// Sets *version, if given, to the version value was cached at.
+	bool Get(const std::string &key, std::string &value,
+			uint64_t *version = NULL);
+
+	void Put(const std::string &key, const std::string &value,
+			uint64_t version, const std::string &path);
+
+	void Erase(const std::string &key);
+
+	// Drops key unless the cached copy is already at least version.
+	// Returns true (and the path it was cached under) if an entry was dropped.
+	bool Invalidate(const std::string &key, uint64_t version,
+			std::string &path);
+
+	uint64_t LeaseMs() const {
+		return lease_ms;
+	}
+
+private:
+	struct Entry {
+		std::string value;
+		std::string path;
+		uint64_t version;
+		uint64_t expire_ms;
+		std::list<std::string>::iterator lru;
+	};
+
+	static uint64_t NowMs();
+
+	void EraseLocked(std::unordered_map<std::string, Entry>::iterator it);
+
+	size_t capacity;
+	uint64_t lease_ms;
+	std::unordered_map<std::string, Entry> entries;
+	std::list<std::string> lru_list;
+	pthread_mutex_t mutex;
+};
+
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include "fs/tfs_chunkstore.h"
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include "ClientException.h"
+#include "util/monitor.h"
+
+namespace TestFS {
+
+ChunkStore::ChunkStore(RAMCloud::RamCloud* cluster, uint64_t tableid,
+		uint32_t chunk_size) :
+		cluster(cluster), tableid(tableid), chunk_size(chunk_size) {
+}
+
+std::string ChunkStore::ChunkKey(tfs_inode_t inode, uint64_t index) {
+	char key[48];
+	int len = sprintf(key, "%024lu%012lu", (unsigned long) inode,
+			(unsigned long) index);
+	return std::string(key, len);
+}
+
+int ChunkStore::ReadChunks(tfs_inode_t inode, uint64_t first, uint64_t count,
+		std::vector<std::string> &data) {
+	data.assign(count, std::string());
+	for (uint64_t base = 0; base < count; base += MAX_BATCH) {
+		size_t n = (count - base < MAX_BATCH) ? count - base : MAX_BATCH;
+		std::vector<std::string> keys(n);
+		RAMCloud::Tub<RAMCloud::ObjectBuffer>* values =
+				new RAMCloud::Tub<RAMCloud::ObjectBuffer>[n];
+		std::vector<RAMCloud::MultiReadObject> objects(n);
+		std::vector<RAMCloud::MultiReadObject*> requests(n);
+		for (size_t i = 0; i < n; ++i) {
+			keys[i] = ChunkKey(inode, first + base + i);
+			objects[i] = RAMCloud::MultiReadObject(tableid, keys[i].data(),
+					keys[i].size(), &values[i]);
+			requests[i] = &objects[i];
+		}
+		try {
+			cluster->multiRead(&requests[0], n);
+		} catch (RAMCloud::ClientException& e) {
+			delete[] values;
+			return -EIO;
+		}
+		uint64_t bytes = 0;
+		for (size_t i = 0; i < n; ++i) {
+			if (objects[i].status == RAMCloud::STATUS_OK) {
+				uint32_t len = 0;
+				const char* value =
+						static_cast<const char*>(values[i]->getValue(&len));
+				data[base + i].assign(value, len);
+				bytes += len;
+			}
+		}
+		Monitor::CountRpc(RPC_MULTIREAD, bytes);
+		delete[] values;
+	}
+	return 0;
+}
+
+int ChunkStore::Read(tfs_inode_t inode, off_t file_size, char* buf,
+		size_t size, off_t offset) {
+	if (offset >= file_size || size == 0) {
+		return 0;
+	}
+	if ((off_t) (offset + size) > file_size) {
+		size = file_size - offset;
+	}
+	uint64_t first = offset / chunk_size;
+	uint64_t last = (offset + size - 1) / chunk_size;
+	std::vector<std::string> chunks;
+	int ret = ReadChunks(inode, first, last - first + 1, chunks);
+	if (ret < 0) {
+		return ret;
+	}
+	size_t done = 0;
+	for (uint64_t i = first; i <= last; ++i) {
+		const std::string &chunk = chunks[i - first];
+		size_t skip = (i == first) ? offset - first * chunk_size : 0;
+		size_t n = chunk_size - skip;
+		if (n > size - done) {
+			n = size - done;
+		}
+		// bytes past the end of a short or missing chunk are a hole
+		size_t have = (chunk.size() > skip) ? chunk.size() - skip : 0;
+		if (have > n) {
+			have = n;
+		}
+		memcpy(buf + done, chunk.data() + skip, have);
+		memset(buf + done + have, 0, n - have);
+		done += n;
+	}
+	return done;
+}
+
+int ChunkStore::Write(tfs_inode_t inode, const char* buf, size_t size,
+		off_t offset) {
+	if (size == 0) {
+		return 0;
+	}
+	uint64_t first = offset / chunk_size;
+	uint64_t last = (offset + size - 1) / chunk_size;
+	uint64_t count = last - first + 1;
+	size_t head = offset - first * chunk_size;
+	size_t tail = (offset + size) - last * chunk_size;
+
+	// only partially covered end chunks need their old contents
+	std::vector<std::string> chunks(count);
+	if (head > 0 || tail < chunk_size) {
+		std::vector<std::string> old;
+		if (head > 0 || count == 1) {
+			if (ReadChunks(inode, first, 1, old) < 0) {
+				return -EIO;
+			}
+			chunks[0].swap(old[0]);
+		}
+		if (tail < chunk_size && count > 1) {
+			if (ReadChunks(inode, last, 1, old) < 0) {
+				return -EIO;
+			}
+			chunks[count - 1].swap(old[0]);
+		}
+	}
+
+	size_t done = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		std::string &chunk = chunks[i];
+		size_t skip = (i == 0) ? head : 0;
+		size_t n = chunk_size - skip;
+		if (n > size - done) {
+			n = size - done;
+		}
+		if (chunk.size() < skip + n) {
+			chunk.resize(skip + n);
+		}
+		chunk.replace(skip, n, buf + done, n);
+		done += n;
+	}
+
+	for (uint64_t base = 0; base < count; base += MAX_BATCH) {
+		size_t n = (count - base < MAX_BATCH) ? count - base : MAX_BATCH;
+		std::vector<std::string> keys(n);
+		std::vector<RAMCloud::MultiWriteObject> objects(n);
+		std::vector<RAMCloud::MultiWriteObject*> requests(n);
+		uint64_t bytes = 0;
+		for (size_t i = 0; i < n; ++i) {
+			const std::string &chunk = chunks[base + i];
+			keys[i] = ChunkKey(inode, first + base + i);
+			objects[i] = RAMCloud::MultiWriteObject(tableid, keys[i].data(),
+					keys[i].size(), chunk.data(), chunk.size());
+			requests[i] = &objects[i];
+			bytes += chunk.size();
+		}
+		try {
+			cluster->multiWrite(&requests[0], n);
+		} catch (RAMCloud::ClientException& e) {
+			return -EIO;
+		}
+		Monitor::CountRpc(RPC_MULTIWRITE, bytes);
+		for (size_t i = 0; i < n; ++i) {
+			if (objects[i].status != RAMCloud::STATUS_OK) {
+				return -EIO;
+			}
+		}
+	}
+	return size;
+}
+
+int ChunkStore::RemoveChunks(tfs_inode_t inode, uint64_t first,
+		uint64_t last) {
+	for (uint64_t base = first; base < last; base += MAX_BATCH) {
+		size_t n = (last - base < MAX_BATCH) ? last - base : MAX_BATCH;
+		std::vector<std::string> keys(n);
+		std::vector<RAMCloud::MultiRemoveObject> objects(n);
+		std::vector<RAMCloud::MultiRemoveObject*> requests(n);
+		for (size_t i = 0; i < n; ++i) {
+			keys[i] = ChunkKey(inode, base + i);
+			objects[i] = RAMCloud::MultiRemoveObject(tableid, keys[i].data(),
+					keys[i].size());
+			requests[i] = &objects[i];
+		}
+		try {
+			cluster->multiRemove(&requests[0], n);
+		} catch (RAMCloud::ClientException& e) {
+			return -EIO;
+		}
+		Monitor::CountRpc(RPC_MULTIREMOVE, 0);
+	}
+	return 0;
+}
+
+int ChunkStore::Truncate(tfs_inode_t inode, off_t old_size, off_t new_size) {
+	if (new_size >= old_size) {
+		// growing only extends the hole past the last chunk
+		return 0;
+	}
+	uint64_t keep = (new_size + chunk_size - 1) / chunk_size;
+	uint64_t end = (old_size + chunk_size - 1) / chunk_size;
+	size_t tail = new_size - (keep > 0 ? (keep - 1) * chunk_size : 0);
+	if (keep > 0 && tail < chunk_size) {
+		std::vector<std::string> old;
+		if (ReadChunks(inode, keep - 1, 1, old) < 0) {
+			return -EIO;
+		}
+		if (old[0].size() > tail) {
+			old[0].resize(tail);
+			std::string key = ChunkKey(inode, keep - 1);
+			try {
+				cluster->write(tableid, key.data(), key.size(), old[0].data(),
+						old[0].size());
+			} catch (RAMCloud::ClientException& e) {
+				return -EIO;
+			}
+			Monitor::CountRpc(RPC_WRITE, old[0].size());
+		}
+	}
+	return RemoveChunks(inode, keep, end);
+}
+
+int ChunkStore::Remove(tfs_inode_t inode, off_t file_size) {
+	return RemoveChunks(inode, 0, (file_size + chunk_size - 1) / chunk_size);
+}
+
+}
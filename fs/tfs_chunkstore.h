@@ -0,0 +1,61 @@
+#ifndef TFS_CHUNKSTORE_H_
+#define TFS_CHUNKSTORE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "fs/tfs_inode.h"
+#include "RamCloud.h"
+
+namespace TestFS {
+
+// File data above the inline threshold, kept as fixed-size objects in a
+// RAMCloud data table instead of a datadir file, so it survives the loss of
+// the node that wrote it.
+//
+// Chunk i of an inode covers bytes [i * chunk_size, (i + 1) * chunk_size)
+// and is keyed by ChunkKey(inode, i). A chunk holds only the bytes up to the
+// last one written, and missing chunks read as zeros, so sparse files cost
+// nothing. Every operation touches all its chunks with one multiRead /
+// multiWrite / multiRemove per batch.
+//
+// Calls return a byte count or 0 on success, a negative errno on failure.
+class ChunkStore {
+public:
+	ChunkStore(RAMCloud::RamCloud* cluster, uint64_t tableid,
+			uint32_t chunk_size);
+
+	uint32_t ChunkSize() const {
+		return chunk_size;
+	}
+
+	static std::string ChunkKey(tfs_inode_t inode, uint64_t index);
+
+	// file_size bounds the read; the caller knows it from the inode header.
+	int Read(tfs_inode_t inode, off_t file_size, char* buf, size_t size,
+			off_t offset);
+
+	int Write(tfs_inode_t inode, const char* buf, size_t size, off_t offset);
+
+	int Truncate(tfs_inode_t inode, off_t old_size, off_t new_size);
+
+	int Remove(tfs_inode_t inode, off_t file_size);
+
+private:
+	static const size_t MAX_BATCH = 256;
+
+	// Reads chunks [first, first + count) into data; missing chunks are
+	// left empty.
+	int ReadChunks(tfs_inode_t inode, uint64_t first, uint64_t count,
+			std::vector<std::string> &data);
+
+	int RemoveChunks(tfs_inode_t inode, uint64_t first, uint64_t last);
+
+	RAMCloud::RamCloud* cluster;
+	uint64_t tableid;
+	uint32_t chunk_size;
+};
+
+}
+
+#endif
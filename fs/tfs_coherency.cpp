@@ -0,0 +1,112 @@
+#include "fs/tfs_coherency.h"
+#include <endian.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "fs/tfs_rcdb.h"
+#include "util/logging.h"
+
+namespace TestFS {
+
+CoherencyChannel::CoherencyChannel(const std::string &group,
+		unsigned short port, MetaCache* cache, KernelNotifier* notifier) :
+		group(group), port(port), cache(cache), notifier(notifier),
+		sender(NULL), receiver(NULL), running(false),
+		num_sent(0), num_received(0), num_applied(0) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	sender_id = (getpid() << 16) ^ gethostid() ^ tv.tv_usec;
+}
+
+CoherencyChannel::~CoherencyChannel() {
+	Stop();
+	delete sender;
+	delete receiver;
+}
+
+void CoherencyChannel::Start() {
+	try {
+		sender = new UDPSocket();
+		sender->setMulticastTTL(1);
+		receiver = new UDPSocket(port);
+		receiver->joinGroup(group);
+	} catch (SocketException &e) {
+		Logging::Default()->LogMsg("Coherency channel disabled: %s\n",
+				e.what());
+		return;
+	}
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	pthread_create(&thread, NULL, ReceiverMain, this);
+}
+
+void CoherencyChannel::Stop() {
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	// wake the receiver out of recvFrom
+	tfs_inval_msg msg = tfs_inval_msg();
+	try {
+		sender->sendTo(&msg, sizeof(msg), group, port);
+	} catch (SocketException &e) {
+	}
+	pthread_join(thread, NULL);
+}
+
+void CoherencyChannel::Publish(const RAMCloud::KeyInfo &key,
+		uint64_t version) {
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	tfs_inode_t parent_id;
+	tfs_hash_t name_hash;
+	ParseMetaKey(key, parent_id, name_hash);
+	tfs_inval_msg msg;
+	msg.magic = htobe32(TFS_INVAL_MAGIC);
+	msg.sender = htobe32(sender_id);
+	msg.parent_id = htobe64(parent_id);
+	msg.name_hash = htobe64(name_hash);
+	msg.version = htobe64(version);
+	try {
+		sender->sendTo(&msg, sizeof(msg), group, port);
+		__atomic_fetch_add(&num_sent, 1, __ATOMIC_RELAXED);
+	} catch (SocketException &e) {
+		// a lost message is covered by the cache lease
+	}
+}
+
+void CoherencyChannel::Apply(const tfs_inval_msg &msg) {
+	std::string key = MetaKeyString(be64toh(msg.parent_id),
+			be64toh(msg.name_hash));
+	std::string path;
+	if (cache != NULL && cache->Invalidate(key, be64toh(msg.version), path)) {
+		__atomic_fetch_add(&num_applied, 1, __ATOMIC_RELAXED);
+		if (notifier != NULL) {
+			notifier->InvalidateEntry(path);
+		}
+	}
+}
+
+void* CoherencyChannel::ReceiverMain(void* arg) {
+	CoherencyChannel* self = reinterpret_cast<CoherencyChannel*>(arg);
+	tfs_inval_msg msg;
+	std::string source_addr;
+	unsigned short source_port;
+	while (__atomic_load_n(&self->running, __ATOMIC_ACQUIRE)) {
+		int len;
+		try {
+			len = self->receiver->recvFrom(&msg, sizeof(msg), source_addr,
+					source_port);
+		} catch (SocketException &e) {
+			continue;
+		}
+		if (len != sizeof(msg) || be32toh(msg.magic) != TFS_INVAL_MAGIC
+				|| be32toh(msg.sender) == self->sender_id) {
+			continue;
+		}
+		__atomic_fetch_add(&self->num_received, 1, __ATOMIC_RELAXED);
+		self->Apply(msg);
+	}
+	return NULL;
+}
+
+}
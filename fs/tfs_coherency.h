@@ -0,0 +1,72 @@
+#ifndef TFS_COHERENCY_H_
+#define TFS_COHERENCY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include "fs/tfs_cache.h"
+#include "fs/tfs_inode.h"
+#include "fs/tfs_notify.h"
+#include "util/socket.h"
+
+namespace TestFS {
+
+static const uint32_t TFS_INVAL_MAGIC = 0x54465349;  // "TFSI"
+
+// Wire format of an invalidation, all fields in network byte order.
+struct tfs_inval_msg {
+	uint32_t magic;
+	uint32_t sender;
+	uint64_t parent_id;
+	uint64_t name_hash;
+	uint64_t version;
+} __attribute__((packed));
+
+// Broadcasts metatable mutations of this mount to every mount sharing the
+// metatable over UDP multicast, and applies theirs to the local MetaCache
+// and kernel cache. Delivery is best effort; the cache lease bounds how long
+// a lost message can leave an entry stale.
+class CoherencyChannel {
+public:
+	CoherencyChannel(const std::string &group, unsigned short port,
+			MetaCache* cache, KernelNotifier* notifier);
+
+	~CoherencyChannel();
+
+	void Start();
+
+	void Stop();
+
+	void Publish(const RAMCloud::KeyInfo &key, uint64_t version);
+
+	uint64_t NumSent() const {
+		return __atomic_load_n(&num_sent, __ATOMIC_RELAXED);
+	}
+
+	uint64_t NumApplied() const {
+		return __atomic_load_n(&num_applied, __ATOMIC_RELAXED);
+	}
+
+private:
+	static void* ReceiverMain(void* arg);
+
+	void Apply(const tfs_inval_msg &msg);
+
+	std::string group;
+	unsigned short port;
+	MetaCache* cache;
+	KernelNotifier* notifier;
+	UDPSocket* sender;
+	UDPSocket* receiver;
+	uint32_t sender_id;
+	pthread_t thread;
+	// shared by the receiver and the FUSE threads; __atomic only
+	bool running;
+	uint64_t num_sent;
+	uint64_t num_received;
+	uint64_t num_applied;
+};
+
+}
+
+#endif
@@ -0,0 +1,273 @@
+#include "fs/tfs_coldstore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "util/myhash.h"
+
+namespace TestFS {
+
+ColdStore::ColdStore(const std::string &dir, Logging* logs) :
+		dir(dir), logs(logs), active(0), active_fd(-1), active_size(0),
+		dirty(false), num_appended(0), bytes_appended(0), num_read(0),
+		num_bad(0), num_removed(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ColdStore::~ColdStore() {
+	for (std::map<uint32_t, int>::iterator it = fds.begin(); it != fds.end();
+			++it) {
+		if (it->second >= 0) {
+			close(it->second);
+		}
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+std::string ColdStore::SegmentPath(uint32_t segment) const {
+	char name[32];
+	snprintf(name, sizeof(name), "/%08x.log", segment);
+	return dir + name;
+}
+
+int ColdStore::Open() {
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		return -errno;
+	}
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL) {
+		return -errno;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL) {
+		char* end;
+		unsigned long segment = strtoul(entry->d_name, &end, 16);
+		if (end != entry->d_name && strcmp(end, ".log") == 0) {
+			fds[segment] = -1;
+			if (segment + 1 > active) {
+				active = segment + 1;
+			}
+		}
+	}
+	closedir(d);
+	pthread_mutex_lock(&mutex);
+	int ret = Roll();
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+int ColdStore::Roll() {
+	if (active_fd >= 0) {
+		if (dirty && fdatasync(active_fd) != 0) {
+			return -errno;
+		}
+		dirty = false;
+		++active;
+	}
+	std::string path = SegmentPath(active);
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	active_fd = fd;
+	active_size = 0;
+	fds[active] = fd;
+	return 0;
+}
+
+int ColdStore::SegmentFd(uint32_t segment) {
+	std::map<uint32_t, int>::iterator it = fds.find(segment);
+	if (it == fds.end()) {
+		return -ENOENT;
+	}
+	if (it->second < 0) {
+		int fd = open(SegmentPath(segment).c_str(), O_RDONLY);
+		if (fd < 0) {
+			return -errno;
+		}
+		it->second = fd;
+	}
+	return it->second;
+}
+
+int ColdStore::Append(const std::string &key, const char* value, size_t size,
+		ColdLocation &loc) {
+	std::string rec(RECORD_HEADER, '\0');
+	rec.append(key);
+	rec.append(value, size);
+	uint32_t header[4];
+	header[0] = MAGIC;
+	header[1] = crc32(rec.data() + RECORD_HEADER, rec.size() - RECORD_HEADER);
+	header[2] = key.size();
+	header[3] = size;
+	memcpy(&rec[0], header, RECORD_HEADER);
+
+	pthread_mutex_lock(&mutex);
+	int ret = 0;
+	if (active_size > 0 && active_size + rec.size() > SEGMENT_BYTES) {
+		ret = Roll();
+	}
+	if (ret == 0) {
+		ssize_t n = pwrite(active_fd, rec.data(), rec.size(), active_size);
+		if (n != (ssize_t) rec.size()) {
+			ret = (n < 0) ? -errno : -EIO;
+		}
+	}
+	if (ret == 0) {
+		loc.segment = active;
+		loc.offset = active_size;
+		loc.length = rec.size();
+		active_size += rec.size();
+		dirty = true;
+		++num_appended;
+		bytes_appended += rec.size();
+	}
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+int ColdStore::Sync() {
+	pthread_mutex_lock(&mutex);
+	int fd = dirty ? active_fd : -1;
+	dirty = false;
+	pthread_mutex_unlock(&mutex);
+	// only the tiering thread appends, so the segment cannot roll here
+	if (fd >= 0 && fdatasync(fd) != 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+bool ColdStore::Parse(const char* rec, size_t size, std::string &key,
+		std::string &value) {
+	if (size < RECORD_HEADER) {
+		return false;
+	}
+	uint32_t header[4];
+	memcpy(header, rec, RECORD_HEADER);
+	if (header[0] != MAGIC
+			|| (uint64_t) header[2] + header[3] + RECORD_HEADER != size
+			|| crc32(rec + RECORD_HEADER, size - RECORD_HEADER) != header[1]) {
+		return false;
+	}
+	key.assign(rec + RECORD_HEADER, header[2]);
+	value.assign(rec + RECORD_HEADER + header[2], header[3]);
+	return true;
+}
+
+int ColdStore::ReadRaw(const ColdLocation &loc, char* buf) {
+	pthread_mutex_lock(&mutex);
+	int fd = SegmentFd(loc.segment);
+	pthread_mutex_unlock(&mutex);
+	if (fd < 0) {
+		return fd;
+	}
+	ssize_t n = pread(fd, buf, loc.length, loc.offset);
+	if (n < 0) {
+		return -errno;
+	}
+	return (n == (ssize_t) loc.length) ? n : -EIO;
+}
+
+int ColdStore::Read(const ColdLocation &loc, std::string &key,
+		std::string &value) {
+	std::string rec(loc.length, '\0');
+	int ret = ReadRaw(loc, &rec[0]);
+	bool ok = (ret >= 0) && Parse(rec.data(), rec.size(), key, value);
+	pthread_mutex_lock(&mutex);
+	if (ok) {
+		++num_read;
+	} else {
+		++num_bad;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!ok) {
+		logs->LogMsg("ColdStore: bad record %x:%lu\n", loc.segment,
+				(unsigned long) loc.offset);
+		return (ret < 0) ? ret : -EIO;
+	}
+	return 0;
+}
+
+void ColdStore::SealedSegments(std::vector<uint32_t> &out) {
+	pthread_mutex_lock(&mutex);
+	for (std::map<uint32_t, int>::iterator it = fds.begin(); it != fds.end();
+			++it) {
+		if (it->first != active) {
+			out.push_back(it->first);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+int ColdStore::Scan(uint32_t segment, ScanFn fn, void* arg) {
+	pthread_mutex_lock(&mutex);
+	int fd = SegmentFd(segment);
+	pthread_mutex_unlock(&mutex);
+	if (fd < 0) {
+		return fd;
+	}
+	ColdLocation loc;
+	loc.segment = segment;
+	loc.offset = 0;
+	uint32_t header[4];
+	for (;;) {
+		ssize_t n = pread(fd, header, RECORD_HEADER, loc.offset);
+		if (n == 0) {
+			return 0;
+		}
+		if (n != (ssize_t) RECORD_HEADER || header[0] != MAGIC) {
+			// whatever follows cannot be found
+			return -EIO;
+		}
+		std::string key(header[2], '\0');
+		if (pread(fd, &key[0], key.size(), loc.offset + RECORD_HEADER)
+				!= (ssize_t) key.size()) {
+			return -EIO;
+		}
+		loc.length = RECORD_HEADER + header[2] + header[3];
+		if (!fn(arg, loc, key)) {
+			return -EAGAIN;
+		}
+		loc.offset += loc.length;
+	}
+}
+
+int ColdStore::RemoveSegment(uint32_t segment) {
+	pthread_mutex_lock(&mutex);
+	int ret = 0;
+	std::map<uint32_t, int>::iterator it = fds.find(segment);
+	if (segment == active || it == fds.end()) {
+		ret = -EBUSY;
+	} else {
+		if (it->second >= 0) {
+			close(it->second);
+		}
+		fds.erase(it);
+		if (unlink(SegmentPath(segment).c_str()) != 0) {
+			ret = -errno;
+		}
+		++num_removed;
+	}
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void ColdStore::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%lu segments, %lu records (%lu bytes) appended, %lu read, "
+			"%lu bad, %lu segments removed\n",
+			(unsigned long) fds.size(), (unsigned long) num_appended,
+			(unsigned long) bytes_appended, (unsigned long) num_read,
+			(unsigned long) num_bad, (unsigned long) num_removed);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
@@ -0,0 +1,105 @@
+#ifndef TFS_COLDSTORE_H_
+#define TFS_COLDSTORE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "util/logging.h"
+
+namespace TestFS {
+
+struct ColdLocation {
+	uint32_t segment;
+	uint64_t offset;
+	uint32_t length;    // the whole record, header included
+};
+
+// Log-structured store for inode objects that MetaTiering moved out of
+// RAMCloud, kept on local SSD under dir.
+//
+// Records are appended to the active segment, dir/<segment>.log in hex,
+// which is sealed at SEGMENT_BYTES; every mount starts a new one, so a
+// torn tail is never appended to. A record is a 16-byte header (magic,
+// crc32 of key and value, key and value lengths), the meta key and the
+// stored inode value. The store keeps no index: the stub in RAMCloud
+// holds the location, and a record is live only while the stub of its
+// key still points to it. MetaTiering's cleaner uses Scan() to find the
+// live records of sealed segments.
+//
+// Calls return 0 or a byte count on success, a negative errno on failure.
+class ColdStore {
+public:
+	static const uint64_t SEGMENT_BYTES = 64ULL << 20;
+	static const size_t RECORD_HEADER = 16;
+
+	typedef bool (*ScanFn)(void* arg, const ColdLocation &loc,
+			const std::string &key);
+
+	ColdStore(const std::string &dir, Logging* logs);
+
+	~ColdStore();
+
+	int Open();
+
+	int Append(const std::string &key, const char* value, size_t size,
+			ColdLocation &loc);
+
+	// Makes the records appended so far durable; call it before any stub
+	// points to them.
+	int Sync();
+
+	// Reads and checks the record at loc.
+	int Read(const ColdLocation &loc, std::string &key, std::string &value);
+
+	// Reads the raw bytes of a record, for a remote node to Parse().
+	int ReadRaw(const ColdLocation &loc, char* buf);
+
+	// Splits a raw record; false if it is damaged.
+	static bool Parse(const char* rec, size_t size, std::string &key,
+			std::string &value);
+
+	// Segments that are no longer appended to, oldest first.
+	void SealedSegments(std::vector<uint32_t> &out);
+
+	// Calls fn with every record of segment until it returns false.
+	// Returns 0 only if every record up to the end of the file was seen:
+	// -EAGAIN if fn stopped the scan, -EIO if a record could not be read.
+	int Scan(uint32_t segment, ScanFn fn, void* arg);
+
+	int RemoveSegment(uint32_t segment);
+
+	void Report(std::string &out);
+
+private:
+	static const uint32_t MAGIC = 0x444c4f43;  // "COLD"
+
+	std::string SegmentPath(uint32_t segment) const;
+
+	// Returns a descriptor for reading segment; mutex held.
+	int SegmentFd(uint32_t segment);
+
+	// Seals the active segment and starts the next one; mutex held.
+	int Roll();
+
+	std::string dir;
+	Logging* logs;
+
+	pthread_mutex_t mutex;
+	std::map<uint32_t, int> fds;    // every segment, the active one too
+	uint32_t active;
+	int active_fd;
+	uint64_t active_size;
+	bool dirty;
+
+	uint64_t num_appended;
+	uint64_t bytes_appended;
+	uint64_t num_read;
+	uint64_t num_bad;
+	uint64_t num_removed;
+};
+
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include "fs/tfs_compress.h"
+#include <time.h>
+#include <cstdio>
+#include "util/compress.h"
+
+namespace TestFS {
+
+static uint64_t ThreadCpuNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Re-assembles an inode value around new inline data.
+static void BuildValue(const char* value, const InodeHeader &header,
+		uint32_t inline_raw_size, const char* data, size_t size,
+		std::string &out) {
+	tfs_inode_header new_header = *header;
+	new_header.inline_raw_size = inline_raw_size;
+	char encoded[TFS_INODE_MAX_ENCODED];
+	out.assign(encoded, EncodeInodeHeader(new_header, encoded));
+	out.append(value + header.NameOffset(), header->namelen + 1);
+	out.append(data, size);
+}
+
+InlineCompressor::InlineCompressor(bool enabled, size_t min_bytes,
+		uint32_t min_saving) :
+		enabled(enabled), min_bytes(min_bytes), min_saving(min_saving),
+		num_packed(0), num_small(0), num_incompressible(0), bytes_in(0),
+		bytes_out(0), pack_ns(0), num_unpacked(0), num_corrupt(0),
+		unpack_ns(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+InlineCompressor::~InlineCompressor() {
+	pthread_mutex_destroy(&mutex);
+}
+
+bool InlineCompressor::IsPacked(const char* value, size_t size) {
+	// cheap reject: only compact headers carry the flag
+	if (size == 0 || (uint8_t) value[0] != INODE_FORMAT_COMPACT) {
+		return false;
+	}
+	InodeHeader header(value, size);
+	return header.Valid() && header->inline_raw_size != 0;
+}
+
+bool InlineCompressor::Pack(const char* value, size_t size,
+		std::string &out) {
+	if (!enabled || !CompactInodes()) {
+		return false;
+	}
+	InodeHeader header(value, size);
+	if (!header.Valid() || header->has_blob != 0
+			|| header->inline_raw_size != 0) {
+		return false;
+	}
+	size_t raw_size = size - header.DataOffset();
+	if (raw_size == 0) {
+		return false;
+	}
+	if (raw_size < min_bytes) {
+		pthread_mutex_lock(&mutex);
+		++num_small;
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+	std::string block(raw_size - raw_size * min_saving / 100, '\0');
+	uint64_t start = ThreadCpuNanos();
+	size_t len = block.empty() ? 0 : LzCompress(value + header.DataOffset(),
+			raw_size, &block[0], block.size());
+	uint64_t cpu = ThreadCpuNanos() - start;
+	if (len > 0) {
+		BuildValue(value, header, raw_size, block.data(), len, out);
+	}
+	pthread_mutex_lock(&mutex);
+	pack_ns += cpu;
+	if (len > 0) {
+		++num_packed;
+		bytes_in += raw_size;
+		bytes_out += len;
+	} else {
+		++num_incompressible;
+	}
+	pthread_mutex_unlock(&mutex);
+	return len > 0;
+}
+
+bool InlineCompressor::Unpack(std::string &value) {
+	if (!IsPacked(value.data(), value.size())) {
+		return true;
+	}
+	InodeHeader header(value.data(), value.size());
+	std::string raw(header->inline_raw_size, '\0');
+	uint64_t start = ThreadCpuNanos();
+	bool ok = LzDecompress(value.data() + header.DataOffset(),
+			value.size() - header.DataOffset(), &raw[0], raw.size());
+	uint64_t cpu = ThreadCpuNanos() - start;
+	pthread_mutex_lock(&mutex);
+	unpack_ns += cpu;
+	if (ok) {
+		++num_unpacked;
+	} else {
+		++num_corrupt;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!ok) {
+		return false;
+	}
+	std::string plain;
+	BuildValue(value.data(), header, 0, raw.data(), raw.size(), plain);
+	value.swap(plain);
+	return true;
+}
+
+void InlineCompressor::Report(std::string &out) {
+	char line[512];
+	pthread_mutex_lock(&mutex);
+	uint64_t saved = bytes_in - bytes_out;
+	snprintf(line, sizeof(line),
+			"%s, %lu values compressed, %lu too small, %lu incompressible, "
+			"%lu -> %lu bytes (%lu saved, %.1f%%), compress cpu %.3f ms "
+			"(%.1f bytes saved per us), %lu values expanded in %.3f ms cpu, "
+			"%lu corrupt\n",
+			enabled ? "on" : "off", (unsigned long) num_packed,
+			(unsigned long) num_small, (unsigned long) num_incompressible,
+			(unsigned long) bytes_in, (unsigned long) bytes_out,
+			(unsigned long) saved,
+			bytes_in > 0 ? 100.0 * saved / bytes_in : 0.0, pack_ns / 1e6,
+			pack_ns > 0 ? saved * 1e3 / pack_ns : 0.0,
+			(unsigned long) num_unpacked, unpack_ns / 1e6,
+			(unsigned long) num_corrupt);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
@@ -0,0 +1,60 @@
+#ifndef TFS_COMPRESS_H_
+#define TFS_COMPRESS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include "fs/tfs_inode.h"
+
+namespace TestFS {
+
+// Compresses the inline data of inode values on their way to the metadata
+// table and expands it on the way back, so everything above tfs_rcdb only
+// sees plain values.
+//
+// A compressed value keeps its header and name as they are; the header's
+// inline_raw_size says the data after the name is an LzCompress block and
+// how long it expands to. Only compact headers carry that field, so values
+// are stored compressed only while compact inodes are on. Data shorter
+// than min_bytes, and data that does not shrink by min_saving percent, is
+// stored as is. Compressed values are always expanded, whether or not
+// compression is enabled, so it can be turned off at any time.
+class InlineCompressor {
+public:
+	InlineCompressor(bool enabled, size_t min_bytes, uint32_t min_saving);
+
+	~InlineCompressor();
+
+	// True if the encoded inode value holds compressed inline data.
+	static bool IsPacked(const char* value, size_t size);
+
+	// Builds the stored form of an encoded inode value into out. Returns
+	// false, leaving out alone, if the value is to be stored as is.
+	bool Pack(const char* value, size_t size, std::string &out);
+
+	// Expands value in place if it is compressed. Returns false if its
+	// compressed data is corrupt.
+	bool Unpack(std::string &value);
+
+	void Report(std::string &out);
+
+private:
+	bool enabled;
+	size_t min_bytes;
+	uint32_t min_saving;
+
+	pthread_mutex_t mutex;
+	uint64_t num_packed;
+	uint64_t num_small;
+	uint64_t num_incompressible;
+	uint64_t bytes_in;      // inline data of the packed values
+	uint64_t bytes_out;     // what it was stored as
+	uint64_t pack_ns;       // thread CPU time in LzCompress, failed tries too
+	uint64_t num_unpacked;
+	uint64_t num_corrupt;
+	uint64_t unpack_ns;
+};
+
+}
+
+#endif
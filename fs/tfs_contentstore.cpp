@@ -0,0 +1,211 @@
+#include "fs/tfs_contentstore.h"
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include "ClientException.h"
+#include "util/monitor.h"
+
+namespace TestFS {
+
+ContentStore::ContentStore(RAMCloud::RamCloud* cluster, uint64_t tableid) :
+		cluster(cluster), tableid(tableid), num_refs(0), num_hits(0),
+		num_unrefs(0), num_freed(0), num_conflicts(0), logical_bytes(0),
+		stored_bytes(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ContentStore::~ContentStore() {
+	pthread_mutex_destroy(&mutex);
+}
+
+static std::string HexKey(char prefix, const std::string &digest) {
+	char key[2 + 2 * ContentStore::DIGEST_SIZE];
+	key[0] = prefix;
+	for (size_t i = 0; i < digest.size() && i < ContentStore::DIGEST_SIZE; ++i) {
+		sprintf(key + 1 + 2 * i, "%02x", (uint8_t) digest[i]);
+	}
+	return std::string(key, 1 + 2 * ContentStore::DIGEST_SIZE);
+}
+
+std::string ContentStore::ObjectKey(const std::string &digest) {
+	return HexKey('c', digest);
+}
+
+std::string ContentStore::CountKey(const std::string &digest) {
+	return HexKey('r', digest);
+}
+
+bool ContentStore::Load(const std::string &key, std::string &data,
+		uint64_t &version) {
+	RAMCloud::Buffer buf;
+	try {
+		cluster->read(tableid, key.data(), key.size(), &buf, NULL, &version);
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
+		Monitor::CountRpc(RPC_READ, 0);
+		return false;
+	}
+	Monitor::CountRpc(RPC_READ, buf.size());
+	data.resize(buf.size());
+	if (!data.empty()) {
+		buf.copy(0, data.size(), &data[0]);
+	}
+	return true;
+}
+
+int ContentStore::Ref(const char* data, size_t size, std::string &digest) {
+	uint8_t raw[DIGEST_SIZE];
+	sha256(data, size, raw);
+	digest.assign(reinterpret_cast<const char*>(raw), DIGEST_SIZE);
+	std::string count_key = CountKey(digest);
+	std::string key = ObjectKey(digest);
+	int64_t refs = 0;
+	try {
+		Monitor::CountRpc(RPC_INCREMENT, sizeof(refs));
+		refs = cluster->incrementInt64(tableid, count_key.data(),
+				count_key.size(), 1);
+		if (refs == 1) {
+			// first reference, or one racing the last Unref: either way
+			// the payload must be there, and a rewrite changes its version
+			// so that Unref leaves it alone
+			Monitor::CountRpc(RPC_WRITE, size);
+			cluster->write(tableid, key.data(), key.size(), data, size);
+		} else {
+			// normally there already; a first Ref that failed after
+			// counting may have left none
+			RAMCloud::RejectRules rules;
+			memset(&rules, 0, sizeof(rules));
+			rules.exists = 1;
+			Monitor::CountRpc(RPC_WRITE, size);
+			try {
+				cluster->write(tableid, key.data(), key.size(), data, size,
+						&rules);
+			} catch (RAMCloud::RejectRulesException& e) {
+			}
+		}
+	} catch (RAMCloud::ClientException& e) {
+		if (refs > 0) {
+			// counted, but the payload may be missing: take it back
+			try {
+				Monitor::CountRpc(RPC_INCREMENT, sizeof(refs));
+				cluster->incrementInt64(tableid, count_key.data(),
+						count_key.size(), -1);
+			} catch (RAMCloud::ClientException& e) {
+			}
+		}
+		return -EIO;
+	}
+	pthread_mutex_lock(&mutex);
+	++num_refs;
+	logical_bytes += size;
+	if (refs > 1) {
+		++num_hits;
+	} else {
+		stored_bytes += size;
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int ContentStore::Unref(const std::string &digest) {
+	std::string count_key = CountKey(digest);
+	std::string key = ObjectKey(digest);
+	std::string data;
+	uint64_t version = 0, count_version = 0;
+	int64_t refs;
+	bool freed = false;
+	try {
+		// while we hold a reference nobody rewrites the payload, so this
+		// version is the one to remove
+		if (!Load(key, data, version)) {
+			return -ENOENT;
+		}
+		Monitor::CountRpc(RPC_INCREMENT, sizeof(refs));
+		refs = cluster->incrementInt64(tableid, count_key.data(),
+				count_key.size(), -1, NULL, &count_version);
+		if (refs < 0) {
+			// we held none; put the count back
+			cluster->incrementInt64(tableid, count_key.data(),
+					count_key.size(), 1);
+			return -ENOENT;
+		}
+		if (refs == 0) {
+			RAMCloud::RejectRules rules;
+			memset(&rules, 0, sizeof(rules));
+			rules.givenVersion = count_version;
+			rules.versionNeGiven = 1;
+			rules.doesntExist = 1;
+			Monitor::CountRpc(RPC_REMOVE, 0);
+			cluster->remove(tableid, count_key.data(), count_key.size(),
+					&rules);
+			rules.givenVersion = version;
+			Monitor::CountRpc(RPC_REMOVE, 0);
+			cluster->remove(tableid, key.data(), key.size(), &rules);
+			freed = true;
+		}
+	} catch (RAMCloud::RejectRulesException& e) {
+		// a Ref came in after our decrement and keeps the payload
+		pthread_mutex_lock(&mutex);
+		++num_conflicts;
+		pthread_mutex_unlock(&mutex);
+	} catch (RAMCloud::ClientException& e) {
+		return -EIO;
+	}
+	pthread_mutex_lock(&mutex);
+	++num_unrefs;
+	logical_bytes -= data.size();
+	if (freed) {
+		++num_freed;
+		stored_bytes -= data.size();
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int ContentStore::Get(const std::string &digest, std::string &data) {
+	uint64_t version = 0;
+	try {
+		if (!Load(ObjectKey(digest), data, version)) {
+			return -EIO;
+		}
+	} catch (RAMCloud::ClientException& e) {
+		return -EIO;
+	}
+	return 0;
+}
+
+int ContentStore::Read(const std::string &digest, char* buf, size_t size,
+		off_t offset) {
+	std::string data;
+	int ret = Get(digest, data);
+	if (ret < 0) {
+		return ret;
+	}
+	if (offset >= (off_t) data.size()) {
+		return 0;
+	}
+	if (size > data.size() - offset) {
+		size = data.size() - offset;
+	}
+	memcpy(buf, data.data() + offset, size);
+	return size;
+}
+
+void ContentStore::Report(std::string &out) {
+	char line[512];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%lu references (%lu to stored payloads), %lu released, "
+			"%lu payloads freed, %lu revived while freeing; net of this mount "
+			"%ld bytes referenced in %ld bytes stored, dedup ratio %.2f, "
+			"%ld bytes saved\n",
+			(unsigned long) num_refs, (unsigned long) num_hits,
+			(unsigned long) num_unrefs, (unsigned long) num_freed,
+			(unsigned long) num_conflicts, (long) logical_bytes,
+			(long) stored_bytes,
+			stored_bytes > 0 ? (double) logical_bytes / stored_bytes : 0.0,
+			(long) (logical_bytes - stored_bytes));
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
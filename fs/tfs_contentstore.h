@@ -0,0 +1,77 @@
+#ifndef TFS_CONTENTSTORE_H_
+#define TFS_CONTENTSTORE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include "util/sha256.h"
+#include "RamCloud.h"
+
+namespace TestFS {
+
+// Inline file data shared by content: one object per distinct payload in
+// a RAMCloud content table, keyed by the SHA-256 of the bytes, so
+// byte-identical small files are kept once.
+//
+// The payload object holds only the data; its reference count is a
+// separate 8-byte object changed with incrementInt64, so taking or
+// dropping a reference never rewrites the payload, and mounts sharing the
+// table never lose one. Whoever takes the count from 0 to 1 (re)writes
+// the payload; later references write it only if it does not exist, in
+// case an earlier one failed between counting and writing, and a Ref
+// that cannot write takes its count back. Whoever takes the count back
+// to 0 removes the count, then the payload, each conditional on the
+// version it saw, so a Ref racing the last Unref keeps its copy. Inodes
+// hold only the digest (BLOB_SHARED).
+//
+// Calls return 0 or a byte count on success, a negative errno on failure.
+class ContentStore {
+public:
+	static const size_t DIGEST_SIZE = SHA256_DIGEST_SIZE;
+
+	ContentStore(RAMCloud::RamCloud* cluster, uint64_t tableid);
+
+	~ContentStore();
+
+	// Adds a reference to the object holding data, creating it if it is
+	// new, and returns its digest.
+	int Ref(const char* data, size_t size, std::string &digest);
+
+	// Drops a reference; the last one removes the object.
+	int Unref(const std::string &digest);
+
+	// Reads the whole payload of digest into data.
+	int Get(const std::string &digest, std::string &data);
+
+	// Reads up to size bytes from offset of the payload.
+	int Read(const std::string &digest, char* buf, size_t size, off_t offset);
+
+	void Report(std::string &out);
+
+private:
+	// The payload and the reference count of digest.
+	static std::string ObjectKey(const std::string &digest);
+
+	static std::string CountKey(const std::string &digest);
+
+	// Reads the payload: false if it does not exist.
+	bool Load(const std::string &key, std::string &data, uint64_t &version);
+
+	RAMCloud::RamCloud* cluster;
+	uint64_t tableid;
+
+	pthread_mutex_t mutex;
+	uint64_t num_refs;
+	uint64_t num_hits;      // Ref() found the payload already stored
+	uint64_t num_unrefs;
+	uint64_t num_freed;
+	uint64_t num_conflicts; // a Ref revived a payload being freed
+	// what this mount referenced and what it actually stored, net of
+	// the unrefs and frees it did
+	int64_t logical_bytes;
+	int64_t stored_bytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,224 @@
+#include "fs/tfs_fdcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <cstdio>
+
+namespace TestFS {
+
+static const size_t FD_RESERVE = 64;
+static const size_t MIN_CAPACITY = 16;
+
+FdCache::FdCache(size_t capacity, int open_flags) :
+		capacity(capacity), open_flags(open_flags), close_hook(NULL),
+		close_arg(NULL), num_hits(0), num_opens(0), num_evictions(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+FdCache::~FdCache() {
+	for (std::unordered_map<int, Entry>::iterator it = fds.begin();
+			it != fds.end(); ++it) {
+		CloseLocked(it->first);
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+void FdCache::SetCloseHook(CloseFn fn, void* arg) {
+	pthread_mutex_lock(&mutex);
+	close_hook = fn;
+	close_arg = arg;
+	pthread_mutex_unlock(&mutex);
+}
+
+void FdCache::CloseLocked(int fd) {
+	if (close_hook != NULL) {
+		close_hook(close_arg, fd);
+	}
+	close(fd);
+}
+
+size_t FdCache::Capacity(size_t requested) {
+	size_t limit = MAX_OPEN_FILES;
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		size_t usable = (rl.rlim_cur > FD_RESERVE + MIN_CAPACITY)
+				? rl.rlim_cur - FD_RESERVE : MIN_CAPACITY;
+		if (usable < limit) {
+			limit = usable;
+		}
+	}
+	return (requested > 0 && requested < limit) ? requested : limit;
+}
+
+void FdCache::EvictLocked(size_t target) {
+	while (fds.size() > target && !idle_list.empty()) {
+		int fd = idle_list.back();
+		idle_list.pop_back();
+		by_inode.erase(fds[fd].inode);
+		fds.erase(fd);
+		CloseLocked(fd);
+		++num_evictions;
+	}
+}
+
+int FdCache::HitLocked(tfs_inode_t inode, bool write) {
+	std::unordered_map<tfs_inode_t, int>::iterator it = by_inode.find(inode);
+	if (it == by_inode.end()) {
+		return -1;
+	}
+	Entry &entry = fds[it->second];
+	if (write && !entry.writable) {
+		return -1;
+	}
+	if (entry.idle) {
+		idle_list.erase(entry.lru);
+		entry.idle = false;
+	}
+	++entry.refs;
+	return it->second;
+}
+
+int FdCache::Get(tfs_inode_t inode, const char* path, mode_t mode,
+		int flags) {
+	bool write = (flags & O_ACCMODE) != O_RDONLY;
+	int oflags = (write ? O_RDWR : O_RDONLY) | (flags & O_CREAT) | O_CLOEXEC
+			| open_flags;
+	pthread_mutex_lock(&mutex);
+	int fd = HitLocked(inode, write);
+	if (fd >= 0) {
+		++num_hits;
+		pthread_mutex_unlock(&mutex);
+		return fd;
+	}
+	// make room first, so a full cache does not push us over the rlimit
+	EvictLocked(capacity > 0 ? capacity - 1 : 0);
+	pthread_mutex_unlock(&mutex);
+
+	fd = open(path, oflags, mode);
+	if (fd < 0 && errno == EMFILE) {
+		pthread_mutex_lock(&mutex);
+		EvictLocked(0);
+		pthread_mutex_unlock(&mutex);
+		fd = open(path, oflags, mode);
+	}
+	if (fd < 0) {
+		return -errno;
+	}
+
+	pthread_mutex_lock(&mutex);
+	int theirs = HitLocked(inode, write);
+	if (theirs >= 0) {
+		// another thread opened it meanwhile; share theirs
+		close(fd);
+		fd = theirs;
+	} else {
+		std::unordered_map<tfs_inode_t, int>::iterator it = by_inode.find(inode);
+		if (it != by_inode.end()) {
+			// a read-only descriptor; its holders keep it until they put it
+			DetachLocked(it->second, true);
+		}
+		Entry &entry = fds[fd];
+		entry.inode = inode;
+		entry.refs = 1;
+		entry.writable = write;
+		entry.forgotten = false;
+		entry.replaced = false;
+		entry.idle = false;
+		by_inode[inode] = fd;
+		++num_opens;
+	}
+	pthread_mutex_unlock(&mutex);
+	return fd;
+}
+
+void FdCache::Put(int fd, CloseFn on_last, void* arg) {
+	if (fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<int, Entry>::iterator it = fds.find(fd);
+	if (it == fds.end()) {
+		pthread_mutex_unlock(&mutex);
+		close(fd);
+		return;
+	}
+	Entry &entry = it->second;
+	if (--entry.refs == 0) {
+		if (on_last != NULL) {
+			on_last(arg, fd);
+		}
+		if (entry.forgotten) {
+			if (entry.replaced && --replaced_held[entry.inode] == 0) {
+				replaced_held.erase(entry.inode);
+			}
+			fds.erase(it);
+			CloseLocked(fd);
+		} else {
+			idle_list.push_front(fd);
+			entry.lru = idle_list.begin();
+			entry.idle = true;
+			EvictLocked(capacity);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void FdCache::DetachLocked(int fd, bool replaced) {
+	Entry &entry = fds[fd];
+	by_inode.erase(entry.inode);
+	if (entry.refs == 0) {
+		idle_list.erase(entry.lru);
+		fds.erase(fd);
+		CloseLocked(fd);
+	} else {
+		entry.forgotten = true;
+		entry.replaced = replaced;
+		if (replaced) {
+			++replaced_held[entry.inode];
+		}
+	}
+}
+
+void FdCache::Forget(tfs_inode_t inode) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<tfs_inode_t, int>::iterator it = by_inode.find(inode);
+	if (it != by_inode.end()) {
+		DetachLocked(it->second, false);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool FdCache::InUse(tfs_inode_t inode) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<tfs_inode_t, int>::iterator it = by_inode.find(inode);
+	bool in_use = (it != by_inode.end() && fds[it->second].refs > 0)
+			|| replaced_held.count(inode) > 0;
+	pthread_mutex_unlock(&mutex);
+	return in_use;
+}
+
+int FdCache::Holders(tfs_inode_t inode) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<tfs_inode_t, int>::iterator it = by_inode.find(inode);
+	int holders = (it != by_inode.end()) ? fds[it->second].refs : 0;
+	std::unordered_map<tfs_inode_t, int>::iterator r = replaced_held.find(inode);
+	if (r != replaced_held.end()) {
+		holders += r->second;
+	}
+	pthread_mutex_unlock(&mutex);
+	return holders;
+}
+
+void FdCache::Report(std::string &out) {
+	char line[160];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%zu open (%zu idle) of %zu, %lu hits, %lu opens, %lu evictions\n",
+			fds.size(), idle_list.size(), capacity, (unsigned long) num_hits,
+			(unsigned long) num_opens, (unsigned long) num_evictions);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
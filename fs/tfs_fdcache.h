@@ -0,0 +1,101 @@
+#ifndef TFS_FDCACHE_H_
+#define TFS_FDCACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "fs/tfs_inode.h"
+
+namespace TestFS {
+
+// Process-wide cache of open datadir blob files, keyed by inode id.
+//
+// Every handle on an inode shares one descriptor (all blob I/O is
+// positional, so sharing is safe). It is opened O_RDONLY until a caller
+// asks for write access; an O_RDWR descriptor then replaces it for the
+// handles that come later. A descriptor nobody holds stays open on an LRU
+// list and is closed only when the cache is over capacity, so reopening a
+// hot file costs no open(2).
+class FdCache {
+public:
+	// Called with the cache locked right before a descriptor is closed.
+	typedef void (*CloseFn)(void* arg, int fd);
+
+	// open_flags are added to every open, e.g. O_DIRECT.
+	explicit FdCache(size_t capacity, int open_flags = 0);
+
+	~FdCache();
+
+	// Clamps requested to MAX_OPEN_FILES and to what RLIMIT_NOFILE leaves
+	// after a reserve for sockets, pipes and segment files.
+	static size_t Capacity(size_t requested);
+
+	// Returns a descriptor for path or a negative errno. flags are the
+	// caller's open flags: their access mode picks O_RDONLY or O_RDWR, and
+	// O_CREAT creates path with mode if missing. Every Get must be paired
+	// with a Put.
+	int Get(tfs_inode_t inode, const char* path, mode_t mode, int flags);
+
+	// on_last, if given, runs with the cache locked when this Put drops
+	// the last reference, so no other holder can use fd meanwhile.
+	void Put(int fd, CloseFn on_last = NULL, void* arg = NULL);
+
+	// The file was unlinked or replaced: never hand out the old
+	// descriptor again, close it once the last holder puts it.
+	void Forget(tfs_inode_t inode);
+
+	// True while a handle holds a descriptor of inode, including an
+	// O_RDONLY one that was replaced.
+	bool InUse(tfs_inode_t inode);
+
+	// How many handles hold a descriptor of inode, counting each replaced
+	// O_RDONLY descriptor once.
+	int Holders(tfs_inode_t inode);
+
+	void SetCloseHook(CloseFn fn, void* arg);
+
+	void Report(std::string &out);
+
+private:
+	struct Entry {
+		tfs_inode_t inode;
+		int refs;
+		bool writable;
+		bool forgotten;
+		bool replaced;
+		bool idle;
+		std::list<int>::iterator lru;
+	};
+
+	void EvictLocked(size_t target);
+
+	void CloseLocked(int fd);
+
+	// Takes fd out of by_inode: closed now if nobody holds it, else at the
+	// last Put.
+	void DetachLocked(int fd, bool replaced);
+
+	// Hands out the cached descriptor of inode if it allows writes or
+	// none are wanted; returns -1 otherwise.
+	int HitLocked(tfs_inode_t inode, bool write);
+
+	size_t capacity;
+	int open_flags;
+	CloseFn close_hook;
+	void* close_arg;
+	std::unordered_map<int, Entry> fds;
+	std::unordered_map<tfs_inode_t, int> by_inode;
+	std::unordered_map<tfs_inode_t, int> replaced_held;   // entries per inode
+	std::list<int> idle_list;
+	pthread_mutex_t mutex;
+	uint64_t num_hits;
+	uint64_t num_opens;
+	uint64_t num_evictions;
+};
+
+}
+
+#endif
@@ -0,0 +1,354 @@
+#include "fs/tfs_inode.h"
+
+namespace TestFS {
+
+// Compact header layout: INODE_FORMAT_COMPACT, then varints (LEB128):
+//
+//   flags, has_blob, namelen, st_ino, st_mode, st_uid, st_gid, st_size,
+//   st_mtime (zigzag),
+//   and, present only if their flag is set:
+//   st_nlink, st_dev, st_rdev, st_atime - st_mtime, st_ctime - st_mtime
+//   (both zigzag), the three tv_nsec, st_blksize and st_blocks,
+//   blob_owner, inline_threshold, pack_segment/pack_offset/pack_capacity,
+//   inline_raw_size, cold_node/cold_segment/cold_offset/cold_length.
+//
+// A field without its flag has the value InitStat gives it: nlink 1 for
+// files and 2 for directories, the times equal to st_mtime, 0 otherwise.
+enum {
+	F_NLINK = 1 << 0,
+	F_DEV = 1 << 1,
+	F_RDEV = 1 << 2,
+	F_ATIME = 1 << 3,
+	F_CTIME = 1 << 4,
+	F_NSEC = 1 << 5,
+	F_BLOCKS = 1 << 6,
+	F_OWNER = 1 << 7,
+	F_THRESHOLD = 1 << 8,
+	F_PACK = 1 << 9,
+	F_COMPRESSED = 1 << 10,
+	F_COLD = 1 << 11,
+	F_ALL = (1 << 12) - 1,
+};
+
+static bool compact_inodes = true;
+
+void SetCompactInodes(bool compact) {
+	compact_inodes = compact;
+}
+
+bool CompactInodes() {
+	return compact_inodes;
+}
+
+static char* PutVarint(char* out, uint64_t v) {
+	while (v >= 0x80) {
+		*out++ = (char) (v | 0x80);
+		v >>= 7;
+	}
+	*out++ = (char) v;
+	return out;
+}
+
+static char* PutSigned(char* out, int64_t v) {
+	return PutVarint(out, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static bool GetVarint(const char* &in, const char* end, uint64_t &v) {
+	v = 0;
+	for (int shift = 0; shift < 64 && in < end; shift += 7) {
+		uint8_t byte = *in++;
+		v |= (uint64_t) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool GetSigned(const char* &in, const char* end, int64_t &v) {
+	uint64_t u;
+	if (!GetVarint(in, end, u)) {
+		return false;
+	}
+	v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+	return true;
+}
+
+static nlink_t DefaultNlink(mode_t mode) {
+	return S_ISDIR(mode) ? 2 : 1;
+}
+
+static size_t EncodeCompact(const tfs_inode_header &header, char* out) {
+	const tfs_stat_t &st = header.fstat;
+	uint64_t flags = 0;
+	if (st.st_nlink != DefaultNlink(st.st_mode)) {
+		flags |= F_NLINK;
+	}
+	if (st.st_dev != 0) {
+		flags |= F_DEV;
+	}
+	if (st.st_rdev != 0) {
+		flags |= F_RDEV;
+	}
+	if (st.st_atim.tv_sec != st.st_mtim.tv_sec) {
+		flags |= F_ATIME;
+	}
+	if (st.st_ctim.tv_sec != st.st_mtim.tv_sec) {
+		flags |= F_CTIME;
+	}
+	if (st.st_atim.tv_nsec != 0 || st.st_mtim.tv_nsec != 0
+			|| st.st_ctim.tv_nsec != 0) {
+		flags |= F_NSEC;
+	}
+	if (st.st_blksize != 0 || st.st_blocks != 0) {
+		flags |= F_BLOCKS;
+	}
+	if (header.blob_owner != 0) {
+		flags |= F_OWNER;
+	}
+	if (header.inline_threshold != 0) {
+		flags |= F_THRESHOLD;
+	}
+	if (header.pack_segment != 0 || header.pack_offset != 0
+			|| header.pack_capacity != 0) {
+		flags |= F_PACK;
+	}
+	if (header.inline_raw_size != 0) {
+		flags |= F_COMPRESSED;
+	}
+	if (header.cold_length != 0) {
+		flags |= F_COLD;
+	}
+
+	char* p = out;
+	*p++ = (char) INODE_FORMAT_COMPACT;
+	p = PutVarint(p, flags);
+	p = PutVarint(p, header.has_blob);
+	p = PutVarint(p, header.namelen);
+	p = PutVarint(p, st.st_ino);
+	p = PutVarint(p, st.st_mode);
+	p = PutVarint(p, st.st_uid);
+	p = PutVarint(p, st.st_gid);
+	p = PutVarint(p, st.st_size);
+	p = PutSigned(p, st.st_mtim.tv_sec);
+	if (flags & F_NLINK) {
+		p = PutVarint(p, st.st_nlink);
+	}
+	if (flags & F_DEV) {
+		p = PutVarint(p, st.st_dev);
+	}
+	if (flags & F_RDEV) {
+		p = PutVarint(p, st.st_rdev);
+	}
+	if (flags & F_ATIME) {
+		p = PutSigned(p, st.st_atim.tv_sec - st.st_mtim.tv_sec);
+	}
+	if (flags & F_CTIME) {
+		p = PutSigned(p, st.st_ctim.tv_sec - st.st_mtim.tv_sec);
+	}
+	if (flags & F_NSEC) {
+		p = PutVarint(p, st.st_atim.tv_nsec);
+		p = PutVarint(p, st.st_mtim.tv_nsec);
+		p = PutVarint(p, st.st_ctim.tv_nsec);
+	}
+	if (flags & F_BLOCKS) {
+		p = PutVarint(p, st.st_blksize);
+		p = PutVarint(p, st.st_blocks);
+	}
+	if (flags & F_OWNER) {
+		p = PutVarint(p, header.blob_owner);
+	}
+	if (flags & F_THRESHOLD) {
+		p = PutVarint(p, header.inline_threshold);
+	}
+	if (flags & F_PACK) {
+		p = PutVarint(p, header.pack_segment);
+		p = PutVarint(p, header.pack_offset);
+		p = PutVarint(p, header.pack_capacity);
+	}
+	if (flags & F_COMPRESSED) {
+		p = PutVarint(p, header.inline_raw_size);
+	}
+	if (flags & F_COLD) {
+		p = PutVarint(p, header.cold_node);
+		p = PutVarint(p, header.cold_segment);
+		p = PutVarint(p, header.cold_offset);
+		p = PutVarint(p, header.cold_length);
+	}
+	return p - out;
+}
+
+static size_t DecodeCompact(const char* data, size_t size,
+		tfs_inode_header* header) {
+	const char* p = data + 1;
+	const char* end = data + size;
+	tfs_stat_t &st = header->fstat;
+	uint64_t flags, has_blob, namelen, ino, mode, uid, gid, fsize;
+	int64_t mtime;
+	if (!GetVarint(p, end, flags) || (flags & ~(uint64_t) F_ALL) != 0
+			|| !GetVarint(p, end, has_blob) || !GetVarint(p, end, namelen)
+			|| !GetVarint(p, end, ino) || !GetVarint(p, end, mode)
+			|| !GetVarint(p, end, uid) || !GetVarint(p, end, gid)
+			|| !GetVarint(p, end, fsize) || !GetSigned(p, end, mtime)) {
+		return 0;
+	}
+	header->has_blob = has_blob;
+	header->namelen = namelen;
+	st.st_ino = ino;
+	st.st_mode = mode;
+	st.st_uid = uid;
+	st.st_gid = gid;
+	st.st_size = fsize;
+	st.st_mtim.tv_sec = st.st_atim.tv_sec = st.st_ctim.tv_sec = mtime;
+	st.st_nlink = DefaultNlink(st.st_mode);
+
+	uint64_t v;
+	int64_t delta;
+	if (flags & F_NLINK) {
+		if (!GetVarint(p, end, v)) {
+			return 0;
+		}
+		st.st_nlink = v;
+	}
+	if (flags & F_DEV) {
+		if (!GetVarint(p, end, v)) {
+			return 0;
+		}
+		st.st_dev = v;
+	}
+	if (flags & F_RDEV) {
+		if (!GetVarint(p, end, v)) {
+			return 0;
+		}
+		st.st_rdev = v;
+	}
+	if (flags & F_ATIME) {
+		if (!GetSigned(p, end, delta)) {
+			return 0;
+		}
+		st.st_atim.tv_sec = mtime + delta;
+	}
+	if (flags & F_CTIME) {
+		if (!GetSigned(p, end, delta)) {
+			return 0;
+		}
+		st.st_ctim.tv_sec = mtime + delta;
+	}
+	if (flags & F_NSEC) {
+		uint64_t a, m, c;
+		if (!GetVarint(p, end, a) || !GetVarint(p, end, m)
+				|| !GetVarint(p, end, c)) {
+			return 0;
+		}
+		st.st_atim.tv_nsec = a;
+		st.st_mtim.tv_nsec = m;
+		st.st_ctim.tv_nsec = c;
+	}
+	if (flags & F_BLOCKS) {
+		uint64_t blksize, blocks;
+		if (!GetVarint(p, end, blksize) || !GetVarint(p, end, blocks)) {
+			return 0;
+		}
+		st.st_blksize = blksize;
+		st.st_blocks = blocks;
+	}
+	if (flags & F_OWNER) {
+		if (!GetVarint(p, end, v)) {
+			return 0;
+		}
+		header->blob_owner = v;
+	}
+	if (flags & F_THRESHOLD) {
+		if (!GetVarint(p, end, v)) {
+			return 0;
+		}
+		header->inline_threshold = v;
+	}
+	if (flags & F_PACK) {
+		uint64_t segment, offset, capacity;
+		if (!GetVarint(p, end, segment) || !GetVarint(p, end, offset)
+				|| !GetVarint(p, end, capacity)) {
+			return 0;
+		}
+		header->pack_segment = segment;
+		header->pack_offset = offset;
+		header->pack_capacity = capacity;
+	}
+	if (flags & F_COMPRESSED) {
+		if (!GetVarint(p, end, v)) {
+			return 0;
+		}
+		header->inline_raw_size = v;
+	}
+	if (flags & F_COLD) {
+		uint64_t node, segment, offset, length;
+		if (!GetVarint(p, end, node) || !GetVarint(p, end, segment)
+				|| !GetVarint(p, end, offset) || !GetVarint(p, end, length)) {
+			return 0;
+		}
+		header->cold_node = node;
+		header->cold_segment = segment;
+		header->cold_offset = offset;
+		header->cold_length = length;
+	}
+	return p - data;
+}
+
+// The name must fit and be terminated where namelen says.
+static bool NameFits(const char* data, size_t size, size_t header_size,
+		uint32_t namelen) {
+	return header_size + namelen < size && data[header_size + namelen] == '\0';
+}
+
+size_t DecodeInodeHeader(const char* data, size_t size,
+		tfs_inode_header* header) {
+	memset(header, 0, sizeof(*header));
+	if (size > 0 && (uint8_t) data[0] == INODE_FORMAT_COMPACT) {
+		size_t len = DecodeCompact(data, size, header);
+		if (len > 0 && NameFits(data, size, len, header->namelen)) {
+			return len;
+		}
+		// a legacy header whose st_dev happens to start with the marker
+		memset(header, 0, sizeof(*header));
+	}
+	if (size < TFS_INODE_HEADER_SIZE) {
+		return 0;
+	}
+	// the legacy layout is fstat, padding, has_blob and namelen; everything
+	// carved out of the padding since is only carried by compact headers,
+	// and old values may hold anything there
+	tfs_inode_header legacy;
+	memcpy(&legacy, data, TFS_INODE_HEADER_SIZE);
+	header->fstat = legacy.fstat;
+	header->has_blob = legacy.has_blob;
+	header->namelen = legacy.namelen;
+	if (!NameFits(data, size, TFS_INODE_HEADER_SIZE, header->namelen)) {
+		memset(header, 0, sizeof(*header));
+		return 0;
+	}
+	return TFS_INODE_HEADER_SIZE;
+}
+
+// True if header uses fields the legacy layout has no room for.
+static bool NeedsCompact(const tfs_inode_header &header) {
+	return header.blob_owner != 0 || header.inline_threshold != 0
+			|| header.pack_offset != 0 || header.pack_segment != 0
+			|| header.pack_capacity != 0 || header.inline_raw_size != 0
+			|| header.cold_node != 0 || header.cold_offset != 0
+			|| header.cold_segment != 0 || header.cold_length != 0;
+}
+
+size_t EncodeInodeHeader(const tfs_inode_header &header, char* out) {
+	if (compact_inodes || NeedsCompact(header)) {
+		return EncodeCompact(header, out);
+	}
+	tfs_inode_header legacy;
+	memset(&legacy, 0, sizeof(legacy));
+	legacy.fstat = header.fstat;
+	legacy.has_blob = header.has_blob;
+	legacy.namelen = header.namelen;
+	memcpy(out, &legacy, TFS_INODE_HEADER_SIZE);
+	return TFS_INODE_HEADER_SIZE;
+}
+
+}
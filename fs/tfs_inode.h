@@ -4,6 +4,9 @@
 
 #include <sys/stat.h>
 #include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
 #include "IndexLookup.h"
 #include "IndexKey.h"
 
@@ -18,15 +21,39 @@ static const char PATH_DELIMITER = '/';
 static const int INODE_PADDING = 104;
 static const int MAX_PATH_LEN = 256;
 static const tfs_inode_t ROOT_INODE_ID = 0;
-static const int NUM_FILES_IN_DATADIR_BITS = 14;
-static const int NUM_FILES_IN_DATADIR = 16384;
+
+// tfs_inode_header::has_blob: where data above the inline threshold lives
+static const uint32_t BLOB_ON_DISK = 1;  // datadir file on blob_owner
+static const uint32_t BLOB_CHUNKED = 2;  // chunk objects in the data table
+static const uint32_t BLOB_PACKED = 3;   // extent of a segment file on blob_owner
+// with split_inline, inline-sized data moves out of the inode value into
+// one object of the data table (ChunkStore chunk 0)
+static const uint32_t BLOB_SPLIT = 4;
+// with dedup_inline, the inline data is the digest of a ContentStore
+// payload shared with every other file holding the same bytes
+static const uint32_t BLOB_SHARED = 5;
+// cold data compressed into an ArchiveStore extent: pack_segment and
+// pack_offset locate it on blob_owner, st_size is the raw size
+static const uint32_t BLOB_ARCHIVED = 6;
 static const int MAX_OPEN_FILES = 512;
 static const char* ROOT_INODE_STAT = "/tmp/";
 
 
 struct tfs_inode_header {
 	tfs_stat_t fstat;
-	char padding[INODE_PADDING];
+	uint32_t blob_owner;    // node id whose datadir holds the blob
+	uint32_t inline_threshold;  // directories: override for children, 0 if none
+	uint64_t pack_offset;   // BLOB_PACKED, BLOB_ARCHIVED: extent in segment pack_segment
+	uint32_t pack_segment;
+	uint32_t pack_capacity;
+	uint32_t inline_raw_size;  // stored inline data is compressed: its size
+	// a stub left by MetaTiering: the inode is record cold_offset,
+	// cold_length bytes, of segment cold_segment in cold_node's ColdStore
+	uint32_t cold_node;
+	uint64_t cold_offset;
+	uint32_t cold_segment;
+	uint32_t cold_length;
+	char padding[INODE_PADDING - 8 * sizeof(uint32_t) - 2 * sizeof(uint64_t)];
 	uint32_t has_blob;
 	uint32_t namelen;
 };
@@ -34,6 +61,69 @@ struct tfs_inode_header {
 static const size_t TFS_INODE_HEADER_SIZE = sizeof(tfs_inode_header);
 static const size_t TFS_INODE_ATTR_SIZE = sizeof(struct stat);
 
+// An inode value is the encoded header, the name, '\0' and then the inline
+// data. The header is either tfs_inode_header as is (the legacy format) or
+// the compact format of tfs_inode.cpp, which starts with
+// INODE_FORMAT_COMPACT and takes about 25 bytes for a typical file.
+static const uint8_t INODE_FORMAT_COMPACT = 0xC1;
+// no encoded header is longer than the legacy one
+static const size_t TFS_INODE_MAX_ENCODED = TFS_INODE_HEADER_SIZE;
+
+// Decodes the header at the front of an inode value. Returns the length
+// of the encoded header, or 0 if data does not hold an inode value.
+size_t DecodeInodeHeader(const char* data, size_t size,
+		tfs_inode_header* header);
+
+// Encodes header in the current format into out, which has room for
+// TFS_INODE_MAX_ENCODED bytes. Returns the encoded length.
+size_t EncodeInodeHeader(const tfs_inode_header &header, char* out);
+
+// Selects the format headers are written in. Either format is read; a
+// legacy value is rewritten compact the next time its header changes.
+// Headers using fields past the legacy layout (blob_owner onwards) are
+// always written compact; legacy values decode with those fields zero.
+void SetCompactInodes(bool compact);
+
+bool CompactInodes();
+
+// A decoded copy of an inode value's header. It stands in for the header
+// pointer into the value that callers used to get, so it must outlive any
+// pointer taken from it.
+class InodeHeader {
+public:
+	InodeHeader(const char* data, size_t size) {
+		encoded_size = DecodeInodeHeader(data, size, &header);
+	}
+
+	const tfs_inode_header* operator->() const {
+		return &header;
+	}
+
+	const tfs_inode_header &operator*() const {
+		return header;
+	}
+
+	operator const tfs_inode_header*() const {
+		return &header;
+	}
+
+	bool Valid() const {
+		return encoded_size > 0;
+	}
+
+	size_t NameOffset() const {
+		return encoded_size;
+	}
+
+	size_t DataOffset() const {
+		return encoded_size + header.namelen + 1;
+	}
+
+private:
+	tfs_inode_header header;
+	size_t encoded_size;
+};
+
 struct tfs_inode_val_t {
 	size_t size;
 	char* value;
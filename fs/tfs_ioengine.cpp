@@ -0,0 +1,559 @@
+#include "fs/tfs_ioengine.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace TestFS {
+
+static const size_t MAX_FREE_BUFFERS = 16;
+static const unsigned MAX_ENTER_RETRIES = 64;
+
+static int RingSetup(unsigned entries, struct io_uring_params* p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int RingEnter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static int RingRegister(int fd, unsigned opcode, void* arg, unsigned nr) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+// True if the ring supports every opcode IoEngine submits. READ and WRITE
+// (5.6) are younger than io_uring itself; an older kernel would fail each
+// request with -EINVAL, and one without IORING_REGISTER_PROBE is older.
+static bool SupportsOps(int fd) {
+	static const uint8_t needed[] = { IORING_OP_NOP, IORING_OP_READ,
+			IORING_OP_WRITE, IORING_OP_FSYNC };
+	const unsigned max_ops = 256;
+	size_t size = sizeof(struct io_uring_probe)
+			+ max_ops * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe =
+			reinterpret_cast<struct io_uring_probe*>(calloc(1, size));
+	if (probe == NULL) {
+		return false;
+	}
+	bool ok = RingRegister(fd, IORING_REGISTER_PROBE, probe, max_ops) == 0;
+	for (size_t i = 0; ok && i < sizeof(needed); ++i) {
+		ok = needed[i] < probe->ops_len
+				&& (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ok;
+}
+
+IoEngine::IoEngine(bool use_uring, unsigned entries,
+		unsigned registered_files, Logging* logs) :
+		logs(logs), ring_fd(-1), sq_ptr(MAP_FAILED), sq_size(0),
+		cq_ptr(MAP_FAILED), cq_size(0), sqes(NULL), sqes_size(0),
+		sq_entries(0), stopping(false), inflight(0), queued(0),
+		submitting(false), next_victim(0), num_ops(0), num_enters(0),
+		num_fixed(0), num_direct(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&space_cond, NULL);
+	if (use_uring && !SetupRing(entries, registered_files)) {
+		logs->LogMsg("IoEngine: no io_uring (%s), using pread/pwrite\n",
+				strerror(errno));
+	}
+	if (ring_fd >= 0) {
+		pthread_create(&reaper, NULL, ReaperMain, this);
+	}
+}
+
+IoEngine::~IoEngine() {
+	if (ring_fd >= 0) {
+		// a NOP with no Op wakes the reaper, which exits once it drained
+		Sqe nop = { IORING_OP_NOP, -1, NULL, 0, 0, 0, false };
+		pthread_mutex_lock(&mutex);
+		stopping = true;
+		while (inflight + 1 > sq_entries) {
+			pthread_cond_wait(&space_cond, &mutex);
+		}
+		FillLocked(nop, NULL);
+		++inflight;
+		pthread_mutex_unlock(&mutex);
+		while (RingEnter(ring_fd, 1, 0, 0) < 0 && errno == EINTR) {
+		}
+		pthread_join(reaper, NULL);
+	}
+	if (sqes != NULL) {
+		munmap(sqes, sqes_size);
+	}
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+		munmap(cq_ptr, cq_size);
+	}
+	if (sq_ptr != MAP_FAILED) {
+		munmap(sq_ptr, sq_size);
+	}
+	if (ring_fd >= 0) {
+		close(ring_fd);
+	}
+	for (size_t i = 0; i < free_buffers.size(); ++i) {
+		free(free_buffers[i]);
+	}
+	pthread_cond_destroy(&space_cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool IoEngine::SetupRing(unsigned entries, unsigned registered_files) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = RingSetup(entries, &p);
+	if (fd < 0) {
+		return false;
+	}
+	if (!SupportsOps(fd)) {
+		close(fd);
+		errno = EOPNOTSUPP;
+		return false;
+	}
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap) {
+		sq_size = cq_size = std::max(sq_size, cq_size);
+	}
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ptr != MAP_FAILED) {
+		cq_ptr = single_mmap ? sq_ptr : mmap(NULL, cq_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+				IORING_OFF_CQ_RING);
+	}
+	if (cq_ptr != MAP_FAILED) {
+		sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+		void* ptr = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		sqes = (ptr == MAP_FAILED) ? NULL
+				: reinterpret_cast<struct io_uring_sqe*>(ptr);
+	}
+	if (sqes == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+
+	char* sq = reinterpret_cast<char*>(sq_ptr);
+	sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	sq_entries = p.sq_entries;
+	char* cq = reinterpret_cast<char*>(cq_ptr);
+	cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+	if (registered_files > 0) {
+		// a sparse table; hot descriptors are put in as they show up
+		std::vector<int> table(registered_files, -1);
+		if (RingRegister(fd, IORING_REGISTER_FILES, &table[0],
+				registered_files) == 0) {
+			slots = table;
+		} else {
+			logs->LogMsg("IoEngine: cannot register files: %s\n",
+					strerror(errno));
+		}
+	}
+	ring_fd = fd;
+	return true;
+}
+
+int IoEngine::SlotLocked(int fd) {
+	if (slots.empty()) {
+		return -1;
+	}
+	std::unordered_map<int, int>::iterator it = slot_of.find(fd);
+	if (it != slot_of.end()) {
+		return it->second;
+	}
+	if (++uses[fd] < HOT_USES) {
+		return -1;
+	}
+	int slot = -1;
+	for (size_t i = 0; i < slots.size(); ++i) {
+		if (slots[i] < 0) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		// only retarget a slot no unsubmitted SQE can be pointing at
+		if (queued > 0 || submitting) {
+			return -1;
+		}
+		slot = next_victim;
+		next_victim = (next_victim + 1) % slots.size();
+		slot_of.erase(slots[slot]);
+		uses.erase(slots[slot]);
+	}
+	int fds[1] = { fd };
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds = (uint64_t) (uintptr_t) fds;
+	if (RingRegister(ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) {
+		slots[slot] = -1;
+		return -1;
+	}
+	slots[slot] = fd;
+	slot_of[fd] = slot;
+	return slot;
+}
+
+void IoEngine::Unregister(void* arg, int fd) {
+	IoEngine* self = reinterpret_cast<IoEngine*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	self->uses.erase(fd);
+	std::unordered_map<int, int>::iterator it = self->slot_of.find(fd);
+	if (it != self->slot_of.end()) {
+		int fds[1] = { -1 };
+		struct io_uring_files_update update;
+		memset(&update, 0, sizeof(update));
+		update.offset = it->second;
+		update.fds = (uint64_t) (uintptr_t) fds;
+		RingRegister(self->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+		self->slots[it->second] = -1;
+		self->slot_of.erase(it);
+	}
+	pthread_mutex_unlock(&self->mutex);
+}
+
+void IoEngine::FillLocked(const Sqe &req, Op* op) {
+	// the tail is only written here, under mutex
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	struct io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req.opcode;
+	int slot = (req.opcode == IORING_OP_NOP) ? -1 : SlotLocked(req.fd);
+	if (slot >= 0) {
+		sqe->fd = slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+		++num_fixed;
+	} else {
+		sqe->fd = req.fd;
+	}
+	if (req.link) {
+		sqe->flags |= IOSQE_IO_LINK;
+	}
+	sqe->addr = (uint64_t) (uintptr_t) req.buf;
+	sqe->len = req.size;
+	sqe->off = req.offset;
+	sqe->fsync_flags = req.op_flags;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void IoEngine::Submit(const Sqe* reqs, Op* ops, int n) {
+	Waiter waiter;
+	pthread_cond_init(&waiter.cond, NULL);
+	waiter.remaining = n;
+
+	pthread_mutex_lock(&mutex);
+	// in flight never exceeds the SQ, so neither ring can overflow
+	while (inflight + n > sq_entries) {
+		pthread_cond_wait(&space_cond, &mutex);
+	}
+	for (int i = 0; i < n; ++i) {
+		ops[i].waiter = &waiter;
+		ops[i].res = 0;
+		FillLocked(reqs[i], &ops[i]);
+	}
+	inflight += n;
+	queued += n;
+	num_ops += n;
+	if (!submitting) {
+		// submit for everyone who queues up while we are in the kernel
+		submitting = true;
+		while (queued > 0) {
+			unsigned to_submit = queued;
+			queued = 0;
+			pthread_mutex_unlock(&mutex);
+			unsigned done = 0;
+			unsigned retries = 0;
+			while (done < to_submit) {
+				int ret = RingEnter(ring_fd, to_submit - done, 0, 0);
+				if (ret < 0) {
+					if (errno == EINTR || ((errno == EAGAIN || errno == EBUSY)
+							&& ++retries < MAX_ENTER_RETRIES)) {
+						sched_yield();
+						continue;
+					}
+					logs->LogMsg("IoEngine: io_uring_enter: %s\n",
+							strerror(errno));
+					break;
+				}
+				done += ret;
+			}
+			pthread_mutex_lock(&mutex);
+			++num_enters;
+			if (done < to_submit) {
+				// nobody would ever submit what is left; run it here
+				queued += to_submit - done;
+				RunQueuedLocked();
+			}
+		}
+		submitting = false;
+	}
+	// page cache hits complete inside io_uring_enter; take them here
+	// rather than wait for the reaper to wake us
+	ReapLocked();
+	while (waiter.remaining > 0) {
+		pthread_cond_wait(&waiter.cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+	pthread_cond_destroy(&waiter.cond);
+}
+
+void IoEngine::RunQueuedLocked() {
+	struct Taken {
+		Op* op;
+		struct io_uring_sqe sqe;
+	};
+	// without SQPOLL the kernel only reads the SQ inside io_uring_enter,
+	// and we are the only one entering with anything to submit, so the
+	// unsubmitted entries can be taken back by rewinding the tail
+	std::vector<Taken> taken;
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *sq_tail;
+	for (unsigned i = head; i != tail; ++i) {
+		Taken t;
+		t.sqe = sqes[sq_array[i & *sq_mask]];
+		t.op = reinterpret_cast<Op*>((uintptr_t) t.sqe.user_data);
+		if ((t.sqe.flags & IOSQE_FIXED_FILE) != 0) {
+			t.sqe.fd = slots[t.sqe.fd];
+		}
+		taken.push_back(t);
+	}
+	__atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+	queued = 0;
+	pthread_mutex_unlock(&mutex);
+
+	bool cancel = false;
+	for (size_t i = 0; i < taken.size(); ++i) {
+		const struct io_uring_sqe &sqe = taken[i].sqe;
+		void* buf = reinterpret_cast<void*>((uintptr_t) sqe.addr);
+		ssize_t res = 0;
+		if (cancel) {
+			res = -ECANCELED;
+		} else if (sqe.opcode == IORING_OP_READ) {
+			res = pread(sqe.fd, buf, sqe.len, sqe.off);
+		} else if (sqe.opcode == IORING_OP_WRITE) {
+			res = pwrite(sqe.fd, buf, sqe.len, sqe.off);
+		} else if (sqe.opcode == IORING_OP_FSYNC) {
+			res = ((sqe.fsync_flags & IORING_FSYNC_DATASYNC) != 0)
+					? fdatasync(sqe.fd) : fsync(sqe.fd);
+		}
+		if (res < 0 && !cancel) {
+			res = -errno;
+		}
+		// like the ring, a failed or short request cancels its links
+		bool linked = (sqe.flags & IOSQE_IO_LINK) != 0;
+		cancel = linked && (res < 0 || (sqe.opcode != IORING_OP_FSYNC
+				&& (size_t) res != sqe.len));
+		if (taken[i].op != NULL) {
+			taken[i].op->res = res;
+		}
+	}
+
+	pthread_mutex_lock(&mutex);
+	for (size_t i = 0; i < taken.size(); ++i) {
+		Op* op = taken[i].op;
+		if (op != NULL && --op->waiter->remaining == 0) {
+			pthread_cond_signal(&op->waiter->cond);
+		}
+	}
+	inflight -= taken.size();
+	if (!taken.empty()) {
+		pthread_cond_broadcast(&space_cond);
+	}
+}
+
+void* IoEngine::ReaperMain(void* arg) {
+	reinterpret_cast<IoEngine*>(arg)->Reap();
+	return NULL;
+}
+
+void IoEngine::ReapLocked() {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	unsigned completed = 0;
+	for (; head != tail; ++head) {
+		struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+		Op* op = reinterpret_cast<Op*>((uintptr_t) cqe->user_data);
+		++completed;
+		if (op == NULL) {
+			continue;
+		}
+		op->res = cqe->res;
+		if (--op->waiter->remaining == 0) {
+			pthread_cond_signal(&op->waiter->cond);
+		}
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	inflight -= completed;
+	if (completed > 0) {
+		pthread_cond_broadcast(&space_cond);
+	}
+}
+
+void IoEngine::Reap() {
+	for (;;) {
+		if (RingEnter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+				&& errno != EINTR) {
+			logs->LogMsg("IoEngine: reaping: %s\n", strerror(errno));
+		}
+		pthread_mutex_lock(&mutex);
+		ReapLocked();
+		bool done = stopping && inflight == 0;
+		pthread_mutex_unlock(&mutex);
+		if (done) {
+			break;
+		}
+	}
+}
+
+ssize_t IoEngine::Read(int fd, void* buf, size_t size, off_t offset) {
+	if (ring_fd < 0) {
+		ssize_t ret = pread(fd, buf, size, offset);
+		return (ret < 0) ? -errno : ret;
+	}
+	Sqe req = { IORING_OP_READ, fd, buf, size, offset, 0, false };
+	Op op;
+	Submit(&req, &op, 1);
+	return op.res;
+}
+
+ssize_t IoEngine::Write(int fd, const void* buf, size_t size, off_t offset) {
+	if (ring_fd < 0) {
+		ssize_t ret = pwrite(fd, buf, size, offset);
+		return (ret < 0) ? -errno : ret;
+	}
+	Sqe req = { IORING_OP_WRITE, fd, buf, size, offset, 0, false };
+	Op op;
+	Submit(&req, &op, 1);
+	return op.res;
+}
+
+ssize_t IoEngine::WriteSync(int fd, const void* buf, size_t size,
+		off_t offset, bool datasync) {
+	if (ring_fd < 0) {
+		ssize_t ret = pwrite(fd, buf, size, offset);
+		if (ret < 0) {
+			return -errno;
+		}
+		if ((datasync ? fdatasync(fd) : fsync(fd)) != 0) {
+			return -errno;
+		}
+		return ret;
+	}
+	// a failed or short write cancels the linked fsync
+	Sqe reqs[2] = {
+		{ IORING_OP_WRITE, fd, buf, size, offset, 0, true },
+		{ IORING_OP_FSYNC, fd, NULL, 0, 0,
+				datasync ? IORING_FSYNC_DATASYNC : 0, false } };
+	Op ops[2];
+	Submit(reqs, ops, 2);
+	if (ops[0].res < 0 || (size_t) ops[0].res != size) {
+		return ops[0].res;
+	}
+	return (ops[1].res < 0) ? ops[1].res : ops[0].res;
+}
+
+int IoEngine::Fsync(int fd, bool datasync) {
+	if (ring_fd < 0) {
+		return ((datasync ? fdatasync(fd) : fsync(fd)) != 0) ? -errno : 0;
+	}
+	Sqe req = { IORING_OP_FSYNC, fd, NULL, 0, 0,
+			datasync ? IORING_FSYNC_DATASYNC : 0, false };
+	Op op;
+	Submit(&req, &op, 1);
+	return op.res;
+}
+
+char* IoEngine::GetBuffer() {
+	char* buf = NULL;
+	pthread_mutex_lock(&mutex);
+	++num_direct;
+	if (!free_buffers.empty()) {
+		buf = free_buffers.back();
+		free_buffers.pop_back();
+	}
+	pthread_mutex_unlock(&mutex);
+	if (buf == NULL) {
+		void* ptr;
+		if (posix_memalign(&ptr, DIRECT_ALIGN, DIRECT_BUFFER) == 0) {
+			buf = reinterpret_cast<char*>(ptr);
+		}
+	}
+	return buf;
+}
+
+void IoEngine::PutBuffer(char* buf) {
+	pthread_mutex_lock(&mutex);
+	if (free_buffers.size() < MAX_FREE_BUFFERS) {
+		free_buffers.push_back(buf);
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&mutex);
+	free(buf);
+}
+
+ssize_t IoEngine::ReadDirect(int fd, void* buf, size_t size, off_t offset) {
+	char* abuf = GetBuffer();
+	if (abuf == NULL) {
+		return -ENOMEM;
+	}
+	size_t done = 0;
+	ssize_t ret = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t start = pos & ~((off_t) DIRECT_ALIGN - 1);
+		size_t lead = pos - start;
+		size_t want = std::min(size - done, DIRECT_BUFFER - lead);
+		size_t len = (lead + want + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+		ret = Read(fd, abuf, len, start);
+		if (ret <= (ssize_t) lead) {
+			break;
+		}
+		size_t got = std::min((size_t) ret - lead, want);
+		memcpy(reinterpret_cast<char*>(buf) + done, abuf + lead, got);
+		done += got;
+		if (got < want) {
+			break;
+		}
+	}
+	PutBuffer(abuf);
+	return (ret < 0 && done == 0) ? ret : done;
+}
+
+void IoEngine::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%s, %lu ops in %lu enters, %lu on registered files (%zu slots, "
+			"%zu used), %lu direct reads\n",
+			ring_fd >= 0 ? "io_uring" : "pread/pwrite",
+			(unsigned long) num_ops, (unsigned long) num_enters,
+			(unsigned long) num_fixed, slots.size(), slot_of.size(),
+			(unsigned long) num_direct);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
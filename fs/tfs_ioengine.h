@@ -0,0 +1,155 @@
+#ifndef TFS_IOENGINE_H_
+#define TFS_IOENGINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util/logging.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace TestFS {
+
+// Positional I/O on datadir blob files.
+//
+// With use_uring the calls go through one io_uring shared by all FUSE
+// threads. Calls still block their caller, but submission is combined:
+// whoever finds the ring idle submits everything queued so far with one
+// io_uring_enter, and a reaper thread completes requests as the CQ fills.
+// Descriptors used more than HOT_USES times get a registered-file slot, so
+// the kernel skips the fd table lookup; FdCache must report closes through
+// Unregister. Without io_uring (or if the kernel refuses the ring, or its
+// probe does not list the opcodes used here) the calls fall back to
+// pread/pwrite/fsync, and so do requests queued when io_uring_enter fails.
+//
+// ReadDirect is for descriptors opened O_DIRECT: the request is widened to
+// DIRECT_ALIGN and read into a buffer from an aligned pool.
+class IoEngine {
+public:
+	static const size_t DIRECT_ALIGN = 4096;
+	static const size_t DIRECT_BUFFER = 1 << 20;
+	static const unsigned HOT_USES = 8;
+
+	IoEngine(bool use_uring, unsigned entries, unsigned registered_files,
+			Logging* logs);
+
+	~IoEngine();
+
+	bool UsesUring() const {
+		return ring_fd >= 0;
+	}
+
+	// Same results as pread/pwrite, but -errno instead of -1.
+	ssize_t Read(int fd, void* buf, size_t size, off_t offset);
+
+	ssize_t Write(int fd, const void* buf, size_t size, off_t offset);
+
+	// Writes and then syncs, as a linked pair on the ring.
+	ssize_t WriteSync(int fd, const void* buf, size_t size, off_t offset,
+			bool datasync);
+
+	int Fsync(int fd, bool datasync);
+
+	ssize_t ReadDirect(int fd, void* buf, size_t size, off_t offset);
+
+	// FdCache close hook: drops fd's registered slot before it is closed.
+	static void Unregister(void* arg, int fd);
+
+	void Report(std::string &out);
+
+private:
+	struct Waiter;
+
+	struct Op {
+		Waiter* waiter;
+		int res;
+	};
+
+	struct Waiter {
+		pthread_cond_t cond;
+		int remaining;
+	};
+
+	struct Sqe {
+		uint8_t opcode;
+		int fd;
+		const void* buf;
+		size_t size;
+		off_t offset;
+		uint32_t op_flags;
+		bool link;
+	};
+
+	bool SetupRing(unsigned entries, unsigned registered_files);
+
+	// Queues n requests, submits (or leaves it to the active submitter)
+	// and waits for all of them; results land in ops.
+	void Submit(const Sqe* reqs, Op* ops, int n);
+
+	void FillLocked(const Sqe &req, Op* op);
+
+	// Called when io_uring_enter fails for good: takes back whatever is
+	// still in the SQ and runs it with pread/pwrite/fsync, so the waiters
+	// are not left hanging. Drops mutex while doing the I/O.
+	void RunQueuedLocked();
+
+	// Slot for fd in the registered file table, or -1.
+	int SlotLocked(int fd);
+
+	static void* ReaperMain(void* arg);
+
+	void Reap();
+
+	// Completes whatever is in the CQ.
+	void ReapLocked();
+
+	char* GetBuffer();
+
+	void PutBuffer(char* buf);
+
+	Logging* logs;
+	int ring_fd;
+	void* sq_ptr;
+	size_t sq_size;
+	void* cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_entries;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t space_cond;
+	pthread_t reaper;
+	bool stopping;
+	unsigned inflight;
+	unsigned queued;
+	bool submitting;
+
+	std::vector<int> slots;          // slot -> fd, -1 if free
+	std::unordered_map<int, int> slot_of;
+	std::unordered_map<int, unsigned> uses;
+	unsigned next_victim;
+
+	std::vector<char*> free_buffers;
+
+	uint64_t num_ops;
+	uint64_t num_enters;
+	uint64_t num_fixed;
+	uint64_t num_direct;
+};
+
+}
+
+#endif
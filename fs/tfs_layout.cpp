@@ -0,0 +1,224 @@
+#include "fs/tfs_layout.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstring>
+
+namespace TestFS {
+
+static uint64_t MixGroup(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// True if datadir already has flat-layout group directories.
+static bool HasFlatGroups(const std::string &datadir) {
+	DIR* dir = opendir(datadir.c_str());
+	if (dir == NULL) {
+		return false;
+	}
+	bool found = false;
+	struct dirent* entry;
+	while (!found && (entry = readdir(dir)) != NULL) {
+		const char* name = entry->d_name;
+		found = (name[0] != '\0' && strspn(name, "0123456789") == strlen(name));
+	}
+	closedir(dir);
+	return found;
+}
+
+DatadirLayout::DatadirLayout(const std::string &datadir,
+		uint64_t ahead_groups, Logging* logs) :
+		datadir(datadir), ahead_groups(ahead_groups), logs(logs),
+		version(LAYOUT_FLAT), running(false), have_base(false), base(0),
+		ready_end(0), want_end(0), num_created(0), num_inline(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+DatadirLayout::~DatadirLayout() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+int DatadirLayout::Open(uint32_t new_version) {
+	std::string fpath = datadir + "/LAYOUT";
+	int fd = open(fpath.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		char buf[32];
+		ssize_t n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 0) {
+			return -EIO;
+		}
+		buf[n] = '\0';
+		version = strtoul(buf, NULL, 10);
+		if (version != LAYOUT_FLAT && version != LAYOUT_HASHED) {
+			logs->LogMsg("DatadirLayout: unknown layout %s in %s\n", buf,
+					fpath.c_str());
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if (errno != ENOENT) {
+		return -errno;
+	}
+	version = HasFlatGroups(datadir) ? LAYOUT_FLAT : new_version;
+	char line[32];
+	int len = snprintf(line, sizeof(line), "%u\n", version);
+	std::string tmp_path = fpath + ".tmp";
+	fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	int ret = 0;
+	if (write(fd, line, len) != len || fsync(fd) != 0
+			|| rename(tmp_path.c_str(), fpath.c_str()) != 0) {
+		ret = -errno;
+	}
+	close(fd);
+	logs->LogMsg("DatadirLayout: %s uses layout %u\n", datadir.c_str(),
+			version);
+	return ret;
+}
+
+void DatadirLayout::Format(char* path, tfs_inode_t inode_id) const {
+	if (version == LAYOUT_FLAT) {
+		sprintf(path, "%s/%lu/%lu", datadir.c_str(),
+				(unsigned long) (inode_id >> FLAT_GROUP_BITS),
+				(unsigned long) (inode_id & ((1ULL << FLAT_GROUP_BITS) - 1)));
+		return;
+	}
+	uint64_t group = inode_id >> GROUP_BITS;
+	uint64_t h = MixGroup(group);
+	sprintf(path, "%s/%02x/%02x/%lx/%lx", datadir.c_str(),
+			(unsigned) (h & 0xff), (unsigned) ((h >> 8) & 0xff),
+			(unsigned long) group, (unsigned long) inode_id);
+}
+
+void DatadirLayout::FormatGroup(char* path, uint64_t group) const {
+	if (version == LAYOUT_FLAT) {
+		sprintf(path, "%s/%lu", datadir.c_str(), (unsigned long) group);
+		return;
+	}
+	uint64_t h = MixGroup(group);
+	sprintf(path, "%s/%02x/%02x/%lx", datadir.c_str(), (unsigned) (h & 0xff),
+			(unsigned) ((h >> 8) & 0xff), (unsigned long) group);
+}
+
+int DatadirLayout::MakeGroup(uint64_t group) {
+	char path[4096];
+	FormatGroup(path, group);
+	if (mkdir(path, 0777) == 0 || errno == EEXIST) {
+		return 0;
+	}
+	if (errno != ENOENT) {
+		return -errno;
+	}
+	// first group under this parent: create the hashed parents
+	char* slash = path + datadir.size();
+	while ((slash = strchr(slash + 1, '/')) != NULL) {
+		*slash = '\0';
+		if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+			return -errno;
+		}
+		*slash = '/';
+	}
+	return (mkdir(path, 0777) == 0 || errno == EEXIST) ? 0 : -errno;
+}
+
+int DatadirLayout::MakeDirs(tfs_inode_t inode_id) {
+	return MakeGroup(inode_id >> GroupBits());
+}
+
+void DatadirLayout::Reserve(tfs_inode_t inode_id) {
+	uint64_t group = inode_id >> GroupBits();
+	pthread_mutex_lock(&mutex);
+	if (!have_base) {
+		have_base = true;
+		base = ready_end = want_end = group;
+	}
+	bool ready = (group >= base && group < ready_end);
+	if (group + 1 + ahead_groups > want_end) {
+		want_end = group + 1 + ahead_groups;
+		pthread_cond_signal(&cond);
+	}
+	if (!ready) {
+		++num_inline;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!ready && MakeGroup(group) == 0) {
+		pthread_mutex_lock(&mutex);
+		if (group == ready_end) {
+			// spares the rest of the group another inline mkdir
+			ready_end = group + 1;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+void DatadirLayout::Start() {
+	running = true;
+	pthread_create(&creator, NULL, CreatorMain, this);
+}
+
+void DatadirLayout::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(creator, NULL);
+	}
+}
+
+void* DatadirLayout::CreatorMain(void* arg) {
+	DatadirLayout* self = reinterpret_cast<DatadirLayout*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		if (self->ready_end >= self->want_end) {
+			pthread_cond_wait(&self->cond, &self->mutex);
+			continue;
+		}
+		uint64_t group = self->ready_end;
+		pthread_mutex_unlock(&self->mutex);
+		int ret = self->MakeGroup(group);
+		pthread_mutex_lock(&self->mutex);
+		if (ret < 0) {
+			// Reserve() keeps trying inline; do not spin on a full disk
+			self->logs->LogMsg("DatadirLayout: cannot create group %lu: %s\n",
+					(unsigned long) group, strerror(-ret));
+			self->want_end = self->ready_end;
+			continue;
+		}
+		if (self->ready_end < group + 1) {
+			self->ready_end = group + 1;
+		}
+		++self->num_created;
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+void DatadirLayout::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"layout %u, %lu groups created ahead, %lu created inline, "
+			"ready up to group %lu\n",
+			version, (unsigned long) num_created, (unsigned long) num_inline,
+			(unsigned long) ready_end);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
@@ -0,0 +1,95 @@
+#ifndef TFS_LAYOUT_H_
+#define TFS_LAYOUT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include "fs/tfs_inode.h"
+#include "util/logging.h"
+
+namespace TestFS {
+
+// Where inode blobs live under datadir.
+//
+// LAYOUT_FLAT, the original layout, is datadir/<id / 16384>/<id % 16384>:
+// the top directory gains an entry every 16384 inodes.
+//
+// LAYOUT_HASHED puts inodes in groups of 2^GROUP_BITS ids, each group in
+// its own leaf directory, and spreads the groups over 256 x 256 parent
+// directories by a hash of the group number:
+// datadir/<h & 0xff>/<h >> 8 & 0xff>/<group>/<id>, all in hex. A leaf
+// holds at most 4096 files and a parent about 4096 groups at 2^40 inodes.
+//
+// The version is kept in datadir/LAYOUT. A datadir without that file is
+// flat if it already has numbered group directories; otherwise it gets
+// the requested version.
+//
+// Group directories are created ahead of the inode counter by a
+// background thread: Reserve() is called with every new id and only falls
+// back to a mkdir of its own when the thread is behind.
+class DatadirLayout {
+public:
+	static const uint32_t LAYOUT_FLAT = 1;
+	static const uint32_t LAYOUT_HASHED = 2;
+	static const int FLAT_GROUP_BITS = 14;
+	static const int GROUP_BITS = 12;
+
+	DatadirLayout(const std::string &datadir, uint64_t ahead_groups,
+			Logging* logs);
+
+	~DatadirLayout();
+
+	// Reads or writes datadir/LAYOUT. Returns 0 or a negative errno.
+	int Open(uint32_t new_version);
+
+	uint32_t Version() const {
+		return version;
+	}
+
+	void Format(char* path, tfs_inode_t inode_id) const;
+
+	// inode_id was just allocated; makes sure its directory exists and
+	// keeps the pre-created directories ahead of it.
+	void Reserve(tfs_inode_t inode_id);
+
+	// Creates the directories for inode_id now. Returns 0 or -errno.
+	int MakeDirs(tfs_inode_t inode_id);
+
+	void Start();
+
+	void Stop();
+
+	void Report(std::string &out);
+
+private:
+	int GroupBits() const {
+		return version == LAYOUT_FLAT ? FLAT_GROUP_BITS : GROUP_BITS;
+	}
+
+	void FormatGroup(char* path, uint64_t group) const;
+
+	int MakeGroup(uint64_t group);
+
+	static void* CreatorMain(void* arg);
+
+	std::string datadir;
+	uint64_t ahead_groups;
+	Logging* logs;
+	uint32_t version;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t creator;
+	bool running;
+	bool have_base;
+	uint64_t base;          // groups [base, ready_end) exist
+	uint64_t ready_end;
+	uint64_t want_end;
+
+	uint64_t num_created;
+	uint64_t num_inline;    // Reserve() had to mkdir itself
+};
+
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include "fs/tfs_mdsclient.h"
+#include <errno.h>
+#include <cstring>
+#include "fs/tfs_blobproto.h"
+
+namespace TestFS {
+
+MdsClient::MdsClient(const std::string &host, unsigned short port,
+		const std::string &secret) :
+		host(host), port(port), secret(secret), sock(NULL), next_reqid(0),
+		reading(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	try {
+		Connect();
+	} catch (SocketException &e) {
+		delete sock;
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+		throw;
+	}
+}
+
+MdsClient::~MdsClient() {
+	delete sock;
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void MdsClient::AppendRequest(std::string &out, uint32_t reqid,
+		uint8_t opcode, const std::string &key, const std::string &seckey,
+		const char* value, size_t size, uint64_t given_version) {
+	mds_request_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	uint32_t frame = sizeof(hdr) + key.size() + seckey.size() + size;
+	hdr.reqid = reqid;
+	hdr.opcode = opcode;
+	hdr.keylen = key.size();
+	hdr.seckeylen = seckey.size();
+	hdr.vallen = size;
+	hdr.version = given_version;
+	out.append((const char *) &frame, sizeof(frame));
+	out.append((const char *) &hdr, sizeof(hdr));
+	out.append(key);
+	out.append(seckey);
+	if (size > 0) {
+		out.append(value, size);
+	}
+}
+
+void MdsClient::ReadResponse(TCPSocket* sock, mds_response_header &resp,
+		std::string &value) {
+	uint32_t frame;
+	if (sock->recvFully(&frame, sizeof(frame)) != sizeof(frame)
+			|| sock->recvFully(&resp, sizeof(resp)) != sizeof(resp)) {
+		throw SocketException("mdsproxy closed the connection");
+	}
+	if (resp.vallen > MDS_MAX_VALUE || frame != sizeof(resp) + resp.vallen) {
+		throw SocketException("mdsproxy sent a malformed response");
+	}
+	value.resize(resp.vallen);
+	if (resp.vallen > 0
+			&& sock->recvFully(&value[0], resp.vallen) != (int) resp.vallen) {
+		throw SocketException("mdsproxy closed the connection");
+	}
+}
+
+void MdsClient::Connect() {
+	delete sock;
+	sock = NULL;
+	sock = new TCPSocket(host, port);
+	// small request/response frames: do not let Nagle hold them back
+	sock->setNoDelay(true);
+
+	mds_response_header resp;
+	std::string value;
+	ReadResponse(sock, resp, value);
+	if (value.size() != BLOB_NONCE_SIZE) {
+		throw SocketException("mdsproxy sent no challenge");
+	}
+	uint8_t answer[BLOB_AUTH_SIZE];
+	BlobAuth(secret, (const uint8_t *) value.data(), answer);
+	std::string request;
+	uint32_t reqid = next_reqid++;
+	AppendRequest(request, reqid, MDS_AUTH, std::string(), std::string(),
+			(const char *) answer, sizeof(answer), 0);
+	sock->send(request.data(), request.size());
+	ReadResponse(sock, resp, value);
+	if (resp.reqid != reqid || resp.status != 0) {
+		throw SocketException("mdsproxy refused the blob_secret");
+	}
+}
+
+void MdsClient::Fail() {
+	for (size_t i = 0; i < inflight.size(); ++i) {
+		inflight[i]->status = -EIO;
+		inflight[i]->done = true;
+	}
+	inflight.clear();
+	// a reader still blocked on the socket deletes it when it returns
+	if (!reading) {
+		delete sock;
+	}
+	sock = NULL;
+	pthread_cond_broadcast(&cond);
+}
+
+int MdsClient::Call(uint8_t opcode, const std::string &key,
+		const std::string &seckey, const char* value, size_t size,
+		uint64_t given_version, std::string &result, uint64_t *version) {
+	Waiter w;
+	w.done = false;
+	w.status = -EIO;
+	w.version = 0;
+	w.result = &result;
+	std::string request;
+	pthread_mutex_lock(&mutex);
+	// a failed stream is replaced only once nothing is outstanding on it
+	while (sock == NULL && reading) {
+		pthread_cond_wait(&cond, &mutex);
+	}
+	try {
+		if (sock == NULL) {
+			Connect();
+		}
+		w.reqid = next_reqid++;
+		AppendRequest(request, w.reqid, opcode, key, seckey, value, size,
+				given_version);
+		sock->send(request.data(), request.size());
+		inflight.push_back(&w);
+	} catch (SocketException &e) {
+		Fail();
+		pthread_mutex_unlock(&mutex);
+		return -EIO;
+	}
+
+	while (!w.done) {
+		if (reading) {
+			pthread_cond_wait(&cond, &mutex);
+			continue;
+		}
+		reading = true;
+		TCPSocket* s = sock;
+		pthread_mutex_unlock(&mutex);
+		mds_response_header resp;
+		std::string data;
+		bool ok = true;
+		try {
+			ReadResponse(s, resp, data);
+		} catch (SocketException &e) {
+			ok = false;
+		}
+		pthread_mutex_lock(&mutex);
+		reading = false;
+		if (sock != s) {
+			// failed by a sender meanwhile
+			delete s;
+			pthread_cond_broadcast(&cond);
+			continue;
+		}
+		if (!ok || inflight.empty()
+				|| inflight.front()->reqid != resp.reqid) {
+			// out of sync: nothing more on this stream can be trusted
+			Fail();
+			continue;
+		}
+		Waiter* first = inflight.front();
+		inflight.pop_front();
+		first->status = resp.status;
+		first->version = resp.version;
+		first->result->swap(data);
+		first->done = true;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	if (w.status == 0 && version != NULL) {
+		*version = w.version;
+	}
+	return w.status;
+}
+
+int MdsClient::Read(const std::string &key, std::string &value,
+		uint64_t *version) {
+	return Call(MDS_READ, key, std::string(), NULL, 0, 0, value, version);
+}
+
+int MdsClient::Write(const std::string &key, const std::string &seckey,
+		const char* value, size_t size, uint64_t *version) {
+	std::string result;
+	return Call(MDS_WRITE, key, seckey, value, size, 0, result, version);
+}
+
+int MdsClient::WriteIf(const std::string &key, const std::string &seckey,
+		const char* value, size_t size, uint64_t given_version,
+		uint64_t *version) {
+	std::string result;
+	return Call(MDS_WRITE_IF, key, seckey, value, size, given_version, result,
+			version);
+}
+
+int MdsClient::Remove(const std::string &key, uint64_t *version) {
+	std::string result;
+	return Call(MDS_REMOVE, key, std::string(), NULL, 0, 0, result, version);
+}
+
+int MdsClient::NextId(uint64_t *id) {
+	std::string result;
+	return Call(MDS_NEXTID, std::string(), std::string(), NULL, 0, 0, result,
+			id);
+}
+
+int MdsClient::List(const std::string &seckey,
+		std::vector<std::string> &values) {
+	std::string result;
+	int ret = Call(MDS_LIST, std::string(), seckey, NULL, 0, 0, result, NULL);
+	values.clear();
+	size_t pos = 0;
+	while (ret == 0 && pos + sizeof(uint32_t) <= result.size()) {
+		uint32_t len;
+		memcpy(&len, result.data() + pos, sizeof(len));
+		pos += sizeof(len);
+		values.push_back(result.substr(pos, len));
+		pos += len;
+	}
+	return ret;
+}
+
+}
@@ -0,0 +1,90 @@
+#ifndef TFS_MDSCLIENT_H_
+#define TFS_MDSCLIENT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "fs/tfs_mdsproto.h"
+#include "util/socket.h"
+
+namespace TestFS {
+
+// Client side of the metadata proxy. One TCP connection per mount, shared
+// by every FUSE thread: a call sends its request as soon as it is made and
+// waits for its own response, so the requests of concurrent threads are in
+// flight together and the proxy batches their reads. Whichever waiting
+// caller finds no one reading receives the next response for everyone.
+//
+// A response whose reqid is not the oldest outstanding one, or any socket
+// error, fails every outstanding call with -EIO; the next call reconnects.
+class MdsClient {
+public:
+	// Connects and authenticates with secret, the blob_secret of the
+	// proxy; throws SocketException if either fails.
+	MdsClient(const std::string &host, unsigned short port,
+			const std::string &secret);
+
+	~MdsClient();
+
+	int Read(const std::string &key, std::string &value, uint64_t *version);
+
+	int Write(const std::string &key, const std::string &seckey,
+			const char* value, size_t size, uint64_t *version);
+
+	// Writes only if key is still at given_version; -EAGAIN otherwise.
+	int WriteIf(const std::string &key, const std::string &seckey,
+			const char* value, size_t size, uint64_t given_version,
+			uint64_t *version);
+
+	int Remove(const std::string &key, uint64_t *version);
+
+	// Sets *id to the next inode number; returns 0 or -errno.
+	int NextId(uint64_t *id);
+
+	int List(const std::string &seckey, std::vector<std::string> &values);
+
+private:
+	// A call waiting for its response.
+	struct Waiter {
+		uint32_t reqid;
+		bool done;
+		int status;
+		uint64_t version;
+		std::string* result;
+	};
+
+	void AppendRequest(std::string &out, uint32_t reqid, uint8_t opcode,
+			const std::string &key, const std::string &seckey,
+			const char* value, size_t size, uint64_t given_version);
+
+	static void ReadResponse(TCPSocket* sock, mds_response_header &resp,
+			std::string &value);
+
+	// Replaces the connection and authenticates it. Called with mutex
+	// held and nothing outstanding; throws SocketException.
+	void Connect();
+
+	// Drops the connection and fails every outstanding call. Called with
+	// mutex held.
+	void Fail();
+
+	int Call(uint8_t opcode, const std::string &key, const std::string &seckey,
+			const char* value, size_t size, uint64_t given_version,
+			std::string &result, uint64_t *version);
+
+	std::string host;
+	unsigned short port;
+	std::string secret;
+	TCPSocket* sock;             // NULL after Fail() until reconnected
+	uint32_t next_reqid;
+	std::deque<Waiter*> inflight;   // in the order sent
+	bool reading;                // a caller is receiving for the others
+	pthread_mutex_t mutex;       // all of the above; held while sending
+	pthread_cond_t cond;
+};
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef TFS_MDSPROTO_H_
+#define TFS_MDSPROTO_H_
+
+#include <stdint.h>
+
+namespace TestFS {
+
+// Wire protocol between TestFS mounts and testfs-mdsproxy.
+//
+// A request is an mds_request_header followed by keylen bytes of primary
+// key, seckeylen bytes of secondary key and vallen bytes of value. A response
+// is an mds_response_header followed by vallen bytes. Each travels as one
+// util/eventloop frame, a uint32_t of its length and then the bytes. Clients
+// may pipeline: responses on a connection come back in request order and
+// carry the reqid.
+//
+// The proxy opens every connection with a challenge, a response with
+// reqid 0 whose value is BLOB_NONCE_SIZE random bytes. The first request
+// is MDS_AUTH, whose value is BlobAuth() of the blob_secret proxy and mounts
+// share and that nonce; the proxy answers it, and closes a connection that
+// starts with anything else or a wrong answer.
+// MDS_WRITE_IF writes only if the object is still at the request's version,
+// and fails with -EAGAIN if it changed or is gone.
+// Integers are in host byte order; proxy and clients run on one host or rack
+// of identical machines.
+
+static const uint32_t MDS_DEFAULT_PORT = 7655;
+static const uint32_t MDS_MAX_VALUE = 1 << 24;
+
+enum MdsOpcode {
+	MDS_READ = 1, MDS_WRITE = 2, MDS_REMOVE = 3, MDS_NEXTID = 4, MDS_LIST = 5,
+	MDS_AUTH = 6, MDS_WRITE_IF = 7,
+};
+
+struct mds_request_header {
+	uint32_t reqid;
+	uint8_t opcode;
+	uint8_t reserved;
+	uint16_t keylen;
+	uint16_t seckeylen;
+	uint16_t reserved2;
+	uint32_t vallen;
+	uint64_t version;       // MDS_WRITE_IF
+} __attribute__((packed));
+
+// status is 0 or a negative errno. For MDS_NEXTID the new id is returned in
+// version; MDS_LIST returns a sequence of (uint32_t length, bytes) values.
+struct mds_response_header {
+	uint32_t reqid;
+	int32_t status;
+	uint64_t version;
+	uint32_t vallen;
+} __attribute__((packed));
+
+}
+
+#endif
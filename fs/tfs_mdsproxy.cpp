@@ -0,0 +1,383 @@
+#include "fs/tfs_mdsproxy.h"
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include "fs/testfs.h"
+#include "fs/tfs_rcdb.h"
+#include "ramcloud/ClientException.h"
+
+namespace TestFS {
+
+MdsProxy::MdsProxy() :
+		cluster(NULL), cache(NULL), blobclient(NULL), tiering(NULL),
+		loop(NULL), logs(NULL), batch_max(64),
+		num_requests(0), num_cache_hits(0), num_rpcs(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&work_cond, NULL);
+}
+
+MdsProxy::~MdsProxy() {
+	delete loop;
+	delete cache;
+	if (tiering != NULL) {
+		SetMetaTiering(NULL);
+		delete tiering;
+	}
+	delete blobclient;
+	delete cluster;
+	delete logs;
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+int MdsProxy::Setup(Properties& prop) {
+	logs = new Logging(prop.getProperty("logfile", ""));
+	logs->SetDefault(logs);
+	logs->SetLevel(Logging::ParseLevel(prop.getProperty("log_level", "info")));
+	logs->SetText(prop.getProperty("log_format", "binary") == "text");
+	logs->Open();
+
+	std::string endpoint = prop.getProperty("ramcloud_endpoint");
+	try {
+		cluster = new RAMCloud::RamCloud(endpoint.c_str(), "__unnamed__");
+		idt = ConnectDB(cluster, const_cast<char*>(idtable));
+		mdt = ConnectDB(cluster, const_cast<char*>(metatable));
+	} catch (RAMCloud::Exception& e) {
+		fprintf(stderr, "RAMCloud exception: %s\n", e.str().c_str());
+		return -1;
+	}
+
+	// mounts authenticate with the secret the blob servers use
+	secret = prop.getProperty("blob_secret", "");
+	if (secret.size() == 0) {
+		fprintf(stderr, "mdsproxy: blob_secret is required\n");
+		return -1;
+	}
+
+	// clients get values thawed: they have no RAMCloud connection to
+	// write the inode back with. The proxy has no ColdStore, so its node
+	// id matches no storage node and every record is fetched remotely
+	if (prop.getProperty("blob_nodes", "").size() > 0) {
+		blobclient = new BlobClient(NULL, secret);
+		blobclient->AddNodes(prop.getProperty("blob_nodes"));
+	}
+	tiering = new MetaTiering(cluster, mdt, NULL, blobclient, PROXY_NODE_ID,
+			logs);
+	SetMetaTiering(tiering);
+
+	batch_max = prop.getPropertyInt("batch_max", 64);
+	cache = new MetaCache(prop.getPropertyInt("cache_entries", 1 << 20),
+			prop.getPropertyInt("cache_lease_ms", 1000));
+	SocketOptions opts;
+	opts.busy_poll_usec = prop.getPropertyInt("busy_poll_usec", 0);
+	loop = new EventLoop(opts);
+	std::string address = prop.getProperty("listen_address", "127.0.0.1");
+	if (loop->Listen(address, prop.getPropertyInt("port", MDS_DEFAULT_PORT),
+			this) < 0) {
+		fprintf(stderr, "mdsproxy: cannot listen on %s:%d\n", address.c_str(),
+				prop.getPropertyInt("port", MDS_DEFAULT_PORT));
+		return -1;
+	}
+	return 0;
+}
+
+void MdsProxy::Run() {
+	pthread_create(&dispatcher, NULL, DispatcherMain, this);
+	loop->Run();
+}
+
+void MdsProxy::OnMessage(Connection* conn, const char* data, uint32_t len) {
+	mds_request_header hdr;
+	if (len < sizeof(hdr)) {
+		conn->Close();
+		return;
+	}
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.vallen > MDS_MAX_VALUE || len != sizeof(hdr) + hdr.keylen
+			+ hdr.seckeylen + hdr.vallen) {
+		logs->LogMsg("mdsproxy: malformed request, closing the connection\n");
+		conn->Close();
+		return;
+	}
+	Client* client = reinterpret_cast<Client*>(conn->context);
+	const char* body = data + sizeof(hdr);
+	if (!client->authenticated) {
+		if (!Authenticate(conn, client, hdr,
+				body + hdr.keylen + hdr.seckeylen)) {
+			logs->LogMsg("mdsproxy: connection without the blob secret, "
+					"closing it\n");
+			conn->Close();
+			return;
+		}
+		client->authenticated = true;
+		return;
+	}
+	Op* op = new Op();
+	op->client = client;
+	op->hdr = hdr;
+	op->key.assign(body, hdr.keylen);
+	op->seckey.assign(body + hdr.keylen, hdr.seckeylen);
+	op->value.assign(body + hdr.keylen + hdr.seckeylen, hdr.vallen);
+	memset(&op->resp, 0, sizeof(op->resp));
+	op->resp.reqid = hdr.reqid;
+	++client->pending;
+
+	pthread_mutex_lock(&mutex);
+	queue.push_back(op);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+void MdsProxy::OnAccept(Connection* conn) {
+	Client* client = new Client;
+	client->conn = conn;
+	client->pending = 0;
+	client->closed = false;
+	client->authenticated = false;
+	conn->context = client;
+	if (!BlobNonce(client->nonce)) {
+		logs->LogMsg("mdsproxy: no random bytes for a challenge\n");
+		conn->Close();
+		return;
+	}
+	mds_response_header resp;
+	memset(&resp, 0, sizeof(resp));
+	resp.vallen = BLOB_NONCE_SIZE;
+	struct iovec iov[2];
+	iov[0].iov_base = &resp;
+	iov[0].iov_len = sizeof(resp);
+	iov[1].iov_base = client->nonce;
+	iov[1].iov_len = BLOB_NONCE_SIZE;
+	conn->SendMessage(iov, 2);
+}
+
+bool MdsProxy::Authenticate(Connection* conn, Client* client,
+		const mds_request_header &hdr, const char* value) {
+	if (hdr.opcode != MDS_AUTH || hdr.vallen != BLOB_AUTH_SIZE
+			|| !BlobAuthMatches(secret, client->nonce, value)) {
+		return false;
+	}
+	// nothing is queued before it, so it can be answered right away
+	mds_response_header resp;
+	memset(&resp, 0, sizeof(resp));
+	resp.reqid = hdr.reqid;
+	conn->SendMessage((const char *) &resp, sizeof(resp));
+	return true;
+}
+
+void MdsProxy::OnClose(Connection* conn) {
+	Client* client = reinterpret_cast<Client*>(conn->context);
+	if (client == NULL) {
+		return;
+	}
+	// the queued requests still point at it; the last reply frees it
+	client->closed = true;
+	client->conn = NULL;
+	if (client->pending == 0) {
+		delete client;
+	}
+}
+
+void MdsProxy::Reply(void* arg) {
+	Batch* batch = reinterpret_cast<Batch*>(arg);
+	for (size_t i = 0; i < batch->ops.size(); ++i) {
+		Op* op = batch->ops[i];
+		Client* client = op->client;
+		if (!client->closed) {
+			op->resp.vallen = op->result.size();
+			struct iovec iov[2];
+			iov[0].iov_base = &op->resp;
+			iov[0].iov_len = sizeof(op->resp);
+			iov[1].iov_base = const_cast<char*>(op->result.data());
+			iov[1].iov_len = op->result.size();
+			client->conn->SendMessage(iov, 2);
+		}
+		if (--client->pending == 0 && client->closed) {
+			delete client;
+		}
+		delete op;
+	}
+	delete batch;
+}
+
+void* MdsProxy::DispatcherMain(void* arg) {
+	reinterpret_cast<MdsProxy*>(arg)->Dispatch();
+	return NULL;
+}
+
+void MdsProxy::Dispatch() {
+	std::vector<Op*> reads;
+	for (;;) {
+		Batch* batch = new Batch;
+		pthread_mutex_lock(&mutex);
+		while (queue.empty()) {
+			pthread_cond_wait(&work_cond, &mutex);
+		}
+		while (!queue.empty() && batch->ops.size() < batch_max) {
+			batch->ops.push_back(queue.front());
+			queue.pop_front();
+		}
+		pthread_mutex_unlock(&mutex);
+
+		// consecutive reads share one multiRead; a mutation flushes them
+		// first so clients always read their own writes
+		reads.clear();
+		for (size_t i = 0; i < batch->ops.size(); ++i) {
+			Op* op = batch->ops[i];
+			if (op->hdr.opcode == MDS_READ) {
+				reads.push_back(op);
+			} else {
+				ExecuteReads(reads);
+				reads.clear();
+				Execute(op);
+			}
+		}
+		ExecuteReads(reads);
+		num_requests += batch->ops.size();
+
+		// responses go out in queue order, so each client sees its own in
+		// the order it sent them
+		loop->RunInLoop(Reply, batch);
+	}
+}
+
+void MdsProxy::ExecuteReads(std::vector<Op*> &reads) {
+	std::vector<Op*> misses;
+	for (size_t i = 0; i < reads.size(); ++i) {
+		if (cache->Get(reads[i]->key, reads[i]->result,
+				&reads[i]->resp.version)) {
+			++num_cache_hits;
+		} else {
+			misses.push_back(reads[i]);
+		}
+	}
+	if (misses.empty()) {
+		return;
+	}
+
+	size_t n = misses.size();
+	RAMCloud::Tub<RAMCloud::ObjectBuffer>* values =
+			new RAMCloud::Tub<RAMCloud::ObjectBuffer>[n];
+	std::vector<RAMCloud::MultiReadObject> objects(n);
+	std::vector<RAMCloud::MultiReadObject*> requests(n);
+	for (size_t i = 0; i < n; ++i) {
+		objects[i] = RAMCloud::MultiReadObject(mdt, misses[i]->key.data(),
+				misses[i]->key.size(), &values[i]);
+		requests[i] = &objects[i];
+	}
+	try {
+		cluster->multiRead(&requests[0], n);
+		++num_rpcs;
+	} catch (RAMCloud::ClientException& e) {
+		for (size_t i = 0; i < n; ++i) {
+			misses[i]->resp.status = -EIO;
+		}
+		delete[] values;
+		return;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (objects[i].status != RAMCloud::STATUS_OK) {
+			misses[i]->resp.status = -ENOENT;
+			continue;
+		}
+		uint32_t len = 0;
+		const char* data = static_cast<const char*>(values[i]->getValue(&len));
+		uint64_t version = objects[i].version;
+		misses[i]->result.assign(data, len);
+		if (MetaTiering::IsStub(data, len)) {
+			int ret = Thaw(misses[i]->key, misses[i]->result, &version);
+			if (ret < 0) {
+				misses[i]->result.clear();
+				misses[i]->resp.status = ret;
+				continue;
+			}
+		}
+		misses[i]->resp.version = version;
+		cache->Put(misses[i]->key, misses[i]->result, version, "");
+	}
+	delete[] values;
+}
+
+int MdsProxy::Thaw(const std::string &key, std::string &value,
+		uint64_t *version) {
+	RAMCloud::KeyInfo keyinfo;
+	keyinfo.key = key.data();
+	keyinfo.keyLength = key.size();
+	try {
+		++num_rpcs;
+		return tiering->Thaw(keyinfo, value, version);
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
+		return -ENOENT;
+	} catch (RAMCloud::ClientException& e) {
+		return -EIO;
+	}
+}
+
+void MdsProxy::Execute(Op* op) {
+	RAMCloud::KeyInfo keylist[2];
+	keylist[0].key = op->key.data();
+	keylist[0].keyLength = op->key.size();
+	keylist[1].key = op->seckey.data();
+	keylist[1].keyLength = op->seckey.size();
+	uint64_t version = 0;
+	try {
+		switch (op->hdr.opcode) {
+		case MDS_WRITE:
+			WriteString(cluster, keylist, mdt, op->value, &version);
+			cache->Put(op->key, op->value, version, "");
+			break;
+		case MDS_WRITE_IF: {
+			RAMCloud::RejectRules rules;
+			memset(&rules, 0, sizeof(rules));
+			rules.givenVersion = op->hdr.version;
+			rules.versionNeGiven = 1;
+			rules.doesntExist = 1;
+			try {
+				cluster->write(mdt, 2, keylist, op->value.data(),
+						op->value.size(), &rules, &version);
+			} catch (RAMCloud::RejectRulesException& e) {
+				// the client read a cached copy that is stale by now
+				cache->Erase(op->key);
+				op->resp.status = -EAGAIN;
+				return;
+			}
+			cache->Put(op->key, op->value, version, "");
+			break;
+		}
+		case MDS_REMOVE:
+			RemoveKey(cluster, keylist, mdt, &version);
+			cache->Erase(op->key);
+			break;
+		case MDS_NEXTID: {
+			int64_t id = GetNextID(cluster, idt);
+			if (id < 0) {
+				op->resp.status = id;
+				return;
+			}
+			version = id;
+			break;
+		}
+		case MDS_LIST: {
+			std::vector<std::string> values;
+			ListDirectory(cluster, mdt, op->seckey, values);
+			for (size_t i = 0; i < values.size(); ++i) {
+				uint32_t len = values[i].size();
+				op->result.append((const char *) &len, sizeof(len));
+				op->result.append(values[i]);
+			}
+			break;
+		}
+		default:
+			op->resp.status = -EINVAL;
+			return;
+		}
+		++num_rpcs;
+		op->resp.version = version;
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
+		op->resp.status = -ENOENT;
+	} catch (RAMCloud::ClientException& e) {
+		op->resp.status = -EIO;
+	}
+}
+
+}
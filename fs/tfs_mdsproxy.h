@@ -0,0 +1,120 @@
+#ifndef TFS_MDSPROXY_H_
+#define TFS_MDSPROXY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "fs/tfs_cache.h"
+#include "fs/tfs_mdsproto.h"
+#include "fs/tfs_blobclient.h"
+#include "fs/tfs_tiering.h"
+#include "util/properties.h"
+#include "util/eventloop.h"
+#include "util/logging.h"
+#include "ramcloud/RamCloud.h"
+
+namespace TestFS {
+
+// testfs-mdsproxy: owns the RAMCloud connection for many TestFS clients.
+//
+// An EventLoop thread reads the pipelined requests of every client and
+// queues them for a single dispatcher thread, which owns the RamCloud
+// object. The dispatcher serves reads from a shared MetaCache, batches the
+// misses of consecutive reads (across all clients) into one multiRead, and
+// executes mutations in arrival order, writing them through the cache; the
+// responses are handed back to the loop a batch at a time. Stubs of frozen
+// inodes are thawed before they are cached or answered, fetching the
+// records from the blob servers of blob_nodes.
+//
+// The proxy can read and write the whole metatable, so it listens on
+// listen_address only (loopback unless given) and serves a connection once
+// its MDS_AUTH carries the blob_secret, which it refuses to start without.
+class MdsProxy : public ConnectionHandler {
+public:
+	// The node id the proxy thaws as; never a storage node's.
+	static const uint32_t PROXY_NODE_ID = 0xffffffff;
+
+	MdsProxy();
+
+	~MdsProxy();
+
+	int Setup(Properties& prop);
+
+	void Run();
+
+	void OnAccept(Connection* conn);
+
+	void OnMessage(Connection* conn, const char* data, uint32_t len);
+
+	void OnClose(Connection* conn);
+
+private:
+	// A client connection; outlives it while its requests are queued.
+	struct Client {
+		Connection* conn;
+		size_t pending;
+		bool closed;
+		bool authenticated;
+		uint8_t nonce[BLOB_NONCE_SIZE];
+	};
+
+	struct Op {
+		Client* client;
+		mds_request_header hdr;
+		std::string key;
+		std::string seckey;
+		std::string value;
+		mds_response_header resp;
+		std::string result;
+	};
+
+	struct Batch {
+		std::vector<Op*> ops;
+	};
+
+	static void* DispatcherMain(void* arg);
+
+	// Runs on the loop thread: sends the responses of a dispatched batch.
+	static void Reply(void* arg);
+
+	void Dispatch();
+
+	void ExecuteReads(std::vector<Op*> &reads);
+
+	// Replaces the stub value read under key at *version with the inode
+	// it stands for. Returns 0 or -errno.
+	int Thaw(const std::string &key, std::string &value, uint64_t *version);
+
+	void Execute(Op* op);
+
+	// Answers the MDS_AUTH that opens a connection; false if the
+	// connection is to be closed.
+	bool Authenticate(Connection* conn, Client* client,
+			const mds_request_header &hdr, const char* value);
+
+	RAMCloud::RamCloud* cluster;
+	uint64_t idt;
+	uint64_t mdt;
+	MetaCache* cache;
+	BlobClient* blobclient;
+	MetaTiering* tiering;
+	EventLoop* loop;
+	Logging* logs;
+	std::string secret;
+	size_t batch_max;
+
+	pthread_t dispatcher;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	std::deque<Op*> queue;
+
+	uint64_t num_requests;
+	uint64_t num_cache_hits;
+	uint64_t num_rpcs;
+};
+
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include "fs/tfs_migrator.h"
+#include <errno.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+
+namespace TestFS {
+
+Migrator::Migrator(size_t staging_max, WriteBlobFn write_blob,
+		CommitFn commit, void* arg, Logging* logs) :
+		staging_max(staging_max), write_blob(write_blob), commit(commit),
+		arg(arg), logs(logs), running(false), num_migrated(0), num_failed(0),
+		num_resnapshots(0), total_latency_us(0), max_latency_us(0),
+		max_depth(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+}
+
+Migrator::~Migrator() {
+	Stop();
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+uint64_t Migrator::NowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Migrator::Start() {
+	running = true;
+	pthread_create(&worker, NULL, WorkerMain, this);
+}
+
+void Migrator::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(worker, NULL);
+	}
+}
+
+int Migrator::Stage(const std::string &key, tfs_inode_t inode, mode_t mode,
+		const char* inline_data, size_t inline_size, const char* buf, size_t size, off_t offset) {
+	size_t end = offset + size;
+	size_t staged_size = (end > inline_size) ? end : inline_size;
+	if (staged_size > staging_max) {
+		return -EFBIG;
+	}
+	Job* job = new Job;
+	job->inode = inode;
+	job->key = key;
+	job->mode = mode;
+	job->data.assign(inline_data, inline_size);
+	job->data.resize(staged_size);
+	job->data.replace(offset, size, buf, size);
+	job->generation = 0;
+	job->committed = false;
+	job->enqueue_us = NowUs();
+	pthread_mutex_init(&job->mutex, NULL);
+
+	pthread_mutex_lock(&mutex);
+	if (jobs.count(key) > 0) {
+		// lost a race with another writer of the same file
+		pthread_mutex_unlock(&mutex);
+		pthread_mutex_destroy(&job->mutex);
+		delete job;
+		return Write(key, buf, size, offset);
+	}
+	jobs[key] = job;
+	queue.push_back(job);
+	if (queue.size() > max_depth) {
+		max_depth = queue.size();
+	}
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&mutex);
+	return size;
+}
+
+Migrator::Job* Migrator::LockJob(const std::string &key) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Job*>::iterator it = jobs.find(key);
+	Job* job = (it == jobs.end()) ? NULL : it->second;
+	if (job != NULL) {
+		// taken before mutex is released, so the worker cannot free it
+		pthread_mutex_lock(&job->mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+	if (job != NULL && job->committed) {
+		pthread_mutex_unlock(&job->mutex);
+		job = NULL;
+	}
+	return job;
+}
+
+int Migrator::Write(const std::string &key, const char* buf, size_t size,
+		off_t offset) {
+	Job* job = LockJob(key);
+	if (job == NULL) {
+		return -ENOENT;
+	}
+	int ret = size;
+	if (offset + size > staging_max) {
+		ret = -EFBIG;
+	} else {
+		if (job->data.size() < offset + size) {
+			job->data.resize(offset + size);
+		}
+		job->data.replace(offset, size, buf, size);
+		job->generation++;
+	}
+	pthread_mutex_unlock(&job->mutex);
+	return ret;
+}
+
+int Migrator::Read(const std::string &key, char* buf, size_t size,
+		off_t offset) {
+	Job* job = LockJob(key);
+	if (job == NULL) {
+		return -ENOENT;
+	}
+	int ret = 0;
+	if ((size_t) offset < job->data.size()) {
+		ret = job->data.copy(buf, size, offset);
+	}
+	pthread_mutex_unlock(&job->mutex);
+	return ret;
+}
+
+bool Migrator::StagedSize(const std::string &key, off_t &size) {
+	Job* job = LockJob(key);
+	if (job == NULL) {
+		return false;
+	}
+	size = job->data.size();
+	pthread_mutex_unlock(&job->mutex);
+	return true;
+}
+
+bool Migrator::Flush(const std::string &key) {
+	bool staged = false;
+	pthread_mutex_lock(&mutex);
+	while (jobs.count(key) > 0) {
+		staged = true;
+		pthread_cond_wait(&done_cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+	return staged;
+}
+
+void Migrator::Migrate(Job* job) {
+	int ret = 0;
+	for (int i = 0; ; ++i) {
+		pthread_mutex_lock(&job->mutex);
+		if (i == MAX_SNAPSHOTS - 1) {
+			// writers keep coming: finish with them held off
+			ret = write_blob(arg, job->inode, job->mode, job->data);
+			break;
+		}
+		std::string snapshot = job->data;
+		uint64_t generation = job->generation;
+		pthread_mutex_unlock(&job->mutex);
+
+		ret = write_blob(arg, job->inode, job->mode, snapshot);
+
+		pthread_mutex_lock(&job->mutex);
+		if (ret < 0 || job->generation == generation) {
+			break;
+		}
+		pthread_mutex_unlock(&job->mutex);
+		++num_resnapshots;
+	}
+	// job->mutex is held
+	if (ret < 0) {
+		logs->LogMsg("Migrator: cannot write blob for inode %lu: %s\n",
+				(unsigned long) job->inode, strerror(-ret));
+	}
+	int cret = commit(arg, job->key, job->data, ret == 0);
+	job->committed = true;
+	pthread_mutex_unlock(&job->mutex);
+
+	uint64_t latency = NowUs() - job->enqueue_us;
+	pthread_mutex_lock(&mutex);
+	jobs.erase(job->key);
+	if (ret == 0 && cret == 0) {
+		++num_migrated;
+	} else {
+		++num_failed;
+	}
+	total_latency_us += latency;
+	if (latency > max_latency_us) {
+		max_latency_us = latency;
+	}
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&mutex);
+
+	// anyone still holding the job saw committed and lets go
+	pthread_mutex_lock(&job->mutex);
+	pthread_mutex_unlock(&job->mutex);
+	pthread_mutex_destroy(&job->mutex);
+	delete job;
+}
+
+void* Migrator::WorkerMain(void* arg) {
+	Migrator* self = reinterpret_cast<Migrator*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (self->running || !self->queue.empty()) {
+		if (self->queue.empty()) {
+			pthread_cond_wait(&self->work_cond, &self->mutex);
+			continue;
+		}
+		Job* job = self->queue.front();
+		self->queue.pop_front();
+		pthread_mutex_unlock(&self->mutex);
+		self->Migrate(job);
+		pthread_mutex_lock(&self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+void Migrator::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	uint64_t done = num_migrated + num_failed;
+	snprintf(line, sizeof(line),
+			"queue depth %zu (max %zu), %lu migrated, %lu failed, "
+			"%lu resnapshots, latency avg %lu us max %lu us\n",
+			queue.size(), max_depth, (unsigned long) num_migrated,
+			(unsigned long) num_failed, (unsigned long) num_resnapshots,
+			(unsigned long) (done > 0 ? total_latency_us / done : 0),
+			(unsigned long) max_latency_us);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
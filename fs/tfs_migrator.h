@@ -0,0 +1,120 @@
+#ifndef TFS_MIGRATOR_H_
+#define TFS_MIGRATOR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include "fs/tfs_inode.h"
+#include "util/logging.h"
+
+namespace TestFS {
+
+// Moves inline files that outgrow the threshold to datadir in the
+// background, so the write that crosses the threshold does not pay for
+// creating the blob.
+//
+// Stage() copies the inline bytes plus the crossing write into a staging
+// buffer and queues the inode; until the job commits, writes, reads and
+// the file size are served from that buffer while the inode in RAMCloud
+// still says inline. The worker writes a snapshot to the blob file and
+// fdatasyncs it; if more writes came in meanwhile it writes again, the
+// last time with the job locked. Commit then flips the inode to
+// BLOB_ON_DISK in one metadata write with the job still locked, so no
+// staged write is lost. If the blob cannot be written the staged bytes are
+// committed inline instead.
+//
+// Like dirty pages, staged data is only on this mount until the job
+// commits; Fsync and anything that rewrites the inode Flush() first.
+// Commit also stamps atime and mtime, so close() need not wait.
+class Migrator {
+public:
+	typedef int (*WriteBlobFn)(void* arg, tfs_inode_t inode, mode_t mode,
+			const std::string &data);
+
+	// key is the primary meta key; on_disk says whether data is now in
+	// the blob file or has to go back inline.
+	typedef int (*CommitFn)(void* arg, const std::string &key,
+			const std::string &data, bool on_disk);
+
+	Migrator(size_t staging_max, WriteBlobFn write_blob, CommitFn commit,
+			void* arg, Logging* logs);
+
+	~Migrator();
+
+	void Start();
+
+	// Drains the queue and stops the worker.
+	void Stop();
+
+	// Returns size, or -EFBIG if the file would not fit staging_max (the
+	// caller then migrates synchronously).
+	int Stage(const std::string &key, tfs_inode_t inode, mode_t mode,
+			const char* inline_data, size_t inline_size, const char* buf, size_t size, off_t offset);
+
+	// Jobs are found by primary meta key. These return -ENOENT if key is
+	// not staged, and are meant to be called before the inode is read: a
+	// miss means whatever the inode says afterwards is current. Write
+	// returns -EFBIG past staging_max.
+	int Write(const std::string &key, const char* buf, size_t size,
+			off_t offset);
+
+	int Read(const std::string &key, char* buf, size_t size, off_t offset);
+
+	bool StagedSize(const std::string &key, off_t &size);
+
+	// Waits until key is committed. Returns true if it was staged.
+	bool Flush(const std::string &key);
+
+	void Report(std::string &out);
+
+private:
+	struct Job {
+		tfs_inode_t inode;
+		std::string key;
+		mode_t mode;
+		std::string data;
+		uint64_t generation;
+		bool committed;
+		uint64_t enqueue_us;
+		pthread_mutex_t mutex;
+	};
+
+	static const int MAX_SNAPSHOTS = 3;
+
+	static void* WorkerMain(void* arg);
+
+	static uint64_t NowUs();
+
+	// Returns the job locked, or NULL.
+	Job* LockJob(const std::string &key);
+
+	void Migrate(Job* job);
+
+	size_t staging_max;
+	WriteBlobFn write_blob;
+	CommitFn commit;
+	void* arg;
+	Logging* logs;
+
+	std::unordered_map<std::string, Job*> jobs;
+	std::deque<Job*> queue;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t worker;
+	bool running;
+
+	uint64_t num_migrated;
+	uint64_t num_failed;
+	uint64_t num_resnapshots;
+	uint64_t total_latency_us;
+	uint64_t max_latency_us;
+	size_t max_depth;
+};
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "fs/tfs_notify.h"
+#include <sys/stat.h>
+#include <cstring>
+#include "fs/tfs_inode.h"
+
+namespace TestFS {
+
+static const fuse_ino_t FUSE_ROOT_NODE = 1;
+
+KernelNotifier::KernelNotifier(const std::string &mountdir) :
+		mountdir(mountdir), chan(NULL), running(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+KernelNotifier::~KernelNotifier() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void KernelNotifier::Start(struct fuse* fuse) {
+	if (fuse == NULL || running) {
+		return;
+	}
+	chan = fuse_session_next_chan(fuse_get_session(fuse), NULL);
+	if (chan == NULL) {
+		return;
+	}
+	running = true;
+	pthread_create(&worker, NULL, WorkerMain, this);
+}
+
+void KernelNotifier::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(worker, NULL);
+	}
+}
+
+void KernelNotifier::InvalidateEntry(const std::string &path) {
+	Push(path, true);
+}
+
+void KernelNotifier::InvalidateInode(const std::string &path) {
+	Push(path, false);
+}
+
+void KernelNotifier::Push(const std::string &path, bool entry) {
+	pthread_mutex_lock(&mutex);
+	if (running) {
+		Request req;
+		req.path = path;
+		req.entry = entry;
+		pending.push_back(req);
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool KernelNotifier::NodeOf(const std::string &path, fuse_ino_t &node) {
+	if (path.find_first_not_of(PATH_DELIMITER) == std::string::npos) {
+		node = FUSE_ROOT_NODE;
+		return true;
+	}
+	struct stat statbuf;
+	if (lstat((mountdir + path).c_str(), &statbuf) < 0) {
+		return false;
+	}
+	node = statbuf.st_ino;
+	return true;
+}
+
+void KernelNotifier::Send(const Request &req) {
+	size_t end = req.path.find_last_not_of(PATH_DELIMITER);
+	if (end == std::string::npos) {
+		// the root itself: drop its attributes and directory pages
+		fuse_lowlevel_notify_inval_inode(chan, FUSE_ROOT_NODE, 0, 0);
+		return;
+	}
+	std::string path = req.path.substr(0, end + 1);
+	fuse_ino_t node;
+	if (!req.entry) {
+		if (NodeOf(path, node)) {
+			fuse_lowlevel_notify_inval_inode(chan, node, 0, 0);
+		}
+		return;
+	}
+	size_t slash = path.find_last_of(PATH_DELIMITER);
+	std::string parent = (slash == std::string::npos) ? std::string()
+			: path.substr(0, slash);
+	std::string name = path.substr(slash + 1);
+	if (!NodeOf(parent, node)) {
+		return;
+	}
+	// a fresh lookup of name, and of the parent's listing
+	fuse_lowlevel_notify_inval_entry(chan, node, name.data(), name.size());
+	fuse_lowlevel_notify_inval_inode(chan, node, 0, 0);
+}
+
+void* KernelNotifier::WorkerMain(void* arg) {
+	KernelNotifier* self = reinterpret_cast<KernelNotifier*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		if (self->pending.empty()) {
+			pthread_cond_wait(&self->cond, &self->mutex);
+			continue;
+		}
+		Request req = self->pending.front();
+		self->pending.pop_front();
+		pthread_mutex_unlock(&self->mutex);
+		self->Send(req);
+		pthread_mutex_lock(&self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+}
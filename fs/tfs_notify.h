@@ -0,0 +1,69 @@
+#ifndef TFS_NOTIFY_H_
+#define TFS_NOTIFY_H_
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+
+namespace TestFS {
+
+// Pushes dentry/inode invalidations into the kernel so entry_timeout,
+// attr_timeout and kernel_cache can be enabled safely.
+//
+// FUSE forbids notifying from inside a request handler that holds the
+// directory lock, so invalidations are queued and sent from a worker thread.
+// Only changes made by other mounts need one: the kernel already knows what
+// went through it.
+//
+// The high-level API does not expose kernel node ids, but without use_ino
+// it reports them as st_ino, so the worker finds the node of the changed
+// entry's parent by an lstat through mountdir and invalidates exactly that
+// name. The lstat resolves the path as the kernel caches it, stale or not,
+// which is the node that needs dropping.
+class KernelNotifier {
+public:
+	KernelNotifier(const std::string &mountdir);
+
+	~KernelNotifier();
+
+	// Called from Init once the session channel exists.
+	void Start(struct fuse* fuse);
+
+	void Stop();
+
+	// path is relative to the mount root, e.g. "/a/b/c"
+	void InvalidateEntry(const std::string &path);
+
+	void InvalidateInode(const std::string &path);
+
+private:
+	struct Request {
+		std::string path;
+		bool entry;
+	};
+
+	static void* WorkerMain(void* arg);
+
+	void Send(const Request &req);
+
+	// The kernel node of path, relative to the mount root; false if the
+	// kernel cannot resolve it, so it has nothing cached to drop.
+	bool NodeOf(const std::string &path, fuse_ino_t &node);
+
+	void Push(const std::string &path, bool entry);
+
+	std::string mountdir;
+	struct fuse_chan* chan;
+	pthread_t worker;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	std::deque<Request> pending;
+	bool running;
+};
+
+}
+
+#endif
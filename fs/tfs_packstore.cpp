@@ -0,0 +1,450 @@
+#include "fs/tfs_packstore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace TestFS {
+
+static const uint32_t PACK_ALIGN = 4096;
+static const int COMPACT_RETRY_SEC = 30;
+// records start on this alignment: sizeof(pack_record) is a multiple of it
+// and capacities are multiples of PACK_ALIGN
+static const uint64_t RECORD_STEP = 16;
+
+PackStore::PackStore(const std::string &dir, uint32_t node,
+		uint64_t segment_size, double compact_ratio, Logging* logs) :
+		dir(dir), node(node), segment_size(segment_size),
+		compact_ratio(compact_ratio),
+		logs(logs), relocate(NULL), relocate_arg(NULL), active(0),
+		running(false), num_compactions(0), bytes_moved(0) {
+	pthread_rwlock_init(&segments_lock, NULL);
+	pthread_mutex_init(&mutex, NULL);
+	pthread_mutex_init(&extent_lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+PackStore::~PackStore() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(compactor, NULL);
+	}
+	for (std::map<uint32_t, Segment>::iterator it = segments.begin();
+			it != segments.end(); ++it) {
+		close(it->second.fd);
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&extent_lock);
+	pthread_mutex_destroy(&mutex);
+	pthread_rwlock_destroy(&segments_lock);
+}
+
+std::string PackStore::SegmentPath(uint32_t segment) {
+	char name[32];
+	sprintf(name, "/seg-%08u", segment);
+	return dir + name;
+}
+
+uint32_t PackStore::Capacity(size_t length) {
+	if (length == 0) {
+		return PACK_ALIGN;
+	}
+	return (length + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+int PackStore::NextRecord(int fd, uint64_t limit, uint64_t &pos,
+		pack_record &rec) {
+	for (; pos < limit; pos += RECORD_STEP) {
+		ssize_t n = pread(fd, &rec, sizeof(rec), pos);
+		if (n < 0) {
+			return -errno;
+		}
+		if (n != sizeof(rec)) {
+			return 0;
+		}
+		if (rec.magic == RECORD_MAGIC && rec.capacity > 0
+				&& rec.capacity % PACK_ALIGN == 0
+				&& rec.keylen <= sizeof(rec.key)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int PackStore::ScanSegment(uint32_t segment) {
+	int fd = open(SegmentPath(segment).c_str(), O_RDWR);
+	if (fd < 0) {
+		return -errno;
+	}
+	Segment seg;
+	seg.fd = fd;
+	seg.size = 0;
+	seg.live = 0;
+	seg.dead = 0;
+	pack_record rec;
+	uint64_t pos = 0;
+	while (NextRecord(fd, UINT64_MAX, pos, rec) > 0) {
+		// a torn record before this one is dead space
+		seg.dead += pos - seg.size;
+		if (rec.flags & RECORD_LIVE) {
+			seg.live += rec.capacity;
+		} else {
+			seg.dead += sizeof(rec) + rec.capacity;
+		}
+		pos += sizeof(rec) + rec.capacity;
+		seg.size = pos;
+	}
+	// anything after the last whole record is a torn append
+	segments[segment] = seg;
+	return 0;
+}
+
+int PackStore::OpenActiveLocked(uint32_t segment) {
+	int fd = open(SegmentPath(segment).c_str(), O_RDWR | O_CREAT | O_TRUNC,
+			0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	Segment seg;
+	seg.fd = fd;
+	seg.size = 0;
+	seg.live = 0;
+	seg.dead = 0;
+	pthread_mutex_lock(&mutex);
+	segments[segment] = seg;
+	active = segment;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int PackStore::Open(RelocateFn relocate, void* arg) {
+	this->relocate = relocate;
+	this->relocate_arg = arg;
+	mkdir(dir.c_str(), 0755);
+	DIR* dp = opendir(dir.c_str());
+	if (dp == NULL) {
+		return -errno;
+	}
+	uint32_t next = 0;
+	struct dirent* de;
+	while ((de = readdir(dp)) != NULL) {
+		unsigned int segment;
+		if (sscanf(de->d_name, "seg-%08u", &segment) == 1) {
+			ScanSegment(segment);
+			if (segment + 1 > next) {
+				next = segment + 1;
+			}
+		}
+	}
+	closedir(dp);
+	int ret = OpenActiveLocked(next);
+	if (ret < 0) {
+		return ret;
+	}
+	running = true;
+	pthread_create(&compactor, NULL, CompactorMain, this);
+	return 0;
+}
+
+void PackStore::Lock() {
+	pthread_mutex_lock(&extent_lock);
+}
+
+void PackStore::Unlock() {
+	pthread_mutex_unlock(&extent_lock);
+}
+
+int PackStore::SegmentFd(uint32_t segment) {
+	std::map<uint32_t, Segment>::iterator it = segments.find(segment);
+	return (it == segments.end()) ? -1 : it->second.fd;
+}
+
+int PackStore::Append(const std::string &key, tfs_inode_t inode,
+		const char* buf, size_t length, PackLocation &loc) {
+	pack_record rec;
+	memset(&rec, 0, sizeof(rec));
+	if (key.size() > sizeof(rec.key)) {
+		return -ENAMETOOLONG;
+	}
+	rec.magic = RECORD_MAGIC;
+	rec.flags = RECORD_LIVE;
+	rec.inode = inode;
+	rec.capacity = Capacity(length);
+	rec.keylen = key.size();
+	memcpy(rec.key, key.data(), key.size());
+
+	uint64_t pos;
+	int fd;
+	for (;;) {
+		pthread_rwlock_rdlock(&segments_lock);
+		pthread_mutex_lock(&mutex);
+		Segment &seg = segments[active];
+		if (seg.size == 0 || seg.size + sizeof(rec) + rec.capacity <= segment_size) {
+			pos = seg.size;
+			seg.size += sizeof(rec) + rec.capacity;
+			seg.live += rec.capacity;
+			loc.node = node;
+			loc.segment = active;
+			fd = seg.fd;
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		uint32_t full = active;
+		pthread_mutex_unlock(&mutex);
+		pthread_rwlock_unlock(&segments_lock);
+
+		// seal the full segment and start the next one
+		pthread_rwlock_wrlock(&segments_lock);
+		int ret = (active == full) ? OpenActiveLocked(full + 1) : 0;
+		pthread_rwlock_unlock(&segments_lock);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	loc.offset = pos + sizeof(rec);
+	loc.capacity = rec.capacity;
+	int ret = 0;
+	if (pwrite(fd, &rec, sizeof(rec), pos) != sizeof(rec)
+			|| pwrite(fd, buf, length, loc.offset) != (ssize_t) length) {
+		ret = -EIO;
+	}
+	pthread_rwlock_unlock(&segments_lock);
+	if (ret < 0) {
+		Free(loc);
+	}
+	return ret;
+}
+
+int PackStore::Read(const PackLocation &loc, size_t length, char* buf,
+		size_t size, off_t offset) {
+	if (loc.node != node) {
+		return -EREMOTE;
+	}
+	if ((size_t) offset >= length) {
+		return 0;
+	}
+	if (offset + size > length) {
+		size = length - offset;
+	}
+	pthread_rwlock_rdlock(&segments_lock);
+	int fd = SegmentFd(loc.segment);
+	ssize_t n = (fd < 0) ? -1 : pread(fd, buf, size, loc.offset + offset);
+	int ret = (n < 0) ? -EIO : (int) size;
+	pthread_rwlock_unlock(&segments_lock);
+	if (n >= 0 && (size_t) n < size) {
+		// the unwritten tail of the last extent in a segment
+		memset(buf + n, 0, size - n);
+	}
+	return ret;
+}
+
+int PackStore::Write(const PackLocation &loc, const char* buf, size_t size,
+		off_t offset) {
+	if (loc.node != node) {
+		return -EREMOTE;
+	}
+	if (offset + size > loc.capacity) {
+		return -EFBIG;
+	}
+	pthread_rwlock_rdlock(&segments_lock);
+	int fd = SegmentFd(loc.segment);
+	ssize_t n = (fd < 0) ? -1 : pwrite(fd, buf, size, loc.offset + offset);
+	pthread_rwlock_unlock(&segments_lock);
+	return (n < 0) ? -EIO : n;
+}
+
+int PackStore::Zero(const PackLocation &loc, off_t offset, size_t size) {
+	std::vector<char> zeros(size, 0);
+	int ret = Write(loc, &zeros[0], size, offset);
+	return (ret < 0) ? ret : 0;
+}
+
+int PackStore::Sync(const PackLocation &loc) {
+	if (loc.node != node) {
+		return -EREMOTE;
+	}
+	pthread_rwlock_rdlock(&segments_lock);
+	int fd = SegmentFd(loc.segment);
+	int ret = (fd < 0 || fdatasync(fd) != 0) ? -EIO : 0;
+	pthread_rwlock_unlock(&segments_lock);
+	return ret;
+}
+
+void PackStore::Free(const PackLocation &loc) {
+	if (loc.node != node) {
+		return;
+	}
+	uint32_t flags = 0;
+	uint64_t rec_pos = loc.offset - sizeof(pack_record);
+	pthread_rwlock_rdlock(&segments_lock);
+	int fd = SegmentFd(loc.segment);
+	if (fd >= 0) {
+		pwrite(fd, &flags, sizeof(flags), rec_pos + offsetof(pack_record, flags));
+		pthread_mutex_lock(&mutex);
+		Segment &seg = segments[loc.segment];
+		seg.live -= loc.capacity;
+		seg.dead += sizeof(pack_record) + loc.capacity;
+		if (loc.segment != active && seg.dead > compact_ratio * seg.size) {
+			pthread_cond_signal(&cond);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	pthread_rwlock_unlock(&segments_lock);
+}
+
+int PackStore::Relabel(const PackLocation &loc, const std::string &key) {
+	pack_record rec;
+	if (key.size() > sizeof(rec.key)) {
+		return -ENAMETOOLONG;
+	}
+	if (loc.node != node) {
+		return -EREMOTE;
+	}
+	rec.keylen = key.size();
+	memset(rec.key, 0, sizeof(rec.key));
+	memcpy(rec.key, key.data(), key.size());
+	uint64_t rec_pos = loc.offset - sizeof(pack_record);
+	size_t len = sizeof(rec) - offsetof(pack_record, keylen);
+	pthread_rwlock_rdlock(&segments_lock);
+	int fd = SegmentFd(loc.segment);
+	ssize_t n = (fd < 0) ? -1 : pwrite(fd, &rec.keylen, len,
+			rec_pos + offsetof(pack_record, keylen));
+	pthread_rwlock_unlock(&segments_lock);
+	return (n == (ssize_t) len) ? 0 : -EIO;
+}
+
+void PackStore::Compact(uint32_t segment) {
+	pthread_mutex_lock(&mutex);
+	int fd = segments[segment].fd;
+	uint64_t end = segments[segment].size;
+	pthread_mutex_unlock(&mutex);
+
+	// only this thread removes segments, so fd stays valid throughout
+	uint64_t pos = 0;
+	pack_record rec;
+	std::string buf;
+	int found;
+	while ((found = NextRecord(fd, end, pos, rec)) > 0) {
+		PackLocation from;
+		from.node = node;
+		from.segment = segment;
+		from.offset = pos + sizeof(rec);
+		from.capacity = rec.capacity;
+		pos = from.offset + rec.capacity;
+		if (!(rec.flags & RECORD_LIVE)) {
+			continue;
+		}
+
+		Lock();
+		// the record may have been freed or relabelled meanwhile
+		pread(fd, &rec, sizeof(rec), from.offset - sizeof(rec));
+		if (!(rec.flags & RECORD_LIVE)) {
+			Unlock();
+			continue;
+		}
+		buf.assign(rec.capacity, '\0');
+		ssize_t n = pread(fd, &buf[0], rec.capacity, from.offset);
+		std::string key(rec.key, rec.keylen);
+		PackLocation to;
+		bool moved = n >= 0 && Append(key, rec.inode, buf.data(), rec.capacity, to) == 0;
+		if (moved) {
+			int ret = relocate(relocate_arg, key, from, to);
+			if (ret == 0) {
+				bytes_moved += rec.capacity;
+			} else {
+				Free(to);
+				// nothing refers to from either: drop it and go on
+				moved = (ret == -ENOENT);
+			}
+			if (moved) {
+				Free(from);
+			}
+		}
+		Unlock();
+		if (!moved) {
+			logs->LogMsg("PackStore: cannot move inode %lu out of segment %u\n",
+					(unsigned long) rec.inode, segment);
+			return;
+		}
+	}
+	if (found < 0) {
+		// the rest of the segment was not seen: it may hold live extents
+		logs->LogMsg("PackStore: cannot read segment %u: %s\n", segment,
+				strerror(-found));
+		return;
+	}
+
+	pthread_rwlock_wrlock(&segments_lock);
+	pthread_mutex_lock(&mutex);
+	close(fd);
+	unlink(SegmentPath(segment).c_str());
+	segments.erase(segment);
+	++num_compactions;
+	pthread_mutex_unlock(&mutex);
+	pthread_rwlock_unlock(&segments_lock);
+}
+
+void* PackStore::CompactorMain(void* arg) {
+	PackStore* self = reinterpret_cast<PackStore*>(arg);
+	std::map<uint32_t, time_t> retry_at;
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		uint32_t victim = self->active;
+		time_t now = time(NULL);
+		for (std::map<uint32_t, Segment>::iterator it = self->segments.begin();
+				it != self->segments.end(); ++it) {
+			if (it->first != self->active
+					&& it->second.dead > self->compact_ratio * it->second.size
+					&& retry_at[it->first] <= now) {
+				victim = it->first;
+				break;
+			}
+		}
+		if (victim == self->active) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			struct timespec deadline;
+			deadline.tv_sec = tv.tv_sec + 1;
+			deadline.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&self->cond, &self->mutex, &deadline);
+			continue;
+		}
+		pthread_mutex_unlock(&self->mutex);
+		self->Compact(victim);
+		pthread_mutex_lock(&self->mutex);
+		// still there: something could not be moved, back off
+		retry_at[victim] = time(NULL) + COMPACT_RETRY_SEC;
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+void PackStore::Report(std::string &out) {
+	uint64_t live = 0, dead = 0;
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	for (std::map<uint32_t, Segment>::iterator it = segments.begin();
+			it != segments.end(); ++it) {
+		live += it->second.live;
+		dead += it->second.dead;
+	}
+	snprintf(line, sizeof(line),
+			"%zu segments, %lu live bytes, %lu dead bytes, "
+			"%lu compactions, %lu bytes moved\n", segments.size(),
+			(unsigned long) live, (unsigned long) dead,
+			(unsigned long) num_compactions, (unsigned long) bytes_moved);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
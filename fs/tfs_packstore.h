@@ -0,0 +1,147 @@
+#ifndef TFS_PACKSTORE_H_
+#define TFS_PACKSTORE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include "fs/tfs_inode.h"
+#include "util/logging.h"
+
+namespace TestFS {
+
+struct PackLocation {
+	uint32_t node;       // whose datadir/packs holds the extent
+	uint32_t segment;
+	uint64_t offset;     // of the data, just past its pack_record
+	uint32_t capacity;
+};
+
+// Every extent in a segment starts with this record. The key is the
+// owning inode's primary meta key, so compaction can find and update the
+// inode header when it moves the extent.
+struct pack_record {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t inode;
+	uint32_t capacity;
+	uint16_t keylen;
+	uint16_t reserved;
+	char key[56];
+} __attribute__((packed));
+
+// Blobs between the inline threshold and pack_threshold, packed into
+// append-only segment files under datadir/packs instead of one datadir
+// file each.
+//
+// An extent is allocated with some slack (Capacity()) so a growing file is
+// rewritten in place until it outgrows it; then it is appended again and
+// the old extent freed. Bytes past the file size inside an extent are kept
+// zero. Freed extents are marked dead in their record; a compaction thread
+// copies the live extents out of any sealed segment that is more than
+// compact_ratio dead, then deletes it. A record torn by a crash or a
+// failed append is stepped over, and its bytes count as dead.
+//
+// Callers that change an extent together with its inode header hold Lock()
+// across both, which keeps compaction from moving the extent in between.
+//
+// Locations carry the node id of the store that made them; another node's
+// extent is refused with -EREMOTE rather than looked up in this datadir.
+class PackStore {
+public:
+	// Called with Lock() held after an extent was copied to its new place.
+	// Returns 0 once the inode header points at to, -ENOENT if no inode
+	// refers to from any more (both copies are then freed), or another
+	// negative errno if the header could not be updated; the segment is
+	// then left alone and compaction tries again later.
+	typedef int (*RelocateFn)(void* arg, const std::string &key,
+			const PackLocation &from, const PackLocation &to);
+
+	PackStore(const std::string &dir, uint32_t node, uint64_t segment_size,
+			double compact_ratio, Logging* logs);
+
+	~PackStore();
+
+	// Scans existing segments for live and dead bytes and starts the
+	// compaction thread. Returns 0 or a negative errno.
+	int Open(RelocateFn relocate, void* arg);
+
+	void Lock();
+
+	void Unlock();
+
+	static uint32_t Capacity(size_t length);
+
+	int Append(const std::string &key, tfs_inode_t inode, const char* buf,
+			size_t length, PackLocation &loc);
+
+	// Reads within [0, length) of the extent, where length is the file size.
+	int Read(const PackLocation &loc, size_t length, char* buf, size_t size,
+			off_t offset);
+
+	// Writes in place; offset + size must fit the capacity.
+	int Write(const PackLocation &loc, const char* buf, size_t size,
+			off_t offset);
+
+	int Zero(const PackLocation &loc, off_t offset, size_t size);
+
+	int Sync(const PackLocation &loc);
+
+	void Free(const PackLocation &loc);
+
+	int Relabel(const PackLocation &loc, const std::string &key);
+
+	void Report(std::string &out);
+
+private:
+	struct Segment {
+		int fd;
+		uint64_t size;
+		uint64_t live;
+		uint64_t dead;
+	};
+
+	static const uint32_t RECORD_MAGIC = 0x5446504b;
+	static const uint32_t RECORD_LIVE = 1;
+
+	static void* CompactorMain(void* arg);
+
+	std::string SegmentPath(uint32_t segment);
+
+	// Finds the first whole record at or after pos and before limit,
+	// stepping over torn ones. Returns 1 with pos and rec set, 0 if there
+	// is none, or a negative errno.
+	static int NextRecord(int fd, uint64_t limit, uint64_t &pos,
+			pack_record &rec);
+
+	int ScanSegment(uint32_t segment);
+
+	int OpenActiveLocked(uint32_t segment);
+
+	int SegmentFd(uint32_t segment);
+
+	void Compact(uint32_t segment);
+
+	std::string dir;
+	uint32_t node;
+	uint64_t segment_size;
+	double compact_ratio;
+	Logging* logs;
+	RelocateFn relocate;
+	void* relocate_arg;
+
+	std::map<uint32_t, Segment> segments;
+	uint32_t active;
+	pthread_rwlock_t segments_lock;   // fd lifetime: shared for I/O
+	pthread_mutex_t mutex;            // active tail and byte counts
+	pthread_mutex_t extent_lock;      // see Lock()
+	pthread_cond_t cond;
+	pthread_t compactor;
+	bool running;
+	uint64_t num_compactions;
+	uint64_t bytes_moved;
+};
+
+}
+
+#endif
@@ -0,0 +1,193 @@
+#include "fs/tfs_placement.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "fs/tfs_rcdb.h"
+
+namespace TestFS {
+
+struct PassState {
+	PlacementPolicy* self;
+	time_t now;
+	uint64_t files[PlacementPolicy::NUM_TIERS];
+	uint64_t bytes[PlacementPolicy::NUM_TIERS];
+	uint64_t moved[PlacementPolicy::NUM_TIERS];
+	uint64_t refused;
+};
+
+PlacementPolicy::PlacementPolicy(RAMCloud::RamCloud* cluster,
+		uint64_t tableid, MoveFn move, AccessFn access, void* arg,
+		Logging* logs) :
+		cluster(cluster), tableid(tableid), move(move), access(access),
+		arg(arg), logs(logs), inline_max(0), inline_after_secs(0),
+		archive_min(0), archive_after_secs(0), running(false),
+		interval_secs(0), num_passes(0), num_refused(0) {
+	memset(files, 0, sizeof(files));
+	memset(bytes, 0, sizeof(bytes));
+	memset(num_moved, 0, sizeof(num_moved));
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+PlacementPolicy::~PlacementPolicy() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void PlacementPolicy::SetRules(uint64_t inline_max,
+		uint32_t inline_after_secs, uint64_t archive_min,
+		uint32_t archive_after_secs) {
+	this->inline_max = inline_max;
+	this->inline_after_secs = inline_after_secs;
+	this->archive_min = archive_min;
+	this->archive_after_secs = archive_after_secs;
+}
+
+void PlacementPolicy::Start(uint32_t interval_secs) {
+	this->interval_secs = interval_secs;
+	running = true;
+	pthread_create(&worker, NULL, PolicyMain, this);
+}
+
+void PlacementPolicy::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(worker, NULL);
+	}
+}
+
+void* PlacementPolicy::PolicyMain(void* arg) {
+	PlacementPolicy* self = reinterpret_cast<PlacementPolicy*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += self->interval_secs;
+		while (self->running && pthread_cond_timedwait(&self->cond,
+				&self->mutex, &deadline) != ETIMEDOUT) {
+		}
+		if (!self->running) {
+			break;
+		}
+		pthread_mutex_unlock(&self->mutex);
+		self->RunPass();
+		pthread_mutex_lock(&self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+int PlacementPolicy::TierOf(const tfs_inode_header &header) {
+	switch (header.has_blob) {
+	case 0:
+	case BLOB_SPLIT:
+	case BLOB_SHARED:
+		return TIER_INLINE;
+	case BLOB_ON_DISK:
+		return TIER_BLOB;
+	case BLOB_ARCHIVED:
+		return TIER_ARCHIVE;
+	default:
+		return -1;
+	}
+}
+
+PlacementPolicy::Tier PlacementPolicy::Target(Tier tier, uint64_t size,
+		time_t idle) const {
+	if (tier != TIER_BLOB) {
+		return tier;
+	}
+	if (inline_max > 0 && size <= inline_max
+			&& idle >= (time_t) inline_after_secs) {
+		return TIER_INLINE;
+	}
+	if (archive_after_secs > 0 && size >= archive_min
+			&& idle >= (time_t) archive_after_secs) {
+		return TIER_ARCHIVE;
+	}
+	return TIER_BLOB;
+}
+
+bool PlacementPolicy::VisitInode(void* arg, tfs_inode_t parent,
+		const std::string &value) {
+	PassState* state = reinterpret_cast<PassState*>(arg);
+	PlacementPolicy* self = state->self;
+	InodeHeader header(value.data(), value.size());
+	int tier = TierOf(*header);
+	if (!S_ISREG(header->fstat.st_mode) || header->cold_length != 0
+			|| tier < 0) {
+		return self->running;
+	}
+	uint64_t size = header->fstat.st_size;
+	time_t last = std::max(header->fstat.st_atim.tv_sec,
+			std::max(header->fstat.st_mtim.tv_sec,
+					header->fstat.st_ctim.tv_sec));
+	if (tier == TIER_BLOB) {
+		// reads of blob files do not touch the inode
+		last = std::max(last, self->access(self->arg,
+				header->fstat.st_ino));
+	}
+	Tier target = self->Target((Tier) tier, size, state->now - last);
+	if (target != tier) {
+		std::string key = MetaKeyString(parent,
+				value.data() + header.NameOffset(), header->namelen);
+		if (self->move(self->arg, key, target) == 0) {
+			++state->moved[target];
+			tier = target;
+		} else {
+			++state->refused;
+		}
+	}
+	++state->files[tier];
+	state->bytes[tier] += size;
+	return self->running;
+}
+
+void PlacementPolicy::RunPass() {
+	PassState state;
+	memset(&state, 0, sizeof(state));
+	state.self = this;
+	state.now = time(NULL);
+	WalkNamespace(cluster, tableid, VisitInode, &state);
+
+	pthread_mutex_lock(&mutex);
+	++num_passes;
+	for (int t = 0; t < NUM_TIERS; ++t) {
+		files[t] = state.files[t];
+		bytes[t] = state.bytes[t];
+		num_moved[t] += state.moved[t];
+	}
+	num_refused += state.refused;
+	pthread_mutex_unlock(&mutex);
+}
+
+void PlacementPolicy::Report(std::string &out) {
+	char line[512];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%lu passes; last saw %lu files (%lu bytes) inline, %lu (%lu) "
+			"in blobs, %lu (%lu) archived; moved %lu inline, %lu to blobs, "
+			"%lu to the archive, %lu moves refused\n",
+			(unsigned long) num_passes,
+			(unsigned long) files[TIER_INLINE],
+			(unsigned long) bytes[TIER_INLINE],
+			(unsigned long) files[TIER_BLOB],
+			(unsigned long) bytes[TIER_BLOB],
+			(unsigned long) files[TIER_ARCHIVE],
+			(unsigned long) bytes[TIER_ARCHIVE],
+			(unsigned long) num_moved[TIER_INLINE],
+			(unsigned long) num_moved[TIER_BLOB],
+			(unsigned long) num_moved[TIER_ARCHIVE],
+			(unsigned long) num_refused);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
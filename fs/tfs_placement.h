@@ -0,0 +1,99 @@
+#ifndef TFS_PLACEMENT_H_
+#define TFS_PLACEMENT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include "fs/tfs_inode.h"
+#include "util/logging.h"
+#include "RamCloud.h"
+
+namespace TestFS {
+
+// Background policy engine for the three data tiers: inline in the inode
+// value, a datadir blob file, and a compressed ArchiveStore extent.
+//
+// Every interval a pass walks the namespace and classifies each regular
+// file by size and by how long since it was last used, the newest of its
+// inode times and of the access time of its blob file:
+//
+//   blob, at most inline_max bytes, idle inline_after_secs  -> inline
+//   blob, at least archive_min bytes, idle archive_after_secs -> archive
+//
+// Nothing is promoted from the archive here: TestFS restores an archived
+// file into the blob tier on first access, where it stays while it is
+// used. Inline files leave the inline tier on the write that outgrows the
+// threshold, as before. Chunked, packed and remote blobs are not managed.
+//
+// Moves are made by the MoveFn, which rechecks the inode and may refuse
+// (e.g. the file is open); the pass only counts the outcome.
+class PlacementPolicy {
+public:
+	enum Tier {
+		TIER_INLINE = 0, TIER_BLOB = 1, TIER_ARCHIVE = 2, NUM_TIERS = 3,
+	};
+
+	// key is the primary meta key. Returns 0 or a negative errno.
+	typedef int (*MoveFn)(void* arg, const std::string &key, Tier to);
+
+	// When the blob file of inode was last read or written, 0 if unknown.
+	typedef time_t (*AccessFn)(void* arg, tfs_inode_t inode);
+
+	PlacementPolicy(RAMCloud::RamCloud* cluster, uint64_t tableid,
+			MoveFn move, AccessFn access, void* arg, Logging* logs);
+
+	~PlacementPolicy();
+
+	void SetRules(uint64_t inline_max, uint32_t inline_after_secs,
+			uint64_t archive_min, uint32_t archive_after_secs);
+
+	void Start(uint32_t interval_secs);
+
+	void Stop();
+
+	// The tier data of header is in, or -1 if it is not one we manage.
+	static int TierOf(const tfs_inode_header &header);
+
+	void Report(std::string &out);
+
+private:
+	static void* PolicyMain(void* arg);
+
+	void RunPass();
+
+	static bool VisitInode(void* arg, tfs_inode_t parent,
+			const std::string &value);
+
+	// The tier the rules want for a file now in tier.
+	Tier Target(Tier tier, uint64_t size, time_t idle) const;
+
+	RAMCloud::RamCloud* cluster;
+	uint64_t tableid;
+	MoveFn move;
+	AccessFn access;
+	void* arg;
+	Logging* logs;
+
+	uint64_t inline_max;
+	uint32_t inline_after_secs;
+	uint64_t archive_min;
+	uint32_t archive_after_secs;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t worker;
+	bool running;
+	uint32_t interval_secs;
+
+	// what the last pass saw, and the moves of all passes
+	uint64_t num_passes;
+	uint64_t files[NUM_TIERS];
+	uint64_t bytes[NUM_TIERS];
+	uint64_t num_moved[NUM_TIERS];
+	uint64_t num_refused;
+};
+
+}
+
+#endif
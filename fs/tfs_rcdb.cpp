@@ -1,4 +1,11 @@
 #include "tfs_rcdb.h"
+#include <errno.h>
+#include <cstring>
+#include <deque>
+#include "tfs_mdsclient.h"
+#include "tfs_compress.h"
+#include "tfs_tiering.h"
+#include "util/monitor.h"
 
 namespace TestFS {
 #define BIG_CONSTANT(x) (x##LLU)
@@ -50,18 +57,89 @@ uint64_t murmur64( const void * key, int len, uint64_t seed )
 char idkey[]="fileid";
 uint8_t keylength=25;
 uint8_t numKeys=2;
+uint8_t parentIndexId=1;
+
+// When set, every call below is forwarded to testfs-mdsproxy instead of
+// RAMCloud, and the cluster argument is ignored.
+static MdsClient* mds_proxy=NULL;
+
+void SetMdsProxy(MdsClient *proxy){
+	mds_proxy=proxy;
+}
+
+// When set, inode values are written through it and every value read is
+// expanded by it; without one (testfs-mdsproxy) values pass through as is.
+static InlineCompressor* inline_compressor=NULL;
+
+void SetInlineCompressor(InlineCompressor *compressor){
+	inline_compressor=compressor;
+}
+
+// When set, a stub it left in place of a cold inode is thawed by every
+// read below except ListDirectory, whose callers only need names. Without
+// one a stub is an error: values from testfs-mdsproxy come thawed.
+static MetaTiering* meta_tiering=NULL;
+
+void SetMetaTiering(MetaTiering *tiering){
+	meta_tiering=tiering;
+}
+
+static int ThawValue(const RAMCloud::KeyInfo &mykey,std::string &value,uint64_t *version){
+	if(!MetaTiering::IsStub(value.data(),value.size())){
+		return 0;
+	}
+	if(meta_tiering==NULL){
+		return -EIO;
+	}
+	return meta_tiering->Thaw(mykey,value,version);
+}
+
+static int ExpandValue(std::string &value){
+	if(inline_compressor!=NULL && !inline_compressor->Unpack(value)){
+		return -EIO;
+	}
+	return 0;
+}
+
+static int ExpandBuffer(RAMCloud::Buffer *buffer){
+	if(inline_compressor==NULL || buffer->size()==0){
+		return 0;
+	}
+	const char* data=static_cast<const char*>(buffer->getRange(0,buffer->size()));
+	if(!InlineCompressor::IsPacked(data,buffer->size())){
+		return 0;
+	}
+	std::string value(data,buffer->size());
+	buffer->reset();
+	if(ExpandValue(value)<0){
+		return -EIO;
+	}
+	buffer->appendCopy(value.data(),value.size());
+	return 0;
+}
 
 uint64_t ConnectDB(RAMCloud::RamCloud *cluster,char *tablename){
 	return cluster->getTableId(tablename);
 }
 
-uint64_t GetNextID(RAMCloud::RamCloud *cluster,uint64_t tableid){
-	return cluster->incrementInt64(tableid,idkey,strlen(idkey),1);
+int64_t GetNextID(RAMCloud::RamCloud *cluster,uint64_t tableid){
+	Monitor::CountRpc(RPC_INCREMENT,sizeof(uint64_t));
+	if(mds_proxy!=NULL){
+		uint64_t id;
+		int ret=mds_proxy->NextId(&id);
+		return (ret<0) ? ret : (int64_t) id;
+	}
+	try{
+		return cluster->incrementInt64(tableid,idkey,strlen(idkey),1);
+	}catch(RAMCloud::ClientException& e){
+		return -EIO;
+	}
 }
 
 uint64_t GetCurrentID(RAMCloud::RamCloud *cluster,uint64_t tableid){
 	RAMCloud::Buffer buf;
 	cluster->read(tableid,idkey,strlen(idkey),&buf);
+	Monitor::CountRpc(RPC_READ,buf.size());
 	const uint64_t* myid_p=static_cast<const uint64_t *>(buf.getRange(0,buf.size()));	
 	uint64_t myid=*myid_p;
 	return myid;
@@ -79,26 +157,203 @@ int MakeMetaKey(const char* filename, const int len, tfs_inode_t parentid,RAMClo
         mykeylist[1].keyLength=strlen(secondary_key);
 }
 
-int GetRamCloudBuffer(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo mykey,uint64_t tableid,RAMCloud::Buffer *buffer){
-	cluster->read(tableid,mykey.key,mykey.keyLength,buffer);
-	return 0;
+std::string MetaKeyString(const RAMCloud::KeyInfo &mykey){
+	return std::string(static_cast<const char*>(mykey.key),mykey.keyLength);
+}
+
+std::string MetaKeyString(tfs_inode_t parentid, tfs_hash_t hash_id){
+	char primary_key[64];
+	sprintf(primary_key,"%024lu%025lu",parentid,hash_id);
+	return std::string(primary_key);
+}
+
+std::string MetaKeyString(tfs_inode_t parentid, const char* filename, int len){
+	return MetaKeyString(parentid,murmur64(filename,len,123));
+}
+
+void ParseMetaKey(const RAMCloud::KeyInfo &mykey, tfs_inode_t &parentid, tfs_hash_t &hash_id){
+	std::string key=MetaKeyString(mykey);
+	parentid=strtoull(key.substr(0,24).c_str(),NULL,10);
+	hash_id=strtoull(key.substr(24).c_str(),NULL,10);
+}
+
+int GetRamCloudBuffer(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo mykey,uint64_t tableid,RAMCloud::Buffer *buffer,uint64_t *version){
+	if(mds_proxy!=NULL){
+		std::string value;
+		int ret=mds_proxy->Read(MetaKeyString(mykey),value,version);
+		Monitor::CountRpc(RPC_READ,value.size());
+		if(ret==0){
+			ret=ThawValue(mykey,value,version);
+		}
+		if(ret==0){
+			ret=ExpandValue(value);
+		}
+		if(ret==0){
+			buffer->appendCopy(value.data(),value.size());
+		}
+		return ret;
+	}
+	uint64_t stored_version;
+	cluster->read(tableid,mykey.key,mykey.keyLength,buffer,NULL,&stored_version);
+	Monitor::CountRpc(RPC_READ,buffer->size());
+	if(version!=NULL){
+		*version=stored_version;
+	}
+	const char* data=static_cast<const char*>(buffer->getRange(0,buffer->size()));
+	if(MetaTiering::IsStub(data,buffer->size())){
+		std::string value(data,buffer->size());
+		buffer->reset();
+		int ret=ThawValue(mykey,value,&stored_version);
+		if(ret<0){
+			return ret;
+		}
+		if(version!=NULL){
+			*version=stored_version;
+		}
+		buffer->appendCopy(value.data(),value.size());
+	}
+	return ExpandBuffer(buffer);
 }
 std::string CopytoString(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo mykey, uint64_t tableid){
 	RAMCloud::Buffer buffer;
 	std::string value;
-	cluster->read(tableid,mykey.key,mykey.keyLength,&buffer);
-	const char* result=static_cast<const char*>(buffer.getRange(0,buffer.size()));
-	value=std::string(result);
+	if(mds_proxy!=NULL){
+		int ret=mds_proxy->Read(MetaKeyString(mykey),value,NULL);
+		Monitor::CountRpc(RPC_READ,value.size());
+		if(ret==0){
+			ret=ThawValue(mykey,value,NULL);
+		}
+		if(ret<0){
+			value.clear();
+			return value;
+		}
+	} else {
+		uint64_t version;
+		cluster->read(tableid,mykey.key,mykey.keyLength,&buffer,NULL,&version);
+		Monitor::CountRpc(RPC_READ,buffer.size());
+		const char* result=static_cast<const char*>(buffer.getRange(0,buffer.size()));
+		// values hold '\0' bytes: the name terminator, header and data
+		value=std::string(result,buffer.size());
+		if(ThawValue(mykey,value,&version)<0){
+			value.clear();
+			return value;
+		}
+	}
+	if(ExpandValue(value)<0){
+		value.clear();
+	}
 	return value;
 } 
-int WriteString(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo *mykeylist, uint64_t tableid,std::string value)
+int WriteString(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo *mykeylist, uint64_t tableid,std::string value,uint64_t *version)
 { 
-	cluster->write(tableid,numKeys,mykeylist,value.data(),value.size());
+	std::string packed;
+	if(inline_compressor!=NULL && inline_compressor->Pack(value.data(),value.size(),packed)){
+		value.swap(packed);
+	}
+	Monitor::CountRpc(RPC_WRITE,value.size());
+	if(mds_proxy!=NULL){
+		return mds_proxy->Write(MetaKeyString(mykeylist[0]),MetaKeyString(mykeylist[1]),value.data(),value.size(),version);
+	}
+	cluster->write(tableid,numKeys,mykeylist,value.data(),value.size(),NULL,version);
+	return 0;
+}
+int WriteStringIf(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo *mykeylist, uint64_t tableid,std::string value,uint64_t given_version,uint64_t *version)
+{
+	std::string packed;
+	if(inline_compressor!=NULL && inline_compressor->Pack(value.data(),value.size(),packed)){
+		value.swap(packed);
+	}
+	Monitor::CountRpc(RPC_WRITE,value.size());
+	if(mds_proxy!=NULL){
+		return mds_proxy->WriteIf(MetaKeyString(mykeylist[0]),MetaKeyString(mykeylist[1]),value.data(),value.size(),given_version,version);
+	}
+	RAMCloud::RejectRules rules;
+	memset(&rules,0,sizeof(rules));
+	rules.givenVersion=given_version;
+	rules.versionNeGiven=1;
+	rules.doesntExist=1;
+	try{
+		cluster->write(tableid,numKeys,mykeylist,value.data(),value.size(),&rules,version);
+	}catch(RAMCloud::RejectRulesException& e){
+		return -EAGAIN;
+	}catch(RAMCloud::ObjectDoesntExistException& e){
+		return -EAGAIN;
+	}
+	return 0;
+}
+int WriteString(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo *mykeylist, uint64_t tableid,tfs_inode_val_t inode_val,uint64_t *version) 
+{
+	Monitor::CountRpc(RPC_WRITE,inode_val.size);
+	if(mds_proxy!=NULL){
+		return mds_proxy->Write(MetaKeyString(mykeylist[0]),MetaKeyString(mykeylist[1]),inode_val.value,inode_val.size,version);
+	}
+	cluster->write(tableid,numKeys,mykeylist,inode_val.value, inode_val.size,NULL,version);
+	return 0;
+}
+int RemoveKey(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo *mykeylist, uint64_t tableid,uint64_t *version)
+{
+	Monitor::CountRpc(RPC_REMOVE,0);
+	if(mds_proxy!=NULL){
+		return mds_proxy->Remove(MetaKeyString(mykeylist[0]),version);
+	}
+	cluster->remove(tableid,mykeylist[0].key,mykeylist[0].keyLength,NULL,version);
+	return 0;
+}
+int ListDirectory(RAMCloud::RamCloud *cluster, uint64_t tableid,const std::string &secondary_key,std::vector<std::string> &values)
+{
+	if(mds_proxy!=NULL){
+		int ret=mds_proxy->List(secondary_key,values);
+		uint64_t bytes=0;
+		for(size_t i=0;i<values.size();++i){
+			bytes+=values[i].size();
+			// a corrupt value keeps its readable header and name
+			ExpandValue(values[i]);
+		}
+		Monitor::CountRpc(RPC_INDEX_LOOKUP,bytes);
+		return ret;
+	}
+	RAMCloud::IndexKey::IndexKeyRange keyRange(parentIndexId,secondary_key.data(),secondary_key.size(),secondary_key.data(),secondary_key.size());
+	RAMCloud::IndexLookup rangeLookup(cluster,tableid,keyRange);
+	uint64_t bytes=0;
+	while(rangeLookup.getNext()){
+		uint32_t len;
+		const char* value=static_cast<const char*>(rangeLookup.currentObject()->getValue(&len));
+		values.push_back(std::string(value,len));
+		bytes+=len;
+		ExpandValue(values.back());
+	}
+	Monitor::CountRpc(RPC_INDEX_LOOKUP,bytes);
 	return 0;
 }
-int WriteString(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo *mykeylist, uint64_t tableid,tfs_inode_val_t inode_val) 
+int WalkNamespace(RAMCloud::RamCloud *cluster, uint64_t tableid, WalkFn fn, void *arg)
 {
-	cluster->write(tableid,numKeys,mykeylist,inode_val.value, inode_val.size);
+	std::deque<tfs_inode_t> dirs;
+	dirs.push_back(ROOT_INODE_ID);
+	while(!dirs.empty()){
+		tfs_inode_t parentid=dirs.front();
+		dirs.pop_front();
+		char secondary_key[32];
+		sprintf(secondary_key,"%024lu",parentid);
+		std::vector<std::string> values;
+		try{
+			ListDirectory(cluster,tableid,secondary_key,values);
+		}catch(RAMCloud::ClientException& e){
+			continue;
+		}
+		for(size_t i=0;i<values.size();++i){
+			InodeHeader header(values[i].data(),values[i].size());
+			// the root is listed under its own id with an empty name
+			if(!header.Valid() || header->namelen==0 || header->fstat.st_ino==parentid){
+				continue;
+			}
+			if(!fn(arg,parentid,values[i])){
+				return 0;
+			}
+			if(S_ISDIR(header->fstat.st_mode)){
+				dirs.push_back(header->fstat.st_ino);
+			}
+		}
+	}
 	return 0;
 }
 }
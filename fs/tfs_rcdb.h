@@ -8,17 +8,39 @@
 #include "IndexKey.h"
 #include "tfs_inode.h"
 #include "RamCloud.h"
+#include <string>
+#include <vector>
 
 
 namespace TestFS {
+	class MdsClient;
+	void SetMdsProxy(MdsClient *proxy);
+	class InlineCompressor;
+	void SetInlineCompressor(InlineCompressor *compressor);
+	class MetaTiering;
+	void SetMetaTiering(MetaTiering *tiering);
 	uint64_t ConnectDB(RAMCloud::RamCloud *cluster,char *tablename);
-	uint64_t GetNextID(RAMCloud::RamCloud *cluster,uint64_t tableid);
+	// Returns the next inode number, or -errno.
+	int64_t GetNextID(RAMCloud::RamCloud *cluster,uint64_t tableid);
 	uint64_t GetCurrentID(RAMCloud::RamCloud *cluster,uint64_t tableid);
 	int MakeMetaKey(char* filename, tfs_inode_t parentid,RAMCloud::KeyInfo *mykeylist);
-	int GetRamCloudBuffer(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo mykey,uint64_t tableid,RAMCloud::Buffer *value);
+	std::string MetaKeyString(const RAMCloud::KeyInfo &mykey);
+	std::string MetaKeyString(tfs_inode_t parentid, tfs_hash_t hash_id);
+	std::string MetaKeyString(tfs_inode_t parentid, const char* filename, int len);
+	void ParseMetaKey(const RAMCloud::KeyInfo &mykey, tfs_inode_t &parentid, tfs_hash_t &hash_id);
+	int GetRamCloudBuffer(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo mykey,uint64_t tableid,RAMCloud::Buffer *value,uint64_t *version=NULL);
 	std::string CopytoString(RAMCloud::RamCloud *cluster,RAMCloud::KeyInfo mykey, uint64_t tableid);
-	int WriteString(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo *mykeylist,uint64_t tableid,std::string value);
-	int WriteString(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo *mykeylist,uint64_t tableid,tfs_inode_val_t inode_val);
+	int WriteString(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo *mykeylist,uint64_t tableid,std::string value,uint64_t *version=NULL);
+	int WriteString(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo *mykeylist,uint64_t tableid,tfs_inode_val_t inode_val,uint64_t *version=NULL);
+	// Writes value only if the object is still at given_version, as read
+	// by GetRamCloudBuffer. Returns -EAGAIN if it changed or is gone.
+	int WriteStringIf(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo *mykeylist,uint64_t tableid,std::string value,uint64_t given_version,uint64_t *version=NULL);
+	int ListDirectory(RAMCloud::RamCloud *cluster, uint64_t tableid,const std::string &secondary_key,std::vector<std::string> &values);
+	// Calls fn with every inode value under the root, breadth first, until
+	// it returns false. Directories that cannot be listed are skipped.
+	typedef bool (*WalkFn)(void *arg, tfs_inode_t parentid, const std::string &value);
+	int WalkNamespace(RAMCloud::RamCloud *cluster, uint64_t tableid, WalkFn fn, void *arg);
+	int RemoveKey(RAMCloud::RamCloud *cluster, RAMCloud::KeyInfo *mykeylist,uint64_t tableid,uint64_t *version=NULL);
 }
 
 #endif
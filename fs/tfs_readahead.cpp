@@ -0,0 +1,99 @@
+#include "fs/tfs_readahead.h"
+#include <fcntl.h>
+#include <cstdio>
+
+namespace TestFS {
+
+Readahead::Readahead(size_t max_window, uint64_t cache_budget) :
+		max_window(max_window < MIN_WINDOW ? MIN_WINDOW : max_window),
+		cache_budget(cache_budget), num_streams(0), hinted_bytes(0),
+		dropped_bytes(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+Readahead::~Readahead() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void Readahead::OnRead(uint64_t handle, int fd, off_t offset, size_t size,
+		off_t file_size, bool shared) {
+	off_t end = offset + size;
+	off_t hint_from = 0, hint_len = 0, drop_from = 0, drop_len = 0;
+
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<uint64_t, Stream>::iterator it = streams.find(handle);
+	if (it == streams.end()) {
+		Stream fresh = { offset, 0, MIN_WINDOW, end, offset };
+		it = streams.insert(std::make_pair(handle, fresh)).first;
+	}
+	Stream &s = it->second;
+	// FUSE may deliver a stream's requests slightly out of order
+	bool sequential = offset <= s.next + (off_t) s.window
+			&& end > s.next - (off_t) s.window;
+	if (sequential) {
+		if (++s.run == SEQUENTIAL_READS) {
+			++num_streams;
+		}
+	} else {
+		s.run = 0;
+		s.window = MIN_WINDOW;
+		s.hinted_to = end;
+		s.dropped_to = offset;
+	}
+	if (sequential && offset > s.next && s.dropped_to < offset) {
+		// never read the gap; it may be someone else's
+		s.dropped_to = offset;
+	}
+	if (end > s.next) {
+		s.next = end;
+	}
+	if (s.run >= SEQUENTIAL_READS && s.hinted_to < file_size
+			&& s.hinted_to - end < (off_t) s.window / 2) {
+		// the stream has eaten into the second half of the window
+		hint_from = (s.hinted_to > end) ? s.hinted_to : end;
+		hint_len = s.window;
+		if (hint_from + hint_len > file_size) {
+			hint_len = file_size - hint_from;
+		}
+		s.hinted_to = hint_from + hint_len;
+		hinted_bytes += hint_len;
+		if (s.window < max_window) {
+			s.window *= 2;
+		}
+	}
+	if (s.run >= SEQUENTIAL_READS && !shared
+			&& (uint64_t) file_size > cache_budget
+			&& offset - (off_t) KEEP_BEHIND - s.dropped_to >= (off_t) KEEP_BEHIND) {
+		drop_from = s.dropped_to;
+		drop_len = offset - KEEP_BEHIND - drop_from;
+		s.dropped_to += drop_len;
+		dropped_bytes += drop_len;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (hint_len > 0) {
+		posix_fadvise(fd, hint_from, hint_len, POSIX_FADV_WILLNEED);
+	}
+	if (drop_len > 0) {
+		posix_fadvise(fd, drop_from, drop_len, POSIX_FADV_DONTNEED);
+	}
+}
+
+void Readahead::Forget(uint64_t handle) {
+	pthread_mutex_lock(&mutex);
+	streams.erase(handle);
+	pthread_mutex_unlock(&mutex);
+}
+
+void Readahead::Report(std::string &out) {
+	char line[160];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%lu sequential streams, %lu MB hinted, %lu MB dropped behind\n",
+			(unsigned long) num_streams, (unsigned long) (hinted_bytes >> 20),
+			(unsigned long) (dropped_bytes >> 20));
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
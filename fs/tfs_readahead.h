@@ -0,0 +1,65 @@
+#ifndef TFS_READAHEAD_H_
+#define TFS_READAHEAD_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+
+namespace TestFS {
+
+// Per-handle readahead for datadir blob files.
+//
+// Handles on one inode share a single descriptor (FdCache), so the
+// kernel's own readahead state sees their reads interleaved and gives
+// up on streams it would otherwise follow. This tracks each open handle
+// instead: once reads keep landing at the end of the previous one, the
+// range ahead of the stream is hinted with POSIX_FADV_WILLNEED, with a
+// window that doubles from MIN_WINDOW up to max_window. For a file
+// larger than cache_budget, the pages this stream read that are more than
+// KEEP_BEHIND behind it are dropped with POSIX_FADV_DONTNEED, so a big
+// scan recycles its own pages instead of evicting everyone else's. The
+// page cache is per file, so nothing is dropped while other handles have
+// the file open; they may still want those pages.
+class Readahead {
+public:
+	static const size_t MIN_WINDOW = 128 << 10;
+	static const size_t KEEP_BEHIND = 1 << 20;
+	static const int SEQUENTIAL_READS = 2;
+
+	Readahead(size_t max_window, uint64_t cache_budget);
+
+	~Readahead();
+
+	// After a read of size bytes at offset through fd on the handle;
+	// shared if other handles have the file open.
+	void OnRead(uint64_t handle, int fd, off_t offset, size_t size,
+			off_t file_size, bool shared);
+
+	void Forget(uint64_t handle);
+
+	void Report(std::string &out);
+
+private:
+	struct Stream {
+		off_t next;            // end of the last read
+		int run;               // consecutive sequential reads
+		size_t window;
+		off_t hinted_to;       // WILLNEED issued up to here
+		off_t dropped_to;      // DONTNEED issued up to here, or where
+		                       // this stream started reading
+	};
+
+	size_t max_window;
+	uint64_t cache_budget;
+	std::unordered_map<uint64_t, Stream> streams;
+	pthread_mutex_t mutex;
+	uint64_t num_streams;
+	uint64_t hinted_bytes;
+	uint64_t dropped_bytes;
+};
+
+}
+
+#endif
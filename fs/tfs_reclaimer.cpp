@@ -0,0 +1,244 @@
+#include "fs/tfs_reclaimer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+
+namespace TestFS {
+
+static uint64_t NowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+Reclaimer::Reclaimer(const std::string &queue_path, uint64_t files_per_sec,
+		uint64_t bytes_per_sec, Logging* logs) :
+		queue_path(queue_path), files_per_sec(files_per_sec),
+		bytes_per_sec(bytes_per_sec), logs(logs), queue_fd(-1),
+		done_since_rewrite(0), next_ns(0), running(false), num_queued(0),
+		num_recovered(0), num_reclaimed(0), num_failed(0), freed_bytes(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Reclaimer::~Reclaimer() {
+	Stop();
+	if (queue_fd >= 0) {
+		close(queue_fd);
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+int Reclaimer::Open() {
+	queue_fd = open(queue_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (queue_fd < 0) {
+		return -errno;
+	}
+	std::string contents;
+	char buf[65536];
+	ssize_t n;
+	while ((n = pread(queue_fd, buf, sizeof(buf), contents.size())) > 0) {
+		contents.append(buf, n);
+	}
+	if (n < 0) {
+		return -errno;
+	}
+	// a line cut short by a crash is not a path to unlink
+	size_t start = 0, end;
+	while ((end = contents.find('\n', start)) != std::string::npos) {
+		if (end > start) {
+			pending.push_back(contents.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+	num_recovered = pending.size();
+	if (start < contents.size()) {
+		RewriteLocked();
+	}
+	if (num_recovered > 0 && logs != NULL) {
+		logs->LogMsg("Reclaimer: %lu blobs left from a previous run\n",
+				(unsigned long) num_recovered);
+	}
+	return 0;
+}
+
+void Reclaimer::Start() {
+	running = true;
+	pthread_create(&worker, NULL, WorkerMain, this);
+}
+
+void Reclaimer::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(worker, NULL);
+	}
+}
+
+void Reclaimer::Enqueue(const std::string &path) {
+	std::string line = path + "\n";
+	pthread_mutex_lock(&mutex);
+	if (write(queue_fd, line.data(), line.size()) != (ssize_t) line.size()
+			&& logs != NULL) {
+		logs->LogMsg("Reclaimer: cannot queue %s: %s\n", path.c_str(),
+				strerror(errno));
+	}
+	pending.push_back(path);
+	++num_queued;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+bool Reclaimer::Pace(uint64_t cost_ns) {
+	pthread_mutex_lock(&mutex);
+	uint64_t now = NowNs();
+	if (next_ns < now) {
+		next_ns = now;
+	}
+	next_ns += cost_ns;
+	while (running && next_ns > now + BURST_NS) {
+		uint64_t wait_ns = next_ns - now - BURST_NS;
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += wait_ns / 1000000000ULL;
+		deadline.tv_nsec += wait_ns % 1000000000ULL;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&cond, &mutex, &deadline);
+		now = NowNs();
+	}
+	bool ok = running;
+	pthread_mutex_unlock(&mutex);
+	return ok;
+}
+
+bool Reclaimer::Reclaim(const std::string &path, uint64_t &freed) {
+	uint64_t file_cost = (files_per_sec > 0) ? 1000000000ULL / files_per_sec
+			: 0;
+	struct stat st;
+	uint64_t size = 0;
+	if (stat(path.c_str(), &st) == 0) {
+		size = (uint64_t) st.st_blocks * 512;
+	}
+	if (size > TRUNCATE_STEP) {
+		int fd = open(path.c_str(), O_WRONLY);
+		off_t length = st.st_size;
+		while (fd >= 0 && size > TRUNCATE_STEP) {
+			if (bytes_per_sec > 0
+					&& !Pace(TRUNCATE_STEP * 1000000000ULL / bytes_per_sec)) {
+				close(fd);
+				return false;
+			}
+			length = (length > (off_t) TRUNCATE_STEP) ? length - TRUNCATE_STEP : 0;
+			if (ftruncate(fd, length) != 0 || fstat(fd, &st) != 0) {
+				break;
+			}
+			freed += size - (uint64_t) st.st_blocks * 512;
+			size = (uint64_t) st.st_blocks * 512;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	uint64_t byte_cost = (bytes_per_sec > 0)
+			? size * 1000000000ULL / bytes_per_sec : 0;
+	if (!Pace(byte_cost > file_cost ? byte_cost : file_cost)) {
+		return false;
+	}
+	if (unlink(path.c_str()) == 0) {
+		freed += size;
+	} else if (errno != ENOENT) {
+		// already gone is fine: the queue may list a path twice after
+		// a crash
+		if (logs != NULL) {
+			logs->LogMsg("Reclaimer: cannot unlink %s: %s\n", path.c_str(),
+					strerror(errno));
+		}
+		pthread_mutex_lock(&mutex);
+		++num_failed;
+		pthread_mutex_unlock(&mutex);
+	}
+	return true;
+}
+
+void Reclaimer::RewriteLocked() {
+	std::string tmp_path = queue_path + ".tmp";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			0644);
+	if (fd < 0) {
+		return;
+	}
+	std::string contents;
+	for (size_t i = 0; i < pending.size(); ++i) {
+		contents.append(pending[i]).append("\n");
+	}
+	if (write(fd, contents.data(), contents.size()) != (ssize_t) contents.size()
+			|| fsync(fd) != 0 || rename(tmp_path.c_str(), queue_path.c_str()) != 0) {
+		close(fd);
+		unlink(tmp_path.c_str());
+		return;
+	}
+	close(queue_fd);
+	queue_fd = fd;
+	done_since_rewrite = 0;
+}
+
+void* Reclaimer::WorkerMain(void* arg) {
+	Reclaimer* self = reinterpret_cast<Reclaimer*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		if (self->pending.empty()) {
+			if (self->done_since_rewrite > 0) {
+				// everything the file lists is freed
+				if (ftruncate(self->queue_fd, 0) == 0) {
+					self->done_since_rewrite = 0;
+				}
+			}
+			pthread_cond_wait(&self->cond, &self->mutex);
+			continue;
+		}
+		std::string path = self->pending.front();
+		pthread_mutex_unlock(&self->mutex);
+		uint64_t freed = 0;
+		bool finished = self->Reclaim(path, freed);
+		pthread_mutex_lock(&self->mutex);
+		self->freed_bytes += freed;
+		if (!finished) {
+			// still listed in the file; the next Open() picks it up
+			break;
+		}
+		self->pending.pop_front();
+		++self->num_reclaimed;
+		if (++self->done_since_rewrite >= REWRITE_EVERY
+				&& !self->pending.empty()) {
+			self->RewriteLocked();
+		}
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+void Reclaimer::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%lu queued, %lu recovered, %lu reclaimed, %lu MB freed, "
+			"%lu failed, %zu pending\n",
+			(unsigned long) num_queued, (unsigned long) num_recovered,
+			(unsigned long) num_reclaimed, (unsigned long) (freed_bytes >> 20),
+			(unsigned long) num_failed, pending.size());
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+}
+
+}
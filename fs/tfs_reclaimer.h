@@ -0,0 +1,86 @@
+#ifndef TFS_RECLAIMER_H_
+#define TFS_RECLAIMER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include "util/logging.h"
+
+namespace TestFS {
+
+// Frees the datadir files of unlinked inodes in the background.
+//
+// Unlink removes the inode and hands the blob path to Enqueue(), which
+// appends it to a queue file and returns; a worker thread unlinks the
+// files at no more than files_per_sec files and bytes_per_sec bytes per
+// second. Files larger than TRUNCATE_STEP are shrunk a step at a time
+// first, so freeing a huge file does not stall the device in one go.
+//
+// The queue file is only appended to and is emptied whenever the worker
+// catches up (rewritten every REWRITE_EVERY files if it never does). Open()
+// queues whatever it still lists, which finishes the reclamation a crash
+// or an unmount interrupted. Paths enqueued just before a crash may not
+// have reached the file; those blobs leak, the inode is already gone.
+class Reclaimer {
+public:
+	static const uint64_t TRUNCATE_STEP = 1ULL << 30;
+	static const uint64_t REWRITE_EVERY = 65536;
+	// pacing lets the worker run this far ahead of the rates
+	static const uint64_t BURST_NS = 100000000ULL;
+
+	Reclaimer(const std::string &queue_path, uint64_t files_per_sec,
+			uint64_t bytes_per_sec, Logging* logs);
+
+	~Reclaimer();
+
+	// Opens the queue file and queues the paths it lists. Returns 0 or a
+	// negative errno.
+	int Open();
+
+	void Start();
+
+	// Stops the worker; paths not yet freed stay in the queue file.
+	void Stop();
+
+	void Enqueue(const std::string &path);
+
+	void Report(std::string &out);
+
+private:
+	static void* WorkerMain(void* arg);
+
+	// Frees one file and adds the bytes it held to freed. Returns false
+	// if Stop() interrupted it.
+	bool Reclaim(const std::string &path, uint64_t &freed);
+
+	// Sleeps until the pacing clock allows cost_ns more work. Returns
+	// false if the reclaimer is stopping.
+	bool Pace(uint64_t cost_ns);
+
+	// Writes pending to a new queue file. Called with mutex held.
+	void RewriteLocked();
+
+	std::string queue_path;
+	uint64_t files_per_sec;
+	uint64_t bytes_per_sec;
+	Logging* logs;
+	int queue_fd;
+	std::deque<std::string> pending;
+	uint64_t done_since_rewrite;
+	uint64_t next_ns;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t worker;
+	bool running;
+
+	uint64_t num_queued;
+	uint64_t num_recovered;
+	uint64_t num_reclaimed;
+	uint64_t num_failed;
+	uint64_t freed_bytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,293 @@
+#include "fs/tfs_threshold.h"
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace TestFS {
+
+static const uint64_t MIN_GROUP_SAMPLES = 32;
+static const uint64_t RECOMPUTE_INTERVAL = 1024;
+
+ThresholdPolicy::Histogram::Histogram() :
+		samples(0), threshold(0), level(0) {
+	memset(count, 0, sizeof(count));
+	memset(bytes, 0, sizeof(bytes));
+}
+
+ThresholdPolicy::ThresholdPolicy(uint64_t default_threshold,
+		uint64_t min_threshold, uint64_t max_threshold, uint64_t budget_bytes,
+		size_t max_groups, size_t max_files) :
+		default_threshold(default_threshold), budget_bytes(budget_bytes),
+		min_samples(MIN_GROUP_SAMPLES),
+		recompute_interval(RECOMPUTE_INTERVAL), max_groups(max_groups),
+		max_files(max_files), since_recompute(0),
+		dir_inline_bytes(0), ext_inline_bytes(0) {
+	min_level = Bucket(min_threshold);
+	max_level = Bucket(max_threshold);
+	if (max_level < min_level) {
+		max_level = min_level;
+	}
+	this->max_threshold = 1ULL << max_level;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ThresholdPolicy::~ThresholdPolicy() {
+	pthread_mutex_destroy(&mutex);
+}
+
+int ThresholdPolicy::Bucket(uint64_t size) {
+	if (size <= 1) {
+		return 0;
+	}
+	int bucket = 64 - __builtin_clzll(size - 1);
+	return (bucket < NUM_BUCKETS) ? bucket : NUM_BUCKETS - 1;
+}
+
+void ThresholdPolicy::Add(Histogram &h, int bucket, uint64_t size) {
+	h.count[bucket]++;
+	h.bytes[bucket] += size;
+	h.samples++;
+}
+
+void ThresholdPolicy::Subtract(Histogram &h, int bucket, uint64_t size) {
+	// a group dropped and recreated since the sample was added may not
+	// hold it
+	if (h.count[bucket] == 0) {
+		return;
+	}
+	h.count[bucket]--;
+	h.bytes[bucket] -= (h.bytes[bucket] < size) ? h.bytes[bucket] : size;
+	h.samples--;
+}
+
+void ThresholdPolicy::Drop(const FileSample &sample) {
+	int bucket = Bucket(sample.size);
+	Subtract(total, bucket, sample.size);
+	GroupMap::iterator it = dirs.find(sample.dir);
+	if (it != dirs.end()) {
+		Subtract(it->second, bucket, sample.size);
+	}
+	it = exts.find(sample.ext);
+	if (it != exts.end()) {
+		Subtract(it->second, bucket, sample.size);
+	}
+}
+
+ThresholdPolicy::Histogram* ThresholdPolicy::Group(GroupMap &groups,
+		const std::string &key) {
+	GroupMap::iterator it = groups.find(key);
+	if (it != groups.end()) {
+		return &it->second;
+	}
+	if (groups.size() >= max_groups) {
+		for (it = groups.begin(); it != groups.end();) {
+			if (it->second.samples < min_samples) {
+				it = groups.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (groups.size() >= max_groups) {
+			return NULL;
+		}
+	}
+	return &groups[key];
+}
+
+void ThresholdPolicy::SplitPath(const char* path, std::string &dir,
+		std::string &ext) {
+	const char* slash = strrchr(path, '/');
+	const char* name = (slash == NULL) ? path : slash + 1;
+	dir = (slash == NULL || slash == path) ? "/" : std::string(path, slash - path);
+	const char* dot = strrchr(name, '.');
+	// dotfiles without another dot have no extension
+	ext = (dot == NULL || dot == name) ? "" : std::string(dot + 1);
+}
+
+void ThresholdPolicy::Record(uint64_t inode, const std::string &dir,
+		const std::string &ext, uint64_t size) {
+	int bucket = Bucket(size);
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<uint64_t, FileSample>::iterator f = files.find(inode);
+	if (f != files.end()) {
+		Drop(f->second);
+	} else if (files.size() >= max_files) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	} else {
+		f = files.insert(std::make_pair(inode, FileSample())).first;
+	}
+	f->second.dir = dir;
+	f->second.ext = ext;
+	f->second.size = size;
+	Add(total, bucket, size);
+	Histogram* d = Group(dirs, dir);
+	if (d != NULL) {
+		Add(*d, bucket, size);
+	}
+	Histogram* e = Group(exts, ext);
+	if (e != NULL) {
+		Add(*e, bucket, size);
+	}
+	if (++since_recompute >= recompute_interval) {
+		since_recompute = 0;
+		Recompute();
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void ThresholdPolicy::Forget(uint64_t inode) {
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<uint64_t, FileSample>::iterator f = files.find(inode);
+	if (f != files.end()) {
+		Drop(f->second);
+		files.erase(f);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+uint64_t ThresholdPolicy::Fit(GroupMap &groups) {
+	typedef std::pair<double, Histogram*> Step;
+	std::priority_queue<Step> steps;
+	uint64_t used = 0;
+	for (GroupMap::iterator it = groups.begin(); it != groups.end(); ++it) {
+		Histogram &h = it->second;
+		h.level = min_level;
+		for (int i = 0; i <= min_level; ++i) {
+			used += h.bytes[i];
+		}
+		if (h.level < max_level) {
+			int k = h.level + 1;
+			steps.push(Step((double) h.count[k] / (h.bytes[k] + 1), &h));
+		}
+	}
+	while (!steps.empty()) {
+		Histogram* h = steps.top().second;
+		steps.pop();
+		int k = h->level + 1;
+		uint64_t bytes = h->bytes[k];
+		if (used + bytes > budget_bytes) {
+			// thresholds are contiguous: this group stops here
+			continue;
+		}
+		used += bytes;
+		h->level = k;
+		if (k < max_level) {
+			++k;
+			steps.push(Step((double) h->count[k] / (h->bytes[k] + 1), h));
+		}
+	}
+	for (GroupMap::iterator it = groups.begin(); it != groups.end(); ++it) {
+		it->second.threshold = 1ULL << it->second.level;
+	}
+	return used;
+}
+
+void ThresholdPolicy::Recompute() {
+	dir_inline_bytes = Fit(dirs);
+	ext_inline_bytes = Fit(exts);
+}
+
+uint64_t ThresholdPolicy::Threshold(const std::string &dir,
+		const std::string &ext) {
+	uint64_t threshold = default_threshold;
+	pthread_mutex_lock(&mutex);
+	GroupMap::iterator it = dirs.find(dir);
+	if (it != dirs.end() && it->second.threshold > 0
+			&& it->second.samples >= min_samples) {
+		threshold = it->second.threshold;
+	} else if ((it = exts.find(ext)) != exts.end() && it->second.threshold > 0
+			&& it->second.samples >= min_samples) {
+		threshold = it->second.threshold;
+	}
+	pthread_mutex_unlock(&mutex);
+	return threshold;
+}
+
+void ThresholdPolicy::Report(std::string &out) {
+	char line[256];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"inline budget %lu bytes, estimated %lu (by dir) %lu (by ext), "
+			"%zu files, %zu dirs, %zu exts\n", (unsigned long) budget_bytes,
+			(unsigned long) dir_inline_bytes, (unsigned long) ext_inline_bytes,
+			files.size(), dirs.size(), exts.size());
+	out.append(line);
+	for (int i = 0; i < NUM_BUCKETS; ++i) {
+		if (total.count[i] > 0) {
+			snprintf(line, sizeof(line), "  <= %llu: %lu files %lu bytes\n",
+					1ULL << i, (unsigned long) total.count[i],
+					(unsigned long) total.bytes[i]);
+			out.append(line);
+		}
+	}
+	for (GroupMap::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+		if (it->second.samples >= min_samples) {
+			snprintf(line, sizeof(line), "  dir %s: threshold %lu\n",
+					it->first.c_str(), (unsigned long) it->second.threshold);
+			out.append(line);
+		}
+	}
+	for (GroupMap::iterator it = exts.begin(); it != exts.end(); ++it) {
+		if (it->second.samples >= min_samples) {
+			snprintf(line, sizeof(line), "  ext .%s: threshold %lu\n",
+					it->first.c_str(), (unsigned long) it->second.threshold);
+			out.append(line);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+ThresholdOverrides::ThresholdOverrides(size_t capacity, uint64_t lease_ms) :
+		capacity(capacity), lease_ms(lease_ms) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ThresholdOverrides::~ThresholdOverrides() {
+	pthread_mutex_destroy(&mutex);
+}
+
+uint64_t ThresholdOverrides::NowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+bool ThresholdOverrides::Get(const std::string &dir, uint32_t &threshold) {
+	bool found = false;
+	pthread_mutex_lock(&mutex);
+	std::unordered_map<std::string, Entry>::iterator it = entries.find(dir);
+	if (it != entries.end()) {
+		if (it->second.expire_ms > NowMs()) {
+			threshold = it->second.threshold;
+			found = true;
+		} else {
+			entries.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return found;
+}
+
+void ThresholdOverrides::Put(const std::string &dir, uint32_t threshold) {
+	pthread_mutex_lock(&mutex);
+	if (entries.size() >= capacity && entries.find(dir) == entries.end()) {
+		// refetching a few directories is cheaper than tracking recency
+		entries.clear();
+	}
+	Entry &entry = entries[dir];
+	entry.threshold = threshold;
+	entry.expire_ms = NowMs() + lease_ms;
+	pthread_mutex_unlock(&mutex);
+}
+
+void ThresholdOverrides::Clear() {
+	pthread_mutex_lock(&mutex);
+	entries.clear();
+	pthread_mutex_unlock(&mutex);
+}
+
+}
@@ -0,0 +1,149 @@
+#ifndef TFS_THRESHOLD_H_
+#define TFS_THRESHOLD_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+
+namespace TestFS {
+
+// Picks the inline-data threshold per directory and per file extension from
+// the sizes of the files that currently exist.
+//
+// A file's size is sampled when it is released after writing and kept
+// until it is released again or unlinked, so the power-of-two histograms
+// (bucket k holds sizes in (2^(k-1), 2^k]) count each live file once, at
+// its last size. Every recompute_interval samples the thresholds are
+// rebuilt greedily: starting every group at min_threshold, the next doubling
+// with the most files per inline byte wins, until the estimated inline bytes
+// reach budget_bytes or every group is at max_threshold. Directories and
+// extensions each partition the files, so each is fitted to the budget on
+// its own; a file uses its directory's threshold once the directory has
+// min_samples, else its extension's, else the default.
+//
+// At most max_files files are tracked; files released while the table is
+// full are not sampled until room is made by an unlink. At most max_groups
+// directories and as many extensions are tracked; when a map is full, the
+// groups that have not reached min_samples make room, and a new group's
+// samples only count towards the other map until then.
+class ThresholdPolicy {
+public:
+	ThresholdPolicy(uint64_t default_threshold, uint64_t min_threshold,
+			uint64_t max_threshold, uint64_t budget_bytes,
+			size_t max_groups = 65536, size_t max_files = 1 << 20);
+
+	~ThresholdPolicy();
+
+	// Samples inode at size, replacing its previous sample.
+	void Record(uint64_t inode, const std::string &dir, const std::string &ext,
+			uint64_t size);
+
+	// Drops the sample of an unlinked inode.
+	void Forget(uint64_t inode);
+
+	uint64_t Threshold(const std::string &dir, const std::string &ext);
+
+	uint64_t MaxThreshold() const {
+		return max_threshold;
+	}
+
+	void Report(std::string &out);
+
+	// "/a/b/c.txt" -> dir "/a/b", ext "txt"
+	static void SplitPath(const char* path, std::string &dir, std::string &ext);
+
+	static const int NUM_BUCKETS = 48;
+
+private:
+	struct Histogram {
+		uint64_t count[NUM_BUCKETS];
+		uint64_t bytes[NUM_BUCKETS];
+		uint64_t samples;
+		uint64_t threshold;
+		int level;
+
+		Histogram();
+	};
+
+	// The sample a live file contributes, and the groups it went to.
+	struct FileSample {
+		std::string dir;
+		std::string ext;
+		uint64_t size;
+	};
+
+	typedef std::unordered_map<std::string, Histogram> GroupMap;
+
+	static int Bucket(uint64_t size);
+
+	static void Add(Histogram &h, int bucket, uint64_t size);
+
+	static void Subtract(Histogram &h, int bucket, uint64_t size);
+
+	// Takes a file's sample back out of total and, if they are still
+	// tracked, its groups.
+	void Drop(const FileSample &sample);
+
+	// Returns the group for key, or NULL when groups is full even after
+	// dropping the groups below min_samples.
+	Histogram* Group(GroupMap &groups, const std::string &key);
+
+	// Returns the estimated inline bytes of the fitted groups.
+	uint64_t Fit(GroupMap &groups);
+
+	void Recompute();
+
+	uint64_t default_threshold;
+	int min_level;
+	int max_level;
+	uint64_t max_threshold;
+	uint64_t budget_bytes;
+	uint64_t min_samples;
+	uint64_t recompute_interval;
+	size_t max_groups;
+	size_t max_files;
+	uint64_t since_recompute;
+	uint64_t dir_inline_bytes;
+	uint64_t ext_inline_bytes;
+	Histogram total;
+	GroupMap dirs;
+	GroupMap exts;
+	std::unordered_map<uint64_t, FileSample> files;
+	pthread_mutex_t mutex;
+};
+
+// The INLINE_THRESHOLD_XATTR in effect for each directory: its own, else
+// its nearest ancestor's, or 0. It sits next to the MetaCache with the
+// same lease, so another mount's change is seen within lease_ms; local
+// changes Clear() it, as one xattr covers a whole subtree.
+class ThresholdOverrides {
+public:
+	ThresholdOverrides(size_t capacity, uint64_t lease_ms);
+
+	~ThresholdOverrides();
+
+	// Returns false if dir is not cached or its lease has expired.
+	bool Get(const std::string &dir, uint32_t &threshold);
+
+	void Put(const std::string &dir, uint32_t threshold);
+
+	void Clear();
+
+private:
+	struct Entry {
+		uint32_t threshold;
+		uint64_t expire_ms;
+	};
+
+	static uint64_t NowMs();
+
+	size_t capacity;
+	uint64_t lease_ms;
+	std::unordered_map<std::string, Entry> entries;
+	pthread_mutex_t mutex;
+};
+
+}
+
+#endif
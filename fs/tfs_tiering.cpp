@@ -0,0 +1,457 @@
+#include "fs/tfs_tiering.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include "fs/tfs_rcdb.h"
+#include "ClientException.h"
+#include "util/monitor.h"
+
+namespace TestFS {
+
+MetaTiering::MetaTiering(RAMCloud::RamCloud* cluster, uint64_t tableid,
+		ColdStore* store, BlobClient* blobclient, uint32_t node_id,
+		Logging* logs) :
+		cluster(cluster), tableid(tableid), store(store),
+		blobclient(blobclient), node_id(node_id), logs(logs),
+		budget_bytes(0), cold_secs(0), min_idle_secs(0), min_bytes(0),
+		running(false), interval_secs(0), clean_cursor(0), live_bytes(0),
+		segment_bytes(0), num_passes(0), last_resident(0), last_stubs(0),
+		num_frozen(0), bytes_frozen(0), num_races(0), num_thawed(0),
+		num_thawed_remote(0), num_relocated(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+MetaTiering::~MetaTiering() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void MetaTiering::SetPolicy(uint64_t budget_bytes, uint32_t cold_secs,
+		uint32_t min_idle_secs, size_t min_bytes) {
+	this->budget_bytes = budget_bytes;
+	this->cold_secs = cold_secs;
+	this->min_idle_secs = min_idle_secs;
+	this->min_bytes = min_bytes;
+}
+
+void MetaTiering::Start(uint32_t interval_secs) {
+	this->interval_secs = interval_secs;
+	running = true;
+	pthread_create(&worker, NULL, TieringMain, this);
+}
+
+void MetaTiering::Stop() {
+	pthread_mutex_lock(&mutex);
+	bool was_running = running;
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	if (was_running) {
+		pthread_join(worker, NULL);
+	}
+}
+
+void* MetaTiering::TieringMain(void* arg) {
+	MetaTiering* self = reinterpret_cast<MetaTiering*>(arg);
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		pthread_mutex_unlock(&self->mutex);
+		self->RunPass();
+		pthread_mutex_lock(&self->mutex);
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += self->interval_secs;
+		while (self->running && pthread_cond_timedwait(&self->cond,
+				&self->mutex, &deadline) != ETIMEDOUT) {
+		}
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+bool MetaTiering::IsStub(const char* value, size_t size) {
+	InodeHeader header(value, size);
+	return header.Valid() && header->cold_length != 0;
+}
+
+std::string MetaTiering::BuildStub(const tfs_inode_header &header,
+		const char* name, const ColdLocation &loc, uint32_t node) {
+	tfs_inode_header stub;
+	memset(&stub, 0, sizeof(stub));
+	stub.fstat.st_ino = header.fstat.st_ino;
+	stub.fstat.st_mode = header.fstat.st_mode;
+	stub.namelen = header.namelen;
+	stub.cold_node = node;
+	stub.cold_segment = loc.segment;
+	stub.cold_offset = loc.offset;
+	stub.cold_length = loc.length;
+	char encoded[TFS_INODE_MAX_ENCODED];
+	std::string value(encoded, EncodeInodeHeader(stub, encoded));
+	value.append(name, header.namelen);
+	value.push_back('\0');
+	return value;
+}
+
+int MetaTiering::WriteIf(const std::string &key, const std::string &value,
+		uint64_t version, uint64_t *new_version) {
+	RAMCloud::KeyInfo keys[2];
+	keys[0].key = key.data();
+	keys[0].keyLength = key.size();
+	// the parent id, which ListDirectory looks children up by
+	keys[1].key = key.data();
+	keys[1].keyLength = 24;
+	RAMCloud::RejectRules rules;
+	memset(&rules, 0, sizeof(rules));
+	rules.givenVersion = version;
+	rules.versionNeGiven = 1;
+	Monitor::CountRpc(RPC_WRITE, value.size());
+	try {
+		cluster->write(tableid, 2, keys, value.data(), value.size(), &rules,
+				new_version);
+	} catch (RAMCloud::RejectRulesException& e) {
+		return -EAGAIN;
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
+		return -EAGAIN;
+	} catch (RAMCloud::ClientException& e) {
+		return -EIO;
+	}
+	return 0;
+}
+
+void MetaTiering::RunPass() {
+	std::vector<Candidate> candidates;
+	uint64_t resident = 0;
+	Walk(candidates, resident);
+	std::sort(candidates.begin(), candidates.end());
+
+	time_t now = time(NULL);
+	uint64_t over = (budget_bytes > 0 && resident > budget_bytes) ?
+			resident - budget_bytes : 0;
+	std::vector<std::string> batch;
+	for (size_t i = 0; i < candidates.size() && running; ++i) {
+		const Candidate &c = candidates[i];
+		bool cold = cold_secs > 0 && now - c.last_access >= (time_t) cold_secs;
+		if (!cold && over == 0) {
+			// the rest are younger still
+			break;
+		}
+		batch.push_back(c.key);
+		over = (over > c.size) ? over - c.size : 0;
+		if (batch.size() == FREEZE_BATCH) {
+			FreezeBatch(batch);
+			batch.clear();
+		}
+	}
+	if (!batch.empty()) {
+		FreezeBatch(batch);
+	}
+	Clean();
+
+	pthread_mutex_lock(&mutex);
+	++num_passes;
+	last_resident = resident;
+	pthread_mutex_unlock(&mutex);
+}
+
+struct MetaTiering::WalkState {
+	MetaTiering* self;
+	time_t now;
+	uint64_t resident;
+	uint64_t stubs;
+	// a max-heap on last access, so the most recent is dropped at the cap
+	std::priority_queue<Candidate> oldest;
+};
+
+bool MetaTiering::VisitInode(void* arg, tfs_inode_t parent,
+		const std::string &value) {
+	WalkState* state = reinterpret_cast<WalkState*>(arg);
+	MetaTiering* self = state->self;
+	InodeHeader header(value.data(), value.size());
+	state->resident += value.size();
+	if (header->cold_length != 0) {
+		++state->stubs;
+		return self->running;
+	}
+	if (S_ISDIR(header->fstat.st_mode) || value.size() < self->min_bytes) {
+		return self->running;
+	}
+	Candidate c;
+	c.last_access = std::max(header->fstat.st_atim.tv_sec,
+			std::max(header->fstat.st_mtim.tv_sec,
+					header->fstat.st_ctim.tv_sec));
+	if (state->now - c.last_access < (time_t) self->min_idle_secs) {
+		return self->running;
+	}
+	c.key = MetaKeyString(parent, value.data() + header.NameOffset(),
+			header->namelen);
+	c.size = value.size();
+	state->oldest.push(c);
+	if (state->oldest.size() > MAX_CANDIDATES) {
+		state->oldest.pop();
+	}
+	return self->running;
+}
+
+void MetaTiering::Walk(std::vector<Candidate> &candidates,
+		uint64_t &resident) {
+	WalkState state;
+	state.self = this;
+	state.now = time(NULL);
+	state.resident = 0;
+	state.stubs = 0;
+	WalkNamespace(cluster, tableid, VisitInode, &state);
+	while (!state.oldest.empty()) {
+		candidates.push_back(state.oldest.top());
+		state.oldest.pop();
+	}
+	resident = state.resident;
+	pthread_mutex_lock(&mutex);
+	last_stubs = state.stubs;
+	pthread_mutex_unlock(&mutex);
+}
+
+void MetaTiering::FreezeBatch(const std::vector<std::string> &keys) {
+	std::vector<Relocation> appended;
+	std::vector<std::string> stubs;
+	std::vector<size_t> sizes;
+	time_t now = time(NULL);
+	for (size_t i = 0; i < keys.size(); ++i) {
+		RAMCloud::Buffer buf;
+		Relocation r;
+		try {
+			cluster->read(tableid, keys[i].data(), keys[i].size(), &buf, NULL,
+					&r.version);
+		} catch (RAMCloud::ClientException& e) {
+			// removed since the walk
+			continue;
+		}
+		Monitor::CountRpc(RPC_READ, buf.size());
+		const char* value = static_cast<const char*>(buf.getRange(0,
+				buf.size()));
+		InodeHeader header(value, buf.size());
+		// used or changed since the walk saw it
+		if (!header.Valid() || header->cold_length != 0
+				|| now - header->fstat.st_atim.tv_sec < (time_t) min_idle_secs
+				|| now - header->fstat.st_mtim.tv_sec < (time_t) min_idle_secs) {
+			continue;
+		}
+		if (store->Append(keys[i], value, buf.size(), r.loc) < 0) {
+			break;
+		}
+		r.key = keys[i];
+		appended.push_back(r);
+		stubs.push_back(BuildStub(*header, value + header.NameOffset(),
+				r.loc, node_id));
+		sizes.push_back(buf.size());
+	}
+	if (appended.empty() || store->Sync() < 0) {
+		return;
+	}
+	uint64_t frozen = 0, freed = 0, races = 0;
+	for (size_t i = 0; i < appended.size(); ++i) {
+		if (WriteIf(appended[i].key, stubs[i], appended[i].version, NULL) == 0) {
+			++frozen;
+			freed += sizes[i] - stubs[i].size();
+		} else {
+			// the record stays behind as garbage for Clean()
+			++races;
+		}
+	}
+	pthread_mutex_lock(&mutex);
+	num_frozen += frozen;
+	bytes_frozen += freed;
+	num_races += races;
+	pthread_mutex_unlock(&mutex);
+}
+
+int MetaTiering::Fetch(const tfs_inode_header &stub, std::string &key,
+		std::string &value) {
+	ColdLocation loc;
+	loc.segment = stub.cold_segment;
+	loc.offset = stub.cold_offset;
+	loc.length = stub.cold_length;
+	if (stub.cold_node == node_id) {
+		// a thaw-only instance without a store of its own has no records
+		return (store != NULL) ? store->Read(loc, key, value) : -EIO;
+	}
+	if (blobclient == NULL) {
+		return -EHOSTUNREACH;
+	}
+	std::string rec(loc.length, '\0');
+	int ret = blobclient->ReadCold(stub.cold_node, loc, &rec[0]);
+	if (ret < 0) {
+		return ret;
+	}
+	if (ret != (int) rec.size() || !ColdStore::Parse(rec.data(), rec.size(),
+			key, value)) {
+		return -EIO;
+	}
+	pthread_mutex_lock(&mutex);
+	++num_thawed_remote;
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int MetaTiering::Thaw(const RAMCloud::KeyInfo &mykey, std::string &value,
+		uint64_t *version) {
+	std::string key = MetaKeyString(mykey);
+	for (;;) {
+		InodeHeader stub(value.data(), value.size());
+		if (!stub.Valid() || stub->cold_length == 0) {
+			// thawed by someone else while we retried
+			return 0;
+		}
+		std::string stored_key, stored;
+		int ret = Fetch(*stub, stored_key, stored);
+		if (ret < 0) {
+			return ret;
+		}
+		InodeHeader header(stored.data(), stored.size());
+		if (stored_key != key || !header.Valid()) {
+			return -EIO;
+		}
+		tfs_inode_header touched = *header;
+		touched.fstat.st_atim.tv_sec = time(NULL);
+		touched.fstat.st_atim.tv_nsec = 0;
+		char encoded[TFS_INODE_MAX_ENCODED];
+		std::string thawed(encoded, EncodeInodeHeader(touched, encoded));
+		thawed.append(stored, header.NameOffset(), std::string::npos);
+		ret = WriteIf(key, thawed, *version, version);
+		if (ret == 0) {
+			value.swap(thawed);
+			pthread_mutex_lock(&mutex);
+			++num_thawed;
+			pthread_mutex_unlock(&mutex);
+			return 0;
+		} else if (ret != -EAGAIN) {
+			return ret;
+		}
+		// raced with another thaw, a relocation or an unlink
+		RAMCloud::Buffer buf;
+		cluster->read(tableid, key.data(), key.size(), &buf, NULL, version);
+		Monitor::CountRpc(RPC_READ, buf.size());
+		value.assign(static_cast<const char*>(buf.getRange(0, buf.size())),
+				buf.size());
+	}
+}
+
+bool MetaTiering::CollectLive(void* arg, const ColdLocation &loc,
+		const std::string &key) {
+	MetaTiering* self = reinterpret_cast<MetaTiering*>(arg);
+	self->segment_bytes += loc.length;
+	RAMCloud::Buffer buf;
+	Relocation r;
+	try {
+		self->cluster->read(self->tableid, key.data(), key.size(), &buf, NULL,
+				&r.version);
+	} catch (RAMCloud::ObjectDoesntExistException& e) {
+		return true;
+	} catch (RAMCloud::ClientException& e) {
+		// cannot tell; keep the segment
+		self->live_bytes += loc.length;
+		return false;
+	}
+	Monitor::CountRpc(RPC_READ, buf.size());
+	InodeHeader header(static_cast<const char*>(buf.getRange(0, buf.size())),
+			buf.size());
+	if (header.Valid() && header->cold_node == self->node_id
+			&& header->cold_segment == loc.segment
+			&& header->cold_offset == loc.offset
+			&& header->cold_length == loc.length) {
+		r.key = key;
+		r.loc = loc;
+		self->live.push_back(r);
+		self->live_bytes += loc.length;
+	}
+	return self->running;
+}
+
+void MetaTiering::Clean() {
+	std::vector<uint32_t> sealed;
+	store->SealedSegments(sealed);
+	// start past the last segment checked, so every one gets its turn
+	std::vector<uint32_t>::iterator first = std::upper_bound(sealed.begin(),
+			sealed.end(), clean_cursor);
+	if (first == sealed.end()) {
+		first = sealed.begin();
+	}
+	std::rotate(sealed.begin(), first, sealed.end());
+	for (size_t i = 0; i < sealed.size() && i < CLEAN_SEGMENTS && running;
+			++i) {
+		uint32_t segment = sealed[i];
+		clean_cursor = segment;
+		live.clear();
+		live_bytes = 0;
+		segment_bytes = 0;
+		// only a segment seen to its end is known to hold nothing else
+		if (store->Scan(segment, CollectLive, this) < 0 || !running) {
+			continue;
+		}
+		if (live_bytes * 2 >= segment_bytes && live_bytes > 0) {
+			continue;
+		}
+		// move what is still live to the active segment, then repoint
+		// the stubs; a stub that changed meanwhile no longer needs it
+		std::vector<std::string> stubs;
+		bool ok = true;
+		for (size_t j = 0; j < live.size() && ok; ++j) {
+			std::string key, value;
+			ok = store->Read(live[j].loc, key, value) == 0
+					&& store->Append(key, value.data(), value.size(),
+							live[j].loc) == 0;
+			if (ok) {
+				InodeHeader header(value.data(), value.size());
+				stubs.push_back(BuildStub(*header,
+						value.data() + header.NameOffset(), live[j].loc,
+						node_id));
+			}
+		}
+		if (!ok || store->Sync() < 0) {
+			continue;
+		}
+		uint64_t relocated = 0;
+		bool failed = false;
+		for (size_t j = 0; j < live.size(); ++j) {
+			int ret = WriteIf(live[j].key, stubs[j], live[j].version, NULL);
+			if (ret == 0) {
+				++relocated;
+			} else if (ret != -EAGAIN) {
+				// the old stub may still point here
+				failed = true;
+			}
+		}
+		if (!failed) {
+			store->RemoveSegment(segment);
+		}
+		pthread_mutex_lock(&mutex);
+		num_relocated += relocated;
+		pthread_mutex_unlock(&mutex);
+	}
+	live.clear();
+}
+
+void MetaTiering::Report(std::string &out) {
+	char line[512];
+	pthread_mutex_lock(&mutex);
+	snprintf(line, sizeof(line),
+			"%lu passes, last saw %lu resident bytes and %lu stubs; "
+			"%lu inodes frozen (%lu bytes of DRAM freed), %lu freeze races, "
+			"%lu thawed (%lu from other nodes), %lu records relocated\n",
+			(unsigned long) num_passes, (unsigned long) last_resident,
+			(unsigned long) last_stubs, (unsigned long) num_frozen,
+			(unsigned long) bytes_frozen, (unsigned long) num_races,
+			(unsigned long) num_thawed, (unsigned long) num_thawed_remote,
+			(unsigned long) num_relocated);
+	pthread_mutex_unlock(&mutex);
+	out.append(line);
+	if (store != NULL) {
+		store->Report(out);
+	}
+}
+
+}
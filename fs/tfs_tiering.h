@@ -0,0 +1,151 @@
+#ifndef TFS_TIERING_H_
+#define TFS_TIERING_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "fs/tfs_inode.h"
+#include "fs/tfs_coldstore.h"
+#include "fs/tfs_blobclient.h"
+#include "util/logging.h"
+#include "RamCloud.h"
+
+namespace TestFS {
+
+// Moves cold inode objects out of RAMCloud DRAM into this node's
+// ColdStore and brings them back when they are used.
+//
+// A background pass walks the namespace from the root with ListDirectory,
+// adding up the bytes of the inode values it sees. Files and symlinks
+// idle (newest of atime, mtime and ctime) for cold_secs are frozen, and
+// while the walk saw more than budget_bytes, so are the least recently
+// used of the rest down to min_idle_secs. Directories stay resident, and
+// so do values under min_bytes, which a stub would barely shrink.
+//
+// Freezing appends the stored value to the ColdStore and replaces it, if
+// it did not change meanwhile, with a stub: a compact header carrying
+// only st_ino, st_mode, the name and the record location (F_COLD). The
+// stub keeps both keys, so directory listings still see the name.
+//
+// tfs_rcdb calls Thaw() for any stub it reads outside ListDirectory: the
+// record is read from the local store, or through the blob protocol from
+// the node that froze it, and written back over the stub with atime set
+// to now. An instance that is never started only thaws; store may then be
+// NULL (testfs-mdsproxy, or a node that never froze anything). Records whose stub went away are garbage; the pass also checks
+// a few sealed segments, drops the dead ones and moves the live records
+// of mostly dead ones.
+class MetaTiering {
+public:
+	MetaTiering(RAMCloud::RamCloud* cluster, uint64_t tableid,
+			ColdStore* store, BlobClient* blobclient, uint32_t node_id,
+			Logging* logs);
+
+	~MetaTiering();
+
+	void SetPolicy(uint64_t budget_bytes, uint32_t cold_secs,
+			uint32_t min_idle_secs, size_t min_bytes);
+
+	void Start(uint32_t interval_secs);
+
+	void Stop();
+
+	static bool IsStub(const char* value, size_t size);
+
+	// value is the stub stored under key at *version. Replaces it with
+	// the inode value, written back to RAMCloud, and updates *version.
+	// Throws what RAMCloud throws if the object disappears meanwhile.
+	int Thaw(const RAMCloud::KeyInfo &key, std::string &value,
+			uint64_t *version);
+
+	void Report(std::string &out);
+
+private:
+	struct Candidate {
+		time_t last_access;
+		std::string key;
+		size_t size;
+
+		bool operator<(const Candidate &other) const {
+			return last_access < other.last_access;
+		}
+	};
+
+	struct Relocation {
+		std::string key;
+		ColdLocation loc;
+		uint64_t version;
+	};
+
+	struct WalkState;
+
+	static const size_t MAX_CANDIDATES = 1 << 20;
+	static const size_t FREEZE_BATCH = 256;
+	static const size_t CLEAN_SEGMENTS = 4;
+
+	static void* TieringMain(void* arg);
+
+	void RunPass();
+
+	void Walk(std::vector<Candidate> &candidates, uint64_t &resident);
+
+	static bool VisitInode(void* arg, tfs_inode_t parent,
+			const std::string &value);
+
+	void FreezeBatch(const std::vector<std::string> &keys);
+
+	void Clean();
+
+	static bool CollectLive(void* arg, const ColdLocation &loc,
+			const std::string &key);
+
+	// Reads the record a stub points to.
+	int Fetch(const tfs_inode_header &stub, std::string &key,
+			std::string &value);
+
+	static std::string BuildStub(const tfs_inode_header &header,
+			const char* name, const ColdLocation &loc, uint32_t node);
+
+	// Writes value under key if the object is still at version: 0, or
+	// -EAGAIN if it changed or went away, -EIO if RAMCloud failed.
+	int WriteIf(const std::string &key, const std::string &value,
+			uint64_t version, uint64_t *new_version);
+
+	RAMCloud::RamCloud* cluster;
+	uint64_t tableid;
+	ColdStore* store;
+	BlobClient* blobclient;
+	uint32_t node_id;
+	Logging* logs;
+
+	uint64_t budget_bytes;
+	uint32_t cold_secs;
+	uint32_t min_idle_secs;
+	size_t min_bytes;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t worker;
+	bool running;
+	uint32_t interval_secs;
+	uint32_t clean_cursor;
+	// filled by CollectLive during Clean()
+	std::vector<Relocation> live;
+	uint64_t live_bytes;
+	uint64_t segment_bytes;
+
+	uint64_t num_passes;
+	uint64_t last_resident;
+	uint64_t last_stubs;
+	uint64_t num_frozen;
+	uint64_t bytes_frozen;      // DRAM given back: value minus stub
+	uint64_t num_races;
+	uint64_t num_thawed;
+	uint64_t num_thawed_remote;
+	uint64_t num_relocated;
+};
+
+}
+
+#endif
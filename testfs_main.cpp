@@ -4,6 +4,7 @@
 #include "fs/tfs_state.h"
 #include "fs/testfs.h"
 #include "util/properties.h"
+#include "util/traceloader.h"
 
 static void usage() {
 	fprintf(stderr,
@@ -13,29 +14,45 @@ static void usage() {
 
 static TestFS::TestFS *fs;
 
+// every callback is recorded here when trace_file is set; see testfs-replay
+static TestFS::TraceRecorder *tracer = NULL;
+
+using TestFS::TraceScope;
+
 int wrap_getattr(const char *path, struct stat *statbuf) {
-	return fs->GetAttr(path, statbuf);
+	TraceScope trace(tracer, TestFS::OP_GETATTR, path);
+	return trace.Done(fs->GetAttr(path, statbuf));
 }
 int wrap_readlink(const char *path, char *link, size_t size) {
-	return fs->Readlink(path, link, size);
+	TraceScope trace(tracer, TestFS::OP_READLINK, path);
+	trace.Args(size, 0);
+	return trace.Done(fs->Readlink(path, link, size));
 }
 int wrap_mknod(const char *path, mode_t mode, dev_t dev) {
-	return fs->MakeNode(path, mode, dev);
+	TraceScope trace(tracer, TestFS::OP_MKNOD, path);
+	trace.Args(0, dev, mode);
+	return trace.Done(fs->MakeNode(path, mode, dev));
 }
 int wrap_mkdir(const char *path, mode_t mode) {
-	return fs->MakeDir(path, mode);
+	TraceScope trace(tracer, TestFS::OP_MKDIR, path);
+	trace.Args(0, 0, mode);
+	return trace.Done(fs->MakeDir(path, mode));
 }
 int wrap_unlink(const char *path) {
-	return fs->Unlink(path);
+	TraceScope trace(tracer, TestFS::OP_UNLINK, path);
+	return trace.Done(fs->Unlink(path));
 }
 int wrap_rmdir(const char *path) {
-	return fs->RemoveDir(path);
+	TraceScope trace(tracer, TestFS::OP_RMDIR, path);
+	return trace.Done(fs->RemoveDir(path));
 }
 int wrap_symlink(const char *path, const char *link) {
-	return fs->Symlink(path, link);
+	TraceScope trace(tracer, TestFS::OP_SYMLINK, path, link);
+	return trace.Done(fs->Symlink(path, link));
 }
 int wrap_rename(const char *path, const char *newpath) {
-	return fs->Rename(path, newpath);
+	TraceScope trace(tracer, TestFS::OP_RENAME, path, newpath);
+	return trace.Done(fs->Rename(path, newpath));
 }
 /*
  int wrap_link(const char *path, const char *newpath) {
@@ -43,27 +60,56 @@ int wrap_rename(const char *path, const char *newpath) {
  }
  */
 int wrap_chmod(const char *path, mode_t mode) {
-	return fs->Chmod(path, mode);
+	TraceScope trace(tracer, TestFS::OP_CHMOD, path);
+	trace.Args(0, 0, mode);
+	return trace.Done(fs->Chmod(path, mode));
 }
 int wrap_chown(const char *path, uid_t uid, gid_t gid) {
-	return fs->Chown(path, uid, gid);
+	TraceScope trace(tracer, TestFS::OP_CHOWN, path);
+	trace.Args(uid, gid);
+	return trace.Done(fs->Chown(path, uid, gid));
 }
 int wrap_truncate(const char *path, off_t newSize) {
-	return fs->Truncate(path, newSize);
+	TraceScope trace(tracer, TestFS::OP_TRUNCATE, path);
+	trace.Args(0, newSize);
+	return trace.Done(fs->Truncate(path, newSize));
 }
 int wrap_open(const char *path, struct fuse_file_info *fileInfo) {
-	return fs->Open(path, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_OPEN, path);
+	int ret = fs->Open(path, fileInfo);
+	trace.Args(0, 0, fileInfo->flags).File(fileInfo->fh);
+	return trace.Done(ret);
 }
 int wrap_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fileInfo) {
-	return fs->Read(path, buf, size, offset, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_READ, path);
+	trace.Args(size, offset).File(fileInfo->fh);
+	return trace.Done(fs->Read(path, buf, size, offset, fileInfo));
 }
 int wrap_write(const char *path, const char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fileInfo) {
-	return fs->Write(path, buf, size, offset, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_WRITE, path);
+	trace.Args(size, offset).File(fileInfo->fh);
+	return trace.Done(fs->Write(path, buf, size, offset, fileInfo));
+}
+int wrap_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fileInfo) {
+	TraceScope trace(tracer, TestFS::OP_READBUF, path);
+	trace.Args(size, offset).File(fileInfo->fh);
+	return trace.Done(fs->ReadBuf(path, bufp, size, offset, fileInfo));
+}
+int wrap_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fileInfo) {
+	TraceScope trace(tracer, TestFS::OP_WRITEBUF, path);
+	if (tracer != NULL) {
+		trace.Args(fuse_buf_size(buf), offset).File(fileInfo->fh);
+	}
+	return trace.Done(fs->WriteBuf(path, buf, offset, fileInfo));
 }
 int wrap_release(const char *path, struct fuse_file_info *fileInfo) {
-	return fs->Release(path, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_RELEASE, path);
+	trace.File(fileInfo->fh);
+	return trace.Done(fs->Release(path, fileInfo));
 }
 /*
  int wrap_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
@@ -71,26 +117,66 @@ int wrap_release(const char *path, struct fuse_file_info *fileInfo) {
  }
  */
 int wrap_opendir(const char *path, struct fuse_file_info *fileInfo) {
-	return fs->OpenDir(path, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_OPENDIR, path);
+	int ret = fs->OpenDir(path, fileInfo);
+	trace.Args(0, 0, fileInfo->flags).File(fileInfo->fh);
+	return trace.Done(ret);
 }
 int wrap_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		off_t offset, struct fuse_file_info *fileInfo) {
-	return fs->ReadDir(path, buf, filler, offset, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_READDIR, path);
+	trace.Args(0, offset).File(fileInfo->fh);
+	return trace.Done(fs->ReadDir(path, buf, filler, offset, fileInfo));
 }
 int wrap_releasedir(const char *path, struct fuse_file_info *fileInfo) {
-	return fs->ReleaseDir(path, fileInfo);
+	TraceScope trace(tracer, TestFS::OP_RELEASEDIR, path);
+	trace.File(fileInfo->fh);
+	return trace.Done(fs->ReleaseDir(path, fileInfo));
 }
 void* wrap_init(struct fuse_conn_info *conn) {
 	return fs->Init(conn);
 }
 int wrap_access(const char *path, int mask) {
-	return fs->Access(path, mask);
+	TraceScope trace(tracer, TestFS::OP_ACCESS, path);
+	trace.Args(0, 0, mask);
+	return trace.Done(fs->Access(path, mask));
 }
 int wrap_utimens(const char *path, const struct timespec tv[2]) {
-	return fs->UpdateTimens(path, tv);
+	TraceScope trace(tracer, TestFS::OP_UTIMENS, path);
+	trace.Args(tv[0].tv_sec, tv[1].tv_sec);
+	return trace.Done(fs->UpdateTimens(path, tv));
+}
+int wrap_setxattr(const char *path, const char *name, const char *value,
+		size_t size, int flags) {
+	TraceScope trace(tracer, TestFS::OP_SETXATTR, path, name);
+	trace.Args(size, 0, flags).Value(value, size);
+	return trace.Done(fs->SetXattr(path, name, value, size, flags));
+}
+int wrap_getxattr(const char *path, const char *name, char *value,
+		size_t size) {
+	TraceScope trace(tracer, TestFS::OP_GETXATTR, path, name);
+	trace.Args(size, 0);
+	return trace.Done(fs->GetXattr(path, name, value, size));
+}
+int wrap_listxattr(const char *path, char *list, size_t size) {
+	TraceScope trace(tracer, TestFS::OP_LISTXATTR, path);
+	trace.Args(size, 0);
+	return trace.Done(fs->ListXattr(path, list, size));
+}
+int wrap_removexattr(const char *path, const char *name) {
+	TraceScope trace(tracer, TestFS::OP_REMOVEXATTR, path, name);
+	return trace.Done(fs->RemoveXattr(path, name));
+}
+int wrap_fallocate(const char *path, int mode, off_t offset, off_t length,
+		struct fuse_file_info *fileInfo) {
+	TraceScope trace(tracer, TestFS::OP_FALLOCATE, path);
+	trace.Args(length, offset, mode).File(fileInfo->fh);
+	return trace.Done(fs->Fallocate(path, mode, offset, length, fileInfo));
 }
 void wrap_destroy(void * data) {
 	fs->Destroy(data);
+	delete tracer;
+	tracer = NULL;
 }
 
 static struct fuse_operations testfs_operations;
@@ -123,6 +209,37 @@ int main(int argc, char *argv[]) {
 	fuse_argv[fuse_argc++] = fuse_mount_dir;
 	fuse_argv[fuse_argc++] = "-s";
 
+	// kernel caching; TestFS invalidates what other mounts change
+	std::string cache_opts;
+	if (prop.getProperty("entry_timeout", "").size() > 0) {
+		cache_opts += ",entry_timeout=" + prop.getProperty("entry_timeout");
+		cache_opts += ",negative_timeout=" + prop.getProperty("entry_timeout");
+	}
+	if (prop.getProperty("attr_timeout", "").size() > 0) {
+		cache_opts += ",attr_timeout=" + prop.getProperty("attr_timeout");
+	}
+	if (prop.getPropertyBool("kernel_cache", false)) {
+		cache_opts += ",kernel_cache";
+	}
+	if (prop.getPropertyBool("auto_cache", cache_opts.size() > 0)) {
+		cache_opts += ",auto_cache";
+	}
+	char fuse_cache_opts[256];
+	if (cache_opts.size() > 0) {
+		snprintf(fuse_cache_opts, sizeof(fuse_cache_opts), "%s",
+				cache_opts.c_str() + 1);
+		fuse_argv[fuse_argc++] = "-o";
+		fuse_argv[fuse_argc++] = fuse_cache_opts;
+	}
+
+	if (prop.getProperty("trace_file", "").size() > 0) {
+		tracer = new TestFS::TraceRecorder(prop.getProperty("trace_file"));
+		if (tracer->Open() < 0) {
+			fprintf(stderr, "cannot open trace file: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
 	fs = new TestFS::TestFS();
 	fs->SetState(testfs_data);
 
@@ -141,6 +258,8 @@ int main(int argc, char *argv[]) {
 	testfs_opertaions.open = wrap_open;
 	testfs_opertaions.read = wrap_read;
 	testfs_opertaions.write = wrap_write;
+	testfs_opertaions.read_buf = wrap_read_buf;
+	testfs_opertaions.write_buf = wrap_write_buf;
 	testfs_opertaions.mknod = wrap_mknod;
 	testfs_opertaions.unlink = wrap_unlink;
 	testfs_opertaions.release = wrap_release;
@@ -150,6 +269,11 @@ int main(int argc, char *argv[]) {
 	testfs_opertaions.truncate = wrap_truncate;
 	testfs_opertaions.access = wrap_access;
 	testfs_opertaions.utimens = wrap_utimens;
+	testfs_opertaions.setxattr = wrap_setxattr;
+	testfs_opertaions.getxattr = wrap_getxattr;
+	testfs_opertaions.listxattr = wrap_listxattr;
+	testfs_opertaions.removexattr = wrap_removexattr;
+	testfs_opertaions.fallocate = wrap_fallocate;
 	testfs_opertaions.destroy = wrap_destroy;
 
 	fprintf(stdout, "start to run fuse_main at %s %s\n", argv[0],
@@ -0,0 +1,29 @@
+#include <cstdio>
+#include <cstdlib>
+#include "fs/tfs_mdsproxy.h"
+#include "util/properties.h"
+
+static void usage() {
+	fprintf(stderr,
+			"USAGE:  testfs-mdsproxy -ramcloud_endpoint <LOCATOR> -blob_secret <SECRET> [-listen_address <ADDR>] [-port <PORT>] [-busy_poll_usec <USEC>] [-batch_max <N>] [-cache_entries <N>] [-cache_lease_ms <MS>] [-blob_nodes <ID=HOST[:PORT],...>] [-logfile <LOGFILE>]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	TestFS::Properties prop;
+	prop.parseOpts(argc, argv);
+	if (prop.getProperty("ramcloud_endpoint", "").size() == 0
+			|| prop.getProperty("blob_secret", "").size() == 0) {
+		usage();
+	}
+
+	TestFS::MdsProxy proxy;
+	if (proxy.Setup(prop) < 0) {
+		return 1;
+	}
+	fprintf(stdout, "testfs-mdsproxy listening on %s:%d\n",
+			prop.getProperty("listen_address", "127.0.0.1").c_str(),
+			prop.getPropertyInt("port", TestFS::MDS_DEFAULT_PORT));
+	proxy.Run();
+	return 0;
+}
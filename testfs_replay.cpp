@@ -0,0 +1,497 @@
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "fs/testfs.h"
+#include "util/monitor.h"
+#include "util/properties.h"
+#include "util/traceloader.h"
+
+// Replays a trace that testfs recorded with -trace_file against a TestFS
+// in this process, with no kernel or FUSE in between: the same callbacks
+// with the same paths, sizes and offsets, at the recorded pace scaled by
+// -speed (0 for as fast as possible), from -threads workers (1 if not
+// given, as many as the trace recorded if 0 or less). TestFS is called one
+// op at a time, as testfs runs it under -s, so the workers do not replay
+// the trace's concurrency: more of them only keep an op that is due from
+// waiting for the one before it. Reports throughput and latency
+// percentiles of the replay, with RPC counts, next to those recorded.
+//
+// Writes carry incompressible bytes that differ from write to write, so
+// compression and dedup see no more than they would of real data. An op
+// on a file whose open is not in the trace is skipped.
+
+static void usage() {
+	fprintf(stderr,
+			"USAGE:  testfs-replay -trace <TRACE> [-speed <X>] [-threads <N>] <testfs options>\n"
+			"        -speed 0 replays as fast as possible; -threads defaults to 1,\n"
+			"        0 takes the thread count of the trace; ops run one at a time\n");
+	exit(1);
+}
+
+// an op this late on its schedule is counted as such
+static const uint64_t LATE_NS = 1000000;
+
+// file_of for ops that use no file, and for those whose open is missing
+static const int NO_FILE = -1;
+static const int UNKNOWN_FILE = -2;
+
+enum ReplayFileState {
+	FILE_PENDING = 0, FILE_OPEN = 1, FILE_FAILED = 2,
+};
+
+struct ReplayFile {
+	int state;
+	struct fuse_file_info fi;
+	uint32_t uses;             // ops on it but its open and release
+	uint32_t done;
+};
+
+struct Replay {
+	TestFS::TestFS* fs;
+	std::vector<const TestFS::TraceOp*> ops;   // by start time
+	std::vector<int> file_of;
+	std::vector<ReplayFile> files;
+	double speed;
+	uint64_t first_ns;
+	uint64_t start_ns;
+	std::vector<char> data;    // what writes write
+	size_t next;
+	pthread_mutex_t mutex;     // files
+	pthread_mutex_t fs_lock;   // calls into fs, one at a time
+	pthread_cond_t cond;
+	uint64_t differing;
+	uint64_t skipped;
+	uint64_t late;
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+};
+
+static bool UsesFile(int op) {
+	switch (op) {
+	case TestFS::OP_READ:
+	case TestFS::OP_WRITE:
+	case TestFS::OP_READBUF:
+	case TestFS::OP_WRITEBUF:
+	case TestFS::OP_FSYNC:
+	case TestFS::OP_READDIR:
+	case TestFS::OP_FALLOCATE:
+	case TestFS::OP_RELEASE:
+	case TestFS::OP_RELEASEDIR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool IsOpen(int op) {
+	return op == TestFS::OP_OPEN || op == TestFS::OP_OPENDIR;
+}
+
+static bool IsRelease(int op) {
+	return op == TestFS::OP_RELEASE || op == TestFS::OP_RELEASEDIR;
+}
+
+static bool StartsBefore(const TestFS::TraceOp* a, const TestFS::TraceOp* b) {
+	return a->rec.start_ns < b->rec.start_ns;
+}
+
+// Sorts the ops by start and ties every op on a file handle to the open
+// that made it, so a worker can wait for it.
+static void Prepare(Replay &r, const std::vector<TestFS::TraceOp> &ops) {
+	for (size_t i = 0; i < ops.size(); ++i) {
+		r.ops.push_back(&ops[i]);
+	}
+	std::stable_sort(r.ops.begin(), r.ops.end(), StartsBefore);
+	std::unordered_map<uint64_t, int> open_files;
+	size_t max_write = 0;
+	r.file_of.resize(r.ops.size(), NO_FILE);
+	for (size_t i = 0; i < r.ops.size(); ++i) {
+		const TestFS::trace_record &rec = r.ops[i]->rec;
+		if (IsOpen(rec.op)) {
+			if (rec.result == 0) {
+				ReplayFile file;
+				memset(&file, 0, sizeof(file));
+				open_files[rec.fh] = r.files.size();
+				r.file_of[i] = r.files.size();
+				r.files.push_back(file);
+			}
+		} else if (UsesFile(rec.op)) {
+			std::unordered_map<uint64_t, int>::iterator it =
+					open_files.find(rec.fh);
+			if (it == open_files.end()) {
+				r.file_of[i] = UNKNOWN_FILE;
+				continue;
+			}
+			r.file_of[i] = it->second;
+			if (IsRelease(rec.op)) {
+				open_files.erase(it);
+			} else {
+				++r.files[it->second].uses;
+			}
+		}
+		if (rec.op == TestFS::OP_WRITE || rec.op == TestFS::OP_WRITEBUF) {
+			max_write = std::max(max_write, (size_t) rec.size);
+		}
+	}
+	r.data.resize(max_write + 4096);
+	unsigned seed = 1;
+	for (size_t i = 0; i < r.data.size(); ++i) {
+		r.data[i] = (char) rand_r(&seed);
+	}
+}
+
+static int CountEntry(void *buf, const char *name, const struct stat *stbuf,
+		off_t off) {
+	++*reinterpret_cast<uint64_t*>(buf);
+	return 0;
+}
+
+// Issues op i; the data of a write starts at a different place in
+// r.data for every op.
+static int Execute(Replay &r, size_t i, struct fuse_file_info *fi,
+		std::vector<char> &buf, uint64_t &bytes) {
+	const TestFS::TraceOp &op = *r.ops[i];
+	const TestFS::trace_record &rec = op.rec;
+	const char* path = op.path.c_str();
+	const char* data = &r.data[(i * 64) % 4096];
+	bytes = 0;
+	if (buf.size() < rec.size + 1) {
+		buf.resize(rec.size + 1);
+	}
+	int ret;
+	switch (rec.op) {
+	case TestFS::OP_GETATTR: {
+		struct stat statbuf;
+		return r.fs->GetAttr(path, &statbuf);
+	}
+	case TestFS::OP_OPEN:
+		return r.fs->Open(path, fi);
+	case TestFS::OP_READ:
+		ret = r.fs->Read(path, &buf[0], rec.size, rec.offset, fi);
+		bytes = ret > 0 ? ret : 0;
+		return ret;
+	case TestFS::OP_WRITE:
+		ret = r.fs->Write(path, data, rec.size, rec.offset, fi);
+		bytes = ret > 0 ? ret : 0;
+		return ret;
+	case TestFS::OP_READBUF: {
+		struct fuse_bufvec *bufp = NULL;
+		ret = r.fs->ReadBuf(path, &bufp, rec.size, rec.offset, fi);
+		if (bufp != NULL) {
+			// what FUSE would do: copy or splice it out, then free it
+			if (ret == 0) {
+				struct fuse_bufvec dst = FUSE_BUFVEC_INIT(rec.size);
+				dst.buf[0].mem = &buf[0];
+				ssize_t copied = fuse_buf_copy(&dst, bufp,
+						(enum fuse_buf_copy_flags) 0);
+				bytes = copied > 0 ? copied : 0;
+			}
+			for (size_t b = 0; b < bufp->count; ++b) {
+				free(bufp->buf[b].mem);
+			}
+			free(bufp);
+		}
+		return ret;
+	}
+	case TestFS::OP_WRITEBUF: {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(rec.size);
+		bufv.buf[0].mem = (void*) data;
+		ret = r.fs->WriteBuf(path, &bufv, rec.offset, fi);
+		bytes = ret > 0 ? ret : 0;
+		return ret;
+	}
+	case TestFS::OP_TRUNCATE:
+		return r.fs->Truncate(path, rec.offset);
+	case TestFS::OP_FSYNC:
+		return r.fs->Fsync(path, rec.flags, fi);
+	case TestFS::OP_RELEASE:
+		return r.fs->Release(path, fi);
+	case TestFS::OP_READLINK:
+		return r.fs->Readlink(path, &buf[0], rec.size);
+	case TestFS::OP_SYMLINK:
+		return r.fs->Symlink(path, op.name.c_str());
+	case TestFS::OP_UNLINK:
+		return r.fs->Unlink(path);
+	case TestFS::OP_MKNOD:
+		return r.fs->MakeNode(path, rec.flags, rec.offset);
+	case TestFS::OP_MKDIR:
+		return r.fs->MakeDir(path, rec.flags);
+	case TestFS::OP_OPENDIR:
+		return r.fs->OpenDir(path, fi);
+	case TestFS::OP_READDIR: {
+		uint64_t entries = 0;
+		return r.fs->ReadDir(path, &entries, CountEntry, rec.offset, fi);
+	}
+	case TestFS::OP_RELEASEDIR:
+		return r.fs->ReleaseDir(path, fi);
+	case TestFS::OP_RMDIR:
+		return r.fs->RemoveDir(path);
+	case TestFS::OP_RENAME:
+		return r.fs->Rename(path, op.name.c_str());
+	case TestFS::OP_ACCESS:
+		return r.fs->Access(path, rec.flags);
+	case TestFS::OP_UTIMENS: {
+		struct timespec tv[2];
+		tv[0].tv_sec = rec.size;
+		tv[0].tv_nsec = 0;
+		tv[1].tv_sec = rec.offset;
+		tv[1].tv_nsec = 0;
+		return r.fs->UpdateTimens(path, tv);
+	}
+	case TestFS::OP_CHMOD:
+		return r.fs->Chmod(path, rec.flags);
+	case TestFS::OP_CHOWN:
+		return r.fs->Chown(path, rec.size, rec.offset);
+	case TestFS::OP_SETXATTR:
+		return r.fs->SetXattr(path, op.name.c_str(), op.value.data(),
+				op.value.size(), rec.flags);
+	case TestFS::OP_GETXATTR:
+		return r.fs->GetXattr(path, op.name.c_str(),
+				rec.size > 0 ? &buf[0] : NULL, rec.size);
+	case TestFS::OP_LISTXATTR:
+		return r.fs->ListXattr(path, rec.size > 0 ? &buf[0] : NULL,
+				rec.size);
+	case TestFS::OP_REMOVEXATTR:
+		return r.fs->RemoveXattr(path, op.name.c_str());
+	case TestFS::OP_FALLOCATE:
+		return r.fs->Fallocate(path, rec.flags, rec.offset, rec.size, fi);
+	default:
+		return -ENOSYS;
+	}
+}
+
+static void SleepUntil(uint64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+static void Add(uint64_t* counter, uint64_t n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void* ReplayMain(void* arg) {
+	Replay* r = reinterpret_cast<Replay*>(arg);
+	std::vector<char> buf;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+		if (i >= r->ops.size()) {
+			break;
+		}
+		const TestFS::trace_record &rec = r->ops[i]->rec;
+		if (r->speed > 0) {
+			uint64_t due = r->start_ns
+					+ (uint64_t) ((rec.start_ns - r->first_ns) / r->speed);
+			uint64_t now = TestFS::Monitor::Now();
+			if (now < due) {
+				SleepUntil(due);
+			} else if (now - due > LATE_NS) {
+				Add(&r->late, 1);
+			}
+		}
+
+		int file = r->file_of[i];
+		struct fuse_file_info *fi = NULL;
+		struct fuse_file_info unrecorded;
+		if (file == UNKNOWN_FILE) {
+			Add(&r->skipped, 1);
+			continue;
+		} else if (file >= 0) {
+			ReplayFile &f = r->files[file];
+			fi = &f.fi;
+			if (IsOpen(rec.op)) {
+				fi->flags = rec.flags;
+			} else {
+				pthread_mutex_lock(&r->mutex);
+				while (f.state == FILE_PENDING
+						|| (IsRelease(rec.op) && f.done < f.uses)) {
+					pthread_cond_wait(&r->cond, &r->mutex);
+				}
+				bool failed = (f.state == FILE_FAILED);
+				if (failed && !IsRelease(rec.op)) {
+					++f.done;
+					pthread_cond_broadcast(&r->cond);
+				}
+				pthread_mutex_unlock(&r->mutex);
+				if (failed) {
+					Add(&r->skipped, 1);
+					continue;
+				}
+			}
+		} else if (IsOpen(rec.op)) {
+			// failed when recorded; if it works now, close it again
+			memset(&unrecorded, 0, sizeof(unrecorded));
+			unrecorded.flags = rec.flags;
+			fi = &unrecorded;
+		}
+
+		uint64_t bytes;
+		pthread_mutex_lock(&r->fs_lock);
+		int ret = Execute(*r, i, fi, buf, bytes);
+		pthread_mutex_unlock(&r->fs_lock);
+		if (ret != rec.result) {
+			Add(&r->differing, 1);
+		}
+		if (rec.op == TestFS::OP_READ || rec.op == TestFS::OP_READBUF) {
+			Add(&r->read_bytes, bytes);
+		} else if (rec.op == TestFS::OP_WRITE
+				|| rec.op == TestFS::OP_WRITEBUF) {
+			Add(&r->written_bytes, bytes);
+		}
+
+		if (file >= 0 && !IsRelease(rec.op)) {
+			pthread_mutex_lock(&r->mutex);
+			if (IsOpen(rec.op)) {
+				r->files[file].state = (ret == 0) ? FILE_OPEN : FILE_FAILED;
+			} else {
+				++r->files[file].done;
+			}
+			pthread_cond_broadcast(&r->cond);
+			pthread_mutex_unlock(&r->mutex);
+		} else if (fi == &unrecorded && ret == 0) {
+			pthread_mutex_lock(&r->fs_lock);
+			if (rec.op == TestFS::OP_OPEN) {
+				r->fs->Release(r->ops[i]->path.c_str(), fi);
+			} else {
+				r->fs->ReleaseDir(r->ops[i]->path.c_str(), fi);
+			}
+			pthread_mutex_unlock(&r->fs_lock);
+		}
+	}
+	return NULL;
+}
+
+// Closes what the trace left open, so TestFS is not torn down under it.
+static void ReleaseLeftovers(Replay &r) {
+	std::vector<bool> released(r.files.size(), false);
+	for (size_t i = 0; i < r.ops.size(); ++i) {
+		if (IsRelease(r.ops[i]->rec.op) && r.file_of[i] >= 0) {
+			released[r.file_of[i]] = true;
+		}
+	}
+	for (size_t i = 0; i < r.ops.size(); ++i) {
+		int file = r.file_of[i];
+		if (!IsOpen(r.ops[i]->rec.op) || file < 0 || released[file]
+				|| r.files[file].state != FILE_OPEN) {
+			continue;
+		}
+		if (r.ops[i]->rec.op == TestFS::OP_OPEN) {
+			r.fs->Release(r.ops[i]->path.c_str(), &r.files[file].fi);
+		} else {
+			r.fs->ReleaseDir(r.ops[i]->path.c_str(), &r.files[file].fi);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	TestFS::Properties prop;
+	prop.parseOpts(argc, argv);
+	std::string trace_file = prop.getProperty("trace", "");
+	if (trace_file.size() == 0) {
+		usage();
+	}
+
+	TestFS::TraceLoader loader;
+	int ret = loader.Load(trace_file);
+	if (ret < 0) {
+		fprintf(stderr, "cannot load trace %s: %s\n", trace_file.c_str(),
+				strerror(-ret));
+		return 1;
+	}
+	const std::vector<TestFS::TraceOp> &ops = loader.Ops();
+	if (ops.size() == 0) {
+		fprintf(stderr, "trace %s is empty\n", trace_file.c_str());
+		return 1;
+	}
+
+	Replay r;
+	r.speed = prop.getPropertyDouble("speed", 1.0);
+	r.next = 0;
+	r.differing = r.skipped = r.late = 0;
+	r.read_bytes = r.written_bytes = 0;
+	pthread_mutex_init(&r.mutex, NULL);
+	pthread_mutex_init(&r.fs_lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	Prepare(r, ops);
+	r.first_ns = r.ops[0]->rec.start_ns;
+
+	// what the trace saw, and its concurrency
+	TestFS::Monitor recorded;
+	uint32_t trace_threads = 0;
+	uint64_t last_ns = 0;
+	for (size_t i = 0; i < ops.size(); ++i) {
+		recorded.RecordOp((TestFS::MonitorOp) ops[i].rec.op,
+				ops[i].rec.latency_ns);
+		trace_threads = std::max(trace_threads, ops[i].rec.thread);
+		last_ns = std::max(last_ns,
+				ops[i].rec.start_ns + ops[i].rec.latency_ns);
+	}
+	int num_threads = prop.getPropertyInt("threads", 1);
+	if (num_threads <= 0) {
+		num_threads = std::max(trace_threads, 1U);
+	}
+
+	// the replay is timed by TestFS's own monitor, RPCs and all
+	prop.setProperty("op_stats", "true");
+	r.fs = new TestFS::TestFS();
+	if (r.fs->Setup(prop) < 0) {
+		fprintf(stderr, "TestFS setup failed\n");
+		return 1;
+	}
+	r.fs->Init(NULL);
+	TestFS::Monitor* monitor = TestFS::Monitor::Default();
+	monitor->Reset();
+
+	r.start_ns = TestFS::Monitor::Now();
+	std::vector<pthread_t> threads(num_threads);
+	for (int t = 0; t < num_threads; ++t) {
+		pthread_create(&threads[t], NULL, ReplayMain, &r);
+	}
+	for (int t = 0; t < num_threads; ++t) {
+		pthread_join(threads[t], NULL);
+	}
+	double secs = (TestFS::Monitor::Now() - r.start_ns) / 1e9;
+	std::string replay_report;
+	monitor->Report(replay_report);
+	ReleaseLeftovers(r);
+
+	std::string speed = "full speed";
+	if (r.speed > 0) {
+		char x[32];
+		snprintf(x, sizeof(x), "%gx speed", r.speed);
+		speed = x;
+	}
+	printf("%lu ops recorded over %.2f s by %u threads\n",
+			(unsigned long) ops.size(), (last_ns - r.first_ns) / 1e9,
+			trace_threads);
+	printf("replayed in %.2f s by %d threads at %s: %.0f ops/s, "
+			"read %.1f MB/s, wrote %.1f MB/s\n", secs, num_threads,
+			speed.c_str(), ops.size() / secs, r.read_bytes / 1e6 / secs,
+			r.written_bytes / 1e6 / secs);
+	printf("%lu results differ from the trace, %lu ops skipped "
+			"(file not open), %lu started over %lu ms late\n",
+			(unsigned long) r.differing, (unsigned long) r.skipped,
+			(unsigned long) r.late, (unsigned long) (LATE_NS / 1000000));
+	std::string recorded_report;
+	recorded.Report(recorded_report);
+	printf("\nreplay:\n%s\nrecorded:\n%s", replay_report.c_str(),
+			recorded_report.c_str());
+
+	r.fs->Destroy(NULL);
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.fs_lock);
+	pthread_mutex_destroy(&r.mutex);
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include "util/compress.h"
+#include <stdint.h>
+#include <cstring>
+
+namespace TestFS {
+
+static const int HASH_BITS = 12;
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+// no match starts in the last TAIL bytes or runs into the last 5, which
+// keeps the extension loop away from the end of the input
+static const size_t TAIL = 12;
+static const size_t LAST_LITERALS = 5;
+
+static uint32_t Load32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t Hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* PutLength(uint8_t* op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+// Appends one sequence; match_len 0 means literals only. Returns NULL if
+// it does not fit before oend.
+static uint8_t* PutSequence(uint8_t* op, uint8_t* oend, const uint8_t* lit,
+		size_t lit_len, size_t offset, size_t match_len) {
+	size_t extra = match_len > 0 ? match_len - MIN_MATCH : 0;
+	size_t need = 1 + lit_len + lit_len / 255 + 1;
+	if (match_len > 0) {
+		need += 2 + extra / 255 + 1;
+	}
+	if (need > (size_t) (oend - op)) {
+		return NULL;
+	}
+	uint8_t* token = op++;
+	*token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+	if (lit_len >= 15) {
+		op = PutLength(op, lit_len - 15);
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0) {
+		return op;
+	}
+	*op++ = (uint8_t) offset;
+	*op++ = (uint8_t) (offset >> 8);
+	*token |= (uint8_t) (extra < 15 ? extra : 15);
+	if (extra >= 15) {
+		op = PutLength(op, extra - 15);
+	}
+	return op;
+}
+
+size_t LzCompress(const char* src, size_t size, char* dst, size_t capacity) {
+	const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+	const uint8_t* end = in + size;
+	uint8_t* op = reinterpret_cast<uint8_t*>(dst);
+	uint8_t* oend = op + capacity;
+	const uint8_t* anchor = in;
+	const uint8_t* ip = in;
+
+	if (size >= TAIL + MIN_MATCH) {
+		uint32_t table[1 << HASH_BITS];
+		memset(table, 0, sizeof(table));
+		const uint8_t* limit = end - TAIL;
+		const uint8_t* match_limit = end - LAST_LITERALS;
+		size_t misses = 0;
+		while (ip < limit) {
+			uint32_t v = Load32(ip);
+			uint32_t h = Hash(v);
+			const uint8_t* ref = in + table[h];
+			table[h] = ip - in;
+			if (ref >= ip || (size_t) (ip - ref) > MAX_OFFSET
+					|| Load32(ref) != v) {
+				// skip faster through data that does not compress
+				ip += 1 + (misses++ >> 5);
+				continue;
+			}
+			misses = 0;
+			const uint8_t* mp = ip + MIN_MATCH;
+			const uint8_t* rp = ref + MIN_MATCH;
+			while (mp < match_limit && *mp == *rp) {
+				++mp;
+				++rp;
+			}
+			op = PutSequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+			if (op == NULL) {
+				return 0;
+			}
+			ip = anchor = mp;
+		}
+	}
+	op = PutSequence(op, oend, anchor, end - anchor, 0, 0);
+	if (op == NULL) {
+		return 0;
+	}
+	return op - reinterpret_cast<uint8_t*>(dst);
+}
+
+static bool GetLength(const uint8_t* &ip, const uint8_t* iend, size_t &len) {
+	uint8_t byte;
+	do {
+		if (ip >= iend) {
+			return false;
+		}
+		byte = *ip++;
+		len += byte;
+	} while (byte == 255);
+	return true;
+}
+
+bool LzDecompress(const char* src, size_t size, char* dst, size_t raw_size) {
+	const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+	const uint8_t* iend = ip + size;
+	uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+	uint8_t* op = out;
+	uint8_t* oend = out + raw_size;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !GetLength(ip, iend, lit_len)) {
+			return false;
+		}
+		if (lit_len > (size_t) (iend - ip) || lit_len > (size_t) (oend - op)) {
+			return false;
+		}
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == iend) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return false;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !GetLength(ip, iend, match_len)) {
+			return false;
+		}
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (op - out)
+				|| match_len > (size_t) (oend - op)) {
+			return false;
+		}
+		// byte by byte: the match may overlap what it produces
+		const uint8_t* ref = op - offset;
+		while (match_len-- > 0) {
+			*op++ = *ref++;
+		}
+	}
+	return op == oend;
+}
+
+}
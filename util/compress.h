@@ -0,0 +1,26 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+
+namespace TestFS {
+
+// A small LZ77 block codec in the spirit of LZ4, fast enough to sit on the
+// metadata path. A block is a run of sequences, each a token byte (literal
+// count in the high nibble, match length - 4 in the low one, 15 meaning
+// more length bytes follow, 255 at a time), the literals, a 2-byte
+// little-endian match offset and the extra match length bytes. The last
+// sequence has only literals. Blocks do not record their raw size.
+
+// Compresses size bytes of src into dst. Returns the compressed length,
+// or 0 if it would not fit in capacity bytes; a capacity below size thus
+// also rejects input that does not compress well enough.
+size_t LzCompress(const char* src, size_t size, char* dst, size_t capacity);
+
+// Decompresses a block into exactly raw_size bytes of dst. Returns false
+// if the block is corrupt or does not expand to raw_size bytes.
+bool LzDecompress(const char* src, size_t size, char* dst, size_t raw_size);
+
+}
+
+#endif /* COMPRESS_H_ */
@@ -0,0 +1,134 @@
+#include <pthread.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include "util/eventloop.h"
+
+// Loopback echo benchmark for util/eventloop: reports messages/sec and
+// round-trip latency percentiles.
+
+using namespace TestFS;
+
+static void usage() {
+  fprintf(stderr,
+          "USAGE:  echobench [CONNECTIONS] [PIPELINE_DEPTH] [MSG_BYTES] [SECONDS] [BUSY_POLL_USEC]\n");
+  exit(1);
+}
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class EchoServer : public ConnectionHandler {
+public:
+  void OnMessage(Connection* conn, const char* data, uint32_t len) {
+    conn->SendMessage(data, len);
+  }
+};
+
+class EchoClient : public ConnectionHandler {
+public:
+  EchoClient(size_t msg_bytes) : payload(msg_bytes, 'x'), stopping(false) {}
+
+  void Send(Connection* conn) {
+    uint64_t now = NowNs();
+    memcpy(&payload[0], &now, sizeof(now));
+    conn->SendMessage(&payload[0], payload.size());
+  }
+
+  void OnMessage(Connection* conn, const char* data, uint32_t len) {
+    uint64_t sent;
+    if (len < sizeof(sent)) {
+      return;
+    }
+    memcpy(&sent, data, sizeof(sent));
+    latencies.push_back(NowNs() - sent);
+    if (!stopping) {
+      Send(conn);
+    }
+  }
+
+  std::vector<char> payload;
+  std::vector<uint64_t> latencies;
+  bool stopping;
+};
+
+static void* ServerMain(void* arg) {
+  reinterpret_cast<EventLoop*>(arg)->Run();
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && argv[1][0] == '-') {
+    usage();
+  }
+  int conns = (argc > 1) ? atoi(argv[1]) : 4;
+  int depth = (argc > 2) ? atoi(argv[2]) : 16;
+  int msg_arg = (argc > 3) ? atoi(argv[3]) : 64;
+  int seconds = (argc > 4) ? atoi(argv[4]) : 5;
+  SocketOptions opts;
+  opts.busy_poll_usec = (argc > 5) ? atoi(argv[5]) : 0;
+  // every message carries its send time
+  if (msg_arg < (int) sizeof(uint64_t)
+      || msg_arg > (int) Connection::MAX_FRAME) {
+    fprintf(stderr, "MSG_BYTES must be %lu to %u\n", sizeof(uint64_t),
+            Connection::MAX_FRAME);
+    return 1;
+  }
+  size_t msg_bytes = msg_arg;
+
+  EchoServer server;
+  EventLoop server_loop(opts);
+  int port = server_loop.Listen("127.0.0.1", 0, &server);
+  if (port < 0) {
+    perror("listen");
+    return 1;
+  }
+  pthread_t server_thread;
+  pthread_create(&server_thread, NULL, ServerMain, &server_loop);
+
+  EchoClient client(msg_bytes);
+  EventLoop client_loop(opts);
+  std::vector<Connection*> connections;
+  for (int i = 0; i < conns; ++i) {
+    Connection* conn = client_loop.Connect("127.0.0.1", port, &client);
+    if (conn == NULL) {
+      perror("connect");
+      return 1;
+    }
+    connections.push_back(conn);
+  }
+  for (int i = 0; i < conns; ++i) {
+    for (int d = 0; d < depth; ++d) {
+      client.Send(connections[i]);
+    }
+  }
+
+  uint64_t start = NowNs();
+  uint64_t end = start + seconds * 1000000000ULL;
+  while (NowNs() < end) {
+    client_loop.Poll(10);
+  }
+  size_t completed = client.latencies.size();
+  double elapsed = (NowNs() - start) / 1e9;
+  client.stopping = true;
+  server_loop.Stop();
+  pthread_join(server_thread, NULL);
+
+  std::sort(client.latencies.begin(), client.latencies.end());
+  printf("connections %d depth %d msg %lu bytes busy_poll %d\n", conns, depth,
+         msg_bytes, opts.busy_poll_usec);
+  printf("%.0f msgs/sec\n", completed / elapsed);
+  if (completed > 0) {
+    printf("latency us: p50 %.1f p99 %.1f p999 %.1f\n",
+           client.latencies[completed / 2] / 1e3,
+           client.latencies[completed * 99 / 100] / 1e3,
+           client.latencies[completed * 999 / 1000] / 1e3);
+  }
+  return 0;
+}
@@ -0,0 +1,456 @@
+#include "util/eventloop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+namespace TestFS {
+
+static const int MAX_EVENTS = 256;
+static const int MAX_IOV = 64;
+
+// epoll user data: the low bit tags listeners, the wakeup fd is NULL
+static void* TagListener(void* p) {
+  return (void *) ((uintptr_t) p | 1);
+}
+
+void ApplySocketOptions(int fd, const SocketOptions &opts) {
+  int flag = opts.nodelay ? 1 : 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+#ifdef SO_BUSY_POLL
+  if (opts.busy_poll_usec > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opts.busy_poll_usec,
+               sizeof(opts.busy_poll_usec));
+  }
+#endif
+  if (opts.sndbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opts.sndbuf, sizeof(opts.sndbuf));
+  }
+  if (opts.rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts.rcvbuf, sizeof(opts.rcvbuf));
+  }
+}
+
+int SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// BufferPool
+
+BufferPool::BufferPool(size_t buffer_size, size_t max_free)
+    : buffer_size_(buffer_size), max_free_(max_free) {
+}
+
+BufferPool::~BufferPool() {
+  for (size_t i = 0; i < free_.size(); ++i) {
+    delete[] free_[i];
+  }
+}
+
+char* BufferPool::Get() {
+  if (free_.empty()) {
+    return new char[buffer_size_];
+  }
+  char* buf = free_.back();
+  free_.pop_back();
+  return buf;
+}
+
+void BufferPool::Put(char* buf) {
+  if (free_.size() < max_free_) {
+    free_.push_back(buf);
+  } else {
+    delete[] buf;
+  }
+}
+
+// Connection
+
+Connection::Connection(EventLoop* loop, int fd, ConnectionHandler* handler)
+    : context(NULL), loop_(loop), fd_(fd), handler_(handler),
+      input_(16384), read_pos_(0), write_pos_(0), want_write_(false),
+      closing_(false) {
+}
+
+Connection::~Connection() {
+  while (!outq_.empty()) {
+    pool_.Put(outq_.front().buf);
+    outq_.pop_front();
+  }
+}
+
+bool Connection::SendMessage(const char* data, uint32_t len) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char *>(data);
+  iov.iov_len = len;
+  return SendMessage(&iov, 1);
+}
+
+bool Connection::SendMessage(const struct iovec *iov, int iovcnt) {
+  if (closing_ || iovcnt >= MAX_IOV) {
+    return false;
+  }
+  struct iovec vec[MAX_IOV];
+  uint32_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    vec[i + 1] = iov[i];
+    len += iov[i].iov_len;
+  }
+  vec[0].iov_base = &len;
+  vec[0].iov_len = sizeof(len);
+
+  size_t total = sizeof(len) + len;
+  ssize_t written = 0;
+  if (outq_.empty()) {
+    written = writev(fd_, vec, iovcnt + 1);
+    if (written < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        Close();
+        return false;
+      }
+      written = 0;
+    }
+  }
+  if ((size_t) written < total) {
+    // queue the unwritten tail of the frame
+    size_t skip = written;
+    for (int i = 0; i <= iovcnt; ++i) {
+      if (skip >= vec[i].iov_len) {
+        skip -= vec[i].iov_len;
+        continue;
+      }
+      Enqueue((const char *) vec[i].iov_base + skip, vec[i].iov_len - skip);
+      skip = 0;
+    }
+    if (!want_write_) {
+      want_write_ = true;
+      loop_->UpdateEvents(this);
+    }
+  }
+  return true;
+}
+
+void Connection::Enqueue(const char* data, size_t len) {
+  while (len > 0) {
+    if (outq_.empty() || outq_.back().end == pool_.BufferSize()) {
+      OutChunk chunk;
+      chunk.buf = pool_.Get();
+      chunk.start = chunk.end = 0;
+      outq_.push_back(chunk);
+    }
+    OutChunk &tail = outq_.back();
+    size_t n = pool_.BufferSize() - tail.end;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(tail.buf + tail.end, data, n);
+    tail.end += n;
+    data += n;
+    len -= n;
+  }
+}
+
+bool Connection::HandleWrite() {
+  while (!outq_.empty()) {
+    struct iovec vec[MAX_IOV];
+    int n = 0;
+    for (std::deque<OutChunk>::iterator it = outq_.begin();
+         it != outq_.end() && n < MAX_IOV; ++it, ++n) {
+      vec[n].iov_base = it->buf + it->start;
+      vec[n].iov_len = it->end - it->start;
+    }
+    ssize_t written = writev(fd_, vec, n);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    while (written > 0) {
+      OutChunk &head = outq_.front();
+      size_t avail = head.end - head.start;
+      if ((size_t) written < avail) {
+        head.start += written;
+        break;
+      }
+      written -= avail;
+      pool_.Put(head.buf);
+      outq_.pop_front();
+    }
+  }
+  if (want_write_) {
+    want_write_ = false;
+    loop_->UpdateEvents(this);
+  }
+  return true;
+}
+
+bool Connection::HandleRead() {
+  if (read_pos_ > 0 && read_pos_ == write_pos_) {
+    read_pos_ = write_pos_ = 0;
+  }
+  // read into the free tail of the input buffer and spill into a stack
+  // buffer, so one readv drains the socket without oversizing input_
+  char extra[65536];
+  struct iovec vec[2];
+  size_t space = input_.size() - write_pos_;
+  vec[0].iov_base = &input_[0] + write_pos_;
+  vec[0].iov_len = space;
+  vec[1].iov_base = extra;
+  vec[1].iov_len = sizeof(extra);
+  ssize_t n = readv(fd_, vec, 2);
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  if (n == 0) {
+    return false;
+  }
+  if ((size_t) n <= space) {
+    write_pos_ += n;
+  } else {
+    input_.insert(input_.end(), extra, extra + (n - space));
+    write_pos_ = input_.size();
+  }
+
+  while (write_pos_ - read_pos_ >= sizeof(uint32_t) && !closing_) {
+    uint32_t len;
+    memcpy(&len, &input_[read_pos_], sizeof(len));
+    if (len > MAX_FRAME) {
+      return false;
+    }
+    if (write_pos_ - read_pos_ < sizeof(len) + len) {
+      break;
+    }
+    handler_->OnMessage(this, &input_[read_pos_ + sizeof(len)], len);
+    read_pos_ += sizeof(len) + len;
+  }
+  if (read_pos_ > input_.size() / 2) {
+    // slide the partial frame to the front
+    memmove(&input_[0], &input_[read_pos_], write_pos_ - read_pos_);
+    write_pos_ -= read_pos_;
+    read_pos_ = 0;
+  }
+  return true;
+}
+
+void Connection::Close() {
+  if (!closing_) {
+    closing_ = true;
+    loop_->Destroy(this);
+  }
+}
+
+// EventLoop
+
+EventLoop::EventLoop(const SocketOptions &opts)
+    : running_(false), opts_(opts) {
+  pthread_mutex_init(&pending_mutex_, NULL);
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+}
+
+EventLoop::~EventLoop() {
+  for (size_t i = 0; i < listeners_.size(); ++i) {
+    close(listeners_[i]->fd);
+    delete listeners_[i];
+  }
+  for (size_t i = 0; i < closed_.size(); ++i) {
+    delete closed_[i];
+  }
+  close(wakefd_);
+  close(epfd_);
+  pthread_mutex_destroy(&pending_mutex_);
+}
+
+int EventLoop::Listen(const std::string &address, unsigned short port,
+                      ConnectionHandler* handler) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = address.empty() ? htonl(INADDR_ANY)
+                                          : inet_addr(address.c_str());
+  socklen_t addrlen = sizeof(addr);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || listen(fd, 1024) < 0 || SetNonBlocking(fd) < 0
+      || getsockname(fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+    close(fd);
+    return -1;
+  }
+  Listener* listener = new Listener();
+  listener->fd = fd;
+  listener->handler = handler;
+  listeners_.push_back(listener);
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = TagListener(listener);
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+  return ntohs(addr.sin_port);
+}
+
+Connection* EventLoop::Connect(const std::string &host, unsigned short port,
+                               ConnectionHandler* handler) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[16];
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host.c_str(), service, &hints, &res) != 0) {
+    return NULL;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // connect blocking, then switch the established socket to non-blocking
+  if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0
+      || SetNonBlocking(fd) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    freeaddrinfo(res);
+    return NULL;
+  }
+  freeaddrinfo(res);
+  ApplySocketOptions(fd, opts_);
+
+  Connection* conn = new Connection(this, fd, handler);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+  return conn;
+}
+
+void EventLoop::Accept(Listener* listener) {
+  for (;;) {
+    int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    ApplySocketOptions(fd, opts_);
+    Connection* conn = new Connection(this, fd, listener->handler);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    listener->handler->OnAccept(conn);
+  }
+}
+
+void EventLoop::UpdateEvents(Connection* conn) {
+  struct epoll_event ev;
+  ev.events = conn->want_write_ ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  ev.data.ptr = conn;
+  epoll_ctl(epfd_, EPOLL_CTL_MOD, conn->fd_, &ev);
+}
+
+void EventLoop::Destroy(Connection* conn) {
+  // the object may still appear later in this round's event array, so it
+  // is only freed once the round is over
+  epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->fd_, NULL);
+  close(conn->fd_);
+  conn->handler_->OnClose(conn);
+  closed_.push_back(conn);
+}
+
+int EventLoop::Poll(int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epfd_, events, MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    return (errno == EINTR) ? 0 : -1;
+  }
+  for (int i = 0; i < n; ++i) {
+    uintptr_t tag = (uintptr_t) events[i].data.ptr;
+    if (tag == 0) {
+      uint64_t count;
+      read(wakefd_, &count, sizeof(count));
+      RunPending();
+      continue;
+    }
+    if (tag & 1) {
+      Accept(reinterpret_cast<Listener*>(tag & ~(uintptr_t) 1));
+      continue;
+    }
+    Connection* conn = reinterpret_cast<Connection*>(tag);
+    if (conn->closing_) {
+      continue;
+    }
+    bool ok = true;
+    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      ok = conn->HandleRead();
+    }
+    if (ok && !conn->closing_ && (events[i].events & EPOLLOUT)) {
+      ok = conn->HandleWrite();
+    }
+    if (!ok) {
+      conn->Close();
+    }
+  }
+  for (size_t i = 0; i < closed_.size(); ++i) {
+    delete closed_[i];
+  }
+  closed_.clear();
+  return n;
+}
+
+void EventLoop::Run() {
+  running_ = true;
+  while (running_) {
+    if (Poll(-1) < 0) {
+      break;
+    }
+  }
+}
+
+void EventLoop::Stop() {
+  running_ = false;
+  uint64_t one = 1;
+  write(wakefd_, &one, sizeof(one));
+}
+
+void EventLoop::RunInLoop(void (*fn)(void*), void* arg) {
+  pthread_mutex_lock(&pending_mutex_);
+  bool wake = pending_.empty();
+  pending_.push_back(Task(fn, arg));
+  pthread_mutex_unlock(&pending_mutex_);
+  if (wake) {
+    uint64_t one = 1;
+    write(wakefd_, &one, sizeof(one));
+  }
+}
+
+void EventLoop::RunPending() {
+  std::vector<Task> tasks;
+  pthread_mutex_lock(&pending_mutex_);
+  tasks.swap(pending_);
+  pthread_mutex_unlock(&pending_mutex_);
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    tasks[i].first(tasks[i].second);
+  }
+}
+
+}
@@ -0,0 +1,170 @@
+#ifndef EVENTLOOP_H_
+#define EVENTLOOP_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace TestFS {
+
+struct SocketOptions {
+  bool nodelay;        // TCP_NODELAY
+  int busy_poll_usec;  // SO_BUSY_POLL, 0 leaves it off
+  int sndbuf;          // SO_SNDBUF, 0 keeps the kernel default
+  int rcvbuf;          // SO_RCVBUF, 0 keeps the kernel default
+
+  SocketOptions() : nodelay(true), busy_poll_usec(0), sndbuf(0), rcvbuf(0) {}
+};
+
+extern void ApplySocketOptions(int fd, const SocketOptions &opts);
+
+extern int SetNonBlocking(int fd);
+
+// Free list of fixed-size buffers; each connection owns one so steady-state
+// sends do not touch the allocator.
+class BufferPool {
+public:
+  BufferPool(size_t buffer_size = 16384, size_t max_free = 16);
+
+  ~BufferPool();
+
+  char* Get();
+
+  void Put(char* buf);
+
+  size_t BufferSize() const { return buffer_size_; }
+
+private:
+  size_t buffer_size_;
+  size_t max_free_;
+  std::vector<char*> free_;
+};
+
+class Connection;
+class EventLoop;
+
+class ConnectionHandler {
+public:
+  virtual ~ConnectionHandler() {}
+
+  // A connection accepted by a Listen()ing socket, before its first frame.
+  virtual void OnAccept(Connection* /* conn */) {}
+
+  // One complete frame; data is only valid during the call.
+  virtual void OnMessage(Connection* conn, const char* data, uint32_t len) = 0;
+
+  virtual void OnClose(Connection* /* conn */) {}
+};
+
+// A non-blocking stream connection carrying length-prefixed frames
+// (uint32_t length in host order, then the payload).
+class Connection {
+public:
+  // room for a 16 MB payload and the headers in front of it
+  static const uint32_t MAX_FRAME = 1 << 25;
+
+  // Frames the buffers and writes them with one writev; what the socket
+  // does not take is queued and flushed on EPOLLOUT.
+  bool SendMessage(const struct iovec *iov, int iovcnt);
+
+  bool SendMessage(const char* data, uint32_t len);
+
+  void Close();
+
+  int fd() const { return fd_; }
+
+  void* context;       // for the handler's own per-connection state
+
+private:
+  friend class EventLoop;
+
+  struct OutChunk {
+    char* buf;
+    size_t start;
+    size_t end;
+  };
+
+  Connection(EventLoop* loop, int fd, ConnectionHandler* handler);
+
+  ~Connection();
+
+  bool HandleRead();
+
+  bool HandleWrite();
+
+  void Enqueue(const char* data, size_t len);
+
+  EventLoop* loop_;
+  int fd_;
+  ConnectionHandler* handler_;
+  BufferPool pool_;
+  std::deque<OutChunk> outq_;
+  std::vector<char> input_;
+  size_t read_pos_;
+  size_t write_pos_;
+  bool want_write_;
+  bool closing_;
+};
+
+// Level-triggered epoll loop over listening sockets and Connections.
+// Everything except Stop() and RunInLoop() must be called from the loop's
+// own thread.
+class EventLoop {
+public:
+  explicit EventLoop(const SocketOptions &opts = SocketOptions());
+
+  ~EventLoop();
+
+  // Returns the bound port (useful with port 0) or -1.
+  int Listen(const std::string &address, unsigned short port,
+             ConnectionHandler* handler);
+
+  Connection* Connect(const std::string &host, unsigned short port,
+                      ConnectionHandler* handler);
+
+  // Handles ready events once; returns the number of events or -1.
+  int Poll(int timeout_ms);
+
+  void Run();
+
+  void Stop();
+
+  // Calls fn(arg) on the loop's thread during the next Poll, in the order
+  // queued; how other threads hand results to Connections.
+  void RunInLoop(void (*fn)(void*), void* arg);
+
+private:
+  friend class Connection;
+
+  struct Listener {
+    int fd;
+    ConnectionHandler* handler;
+  };
+
+  void Accept(Listener* listener);
+
+  void UpdateEvents(Connection* conn);
+
+  void Destroy(Connection* conn);
+
+  void RunPending();
+
+  typedef std::pair<void (*)(void*), void*> Task;
+
+  int epfd_;
+  int wakefd_;
+  volatile bool running_;
+  SocketOptions opts_;
+  std::vector<Listener*> listeners_;
+  std::vector<Connection*> closed_;
+  pthread_mutex_t pending_mutex_;
+  std::vector<Task> pending_;
+};
+
+}
+
+#endif
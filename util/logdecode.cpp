@@ -0,0 +1,126 @@
+#include <time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "util/logging.h"
+
+// Prints a binary log written by Logging as text, one message per record,
+// each prefixed with its time, thread and level unless -m is given. A log
+// cut short by a crash prints up to its last whole record.
+
+using namespace TestFS;
+
+static void usage() {
+	fprintf(stderr, "USAGE:  logdecode [-m] [-l error|warn|info|debug] <LOG>\n");
+	exit(1);
+}
+
+struct DecodedFormat {
+	std::vector<uint8_t> args;
+	std::string text;
+};
+
+static const char level_names[] = "EWID";
+
+static void PrintPrefix(const log_record &rec) {
+	time_t secs = rec.time_ns / 1000000000ULL;
+	struct tm tm;
+	localtime_r(&secs, &tm);
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06lu [%u] %c ", when,
+			(unsigned long) (rec.time_ns % 1000000000ULL / 1000), rec.thread,
+			rec.level < sizeof(level_names) - 1 ? level_names[rec.level] : '?');
+}
+
+int main(int argc, char *argv[]) {
+	bool bare = false;
+	int max_level = LOG_DEBUG;
+	int c;
+	while ((c = getopt(argc, argv, "ml:")) != -1) {
+		switch (c) {
+		case 'm':
+			bare = true;
+			break;
+		case 'l':
+			max_level = Logging::ParseLevel(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+	}
+	FILE *in = fopen(argv[optind], "r");
+	if (in == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	char magic[sizeof(LOG_FILE_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)
+			|| memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s: not a binary log\n", argv[optind]);
+		return 1;
+	}
+
+	std::map<uint32_t, DecodedFormat> formats;
+	std::vector<char> payload;
+	std::string out;
+	log_record rec;
+	while (fread(&rec, sizeof(rec), 1, in) == 1) {
+		payload.resize(rec.length);
+		if (rec.length > 0 && fread(&payload[0], 1, rec.length, in) != rec.length) {
+			break;
+		}
+		if (rec.type == LOG_RECORD_FORMAT) {
+			uint32_t nargs;
+			if (rec.length < sizeof(nargs)) {
+				continue;
+			}
+			memcpy(&nargs, &payload[0], sizeof(nargs));
+			if (rec.length < sizeof(nargs) + nargs) {
+				continue;
+			}
+			DecodedFormat &f = formats[rec.format];
+			f.args.assign(payload.begin() + sizeof(nargs),
+					payload.begin() + sizeof(nargs) + nargs);
+			f.text.assign(payload.begin() + sizeof(nargs) + nargs,
+					payload.end());
+		} else if (rec.type == LOG_RECORD_MESSAGE) {
+			if (rec.level > max_level) {
+				continue;
+			}
+			std::map<uint32_t, DecodedFormat>::const_iterator it =
+					formats.find(rec.format);
+			if (!bare) {
+				PrintPrefix(rec);
+			}
+			if (it == formats.end()) {
+				printf("<unknown format %u>\n", rec.format);
+				continue;
+			}
+			out.clear();
+			Logging::FormatMessage(it->second.text,
+					it->second.args.empty() ? NULL : &it->second.args[0],
+					it->second.args.size(), payload.empty() ? NULL : &payload[0],
+					payload.size(), out);
+			fwrite(out.data(), 1, out.size(), stdout);
+		} else if (rec.type == LOG_RECORD_DROPPED) {
+			uint64_t count = 0;
+			if (rec.length >= sizeof(count)) {
+				memcpy(&count, &payload[0], sizeof(count));
+			}
+			if (!bare) {
+				PrintPrefix(rec);
+			}
+			printf("%lu log records dropped\n", (unsigned long) count);
+		}
+	}
+	fclose(in);
+	return 0;
+}
@@ -6,15 +6,131 @@
  */
 
 #include "logging.h"
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
 namespace TestFS {
 
+static const size_t DEFAULT_RING_SIZE = 256 << 10;
+
+// how long the writer sleeps after a pass that found records, and after
+// one that found none
+static const long BUSY_WAIT_NS = 1000000;
+static const long IDLE_WAIT_NS = 20000000;
+
+static uint64_t num_instances = 0;
+
+// the calling thread's ring of the Logging it last logged to
+static __thread uint64_t ring_owner = 0;
+static __thread void* ring_of_owner = NULL;
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+Logging::Logging() : logging_filename("/tmp/tmp.log") {
+  Init();
+}
+
+Logging::Logging(const char *path) : logging_filename(path) {
+  Init();
+}
+
+Logging::Logging(const std::string &path) : logging_filename(path) {
+  Init();
+}
+
+void Logging::Init() {
+  instance = __atomic_add_fetch(&num_instances, 1, __ATOMIC_RELAXED);
+  logfile = NULL;
+  text = false;
+  ring_size = DEFAULT_RING_SIZE;
+  level = LOG_INFO;
+  memset(format_keys, 0, sizeof(format_keys));
+  memset(format_entries, 0, sizeof(format_entries));
+  memset(formats_by_id, 0, sizeof(formats_by_id));
+  num_formats = 0;
+  format_written = NULL;
+  rings = NULL;
+  retired_dropped = 0;
+  has_ring_key = pthread_key_create(&ring_key, RetireRing) == 0;
+  num_threads = 0;
+  running = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+  pthread_mutex_init(&drain_lock, NULL);
+}
+
 Logging::~Logging() {
+  pthread_mutex_lock(&mutex);
+  bool was_running = running;
+  running = false;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+  if (was_running) {
+    pthread_join(writer, NULL);
+  }
+  if (has_ring_key) {
+    // threads exiting from now on leave their rings to us
+    pthread_key_delete(ring_key);
+  }
   if (logfile != NULL) {
+    Drain();
     fflush(logfile);
     fclose(logfile);
   }
+  while (rings != NULL) {
+    Ring *next = rings->next;
+    delete[] rings->data;
+    delete rings;
+    rings = next;
+  }
+  for (size_t i = 0; i < MAX_FORMATS; ++i) {
+    delete format_entries[i];
+  }
+  delete[] format_written;
+  pthread_mutex_destroy(&drain_lock);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Logging::SetRingSize(size_t bytes) {
+  size_t size = 4096;
+  while (size < bytes) {
+    size <<= 1;
+  }
+  ring_size = size;
+}
+
+void Logging::SetText(bool text) {
+  this->text = text;
+}
+
+void Logging::SetLevel(int level) {
+  __atomic_store_n(&this->level, level, __ATOMIC_RELAXED);
+}
+
+int Logging::Level() const {
+  return __atomic_load_n(&level, __ATOMIC_RELAXED);
+}
+
+int Logging::ParseLevel(const std::string &name) {
+  if (name == "error") {
+    return LOG_ERROR;
+  } else if (name == "warn") {
+    return LOG_WARN;
+  } else if (name == "debug") {
+    return LOG_DEBUG;
+  }
+  return LOG_INFO;
 }
 
 void Logging::Open() {
@@ -23,32 +139,531 @@ void Logging::Open() {
   } else {
     logfile = NULL;
   }
+  if (logfile == NULL) {
+    return;
+  }
+  if (!text) {
+    fwrite(LOG_FILE_MAGIC, 1, sizeof(LOG_FILE_MAGIC) - 1, logfile);
+  }
+  format_written = new bool[MAX_FORMATS]();
+  running = true;
+  pthread_create(&writer, NULL, WriterMain, this);
 }
 
 void Logging::LogMsg(const char *format, ...)
 {
-  if (logfile != NULL) {
-    va_list ap;
-    va_start(ap, format);
+  if (LOG_INFO > Level() || logfile == NULL) {
+    return;
+  }
+  va_list ap;
+  va_start(ap, format);
+  Append(LOG_INFO, format, ap);
+  va_end(ap);
+}
 
-    vfprintf(logfile, format, ap);
-    fflush(logfile);
+void Logging::Log(int level, const char *format, ...)
+{
+  if (level > Level() || logfile == NULL) {
+    return;
   }
+  va_list ap;
+  va_start(ap, format);
+  Append(level, format, ap);
+  va_end(ap);
 }
 
 void Logging::LogStat(const char *path, const struct stat *statbuf)
 {
-  if (logfile != NULL) {
-    fprintf(logfile, "Stat of [%s]:\n", path);
-    fprintf(logfile, "  inode[%d] mode[%d], uid[%d], gid[%d], size[%d]\n",
-            statbuf->st_ino,
-            statbuf->st_mode, statbuf->st_uid,
-            statbuf->st_gid, statbuf->st_size);
-    fprintf(logfile, "  atime[%d] mtime[%d] ctime[%d]\n",
-            statbuf->st_atime, statbuf->st_mtime,
-            statbuf->st_ctime);
+  LogMsg("Stat of [%s]:\n"
+         "  inode[%lu] mode[%o], uid[%u], gid[%u], size[%ld]\n"
+         "  atime[%ld] mtime[%ld] ctime[%ld]\n",
+         path, (unsigned long) statbuf->st_ino,
+         (unsigned int) statbuf->st_mode, (unsigned int) statbuf->st_uid,
+         (unsigned int) statbuf->st_gid, (long) statbuf->st_size,
+         (long) statbuf->st_atime, (long) statbuf->st_mtime,
+         (long) statbuf->st_ctime);
+}
+
+const char* Logging::ParseSpec(const char *spec, int &stars, int &arg) {
+  const char *p = spec;
+  stars = 0;
+  arg = 0;
+  if (*p == '%') {
+    return p + 1;
+  }
+  while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+    ++p;
+  }
+  if (*p == '*') {
+    ++stars;
+    ++p;
+  }
+  while (isdigit(*p)) {
+    ++p;
+  }
+  if (*p == '.') {
+    ++p;
+    if (*p == '*') {
+      ++stars;
+      ++p;
+    }
+    while (isdigit(*p)) {
+      ++p;
+    }
+  }
+  bool wide = false, big = false;
+  while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) {
+    if (*p == 'L') {
+      big = true;
+    } else if (*p != 'h') {
+      wide = true;
+    }
+    ++p;
+  }
+  switch (*p) {
+  case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+    arg = wide ? LOG_ARG_LONG : LOG_ARG_INT;
+    break;
+  case 'c':
+    arg = LOG_ARG_INT;
+    break;
+  case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a':
+  case 'A':
+    arg = big ? LOG_ARG_LONG_DOUBLE : LOG_ARG_DOUBLE;
+    break;
+  case 's':
+    arg = LOG_ARG_STRING;
+    break;
+  case 'p': case 'n':
+    arg = LOG_ARG_POINTER;
+    break;
+  case '\0':
+    return p;
+  }
+  return p + 1;
+}
+
+Logging::Format* Logging::Register(size_t slot, const char *format) {
+  Format *f = new Format();
+  f->id = __atomic_fetch_add(&num_formats, 1, __ATOMIC_RELAXED);
+  f->nargs = 0;
+  f->text = format;
+  for (const char *p = strchr(format, '%'); p != NULL; p = strchr(p, '%')) {
+    int stars, arg;
+    p = ParseSpec(p + 1, stars, arg);
+    for (int i = 0; i < stars && f->nargs < MAX_ARGS; ++i) {
+      f->args[f->nargs++] = LOG_ARG_INT;
+    }
+    if (arg != 0 && f->nargs < MAX_ARGS) {
+      f->args[f->nargs++] = arg;
+    }
+  }
+  __atomic_store_n(&formats_by_id[f->id], f, __ATOMIC_RELEASE);
+  __atomic_store_n(&format_entries[slot], f, __ATOMIC_RELEASE);
+  return f;
+}
+
+const Logging::Format* Logging::Lookup(const char *format) {
+  size_t hash = ((uintptr_t) format * 0x9E3779B97F4A7C15ULL)
+      >> (64 - FORMAT_BITS);
+  for (size_t probe = 0; probe < MAX_FORMATS; ++probe) {
+    size_t slot = (hash + probe) & (MAX_FORMATS - 1);
+    const char *key = __atomic_load_n(&format_keys[slot], __ATOMIC_ACQUIRE);
+    if (key == NULL) {
+      if (__atomic_compare_exchange_n(&format_keys[slot], &key, format, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return Register(slot, format);
+      }
+      // key is now whichever format took the slot
+    }
+    if (key == format) {
+      Format *f;
+      while ((f = __atomic_load_n(&format_entries[slot],
+                                  __ATOMIC_ACQUIRE)) == NULL) {
+        // another thread is registering it
+        sched_yield();
+      }
+      return f;
+    }
+  }
+  return NULL;
+}
+
+Logging::Ring* Logging::MyRing() {
+  if (ring_owner == instance) {
+    return reinterpret_cast<Ring*>(ring_of_owner);
+  }
+  // the thread may have logged to another Logging since
+  Ring *ring = has_ring_key
+      ? reinterpret_cast<Ring*>(pthread_getspecific(ring_key)) : NULL;
+  if (ring == NULL) {
+    ring = new Ring();
+    // zeroed, so the thread does not take the page faults while logging
+    ring->data = new char[ring_size]();
+    ring->size = ring_size;
+    pthread_mutex_lock(&mutex);
+    ring->thread = ++num_threads;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&mutex);
+    if (has_ring_key) {
+      pthread_setspecific(ring_key, ring);
+    }
+  }
+  ring_owner = instance;
+  ring_of_owner = ring;
+  return ring;
+}
+
+void Logging::RetireRing(void *arg) {
+  Ring *ring = reinterpret_cast<Ring*>(arg);
+  __atomic_store_n(&ring->retired, true, __ATOMIC_RELEASE);
+  if (ring_of_owner == ring) {
+    ring_owner = 0;
+    ring_of_owner = NULL;
+  }
+}
+
+void Logging::Append(int level, const char *format, va_list ap) {
+  Ring *ring = MyRing();
+  const Format *f = Lookup(format);
+  if (f == NULL) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  uint64_t values[MAX_ARGS];
+  const char *strings[MAX_ARGS];
+  size_t max_string = ring->size / 4;
+  size_t length = 0;
+  for (uint32_t i = 0; i < f->nargs; ++i) {
+    switch (f->args[i]) {
+    case LOG_ARG_INT:
+      values[i] = (int64_t) va_arg(ap, int);
+      break;
+    case LOG_ARG_LONG:
+      values[i] = va_arg(ap, long long);
+      break;
+    case LOG_ARG_DOUBLE: {
+      double d = va_arg(ap, double);
+      memcpy(&values[i], &d, sizeof(d));
+      break;
+    }
+    case LOG_ARG_LONG_DOUBLE: {
+      double d = va_arg(ap, long double);
+      memcpy(&values[i], &d, sizeof(d));
+      break;
+    }
+    case LOG_ARG_POINTER:
+      values[i] = (uintptr_t) va_arg(ap, void*);
+      break;
+    case LOG_ARG_STRING:
+      strings[i] = va_arg(ap, const char*);
+      if (strings[i] == NULL) {
+        strings[i] = "(null)";
+      }
+      values[i] = strnlen(strings[i], max_string);
+      length += sizeof(uint32_t) + values[i];
+      continue;
+    }
+    length += sizeof(uint64_t);
+  }
+
+  size_t total = (sizeof(log_record) + length + 7) & ~(size_t) 7;
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t pos = head & (ring->size - 1);
+  // a record does not wrap; the writer skips the rest of the ring, which
+  // is a PAD record if one fits
+  size_t skip = (ring->size - pos < total) ? ring->size - pos : 0;
+  if (head + skip + total - tail > ring->size) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  log_record rec;
+  if (skip >= sizeof(rec)) {
+    memset(&rec, 0, sizeof(rec));
+    rec.type = LOG_RECORD_PAD;
+    rec.length = skip - sizeof(rec);
+    memcpy(ring->data + pos, &rec, sizeof(rec));
+  }
+  char *p = ring->data + ((pos + skip) & (ring->size - 1));
+  rec.type = LOG_RECORD_MESSAGE;
+  rec.level = level;
+  rec.length = total - sizeof(rec);
+  rec.format = f->id;
+  rec.thread = ring->thread;
+  rec.time_ns = NowNs();
+  memcpy(p, &rec, sizeof(rec));
+  p += sizeof(rec);
+  for (uint32_t i = 0; i < f->nargs; ++i) {
+    if (f->args[i] == LOG_ARG_STRING) {
+      uint32_t len = values[i];
+      memcpy(p, &len, sizeof(len));
+      memcpy(p + sizeof(len), strings[i], len);
+      p += sizeof(len) + len;
+    } else {
+      memcpy(p, &values[i], sizeof(values[i]));
+      p += sizeof(values[i]);
+    }
+  }
+  __atomic_store_n(&ring->head, head + skip + total, __ATOMIC_RELEASE);
+}
+
+// snprintf into out, with a single conversion in spec.
+static void AppendFormatted(std::string &out, const char *spec, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, spec);
+  int n = vsnprintf(buf, sizeof(buf), spec, ap);
+  va_end(ap);
+  if (n < 0) {
+    return;
+  }
+  if ((size_t) n < sizeof(buf)) {
+    out.append(buf, n);
+    return;
+  }
+  size_t at = out.size();
+  out.resize(at + n + 1);
+  va_start(ap, spec);
+  vsnprintf(&out[at], n + 1, spec, ap);
+  va_end(ap);
+  out.resize(at + n);
+}
+
+void Logging::FormatMessage(const std::string &format, const uint8_t *args,
+                            int nargs, const char *payload, size_t length,
+                            std::string &out) {
+  const char *p = format.c_str();
+  const char *end = p + format.size();
+  size_t offset = 0;
+  int next = 0;
+  while (p < end) {
+    const char *pct = strchr(p, '%');
+    if (pct == NULL) {
+      out.append(p, end - p);
+      break;
+    }
+    out.append(p, pct - p);
+    int stars, arg;
+    const char *after = ParseSpec(pct + 1, stars, arg);
+    if (arg == 0) {
+      // "%%", or a conversion we do not know, which printf leaves alone
+      out.append(pct[1] == '%' ? "%" : std::string(pct, after - pct));
+      p = after;
+      continue;
+    }
+    // the spec with its '*'s filled in and without 'L', whose value is
+    // a double by now
+    std::string spec;
+    bool ok = true;
+    for (const char *s = pct; s < after; ++s) {
+      if (*s == '*') {
+        int64_t v;
+        if (next >= nargs || args[next] != LOG_ARG_INT
+            || offset + sizeof(v) > length) {
+          ok = false;
+          break;
+        }
+        memcpy(&v, payload + offset, sizeof(v));
+        offset += sizeof(v);
+        ++next;
+        char number[24];
+        sprintf(number, "%d", (int) v);
+        spec += number;
+      } else if (*s != 'L') {
+        spec += *s;
+      }
+    }
+    if (!ok || next >= nargs) {
+      out.append(pct, after - pct);
+      p = after;
+      continue;
+    }
+    int type = args[next++];
+    if (type == LOG_ARG_STRING) {
+      uint32_t len;
+      if (offset + sizeof(len) > length) {
+        break;
+      }
+      memcpy(&len, payload + offset, sizeof(len));
+      offset += sizeof(len);
+      if (offset + len > length) {
+        break;
+      }
+      std::string s(payload + offset, len);
+      offset += len;
+      AppendFormatted(out, spec.c_str(), s.c_str());
+    } else {
+      uint64_t v;
+      if (offset + sizeof(v) > length) {
+        break;
+      }
+      memcpy(&v, payload + offset, sizeof(v));
+      offset += sizeof(v);
+      if (after[-1] == 'n') {
+        // nothing to print, and nowhere to store the count
+      } else if (type == LOG_ARG_INT) {
+        AppendFormatted(out, spec.c_str(), (int) v);
+      } else if (type == LOG_ARG_LONG) {
+        AppendFormatted(out, spec.c_str(), (long long) v);
+      } else if (type == LOG_ARG_POINTER) {
+        AppendFormatted(out, spec.c_str(), (void*) (uintptr_t) v);
+      } else {
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        AppendFormatted(out, spec.c_str(), d);
+      }
+    }
+    p = after;
+  }
+}
+
+void Logging::WriteRecord(const log_record &rec, const char *payload) {
+  const Format *f = __atomic_load_n(&formats_by_id[rec.format],
+                                    __ATOMIC_ACQUIRE);
+  if (text) {
+    std::string out;
+    FormatMessage(f->text, f->args, f->nargs, payload, rec.length, out);
+    fwrite(out.data(), 1, out.size(), logfile);
+    return;
+  }
+  if (!format_written[f->id]) {
+    uint32_t len = strlen(f->text);
+    log_record frec;
+    memset(&frec, 0, sizeof(frec));
+    frec.type = LOG_RECORD_FORMAT;
+    frec.length = sizeof(f->nargs) + f->nargs + len;
+    frec.format = f->id;
+    frec.time_ns = rec.time_ns;
+    fwrite(&frec, sizeof(frec), 1, logfile);
+    fwrite(&f->nargs, sizeof(f->nargs), 1, logfile);
+    fwrite(f->args, 1, f->nargs, logfile);
+    fwrite(f->text, 1, len, logfile);
+    format_written[f->id] = true;
+  }
+  fwrite(&rec, sizeof(rec), 1, logfile);
+  fwrite(payload, 1, rec.length, logfile);
+}
+
+size_t Logging::Drain() {
+  pthread_mutex_lock(&mutex);
+  Ring *first = rings;
+  pthread_mutex_unlock(&mutex);
+
+  size_t written = 0;
+  bool wrote = false;
+  std::vector<Ring*> retired;
+  for (Ring *ring = first; ring != NULL; ring = ring->next) {
+    // read before head: a retired ring gets no more records, so once this
+    // pass has drained it, it can go
+    if (__atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE)) {
+      retired.push_back(ring);
+    }
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    while (tail < head) {
+      size_t pos = tail & (ring->size - 1);
+      log_record rec;
+      if (ring->size - pos < sizeof(rec)) {
+        tail += ring->size - pos;
+        continue;
+      }
+      memcpy(&rec, ring->data + pos, sizeof(rec));
+      if (rec.type == LOG_RECORD_MESSAGE) {
+        WriteRecord(rec, ring->data + pos + sizeof(rec));
+        ++written;
+      }
+      tail += sizeof(rec) + rec.length;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+      uint64_t count = dropped - ring->reported;
+      if (text) {
+        fprintf(logfile, "%lu log records dropped by thread %u\n",
+                (unsigned long) count, ring->thread);
+      } else {
+        log_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = LOG_RECORD_DROPPED;
+        rec.level = LOG_WARN;
+        rec.length = sizeof(count);
+        rec.thread = ring->thread;
+        rec.time_ns = NowNs();
+        fwrite(&rec, sizeof(rec), 1, logfile);
+        fwrite(&count, sizeof(count), 1, logfile);
+      }
+      ring->reported = dropped;
+      wrote = true;
+    }
+  }
+  if (written > 0 || wrote) {
     fflush(logfile);
   }
+  if (!retired.empty()) {
+    // only Drain() unlinks rings, and MyRing() only pushes at the front
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < retired.size(); ++i) {
+      Ring **link = &rings;
+      while (*link != retired[i]) {
+        link = &(*link)->next;
+      }
+      *link = retired[i]->next;
+      retired_dropped += retired[i]->dropped;
+    }
+    pthread_mutex_unlock(&mutex);
+    for (size_t i = 0; i < retired.size(); ++i) {
+      delete[] retired[i]->data;
+      delete retired[i];
+    }
+  }
+  return written;
+}
+
+void* Logging::WriterMain(void *arg) {
+  Logging *self = reinterpret_cast<Logging*>(arg);
+  pthread_mutex_lock(&self->mutex);
+  while (self->running) {
+    pthread_mutex_unlock(&self->mutex);
+    pthread_mutex_lock(&self->drain_lock);
+    size_t written = self->Drain();
+    pthread_mutex_unlock(&self->drain_lock);
+    pthread_mutex_lock(&self->mutex);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (written > 0) ? BUSY_WAIT_NS : IDLE_WAIT_NS;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (self->running) {
+      pthread_cond_timedwait(&self->cond, &self->mutex, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&self->mutex);
+  return NULL;
+}
+
+void Logging::Flush() {
+  if (logfile == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&drain_lock);
+  Drain();
+  pthread_mutex_unlock(&drain_lock);
+}
+
+uint64_t Logging::Dropped() {
+  pthread_mutex_lock(&mutex);
+  uint64_t total = retired_dropped;
+  for (Ring *ring = rings; ring != NULL; ring = ring->next) {
+    total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&mutex);
+  return total;
 }
 
 
@@ -62,4 +677,4 @@ void Logging::SetDefault(Logging* log) {
   log_ = log;
 }
 
-} 
+}
@@ -8,6 +8,8 @@
 #ifndef LOGGING_H_
 #define LOGGING_H_
 
+#include <stdint.h>
+#include <pthread.h>
 #include <string>
 #include <cstdarg>
 #include <cstdio>
@@ -15,29 +17,187 @@
 
 namespace TestFS {
 
+enum LogLevel {
+  LOG_ERROR = 0, LOG_WARN = 1, LOG_INFO = 2, LOG_DEBUG = 3,
+};
+
+// Every record in a binary log, and in the rings, starts with this.
+struct log_record {
+  uint16_t type;       // LOG_RECORD_*
+  uint16_t level;
+  uint32_t length;     // of the payload that follows
+  uint32_t format;     // id of the format, 0 for DROPPED
+  uint32_t thread;
+  uint64_t time_ns;    // CLOCK_REALTIME
+} __attribute__((packed));
+
+enum LogRecordType {
+  LOG_RECORD_PAD = 0,      // ring filler up to the wrap, never written out
+  LOG_RECORD_FORMAT = 1,   // uint32 nargs, nargs LogArg bytes, the format
+  LOG_RECORD_MESSAGE = 2,  // the arguments; see LogArg
+  LOG_RECORD_DROPPED = 3,  // uint64 records thread dropped since the last
+};
+
+// How a MESSAGE stores each argument: numbers as 8 bytes, strings as a
+// uint32 length and the bytes. Records are padded to 8 bytes.
+enum LogArg {
+  LOG_ARG_INT = 1,       // int and smaller, sign-extended
+  LOG_ARG_LONG = 2,      // l, ll, z, j, t and q
+  LOG_ARG_DOUBLE = 3,    // double and float
+  LOG_ARG_STRING = 4,
+  LOG_ARG_POINTER = 5,
+  LOG_ARG_LONG_DOUBLE = 6, // read as long double, stored as double
+};
+
+// The first bytes of a binary log.
+const char LOG_FILE_MAGIC[] = "TFSLOG1\n";
+
+// Asynchronous binary logging.
+//
+// LogMsg() does not format: it copies the format's id and the raw
+// arguments into a ring of the calling thread, which only that thread
+// writes, and a writer thread drains the rings to the log file every few
+// milliseconds. A record costs a level check, a lookup of the format by
+// address, a clock read and the copies; it takes no lock and makes no
+// system call. When a ring is full the record is dropped and counted, and
+// the writer logs the count, so memory stays at ring_size per thread. When
+// a thread exits its ring is retired, and the writer frees it once it has
+// drained what is left.
+//
+// The file holds the binary records, each format once before its first
+// use; util/logdecode prints it. With SetText() the writer formats the
+// records itself and the file reads as before.
+//
+// Formats are taken by address, so they must be string literals or
+// otherwise outlive the Logging. The printf conversions are supported,
+// %n and wide characters are not; strings are cut at ring_size / 4.
 class Logging {
 public:
-  Logging() : logging_filename("/tmp/tmp.log") {}
+  Logging();
+
+  Logging(const char *path);
 
-  Logging(const char *path) : logging_filename(path) {}
+  Logging(const std::string &path);
 
-  Logging(const std::string &path) : logging_filename(path) {}
+  // Before Open(): the ring of each thread, a power of two.
+  void SetRingSize(size_t bytes);
+
+  // Before Open(): have the writer write text instead of records.
+  void SetText(bool text);
+
+  // Records above level are dropped before they are copied; may be
+  // changed at any time.
+  void SetLevel(int level);
+
+  int Level() const;
+
+  // "error", "warn", "info" or "debug"; LOG_INFO for anything else.
+  static int ParseLevel(const std::string &name);
 
   void Open();
 
+  // At LOG_INFO.
   void LogMsg(const char *format, ...);
 
+  void Log(int level, const char *format, ...);
+
   void LogStat(const char* path, const struct stat* statbuf);
 
+  // Waits until everything logged so far is in the file.
+  void Flush();
+
+  // Records dropped on full rings so far.
+  uint64_t Dropped();
+
   virtual ~Logging();
 
   static Logging* Default();
 
   void SetDefault(Logging* log);
 
+  // Parses the conversion after a '%': returns the end of it, the number
+  // of '*' it reads and the LogArg of its value, 0 for none ("%%").
+  static const char* ParseSpec(const char *spec, int &stars, int &arg);
+
+  // Formats the payload of a MESSAGE with its format and argument types.
+  static void FormatMessage(const std::string &format, const uint8_t *args,
+                            int nargs, const char *payload, size_t length,
+                            std::string &out);
+
+  static const uint32_t MAX_ARGS = 24;
+
 private:
+  struct Format {
+    uint32_t id;
+    uint32_t nargs;
+    uint8_t args[MAX_ARGS];
+    const char *text;
+  };
+
+  struct Ring {
+    char *data;
+    size_t size;
+    uint32_t thread;
+    Ring *next;
+    uint64_t reported;           // drops the writer has logged
+    char pad0[64];
+    uint64_t head;               // written by the thread
+    uint64_t dropped;
+    bool retired;                // the thread exited
+    char pad1[64];
+    uint64_t tail;               // written by the writer
+  };
+
+  static const int FORMAT_BITS = 12;
+  static const size_t MAX_FORMATS = 1 << FORMAT_BITS;
+
+  void Init();
+
+  // Makes an entry for the format that took slot.
+  Format* Register(size_t slot, const char *format);
+
+  void Append(int level, const char *format, va_list ap);
+
+  // The format's entry, registered on first use; NULL if the table is full.
+  const Format* Lookup(const char *format);
+
+  Ring* MyRing();
+
+  // ring_key destructor: the thread owning the ring exits.
+  static void RetireRing(void *arg);
+
+  static void* WriterMain(void *arg);
+
+  // Drains every ring once. Returns the number of records written.
+  size_t Drain();
+
+  void WriteRecord(const log_record &rec, const char *payload);
+
   std::string logging_filename;
+  uint64_t instance;             // tells a Logging from an earlier one at
+                                 // the same address
   FILE *logfile;
+  bool text;
+  size_t ring_size;
+  int level;
+
+  // open addressing by format address, and the same entries by id
+  const char *format_keys[MAX_FORMATS];
+  Format *format_entries[MAX_FORMATS];
+  Format *formats_by_id[MAX_FORMATS];
+  uint32_t num_formats;
+  bool *format_written;          // by id; the writer's
+
+  pthread_mutex_t mutex;         // the ring list and the writer's wakeups
+  pthread_cond_t cond;
+  pthread_mutex_t drain_lock;    // one Drain() at a time
+  Ring *rings;
+  uint64_t retired_dropped;      // by rings freed since
+  pthread_key_t ring_key;        // each thread's ring, to retire it
+  bool has_ring_key;
+  uint32_t num_threads;
+  pthread_t writer;
+  bool running;
 };
 
 }
@@ -0,0 +1,237 @@
+#include "util/monitor.h"
+#include <cstdio>
+#include <cstring>
+
+namespace TestFS {
+
+static const char* op_names[NUM_MONITOR_OPS] = {
+	"background", "getattr", "open", "read", "write", "read_buf",
+	"write_buf", "truncate", "fsync", "release", "readlink", "symlink",
+	"unlink", "mknod", "mkdir", "opendir", "readdir", "releasedir", "rmdir",
+	"rename", "access", "utimens", "chmod", "chown", "setxattr", "getxattr",
+	"listxattr", "removexattr", "fallocate",
+};
+
+static const char* rpc_names[NUM_MONITOR_RPCS] = {
+	"read", "multiread", "write", "multiwrite", "remove", "multiremove",
+	"increment", "index_lookup",
+};
+
+static Monitor* default_ = NULL;
+static uint64_t num_instances = 0;
+
+// the operation the thread is in, and its slab of the monitor it last
+// counted on
+static __thread int current_op = OP_NONE;
+static __thread uint64_t slab_owner = 0;
+static __thread void* slab_of_owner = NULL;
+
+// Only the owning thread writes a counter; the atomics keep the loads of
+// Report whole and the compiler from caching the value.
+static inline void Add(uint64_t* counter, uint64_t n) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			__ATOMIC_RELAXED);
+}
+
+static inline uint64_t Load(const uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+Monitor::Monitor() :
+		slabs(NULL), baseline(new Counts()), reset_at(Now()),
+		instance(__atomic_add_fetch(&num_instances, 1, __ATOMIC_RELAXED)) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+Monitor::~Monitor() {
+	if (default_ == this) {
+		default_ = NULL;
+	}
+	while (slabs != NULL) {
+		Slab* next = slabs->next;
+		delete slabs;
+		slabs = next;
+	}
+	delete baseline;
+	pthread_mutex_destroy(&mutex);
+}
+
+int Monitor::BucketOf(uint64_t ns) {
+	if (ns < (2ULL << SUB_BITS)) {
+		return (int) ns;
+	}
+	int msb = 63 - __builtin_clzll(ns);
+	if (msb >= MAX_BITS) {
+		return NUM_BUCKETS - 1;
+	}
+	int shift = msb - SUB_BITS;
+	return ((shift + 1) << SUB_BITS) + (int) (ns >> shift) - (1 << SUB_BITS);
+}
+
+uint64_t Monitor::BucketLimit(int bucket) {
+	if (bucket < (2 << SUB_BITS)) {
+		return bucket;
+	}
+	int shift = (bucket >> SUB_BITS) - 1;
+	uint64_t sub = bucket & ((1 << SUB_BITS) - 1);
+	return (((1ULL << SUB_BITS) + sub) << shift) + (1ULL << shift) - 1;
+}
+
+Monitor::Slab* Monitor::MySlab() {
+	if (slab_owner == instance) {
+		return reinterpret_cast<Slab*>(slab_of_owner);
+	}
+	Slab* slab = new Slab();
+	pthread_mutex_lock(&mutex);
+	slab->next = slabs;
+	slabs = slab;
+	pthread_mutex_unlock(&mutex);
+	slab_owner = instance;
+	slab_of_owner = slab;
+	return slab;
+}
+
+void Monitor::RecordOp(MonitorOp op, uint64_t ns) {
+	Counts &c = MySlab()->counts;
+	Add(&c.hist[op][BucketOf(ns)], 1);
+	Add(&c.ops[op], 1);
+	Add(&c.ns[op], ns);
+}
+
+void Monitor::RecordRpc(MonitorRpc rpc, uint64_t bytes) {
+	Counts &c = MySlab()->counts;
+	Add(&c.rpcs[current_op][rpc], 1);
+	Add(&c.bytes[current_op][rpc], bytes);
+}
+
+void Monitor::CountRpc(MonitorRpc rpc, uint64_t bytes) {
+	Monitor* monitor = default_;
+	if (monitor != NULL) {
+		monitor->RecordRpc(rpc, bytes);
+	}
+}
+
+void Monitor::SumLocked(Counts &total) {
+	memset(&total, 0, sizeof(total));
+	const uint64_t* end = reinterpret_cast<const uint64_t*>(&total + 1);
+	for (Slab* slab = slabs; slab != NULL; slab = slab->next) {
+		const uint64_t* from = reinterpret_cast<const uint64_t*>(&slab->counts);
+		for (uint64_t* to = reinterpret_cast<uint64_t*>(&total); to < end;
+				++to, ++from) {
+			*to += Load(from);
+		}
+	}
+}
+
+void Monitor::Reset() {
+	pthread_mutex_lock(&mutex);
+	SumLocked(*baseline);
+	reset_at = Now();
+	pthread_mutex_unlock(&mutex);
+}
+
+// The value at quantile q of hist, as the limit of its bucket.
+static uint64_t Percentile(const uint64_t* hist, uint64_t count, double q) {
+	uint64_t rank = (uint64_t) (q * count);
+	if (rank < 1) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (int b = 0; b < Monitor::NUM_BUCKETS; ++b) {
+		seen += hist[b];
+		if (seen >= rank) {
+			return Monitor::BucketLimit(b);
+		}
+	}
+	return Monitor::BucketLimit(Monitor::NUM_BUCKETS - 1);
+}
+
+void Monitor::Report(std::string &out) {
+	Counts* total = new Counts();
+	pthread_mutex_lock(&mutex);
+	SumLocked(*total);
+	uint64_t* t = reinterpret_cast<uint64_t*>(total);
+	const uint64_t* b = reinterpret_cast<const uint64_t*>(baseline);
+	for (size_t i = 0; i < sizeof(Counts) / sizeof(uint64_t); ++i) {
+		t[i] -= b[i];
+	}
+	uint64_t since = Now() - reset_at;
+	pthread_mutex_unlock(&mutex);
+
+	char line[256];
+	snprintf(line, sizeof(line), "# %.1f s since reset; latencies in us\n"
+			"%-12s %10s %10s %10s %10s %10s %10s\n", since / 1e9, "op", "calls",
+			"mean", "p50", "p99", "p999", "max");
+	out.append(line);
+	for (int op = OP_NONE + 1; op < NUM_MONITOR_OPS; ++op) {
+		uint64_t n = total->ops[op];
+		if (n == 0) {
+			continue;
+		}
+		int last = NUM_BUCKETS - 1;
+		while (last > 0 && total->hist[op][last] == 0) {
+			--last;
+		}
+		snprintf(line, sizeof(line),
+				"%-12s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				op_names[op], (unsigned long) n, total->ns[op] / 1e3 / n,
+				Percentile(total->hist[op], n, 0.50) / 1e3,
+				Percentile(total->hist[op], n, 0.99) / 1e3,
+				Percentile(total->hist[op], n, 0.999) / 1e3,
+				BucketLimit(last) / 1e3);
+		out.append(line);
+	}
+	snprintf(line, sizeof(line), "\n%-12s %-12s %10s %14s\n", "op", "rpc",
+			"calls", "bytes");
+	out.append(line);
+	for (int op = 0; op < NUM_MONITOR_OPS; ++op) {
+		for (int rpc = 0; rpc < NUM_MONITOR_RPCS; ++rpc) {
+			if (total->rpcs[op][rpc] == 0) {
+				continue;
+			}
+			snprintf(line, sizeof(line), "%-12s %-12s %10lu %14lu\n",
+					op_names[op], rpc_names[rpc],
+					(unsigned long) total->rpcs[op][rpc],
+					(unsigned long) total->bytes[op][rpc]);
+			out.append(line);
+		}
+	}
+	delete total;
+}
+
+const char* Monitor::OpName(MonitorOp op) {
+	return op_names[op];
+}
+
+const char* Monitor::RpcName(MonitorRpc rpc) {
+	return rpc_names[rpc];
+}
+
+Monitor* Monitor::Default() {
+	return default_;
+}
+
+void Monitor::SetDefault(Monitor* monitor) {
+	default_ = monitor;
+}
+
+MonitorScope::MonitorScope(Monitor* monitor, MonitorOp op) :
+		monitor(monitor), op(op), start(0) {
+	if (current_op != OP_NONE) {
+		// nested, e.g. WriteBuf falling back to Write
+		this->monitor = NULL;
+	}
+	if (this->monitor != NULL) {
+		current_op = op;
+		start = Monitor::Now();
+	}
+}
+
+MonitorScope::~MonitorScope() {
+	if (monitor != NULL) {
+		monitor->RecordOp(op, Monitor::Now() - start);
+		current_op = OP_NONE;
+	}
+}
+
+}
@@ -0,0 +1,132 @@
+#ifndef MONITOR_H_
+#define MONITOR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+
+namespace TestFS {
+
+// Also the op of a trace record, so new operations go at the end.
+enum MonitorOp {
+	OP_NONE = 0,        // background threads, outside any operation
+	OP_GETATTR, OP_OPEN, OP_READ, OP_WRITE, OP_READBUF, OP_WRITEBUF,
+	OP_TRUNCATE, OP_FSYNC, OP_RELEASE, OP_READLINK, OP_SYMLINK, OP_UNLINK,
+	OP_MKNOD, OP_MKDIR, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_RMDIR,
+	OP_RENAME, OP_ACCESS, OP_UTIMENS, OP_CHMOD, OP_CHOWN, OP_SETXATTR,
+	OP_GETXATTR, OP_LISTXATTR, OP_REMOVEXATTR, OP_FALLOCATE,
+	NUM_MONITOR_OPS
+};
+
+enum MonitorRpc {
+	RPC_READ = 0, RPC_MULTIREAD, RPC_WRITE, RPC_MULTIWRITE, RPC_REMOVE,
+	RPC_MULTIREMOVE, RPC_INCREMENT, RPC_INDEX_LOOKUP,
+	NUM_MONITOR_RPCS
+};
+
+// Per-operation latency histograms and RAMCloud RPC counts.
+//
+// Histograms are log-linear in the HDR style: values below 2^(SUB_BITS+1)
+// ns have a bucket each, and every power of two above is split into
+// 2^SUB_BITS buckets, so a percentile is within 1/2^SUB_BITS (3%) of the
+// true value, up to 2^MAX_BITS ns (68 s) where the last bucket takes the
+// rest.
+//
+// Every thread counts into its own slab, which only it writes, with plain
+// relaxed stores: recording takes no lock and shares no cache line. Report
+// sums the slabs; Reset does not touch them but moves the baseline that
+// Report subtracts. Slabs outlive their threads, so nothing is lost when
+// FUSE retires a worker.
+//
+// An RPC is charged to the operation the thread is in, set by
+// MonitorScope, and to OP_NONE outside one.
+class Monitor {
+public:
+	static const int SUB_BITS = 5;
+	static const int MAX_BITS = 36;
+	static const int NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+	Monitor();
+
+	~Monitor();
+
+	static uint64_t Now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	void RecordOp(MonitorOp op, uint64_t ns);
+
+	void RecordRpc(MonitorRpc rpc, uint64_t bytes);
+
+	// Counts an RPC of the calling thread on the default monitor, if any;
+	// for the RAMCloud wrappers, which have no TestFS at hand.
+	static void CountRpc(MonitorRpc rpc, uint64_t bytes);
+
+	// Starts the counts over from zero, as seen by Report.
+	void Reset();
+
+	// Percentiles per operation and RPC counts and bytes per operation and
+	// type, as a table; operations that did not run are left out.
+	void Report(std::string &out);
+
+	static const char* OpName(MonitorOp op);
+
+	static const char* RpcName(MonitorRpc rpc);
+
+	static Monitor* Default();
+
+	void SetDefault(Monitor* monitor);
+
+	static int BucketOf(uint64_t ns);
+
+	// The largest value that falls in bucket.
+	static uint64_t BucketLimit(int bucket);
+
+private:
+	struct Counts {
+		uint64_t hist[NUM_MONITOR_OPS][NUM_BUCKETS];
+		uint64_t ops[NUM_MONITOR_OPS];
+		uint64_t ns[NUM_MONITOR_OPS];
+		uint64_t rpcs[NUM_MONITOR_OPS][NUM_MONITOR_RPCS];
+		uint64_t bytes[NUM_MONITOR_OPS][NUM_MONITOR_RPCS];
+	};
+
+	struct Slab {
+		Counts counts;
+		Slab* next;
+	};
+
+	// The calling thread's slab, made on its first count.
+	Slab* MySlab();
+
+	// Sums every slab into total. Called with mutex held.
+	void SumLocked(Counts &total);
+
+	pthread_mutex_t mutex;   // the slab list and baseline
+	Slab* slabs;
+	Counts* baseline;
+	uint64_t reset_at;
+	uint64_t instance;       // tells a Monitor from an earlier one at the
+	                         // same address
+};
+
+// Times the enclosing operation and charges the RPCs it makes to it. An
+// operation called from another one is part of the outer one.
+class MonitorScope {
+public:
+	MonitorScope(Monitor* monitor, MonitorOp op);
+
+	~MonitorScope();
+
+private:
+	Monitor* monitor;
+	MonitorOp op;
+	uint64_t start;
+};
+
+}
+
+#endif /* MONITOR_H_ */
@@ -0,0 +1,21 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace TestFS {
+
+static const size_t SHA256_DIGEST_SIZE = 32;
+
+// SHA-256 (FIPS 180-4) of size bytes at data, written to digest.
+extern void sha256(const void* data, size_t size,
+		uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// HMAC-SHA-256 (RFC 2104) of size bytes at data under key.
+extern void hmac_sha256(const void* key, size_t key_size, const void* data,
+		size_t size, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+}
+
+#endif /* SHA256_H_ */
@@ -25,7 +25,10 @@
 #include <arpa/inet.h>       // For inet_addr()
 #include <unistd.h>          // For close()
 #include <netinet/in.h>      // For sockaddr_in
+#include <netinet/tcp.h>     // For TCP_NODELAY
+#include <sys/time.h>        // For timeval
 #include <string.h>
+#include <limits.h>          // For IOV_MAX
 typedef void raw_type;       // Type used for raw data on this platform
 
 #include <errno.h>             // For errno
@@ -202,6 +205,93 @@ int CommunicatingSocket::recv(void *buffer, int bufferLen)
   return rtn;
 }
 
+int CommunicatingSocket::recvFully(void *buffer, int bufferLen)
+    throw(SocketException) {
+  char *pos = (char *) buffer;
+  int total = 0;
+  while (total < bufferLen) {
+    int rtn = ::recv(sockDesc, (raw_type *) (pos + total), bufferLen - total, 0);
+    if (rtn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw SocketException("Received failed (recv())", true);
+    }
+    if (rtn == 0) {
+      break;
+    }
+    total += rtn;
+  }
+
+  return total;
+}
+
+void CommunicatingSocket::sendv(const struct iovec *iov, int iovcnt)
+    throw(SocketException) {
+  struct iovec vec[IOV_MAX];
+  if (iovcnt > IOV_MAX) {
+    throw SocketException("Send failed (too many buffers)");
+  }
+  memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+  struct iovec *cur = vec;
+  while (iovcnt > 0) {
+    ssize_t rtn = ::writev(sockDesc, cur, iovcnt);
+    if (rtn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw SocketException("Send failed (writev())", true);
+    }
+    // skip what was written, possibly part way into a buffer
+    while (iovcnt > 0 && (size_t) rtn >= cur->iov_len) {
+      rtn -= cur->iov_len;
+      ++cur;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (char *) cur->iov_base + rtn;
+      cur->iov_len -= rtn;
+    }
+  }
+}
+
+int CommunicatingSocket::recvv(const struct iovec *iov, int iovcnt)
+    throw(SocketException) {
+  int rtn;
+  if ((rtn = ::readv(sockDesc, iov, iovcnt)) < 0) {
+    throw SocketException("Received failed (readv())", true);
+  }
+
+  return rtn;
+}
+
+void CommunicatingSocket::setNoDelay(bool noDelay) throw(SocketException) {
+  int flag = noDelay ? 1 : 0;
+  if (setsockopt(sockDesc, IPPROTO_TCP, TCP_NODELAY,
+                 (raw_type *) &flag, sizeof(flag)) < 0) {
+    throw SocketException("Set TCP_NODELAY failed (setsockopt())", true);
+  }
+}
+
+void CommunicatingSocket::setBusyPoll(int usec) {
+#ifdef SO_BUSY_POLL
+  setsockopt(sockDesc, SOL_SOCKET, SO_BUSY_POLL,
+             (raw_type *) &usec, sizeof(usec));
+#endif
+}
+
+void CommunicatingSocket::setTimeout(int timeoutMs) throw(SocketException) {
+  struct timeval tv;
+  tv.tv_sec = timeoutMs / 1000;
+  tv.tv_usec = (timeoutMs % 1000) * 1000;
+  if (setsockopt(sockDesc, SOL_SOCKET, SO_RCVTIMEO,
+                 (raw_type *) &tv, sizeof(tv)) < 0
+      || setsockopt(sockDesc, SOL_SOCKET, SO_SNDTIMEO,
+                    (raw_type *) &tv, sizeof(tv)) < 0) {
+    throw SocketException("Set timeout failed (setsockopt())", true);
+  }
+}
+
 string CommunicatingSocket::getForeignAddress() 
     throw(SocketException) {
   sockaddr_in addr;
@@ -22,6 +22,7 @@
 
 #include <string>            // For string
 #include <exception>         // For exception class
+#include <sys/uio.h>         // For iovec
 
 using namespace std;
 
@@ -120,6 +121,13 @@ public:
   static unsigned short resolveService(const string &service,
                                        const string &protocol = "tcp");
 
+  /**
+   *   Get the underlying descriptor, e.g. for sendfile().  The socket
+   *   keeps ownership and closes it on destruction
+   *   @return socket descriptor
+   */
+  int getDescriptor() const { return sockDesc; }
+
 private:
   // Prevent the user from trying to use value semantics on this object
   Socket(const Socket &sock);
@@ -165,6 +173,56 @@ public:
    */
   int recv(void *buffer, int bufferLen) throw(SocketException);
 
+  /**
+   *   Read exactly bufferLen bytes into the given buffer, unless the peer
+   *   closes the connection first.  Call connect() before calling recvFully()
+   *   @param buffer buffer to receive the data
+   *   @param bufferLen number of bytes to read into buffer
+   *   @return number of bytes read, less than bufferLen only on EOF
+   *   @exception SocketException thrown if unable to receive data
+   */
+  int recvFully(void *buffer, int bufferLen) throw(SocketException);
+
+  /**
+   *   Write all the given buffers to this socket with one writev() where
+   *   possible.  Call connect() before calling sendv()
+   *   @param iov buffers to be written
+   *   @param iovcnt number of buffers
+   *   @exception SocketException thrown if unable to send data
+   */
+  void sendv(const struct iovec *iov, int iovcnt) throw(SocketException);
+
+  /**
+   *   Scatter-read up to the total size of the given buffers from this
+   *   socket.  Call connect() before calling recvv()
+   *   @param iov buffers to receive the data
+   *   @param iovcnt number of buffers
+   *   @return number of bytes read, 0 for EOF
+   *   @exception SocketException thrown if unable to receive data
+   */
+  int recvv(const struct iovec *iov, int iovcnt) throw(SocketException);
+
+  /**
+   *   Enable or disable Nagle's algorithm (TCP_NODELAY)
+   *   @param noDelay true to send small segments immediately
+   *   @exception SocketException thrown if unable to set the option
+   */
+  void setNoDelay(bool noDelay) throw(SocketException);
+
+  /**
+   *   Busy-poll the device queue for up to usec microseconds on blocking
+   *   receives (SO_BUSY_POLL).  Failure is ignored on kernels without it.
+   *   @param usec busy poll budget, 0 to disable
+   */
+  void setBusyPoll(int usec);
+
+  /**
+   *   Bound blocking send() and recv() calls; a timed out call throws
+   *   @param timeoutMs timeout in milliseconds, 0 to block forever
+   *   @exception SocketException thrown if unable to set the option
+   */
+  void setTimeout(int timeoutMs) throw(SocketException);
+
   /**
    *   Get the foreign address.  Call connect() before calling recv()
    *   @return foreign address
@@ -0,0 +1,174 @@
+#include "util/traceloader.h"
+#include <errno.h>
+#include <time.h>
+#include <cstring>
+
+namespace TestFS {
+
+// records are written when this much is buffered, or a second has passed
+static const size_t FLUSH_BYTES = 1 << 20;
+static const uint64_t FLUSH_NS = 1000000000ULL;
+
+static __thread uint32_t trace_thread = 0;
+
+static uint16_t Length(const char* s) {
+	if (s == NULL) {
+		return 0;
+	}
+	size_t len = strlen(s);
+	return len > 0xffff ? 0xffff : (uint16_t) len;
+}
+
+TraceRecorder::TraceRecorder(const std::string &path) :
+		filename(path), file(NULL), began(Monitor::Now()), flushed_at(began),
+		num_threads(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+TraceRecorder::~TraceRecorder() {
+	if (file != NULL) {
+		Flush();
+		fclose(file);
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+int TraceRecorder::Open() {
+	file = fopen(filename.c_str(), "w");
+	if (file == NULL) {
+		return -errno;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t wall = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	began = Monitor::Now();
+	flushed_at = began;
+	fwrite(TRACE_FILE_MAGIC, 1, sizeof(TRACE_FILE_MAGIC) - 1, file);
+	fwrite(&wall, sizeof(wall), 1, file);
+	buffer.reserve(FLUSH_BYTES + 4096);
+	return 0;
+}
+
+void TraceRecorder::Record(trace_record &rec, const char* path,
+		const char* name, const char* value) {
+	if (file == NULL) {
+		return;
+	}
+	if (trace_thread == 0) {
+		trace_thread = __atomic_add_fetch(&num_threads, 1, __ATOMIC_RELAXED);
+	}
+	rec.thread = trace_thread;
+	rec.path_length = Length(path);
+	rec.name_length = Length(name);
+	uint64_t now = Monitor::Now();
+	pthread_mutex_lock(&mutex);
+	buffer.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+	if (rec.path_length > 0) {
+		buffer.append(path, rec.path_length);
+	}
+	if (rec.name_length > 0) {
+		buffer.append(name, rec.name_length);
+	}
+	if (rec.value_length > 0) {
+		buffer.append(value, rec.value_length);
+	}
+	if (buffer.size() >= FLUSH_BYTES || now - flushed_at >= FLUSH_NS) {
+		FlushLocked();
+		flushed_at = now;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void TraceRecorder::FlushLocked() {
+	if (buffer.size() > 0) {
+		fwrite(buffer.data(), 1, buffer.size(), file);
+		buffer.clear();
+	}
+	fflush(file);
+}
+
+void TraceRecorder::Flush() {
+	if (file == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	FlushLocked();
+	pthread_mutex_unlock(&mutex);
+}
+
+TraceLoader::TraceLoader() :
+		began(0) {
+}
+
+int TraceLoader::Load(const std::string &path) {
+	FILE* in = fopen(path.c_str(), "r");
+	if (in == NULL) {
+		return -errno;
+	}
+	char magic[sizeof(TRACE_FILE_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)
+			|| memcmp(magic, TRACE_FILE_MAGIC, sizeof(magic)) != 0
+			|| fread(&began, sizeof(began), 1, in) != 1) {
+		fclose(in);
+		return -EINVAL;
+	}
+	ops.clear();
+	TraceOp op;
+	char buf[3 * 0x10000];
+	while (fread(&op.rec, sizeof(op.rec), 1, in) == 1) {
+		size_t len = (size_t) op.rec.path_length + op.rec.name_length
+				+ op.rec.value_length;
+		if (len > 0 && fread(buf, 1, len, in) != len) {
+			break;
+		}
+		op.path.assign(buf, op.rec.path_length);
+		op.name.assign(buf + op.rec.path_length, op.rec.name_length);
+		op.value.assign(buf + op.rec.path_length + op.rec.name_length,
+				op.rec.value_length);
+		ops.push_back(op);
+	}
+	fclose(in);
+	return 0;
+}
+
+TraceScope::TraceScope(TraceRecorder* recorder, MonitorOp op,
+		const char* path, const char* name) :
+		recorder(recorder), path(path), name(name), value(NULL) {
+	if (recorder != NULL) {
+		memset(&rec, 0, sizeof(rec));
+		rec.op = op;
+		rec.start_ns = Monitor::Now();
+	}
+}
+
+TraceScope& TraceScope::Args(uint64_t size, int64_t offset, uint32_t flags) {
+	rec.size = size;
+	rec.offset = offset;
+	rec.flags = flags;
+	return *this;
+}
+
+TraceScope& TraceScope::File(uint64_t fh) {
+	rec.fh = fh;
+	return *this;
+}
+
+TraceScope& TraceScope::Value(const char* value, size_t length) {
+	this->value = value;
+	rec.value_length = length > 0xffff ? 0xffff : (uint16_t) length;
+	return *this;
+}
+
+int TraceScope::Done(int result) {
+	if (recorder != NULL) {
+		uint64_t latency = Monitor::Now() - rec.start_ns;
+		rec.latency_ns = latency > 0xffffffffULL ? 0xffffffffU
+				: (uint32_t) latency;
+		rec.start_ns -= recorder->Began();
+		rec.result = result;
+		recorder->Record(rec, path, name, value);
+	}
+	return result;
+}
+
+}
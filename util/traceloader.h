@@ -0,0 +1,138 @@
+#ifndef TRACELOADER_H_
+#define TRACELOADER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "util/monitor.h"
+
+namespace TestFS {
+
+// The first bytes of a trace, followed by the CLOCK_REALTIME ns at which
+// recording began, as a uint64.
+const char TRACE_FILE_MAGIC[] = "TFSTRC1\n";
+
+// One FUSE callback, followed by path_length bytes of path, name_length
+// of name and value_length of value. What the numbers hold depends on op:
+//
+//   size    bytes asked for (read, write, readlink, *xattr), the length of
+//           fallocate, atime seconds for utimens, the uid for chown
+//   offset  the offset of read, write and fallocate, the new size for
+//           truncate, dev for mknod, mtime seconds for utimens, the gid
+//           for chown
+//   flags   open flags, the mode of mknod, mkdir, chmod and fallocate,
+//           the mask of access, setxattr flags, datasync
+//   fh      the file handle the callback was given, or set by open and
+//           opendir
+//   name    the second path of rename and symlink, the xattr name
+//   value   the setxattr value
+struct trace_record {
+	uint8_t op;              // MonitorOp
+	uint8_t reserved;
+	uint16_t path_length;
+	uint16_t name_length;
+	uint16_t value_length;
+	uint32_t thread;         // numbered by first callback
+	int32_t result;
+	uint64_t start_ns;       // CLOCK_MONOTONIC since recording began
+	uint32_t latency_ns;     // saturates at 4.2 s
+	uint32_t flags;
+	uint64_t fh;
+	uint64_t size;
+	int64_t offset;
+} __attribute__((packed));
+
+struct TraceOp {
+	trace_record rec;
+	std::string path;
+	std::string name;
+	std::string value;
+};
+
+// Appends a record per callback to a trace file. Records are buffered
+// and written in batches, at most a second apart while callbacks keep
+// coming; the last batch is written when the recorder is deleted.
+class TraceRecorder {
+public:
+	TraceRecorder(const std::string &path);
+
+	~TraceRecorder();
+
+	// Returns 0 or -errno.
+	int Open();
+
+	void Record(trace_record &rec, const char* path, const char* name,
+			const char* value);
+
+	void Flush();
+
+	// Start of recording, CLOCK_MONOTONIC.
+	uint64_t Began() const {
+		return began;
+	}
+
+private:
+	// Writes out buffer. Called with mutex held.
+	void FlushLocked();
+
+	std::string filename;
+	FILE* file;
+	uint64_t began;
+	pthread_mutex_t mutex;   // buffer and file
+	std::string buffer;
+	uint64_t flushed_at;
+	uint32_t num_threads;
+};
+
+// Reads a trace back. A record cut short at the end, as a crash leaves
+// it, is dropped.
+class TraceLoader {
+public:
+	TraceLoader();
+
+	// Returns 0 or -errno; -EINVAL if path is not a trace.
+	int Load(const std::string &path);
+
+	const std::vector<TraceOp>& Ops() const {
+		return ops;
+	}
+
+	// CLOCK_REALTIME ns of the start of recording.
+	uint64_t Began() const {
+		return began;
+	}
+
+private:
+	std::vector<TraceOp> ops;
+	uint64_t began;
+};
+
+// Records the enclosing callback, when given a recorder; the arguments
+// are filled in by the caller and the record is written by Done().
+class TraceScope {
+public:
+	TraceScope(TraceRecorder* recorder, MonitorOp op, const char* path,
+			const char* name = NULL);
+
+	TraceScope& Args(uint64_t size, int64_t offset, uint32_t flags = 0);
+
+	TraceScope& File(uint64_t fh);
+
+	TraceScope& Value(const char* value, size_t length);
+
+	// Writes the record with result and returns it.
+	int Done(int result);
+
+private:
+	TraceRecorder* recorder;
+	trace_record rec;
+	const char* path;
+	const char* name;
+	const char* value;
+};
+
+}
+
+#endif /* TRACELOADER_H_ */